@@ -0,0 +1,1128 @@
+/*
+ * et_bench.c
+ *
+ * Benchmarks for ExprTree
+ *
+ * Author: Howdy Pierce <howdy@sleepymoose.net>
+ * Contributor: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "expr_tree.h"
+
+// Heap allocations made so far, counted by interposing on glibc's
+// allocator; stays 0 elsewhere
+static atomic_size_t n_allocs;
+
+#if defined(__GLIBC__)
+#define ALLOCS_COUNTED 1
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+  atomic_fetch_add_explicit(&n_allocs, 1, memory_order_relaxed);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+  atomic_fetch_add_explicit(&n_allocs, 1, memory_order_relaxed);
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+  atomic_fetch_add_explicit(&n_allocs, 1, memory_order_relaxed);
+  return __libc_realloc(ptr, size);
+}
+#endif
+
+/*
+ * Return a monotonic timestamp in nanoseconds
+ */
+static double now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * Build a left-deep chain of n_ops alternating additions and
+ * subtractions, so the tree is as deep as it is large.
+ *
+ * Parameters:
+ *   n_ops    Number of interior nodes
+ *
+ * Returns: The new tree
+ */
+static ExprTree make_deep(int n_ops)
+{
+  ExprTree tree = ET_value(1);
+  for (int i = 0; i < n_ops; i++)
+    tree = ET_node(i % 2 ? OP_SUB : OP_ADD, tree, ET_value(i % 7));
+  return tree;
+}
+
+/*
+ * Build a perfectly balanced tree of the given depth, cycling through
+ * the binary operators.
+ *
+ * Parameters:
+ *   depth    Depth of the tree; 1 is a single leaf
+ *
+ * Returns: The new tree
+ */
+static ExprTree make_wide(int depth)
+{
+  static const ExprNodeType ops[] = {OP_ADD, OP_MUL, OP_SUB, OP_DIV};
+
+  if (depth <= 1)
+    return ET_value(1.0 + depth);
+
+  return ET_node(ops[depth % 4], make_wide(depth - 1), make_wide(depth - 1));
+}
+
+/*
+ * Build a lopsided tree with n_ops interior nodes: each node puts
+ * percent of its interior nodes under its left child and the rest
+ * under its right child.
+ *
+ * Parameters:
+ *   n_ops    Number of interior nodes
+ *   percent  Share of the nodes on the left, 50 to 99
+ *
+ * Returns: The new tree
+ */
+static ExprTree make_skewed(int n_ops, int percent)
+{
+  static const ExprNodeType ops[] = {OP_ADD, OP_MUL, OP_SUB, OP_DIV};
+
+  if (n_ops == 0)
+    return ET_value(1.5);
+
+  int left = (int)((long)(n_ops - 1) * percent / 100);
+  return ET_node(ops[n_ops % 4], make_skewed(left, percent), make_skewed(n_ops - 1 - left, percent));
+}
+
+/*
+ * Time ET_evaluate_parallel on tree with 1, 2, 4, ... threads up to
+ * max_threads and print ns/node and the speedup over ET_evaluate
+ *
+ * Parameters:
+ *   name         Label for the output lines
+ *   tree         The tree to evaluate
+ *   max_threads  Largest thread count to try
+ *   reps         Number of evaluations to time per thread count
+ */
+static void bench_parallel(const char *name, ExprTree tree, int max_threads, int reps)
+{
+  int nodes = ET_count(tree);
+  volatile double sink;
+  double start;
+
+  start = now_ns();
+  for (int i = 0; i < reps; i++)
+    sink = ET_evaluate(tree);
+  double seq_ns = (now_ns() - start) / reps;
+
+  for (int threads = 1; threads <= max_threads; threads *= 2)
+  {
+    start = now_ns();
+    for (int i = 0; i < reps; i++)
+      sink = ET_evaluate_parallel(tree, threads);
+    double par_ns = (now_ns() - start) / reps;
+
+    printf("%-6s nodes=%-9d threads=%-3d ET_evaluate_parallel %6.2f ns/node  speedup %5.2fx\n",
+           name, nodes, threads, par_ns / nodes, seq_ns / par_ns);
+  }
+  (void)sink;
+}
+
+/*
+ * Build a balanced tree over n_leaves leaves (a power of two), keeping
+ * the leaves, then time random single-leaf updates followed by
+ * ET_evaluate_incremental against a full ET_evaluate
+ *
+ * Parameters:
+ *   n_leaves   Number of leaves; the tree has 2 * n_leaves - 1 nodes
+ *   n_updates  Number of updates to time
+ */
+static void bench_incremental(int n_leaves, int n_updates)
+{
+  static const ExprNodeType ops[] = {OP_ADD, OP_MUL, OP_SUB, OP_DIV};
+  ExprTree *leaves = malloc(n_leaves * sizeof(ExprTree));
+  ExprTree *level = malloc(n_leaves * sizeof(ExprTree));
+  volatile double sink;
+  double start;
+
+  for (int i = 0; i < n_leaves; i++)
+    leaves[i] = level[i] = ET_value(1.0 + i % 7);
+  for (int n = n_leaves; n > 1; n /= 2)
+    for (int i = 0; i < n / 2; i++)
+      level[i] = ET_node(ops[i % 4], level[2 * i], level[2 * i + 1]);
+  ExprTree tree = level[0];
+  int nodes = ET_count(tree);
+
+  start = now_ns();
+  sink = ET_evaluate(tree);
+  double full_ns = now_ns() - start;
+
+  sink = ET_evaluate_incremental(tree);
+  srand(3);
+  size_t allocs = atomic_load(&n_allocs);
+  start = now_ns();
+  for (int i = 0; i < n_updates; i++)
+  {
+    ET_set_value(leaves[rand() % n_leaves], 1.0 + i % 5);
+    sink = ET_evaluate_incremental(tree);
+  }
+  double update_ns = (now_ns() - start) / n_updates;
+  allocs = atomic_load(&n_allocs) - allocs;
+
+  (void)sink;
+  printf("incr   nodes=%-9d ET_evaluate %10.0f ns  ET_set_value+ET_evaluate_incremental %6.0f ns/update",
+         nodes, full_ns, update_ns);
+#ifdef ALLOCS_COUNTED
+  printf("  allocs_per_update=%.4f\n", (double)allocs / n_updates);
+#else
+  printf("  allocs_per_update=NA\n");
+#endif
+  ET_free(tree);
+  free(level);
+  free(leaves);
+}
+
+/*
+ * Return the peak resident set size of the process so far, in KB
+ */
+static long peak_rss_kb()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+/*
+ * Build a right-deep chain of n_ops alternating multiplications and
+ * divisions
+ *
+ * Parameters:
+ *   n_ops    Number of interior nodes
+ *
+ * Returns: The new tree
+ */
+static ExprTree make_right_deep(int n_ops)
+{
+  ExprTree tree = ET_value(1);
+  for (int i = 0; i < n_ops; i++)
+    tree = ET_node(i % 2 ? OP_DIV : OP_MUL, ET_value(1 + i % 3), tree);
+  return tree;
+}
+
+/*
+ * Build a balanced tree with n_ops interior nodes, cycling through the
+ * binary operators
+ *
+ * Parameters:
+ *   n_ops    Number of interior nodes
+ *
+ * Returns: The new tree
+ */
+static ExprTree make_balanced(int n_ops)
+{
+  static const ExprNodeType ops[] = {OP_ADD, OP_MUL, OP_SUB, OP_DIV};
+
+  if (n_ops == 0)
+    return ET_value(1.0 + n_ops % 3);
+
+  int left = (n_ops - 1) / 2;
+  return ET_node(ops[n_ops % 4], make_balanced(left), make_balanced(n_ops - 1 - left));
+}
+
+/*
+ * Time ET_evaluate against ET_run and ET_jit_run on tree and print
+ * ns/node for each
+ *
+ * Parameters:
+ *   name     Label for the output line
+ *   tree     The tree to evaluate
+ *   reps     Number of evaluations to time
+ */
+static void bench_evaluate(const char *name, ExprTree tree, int reps)
+{
+  int nodes = ET_count(tree);
+  ExprProgram prog = ET_compile(tree);
+  volatile double sink;
+  double start;
+
+  start = now_ns();
+  for (int i = 0; i < reps; i++)
+    sink = ET_evaluate(tree);
+  double tree_ns = (now_ns() - start) / reps / nodes;
+
+  start = now_ns();
+  for (int i = 0; i < reps; i++)
+    sink = ET_run(prog);
+  double prog_ns = (now_ns() - start) / reps / nodes;
+
+  // with NULL vars the native code just returns a precomputed constant
+  static const double vars[1] = {0};
+  ExprJit jit = ET_jit(tree);
+  start = now_ns();
+  for (int i = 0; i < reps; i++)
+    sink = ET_jit_run(jit, vars);
+  double jit_ns = (now_ns() - start) / reps / nodes;
+
+  (void)sink;
+  printf("%-6s nodes=%-9d ET_evaluate %6.2f ns/node   ET_run %6.2f ns/node   ET_jit_run %6.2f ns/node%s\n",
+         name, nodes, tree_ns, prog_ns, jit_ns, ET_jit_function(jit) == NULL ? " (interpreted)" : "");
+  ET_jit_free(jit);
+  ET_program_free(prog);
+}
+
+/*
+ * Build a random tree with n_ops interior nodes over constants and
+ * variables x0..x3, using rand()
+ *
+ * Parameters:
+ *   n_ops    Number of interior nodes
+ *
+ * Returns: The new tree
+ */
+static ExprTree make_random(int n_ops)
+{
+  static const ExprNodeType ops[] = {OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_POWER, UNARY_NEGATE};
+
+  if (n_ops == 0)
+    return rand() % 2 ? ET_var(rand() % 4) : ET_value((rand() % 2000 - 1000) / 8.0);
+
+  ExprNodeType op = ops[rand() % 6];
+  if (op == UNARY_NEGATE)
+    return ET_node(op, make_random(n_ops - 1), NULL);
+
+  int left = rand() % n_ops;
+  return ET_node(op, make_random(left), make_random(n_ops - 1 - left));
+}
+
+/*
+ * Time ET_evaluate_many on n_trees small random trees plus one large
+ * one, on pools of 1, 2, 4... threads up to max_threads, and print
+ * trees/second and the speedup over a loop of ET_evaluate
+ *
+ * Parameters:
+ *   n_trees      Number of trees in the batch
+ *   max_threads  Largest thread count to try
+ *   reps         Number of batches to time per thread count
+ */
+static void bench_many(size_t n_trees, int max_threads, int reps)
+{
+  ExprTree *trees = malloc(n_trees * sizeof(ExprTree));
+  double *results = malloc(n_trees * sizeof(double));
+  double start;
+
+  for (size_t i = 0; i < n_trees; i++)
+    trees[i] = make_random(rand() % 32);
+  // one tree as big as all the others together
+  ET_free(trees[n_trees / 2]);
+  trees[n_trees / 2] = make_random(16 * n_trees);
+
+  start = now_ns();
+  for (int r = 0; r < reps; r++)
+    for (size_t i = 0; i < n_trees; i++)
+      results[i] = ET_evaluate(trees[i]);
+  double seq_ns = (now_ns() - start) / reps;
+
+  for (int threads = 1; threads <= max_threads; threads *= 2)
+  {
+    ExprPool pool = ET_pool_create(threads);
+    start = now_ns();
+    for (int r = 0; r < reps; r++)
+      ET_evaluate_many(trees, n_trees, results, pool);
+    double many_ns = (now_ns() - start) / reps;
+    ET_pool_destroy(pool);
+
+    printf("many   trees=%-9zu threads=%-3d ET_evaluate_many %10.0f trees/s  speedup %5.2fx\n",
+           n_trees, threads, n_trees / many_ns * 1e9, seq_ns / many_ns);
+  }
+
+  for (size_t i = 0; i < n_trees; i++)
+    ET_free(trees[i]);
+  free(trees);
+  free(results);
+}
+
+/*
+ * Time ET_parse on a corpus of n_exprs random expressions, one per
+ * line, allocating from an arena, and print MB/s and ns/expression
+ *
+ * Parameters:
+ *   n_exprs  Number of expressions in the corpus
+ *   n_ops    Interior nodes per expression
+ */
+static void bench_parse(int n_exprs, int n_ops)
+{
+  size_t cap = (size_t)n_exprs * (n_ops * 16 + 16), len = 0;
+  char *corpus = malloc(cap);
+
+  srand(1);
+  for (int i = 0; i < n_exprs; i++)
+  {
+    ExprTree tree = make_random(n_ops);
+    len += ET_tree2string(tree, corpus + len, cap - len - 1);
+    corpus[len++] = '\n';
+    ET_free(tree);
+  }
+
+  ExprArena arena = ET_arena_create(0);
+  size_t pos = 0, end;
+  int parsed = 0;
+
+  double start = now_ns();
+  while (pos < len)
+  {
+    ExprTree tree = ET_parse(corpus + pos, len - pos, arena, &end);
+    if (tree == NULL)
+      break;
+    pos += end;
+    if (++parsed % 4096 == 0)
+      ET_arena_reset(arena);
+  }
+  double elapsed = now_ns() - start;
+
+  printf("parse  exprs=%-9d %8.1f MB/s  %6.1f ns/expr  (%zu bytes)\n",
+         parsed, len / elapsed * 1e3, elapsed / parsed, len);
+  ET_arena_destroy(arena);
+  free(corpus);
+}
+
+/*
+ * Time ET_evaluate on tree before and after ET_intern and print the
+ * node counts and times
+ *
+ * Parameters:
+ *   name     Label for the output line
+ *   tree     The tree; it is interned and freed
+ *   reps     Number of evaluations to time
+ */
+static void bench_intern(const char *name, ExprTree tree, int reps)
+{
+  volatile double sink;
+  int nodes = ET_count(tree);
+  double start;
+
+  start = now_ns();
+  for (int i = 0; i < reps; i++)
+    sink = ET_evaluate(tree);
+  double tree_ns = (now_ns() - start) / reps;
+
+  start = now_ns();
+  tree = ET_intern(tree);
+  double intern_ns = now_ns() - start;
+  int distinct = ET_count_distinct(tree);
+
+  start = now_ns();
+  for (int i = 0; i < reps; i++)
+    sink = ET_evaluate(tree);
+  double dag_ns = (now_ns() - start) / reps;
+
+  (void)sink;
+  printf("%-6s nodes=%-9d distinct=%-7d tree %10.0f ns  dag %8.0f ns  (ET_intern %.0f ns)\n",
+         name, nodes, distinct, tree_ns, dag_ns, intern_ns);
+  ET_free(tree);
+}
+
+/*
+ * ExprWriteFunction that adds the length of each chunk to the size_t
+ * at ctx
+ */
+static int count_chars(void *ctx, const char *data, size_t len)
+{
+  (void)data;
+  *(size_t *)ctx += len;
+  return 0;
+}
+
+/*
+ * Time ET_tree2string, and ET_write in each format, on tree and print
+ * ns/node and MB/s
+ *
+ * Parameters:
+ *   name     Label for the output line
+ *   tree     The tree to print
+ *   buf_sz   Size of the output buffer
+ *   reps     Number of conversions to time
+ */
+static void bench_tree2string(const char *name, ExprTree tree, size_t buf_sz, int reps)
+{
+  int nodes = ET_count(tree);
+  char *buf = malloc(buf_sz);
+  size_t length = 0;
+
+  double start = now_ns();
+  for (int i = 0; i < reps; i++)
+    length = ET_tree2string(tree, buf, buf_sz);
+  double elapsed = (now_ns() - start) / reps;
+
+  printf("%-6s nodes=%-9d ET_tree2string %6.2f ns/node  %8.1f MB/s  (%zu chars)\n",
+         name, nodes, elapsed / nodes, length / elapsed * 1e3, length);
+
+  // the same text streamed in chunks to a function that only counts it
+  static const char *const formats[] = {"infix", "postfix", "json"};
+  for (int f = 0; f < (int)(sizeof(formats) / sizeof(formats[0])); f++)
+  {
+    length = 0;
+    start = now_ns();
+    for (int i = 0; i < reps; i++)
+      ET_write(tree, count_chars, &length, (ExprFormat)f);
+    elapsed = (now_ns() - start) / reps;
+    length /= reps;
+    printf("%-6s nodes=%-9d ET_write %-7s %6.2f ns/node  %8.1f MB/s  (%zu chars)\n",
+           name, nodes, formats[f], elapsed / nodes, length / elapsed * 1e3, length);
+  }
+  free(buf);
+}
+
+/*
+ * Time ET_evaluate and ET_tree2string on tree against their
+ * ET_frozen_* counterparts on a frozen copy of it, along with
+ * ET_freeze itself and the linear scan of ET_frozen_depth, and print
+ * ns/node for each
+ *
+ * Parameters:
+ *   name     Label for the output line
+ *   tree     The tree to freeze
+ *   reps     Number of repetitions to time
+ */
+static void bench_frozen(const char *name, ExprTree tree, int reps)
+{
+  int nodes = ET_count(tree);
+  size_t buf_sz = (size_t)nodes * 24 + 64;
+  char *buf = malloc(buf_sz);
+  volatile double sink;
+  double start;
+
+  start = now_ns();
+  ExprFrozen frozen = ET_freeze(tree);
+  double freeze_ns = (now_ns() - start) / nodes;
+
+  start = now_ns();
+  for (int i = 0; i < reps; i++)
+    sink = ET_evaluate(tree);
+  double tree_eval_ns = (now_ns() - start) / reps / nodes;
+
+  start = now_ns();
+  for (int i = 0; i < reps; i++)
+    sink = ET_frozen_evaluate(frozen, NULL);
+  double frozen_eval_ns = (now_ns() - start) / reps / nodes;
+
+  start = now_ns();
+  for (int i = 0; i < reps; i++)
+    sink = ET_tree2string(tree, buf, buf_sz);
+  double tree_str_ns = (now_ns() - start) / reps / nodes;
+
+  start = now_ns();
+  for (int i = 0; i < reps; i++)
+    sink = ET_frozen_tree2string(frozen, buf, buf_sz);
+  double frozen_str_ns = (now_ns() - start) / reps / nodes;
+
+  start = now_ns();
+  for (int i = 0; i < reps; i++)
+    sink = ET_frozen_depth(frozen);
+  double depth_ns = (now_ns() - start) / reps / nodes;
+
+  (void)sink;
+  printf("%-6s nodes=%-9d ET_freeze %6.2f ns/node   evaluate %6.2f -> %6.2f ns/node   "
+         "tree2string %6.2f -> %6.2f ns/node   ET_frozen_depth %6.2f ns/node\n",
+         name, nodes, freeze_ns, tree_eval_ns, frozen_eval_ns, tree_str_ns, frozen_str_ns, depth_ns);
+  ET_frozen_free(frozen);
+  free(buf);
+}
+
+/*
+ * Time ET_tree2string_format on a balanced tree of 2^(depth-1) leaves
+ * holding full-precision random values, printing them with "%g" and
+ * with ET_FORMAT_SHORTEST, and print leaves/s for each
+ *
+ * Parameters:
+ *   depth    Depth of the tree
+ *   reps     Number of conversions to time
+ */
+static void bench_format(int depth, int reps)
+{
+  size_t n_leaves = (size_t)1 << (depth - 1);
+  ExprTree *level = malloc(n_leaves * sizeof(ExprTree));
+
+  for (size_t i = 0; i < n_leaves; i++)
+    level[i] = ET_value((double)rand() / RAND_MAX * pow(10, rand() % 40 - 20));
+  for (size_t n = n_leaves; n > 1; n /= 2)
+    for (size_t i = 0; i < n / 2; i++)
+      level[i] = ET_node(OP_ADD, level[2 * i], level[2 * i + 1]);
+  ExprTree tree = level[0];
+  free(level);
+
+  size_t buf_sz = n_leaves * 32 + 64;
+  char *buf = malloc(buf_sz);
+  static const struct
+  {
+    const char *name;
+    ExprFormat format;
+  } modes[] = {{"%g", ET_FORMAT_INFIX}, {"shortest", ET_FORMAT_INFIX | ET_FORMAT_SHORTEST}};
+
+  for (int m = 0; m < (int)(sizeof(modes) / sizeof(modes[0])); m++)
+  {
+    size_t length = 0;
+    double start = now_ns();
+    for (int i = 0; i < reps; i++)
+      length = ET_tree2string_format(tree, buf, buf_sz, modes[m].format);
+    double elapsed = (now_ns() - start) / reps;
+    printf("format leaves=%-9zu %-8s %8.2f M leaves/s  (%zu chars)\n",
+           n_leaves, modes[m].name, n_leaves / elapsed * 1e3, length);
+  }
+
+  free(buf);
+  ET_free(tree);
+}
+
+/*
+ * Time ET_serialize, ET_load into an arena and ET_evaluate_serialized on
+ * tree and print ns/node for each
+ *
+ * Parameters:
+ *   name     Label for the output line
+ *   tree     The tree to serialize
+ *   reps     Number of repetitions to time
+ */
+static void bench_serialize(const char *name, ExprTree tree, int reps)
+{
+  volatile double sink;
+  int nodes = ET_count(tree);
+  size_t size = ET_serialize(tree, NULL, 0);
+  unsigned char *buf = malloc(size);
+  ExprArena arena = ET_arena_create(0);
+  double start;
+
+  start = now_ns();
+  for (int i = 0; i < reps; i++)
+    ET_serialize(tree, buf, size);
+  double write_ns = (now_ns() - start) / reps;
+
+  start = now_ns();
+  for (int i = 0; i < reps; i++)
+  {
+    ET_load(buf, size, arena, NULL);
+    ET_arena_reset(arena);
+  }
+  double load_ns = (now_ns() - start) / reps;
+
+  start = now_ns();
+  for (int i = 0; i < reps; i++)
+    sink = ET_evaluate_serialized(buf, size, NULL);
+  double eval_ns = (now_ns() - start) / reps;
+
+  (void)sink;
+  printf("%-6s nodes=%-9d ET_serialize %5.2f ns/node  ET_load %5.2f ns/node  ET_evaluate_serialized %5.2f ns/node  (%zu bytes)\n",
+         name, nodes, write_ns / nodes, load_ns / nodes, eval_ns / nodes, size);
+  ET_arena_destroy(arena);
+  free(buf);
+}
+
+/*
+ * Time per-row ET_evaluate_vars against ET_evaluate_batch over columns
+ * and print ns/row for both
+ *
+ * Parameters:
+ *   name     Label for the output line
+ *   tree     The tree to evaluate; uses variables 0 and 1
+ *   n_rows   Number of rows
+ */
+static void bench_batch(const char *name, ExprTree tree, size_t n_rows)
+{
+  double *x0 = malloc(n_rows * sizeof(double));
+  double *x1 = malloc(n_rows * sizeof(double));
+  double *out = malloc(n_rows * sizeof(double));
+  const double *columns[] = {x0, x1};
+  double start;
+
+  for (size_t i = 0; i < n_rows; i++)
+  {
+    x0[i] = i * 0.5;
+    x1[i] = 1.0 + i % 10;
+  }
+
+  start = now_ns();
+  for (size_t i = 0; i < n_rows; i++)
+  {
+    double row[] = {x0[i], x1[i]};
+    out[i] = ET_evaluate_vars(tree, row);
+  }
+  double row_ns = (now_ns() - start) / n_rows;
+
+  start = now_ns();
+  ET_evaluate_batch(tree, columns, n_rows, out);
+  double batch_ns = (now_ns() - start) / n_rows;
+
+  printf("%-6s rows=%-10zu ET_evaluate_vars %6.2f ns/row   ET_evaluate_batch %6.2f ns/row\n",
+         name, n_rows, row_ns, batch_ns);
+  free(x0);
+  free(x1);
+  free(out);
+}
+
+/*
+ * Time the gradient of a tree over x0..x3 by central differences with
+ * ET_run_vars, by ET_run_gradient and by ET_run_gradient_batch, and
+ * print ns per gradient of each
+ *
+ * Parameters:
+ *   name     Label for the output line
+ *   tree     The tree, over variables x0..x3
+ *   n_rows   Number of points to take gradients at
+ */
+static void bench_gradient(const char *name, ExprTree tree, size_t n_rows)
+{
+  ExprProgram prog = ET_compile(tree);
+  double *xs[4], *grads[4];
+  double *out = malloc(n_rows * sizeof(double));
+  double start, sink = 0;
+
+  for (int v = 0; v < 4; v++)
+  {
+    xs[v] = malloc(n_rows * sizeof(double));
+    grads[v] = malloc(n_rows * sizeof(double));
+    for (size_t i = 0; i < n_rows; i++)
+      xs[v][i] = 1.0 + (i * (v + 1)) % 17 * 0.25;
+  }
+
+  start = now_ns();
+  for (size_t i = 0; i < n_rows; i++)
+  {
+    double row[] = {xs[0][i], xs[1][i], xs[2][i], xs[3][i]};
+    for (int v = 0; v < 4; v++)
+    {
+      double h = 1e-6 * row[v], x = row[v];
+      row[v] = x + h;
+      double up = ET_run_vars(prog, row);
+      row[v] = x - h;
+      sink += (up - ET_run_vars(prog, row)) / (2 * h);
+      row[v] = x;
+    }
+  }
+  double diff_ns = (now_ns() - start) / n_rows;
+
+  start = now_ns();
+  for (size_t i = 0; i < n_rows; i++)
+  {
+    double row[] = {xs[0][i], xs[1][i], xs[2][i], xs[3][i]}, grad[4];
+    sink += ET_run_gradient(prog, row, 4, grad) + grad[0];
+  }
+  double grad_ns = (now_ns() - start) / n_rows;
+
+  start = now_ns();
+  ET_run_gradient_batch(prog, (const double *const *)xs, n_rows, 4, out, grads);
+  double batch_ns = (now_ns() - start) / n_rows;
+
+  printf("%-6s rows=%-10zu differences %8.2f ns/row   ET_run_gradient %8.2f ns/row   "
+         "ET_run_gradient_batch %8.2f ns/row   (sink %g)\n",
+         name, n_rows, diff_ns, grad_ns, batch_ns, sink);
+  for (int v = 0; v < 4; v++)
+  {
+    free(xs[v]);
+    free(grads[v]);
+  }
+  free(out);
+  ET_program_free(prog);
+}
+
+// The tree shapes of the core suite
+static const struct
+{
+  const char *name;
+  ExprTree (*make)(int n_ops);
+} core_shapes[] = {
+    {"random", make_random},
+    {"balanced", make_balanced},
+    {"left_deep", make_deep},
+    {"right_deep", make_right_deep},
+};
+
+/*
+ * Print one result of the core suite as a line of key=value pairs
+ *
+ * Parameters:
+ *   op       The operation timed
+ *   shape    The tree shape
+ *   nodes    Nodes in the tree
+ *   ns       Best time of one operation over the whole tree
+ *   allocs   Heap allocations made by one operation
+ */
+static void core_report(const char *op, const char *shape, int nodes, double ns, size_t allocs)
+{
+  printf("op=%s shape=%s nodes=%d ns_per_node=%.3f", op, shape, nodes, ns / nodes);
+#ifdef ALLOCS_COUNTED
+  printf(" allocs_per_node=%.4f", (double)allocs / nodes);
+#else
+  printf(" allocs_per_node=NA");
+#endif
+  printf(" peak_rss_kb=%ld\n", peak_rss_kb());
+}
+
+/*
+ * Time building a tree of the given shape from ET_value and ET_node,
+ * ET_count, ET_depth, ET_evaluate, ET_tree2string and ET_free, and
+ * print a line per operation with the best of reps runs
+ *
+ * Parameters:
+ *   shape    Index into core_shapes
+ *   n_ops    Interior nodes in the tree
+ *   seed     Seed for the random shape; each build starts from it
+ *   reps     Number of runs of each operation
+ */
+static void bench_core(int shape, int n_ops, unsigned seed, int reps)
+{
+  static const char *const ops[] = {"build", "free", "count", "depth", "evaluate", "tree2string"};
+  enum { BUILD, FREE, COUNT, DEPTH, EVALUATE, TREE2STRING, N_OPS };
+  const char *name = core_shapes[shape].name;
+  double best[N_OPS];
+  size_t allocs[N_OPS];
+  volatile double sink;
+  ExprTree tree = NULL;
+  char *buf = NULL;
+  size_t buf_sz = 0;
+  int nodes = 0;
+
+  for (int op = 0; op < N_OPS; op++)
+  {
+    for (int r = 0; r < reps; r++)
+    {
+      // every run but that of ET_free needs a tree, and ET_free needs
+      // a fresh one each time
+      if (op == FREE || (op > BUILD && tree == NULL))
+      {
+        srand(seed);
+        tree = core_shapes[shape].make(n_ops);
+      }
+
+      size_t before = atomic_load(&n_allocs);
+      double start = now_ns();
+      switch (op)
+      {
+      case BUILD:
+        srand(seed);
+        tree = core_shapes[shape].make(n_ops);
+        break;
+      case FREE:
+        ET_free(tree);
+        tree = NULL;
+        break;
+      case COUNT:
+        sink = ET_count(tree);
+        break;
+      case DEPTH:
+        sink = ET_depth(tree);
+        break;
+      case EVALUATE:
+        sink = ET_evaluate(tree);
+        break;
+      case TREE2STRING:
+        sink = ET_tree2string(tree, buf, buf_sz);
+        break;
+      }
+      double ns = now_ns() - start;
+
+      if (r == 0 || ns < best[op])
+        best[op] = ns;
+      allocs[op] = atomic_load(&n_allocs) - before;
+
+      if (op == BUILD)
+      {
+        nodes = ET_count(tree);
+        ET_free(tree);
+        tree = NULL;
+      }
+    }
+
+    if (op == FREE)
+    {
+      buf_sz = (size_t)nodes * 24 + 64;
+      buf = malloc(buf_sz);
+    }
+  }
+
+  (void)sink;
+  ET_free(tree);
+  free(buf);
+
+  for (int op = 0; op < N_OPS; op++)
+    core_report(ops[op], name, nodes, best[op], allocs[op]);
+}
+
+/*
+ * Scalar kernel of "exp_rows", exp registered without a batch kernel
+ * so that bench_call can compare the two ways of running a call
+ */
+static double exp_rows(const double *args)
+{
+  return exp(args[0]);
+}
+
+/*
+ * Time ET_run_batch on a sum of n_calls calls of exp, once with the
+ * built-in exp and its batch kernel and once with exp_rows, whose
+ * scalar kernel runs per row, as well as ET_jit_run per row, and print
+ * ns per row of each
+ *
+ * Parameters:
+ *   n_calls  Number of calls in the tree
+ *   n_rows   Number of rows
+ */
+static void bench_call(int n_calls, size_t n_rows)
+{
+  int fn = ET_find_fn("exp_rows", 8);
+  if (fn < 0)
+    fn = ET_register_fn("exp_rows", 1, exp_rows, NULL, NULL);
+
+  // sum of exp(x0 * 0.001 * k - x1)
+  ExprTree batch_args[n_calls], row_args[n_calls];
+  for (int k = 0; k < n_calls; k++)
+  {
+    ExprTree arg = ET_node(OP_SUB, ET_node(OP_MUL, ET_var(0), ET_value(0.001 * k)), ET_var(1));
+    batch_args[k] = ET_call(ET_FN_EXP, (ExprTree[]){ET_clone(arg)}, 1);
+    row_args[k] = ET_call(fn, (ExprTree[]){arg}, 1);
+  }
+  ExprTree batch_tree = ET_node_list(OP_SUM, batch_args, n_calls);
+  ExprTree row_tree = ET_node_list(OP_SUM, row_args, n_calls);
+  ExprProgram batch_prog = ET_compile(batch_tree), row_prog = ET_compile(row_tree);
+  ExprJit jit = ET_jit(batch_tree);
+
+  double *x0 = malloc(n_rows * sizeof(double));
+  double *x1 = malloc(n_rows * sizeof(double));
+  double *out = malloc(n_rows * sizeof(double));
+  const double *columns[] = {x0, x1};
+  double start, sink = 0;
+  for (size_t i = 0; i < n_rows; i++)
+  {
+    x0[i] = i % 1000 * 0.01;
+    x1[i] = 0.5 + i % 7;
+  }
+
+  start = now_ns();
+  ET_run_batch(batch_prog, columns, n_rows, out);
+  double batch_ns = (now_ns() - start) / n_rows;
+  sink += out[n_rows / 2];
+
+  start = now_ns();
+  ET_run_batch(row_prog, columns, n_rows, out);
+  double scalar_ns = (now_ns() - start) / n_rows;
+  sink += out[n_rows / 2];
+
+  start = now_ns();
+  for (size_t i = 0; i < n_rows; i++)
+  {
+    double row[] = {x0[i], x1[i]};
+    sink += ET_jit_run(jit, row);
+  }
+  double jit_ns = (now_ns() - start) / n_rows;
+
+  printf("call   calls=%-4d rows=%-10zu batch kernel %7.2f ns/row   scalar kernel %7.2f ns/row   "
+         "ET_jit_run %7.2f ns/row   (sink %g)\n",
+         n_calls, n_rows, batch_ns, scalar_ns, jit_ns, sink);
+  free(x0);
+  free(x1);
+  free(out);
+  ET_jit_free(jit);
+  ET_program_free(batch_prog);
+  ET_program_free(row_prog);
+  ET_free(batch_tree);
+  ET_free(row_tree);
+}
+
+/*
+ * Time ET_specialize on a sum of terms over n_vars variables with all
+ * but x0 and x1 bound, as when most inputs of a formula are fixed per
+ * scenario, and ET_run_vars on the original and residual trees, and
+ * print both node counts and the ns per row of each
+ *
+ * Parameters:
+ *   n_vars     Number of variables, at least 3
+ *   scenarios  Number of sets of bindings to specialize for
+ *   n_rows     Rows of x0 and x1 to run each residual on
+ */
+static void bench_specialize(int n_vars, int scenarios, size_t n_rows)
+{
+  // sum of ((xk * 0.5 + exp(x(k-1) * 0.01)) / (xk + 2)) * x(k % 2) + (xk * xk + 1) ^ 1.5
+  int n_terms = n_vars - 2;
+  ExprTree terms[n_terms];
+  for (int k = 2; k < n_vars; k++)
+  {
+    ExprTree scaled = ET_node(OP_ADD, ET_node(OP_MUL, ET_var(k), ET_value(0.5)),
+                              ET_call(ET_FN_EXP, (ExprTree[]){ET_node(OP_MUL, ET_var(k - 1), ET_value(0.01))}, 1));
+    ExprTree ratio = ET_node(OP_DIV, scaled, ET_node(OP_ADD, ET_var(k), ET_value(2)));
+    ExprTree power = ET_node(OP_POWER, ET_node(OP_ADD, ET_node(OP_MUL, ET_var(k), ET_var(k)), ET_value(1)), ET_value(1.5));
+    terms[k - 2] = ET_node(OP_ADD, ET_node(OP_MUL, ratio, ET_var(k % 2)), power);
+  }
+  ExprTree tree = ET_node_list(OP_SUM, terms, n_terms);
+  ExprProgram prog = ET_compile(tree);
+
+  ExprBinding *bindings = malloc(n_terms * sizeof(ExprBinding));
+  double *vars = malloc(n_vars * sizeof(double));
+  double spec_ns = 0, orig_ns = 0, residual_ns = 0, sink = 0, check = 0;
+  int residual_nodes = 0;
+
+  for (int s = 0; s < scenarios; s++)
+  {
+    for (int k = 2; k < n_vars; k++)
+    {
+      bindings[k - 2].var = k;
+      bindings[k - 2].value = vars[k] = 0.25 + (s * 7 + k) % 13 * 0.125;
+    }
+
+    double start = now_ns();
+    ExprTree residual = ET_specialize(tree, bindings, n_terms);
+    spec_ns += now_ns() - start;
+    residual_nodes = ET_count(residual);
+    ExprProgram residual_prog = ET_compile(residual);
+
+    start = now_ns();
+    for (size_t i = 0; i < n_rows; i++)
+    {
+      vars[0] = i % 100 * 0.01;
+      vars[1] = 1 + i % 3;
+      check += ET_run_vars(prog, vars);
+    }
+    orig_ns += now_ns() - start;
+
+    start = now_ns();
+    for (size_t i = 0; i < n_rows; i++)
+    {
+      vars[0] = i % 100 * 0.01;
+      vars[1] = 1 + i % 3;
+      sink += ET_run_vars(residual_prog, vars);
+    }
+    residual_ns += now_ns() - start;
+
+    ET_program_free(residual_prog);
+    ET_free(residual);
+  }
+
+  printf("specialize vars=%-4d nodes=%d residual=%d   ET_specialize %8.0f ns   "
+         "ET_run_vars %7.2f ns/row   residual %7.2f ns/row   (%s)\n",
+         n_vars, ET_count(tree), residual_nodes, spec_ns / scenarios, orig_ns / scenarios / n_rows,
+         residual_ns / scenarios / n_rows, sink == check ? "same" : "DIFFERENT");
+  free(bindings);
+  free(vars);
+  ET_program_free(prog);
+  ET_free(tree);
+}
+
+int main(int argc, char **argv)
+{
+  int n_ops = 1000000, reps = 5;
+  unsigned seed = 1;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:s:r:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'n':
+      n_ops = atoi(optarg);
+      break;
+    case 's':
+      seed = strtoul(optarg, NULL, 0);
+      break;
+    case 'r':
+      reps = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-n nodes] [-s seed] [-r reps] [core|extra|all]\n", argv[0]);
+      return 2;
+    }
+  }
+  const char *suite = optind < argc ? argv[optind] : "all";
+  if (n_ops < 1 || reps < 1)
+    n_ops = reps = 1;
+
+  if (strcmp(suite, "extra") != 0)
+    for (int shape = 0; shape < (int)(sizeof(core_shapes) / sizeof(core_shapes[0])); shape++)
+      bench_core(shape, n_ops, seed, reps);
+
+  if (strcmp(suite, "core") == 0)
+    return 0;
+
+  ExprTree tree;
+
+  tree = make_deep(100000);
+  bench_evaluate("deep", tree, 200);
+  bench_tree2string("deep", tree, 1 << 22, 20);
+  ET_free(tree);
+
+  // a chain of additions alone, before and after ET_fuse folds it
+  tree = ET_value(1);
+  for (int i = 0; i < 100000; i++)
+    tree = ET_node(OP_ADD, tree, ET_value(i % 7));
+  bench_evaluate("chain", tree, 200);
+  tree = ET_fuse(tree, NULL);
+  bench_evaluate("fused", tree, 200);
+  ET_free(tree);
+
+  tree = make_wide(18);
+  bench_evaluate("wide", tree, 50);
+  bench_tree2string("wide", tree, 1 << 23, 20);
+  bench_serialize("wide", tree, 20);
+  ET_free(tree);
+
+  srand(seed);
+  bench_format(18, 10);
+
+  // random trees well beyond L2, whose nodes are scattered over the heap
+  srand(seed);
+  tree = make_random(1 << 21);
+  bench_frozen("frozen", tree, 10);
+  ET_free(tree);
+
+  int cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  tree = make_wide(22);
+  bench_parallel("bal", tree, cpus > 4 ? cpus : 4, 5);
+  ET_free(tree);
+  tree = make_skewed(1 << 21, 90);
+  bench_parallel("skew", tree, cpus > 4 ? cpus : 4, 5);
+  ET_free(tree);
+
+  srand(seed);
+  bench_many(10000, cpus > 4 ? cpus : 4, 20);
+
+  bench_incremental(1 << 19, 100000);
+
+  bench_intern("intern", make_wide(18), 20);
+
+  bench_parse(1000000, 8);
+
+  // ((x0 * x1) + ((x0 - 3) / (-x1)))
+  tree = ET_node(OP_ADD, ET_node(OP_MUL, ET_var(0), ET_var(1)),
+                 ET_node(OP_DIV, ET_node(OP_SUB, ET_var(0), ET_value(3)), ET_node(UNARY_NEGATE, ET_var(1), NULL)));
+  bench_batch("batch", tree, 1000000);
+  ET_free(tree);
+
+  srand(seed);
+  tree = make_random(200);
+  bench_gradient("grad", tree, 100000);
+  ET_free(tree);
+
+  bench_call(16, 1000000);
+
+  bench_specialize(64, 20, 100000);
+
+  return 0;
+}
@@ -0,0 +1,167 @@
+/*
+ * et_bench_hpp.cpp
+ *
+ * Benchmarks for the static expressions of expr_tree.hpp against the
+ * runtime evaluators of the same trees
+ *
+ * Author: Howdy Pierce <howdy@sleepymoose.net>
+ * Contributor: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <time.h>
+#include <unistd.h>
+
+#include "expr_tree.hpp"
+
+// Heap allocations made so far, counted by interposing on glibc's
+// allocator as et_bench does; stays 0 elsewhere
+static std::atomic<size_t> n_allocs;
+
+#if defined(__GLIBC__)
+#define ALLOCS_COUNTED 1
+
+extern "C"
+{
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+  n_allocs.fetch_add(1, std::memory_order_relaxed);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+  n_allocs.fetch_add(1, std::memory_order_relaxed);
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+  n_allocs.fetch_add(1, std::memory_order_relaxed);
+  return __libc_realloc(ptr, size);
+}
+}
+#endif
+
+/*
+ * Return a monotonic timestamp in nanoseconds
+ */
+static double now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * Print the time and allocations per row of one way of evaluating
+ */
+static void report(const char *name, const char *how, size_t n_rows, double ns, size_t allocs, double sink)
+{
+  printf("%-8s %-24s %8.2f ns/row", name, how, ns / n_rows);
+#ifdef ALLOCS_COUNTED
+  printf("   allocs/row %.3f", (double)allocs / n_rows);
+#endif
+  printf("   (sink %g)\n", sink);
+}
+
+/*
+ * Time one static expression over n_rows rows of n_vars variables:
+ * inline through et::evaluate, then its runtime tree through
+ * ET_evaluate_vars, ET_run_vars, ET_jit_run and ET_run_batch. Every
+ * way must give the same sum, which is printed as the sink.
+ *
+ * Parameters:
+ *   name     Label for the output lines
+ *   e        The expression
+ *   n_vars   Variables it reads, at most 4
+ *   n_rows   Number of rows
+ */
+template <class E>
+static void bench_static(const char *name, const E &e, size_t n_vars, size_t n_rows)
+{
+  double *columns[4], *out = (double *)malloc(n_rows * sizeof(double));
+  for (size_t v = 0; v < n_vars; v++)
+  {
+    columns[v] = (double *)malloc(n_rows * sizeof(double));
+    for (size_t i = 0; i < n_rows; i++)
+      columns[v][i] = 0.5 + (i * (v + 3)) % 97 * 0.03125;
+  }
+
+  ExprTree tree = et::to_tree(e);
+  ExprProgram prog = ET_compile(tree);
+  ExprJit jit = ET_jit(tree);
+  double start, sink;
+  size_t allocs;
+
+#define TIME_ROWS(how, expr)                      \
+  sink = 0;                                       \
+  allocs = n_allocs.load();                       \
+  start = now_ns();                               \
+  for (size_t i = 0; i < n_rows; i++)             \
+  {                                               \
+    double row[4];                                \
+    for (size_t v = 0; v < n_vars; v++)           \
+      row[v] = columns[v][i];                     \
+    sink += (expr);                               \
+  }                                               \
+  report(name, how, n_rows, now_ns() - start, n_allocs.load() - allocs, sink);
+
+  TIME_ROWS("et::evaluate", et::evaluate(e, row));
+  TIME_ROWS("ET_evaluate_vars", ET_evaluate_vars(tree, row));
+  TIME_ROWS("ET_run_vars", ET_run_vars(prog, row));
+  TIME_ROWS("ET_jit_run", ET_jit_run(jit, row));
+#undef TIME_ROWS
+
+  allocs = n_allocs.load();
+  start = now_ns();
+  ET_run_batch(prog, (const double *const *)columns, n_rows, out);
+  double ns = now_ns() - start;
+  sink = 0;
+  for (size_t i = 0; i < n_rows; i++)
+    sink += out[i];
+  report(name, "ET_run_batch", n_rows, ns, n_allocs.load() - allocs, sink);
+
+  // building the tree is the other cost the static path avoids
+  allocs = n_allocs.load();
+  start = now_ns();
+  for (int r = 0; r < 1000; r++)
+    ET_free(et::to_tree(e));
+  report(name, "et::to_tree + ET_free", 1000, now_ns() - start, n_allocs.load() - allocs, 0);
+
+  ET_jit_free(jit);
+  ET_program_free(prog);
+  ET_free(tree);
+  for (size_t v = 0; v < n_vars; v++)
+    free(columns[v]);
+  free(out);
+}
+
+int main(int argc, char **argv)
+{
+  size_t n_rows = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000000;
+  if (n_rows == 0)
+    n_rows = 1;
+
+  auto x0 = et::var<0>;
+  auto x1 = et::var<1>;
+  auto x2 = et::var<2>;
+  auto x3 = et::var<3>;
+
+  // a cubic by Horner's rule
+  bench_static("horner", ((x0 * 0.25 - 1.5) * x0 + 2) * x0 - 0.75, 1, n_rows);
+
+  // a rational function of several variables, with an integer power
+  bench_static("rational", (x0 * x1 + et::powi(x2, 3) - x3 / 7) / (x0 * x0 + x1 * x3 + 1), 4, n_rows);
+
+  // built-in functions and pow(), which no evaluator can fold
+  bench_static("calls", et::max(et::exp(-x0 * x1), et::sqrt(x2)) + et::pow(x3, 1.5) * et::log(x0 + 1), 4, n_rows);
+
+  return 0;
+}
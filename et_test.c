@@ -14,6 +14,10 @@
 #include <ctype.h>  // isblank
 #include <math.h>   // fabs
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h> // INT_MAX
+#include <unistd.h> // close, unlink
+#include <pthread.h>
 
 #include "expr_tree.h"
 
@@ -170,6 +174,35 @@ int test_count()
   ET_free(tree);
   test_assert(count == 11);
 
+  // counts kept up to date when a subtree is simplified in place...
+  ExprTree sub = ET_node(OP_ADD, ET_value(1), ET_node(OP_MUL, ET_value(2), ET_value(3)));
+  tree = ET_node(OP_SUB, ET_node(UNARY_NEGATE, sub, NULL), ET_value(4));
+  test_assert(ET_count(tree) == 8 && ET_depth(tree) == 5);
+  test_assert(ET_simplify(sub, true, NULL) == sub);
+  test_assert(ET_count(tree) == 4 && ET_depth(tree) == 3);
+  ET_free(tree);
+
+  // ...and when a tree is loaded
+  unsigned char buf[256];
+  tree = ET_node(OP_DIV, ET_node(UNARY_NEGATE, ET_node(OP_ADD, ET_var(0), ET_value(1)), NULL), ET_value(2));
+  size_t size = ET_serialize(tree, buf, sizeof(buf));
+  ET_free(tree);
+  tree = ET_load(buf, size, NULL, NULL);
+  test_assert(ET_count(tree) == 6 && ET_depth(tree) == 4);
+  ET_free(tree);
+
+  // a DAG that doubles at every level counts 2^(n + 1) - 1 nodes,
+  // which stops at INT_MAX, and does not wrap even past 2^64
+  tree = ET_var(0);
+  for (int i = 0; i < 63; i++)
+  {
+    tree = ET_node(OP_ADD, tree, ET_share(tree));
+    test_assert(ET_count(tree) == (i < 30 ? (2 << (i + 1)) - 1 : INT_MAX));
+  }
+  tree = ET_node(UNARY_NEGATE, ET_node(UNARY_NEGATE, tree, NULL), NULL);
+  test_assert(ET_count(tree) == INT_MAX && ET_depth(tree) == 66 && ET_count_distinct(tree) == 66);
+  ET_free(tree);
+
   return 1;
 }
 
@@ -403,25 +436,2313 @@ int test_tree2string()
   return 1;
 }
 
-int main()
+/*
+ * Tests the ExprArena functions.
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_arena()
 {
-  int passed = 0;
-  int num_tests = 0;
+  // a tiny block size forces the arena to chain several blocks
+  ExprArena arena = ET_arena_create(2);
+  ExprTree tree;
+  char buf[64];
+
+  // (((2 + 1) ^ (1.5 * 2)) / (-1.7 + (6 - 0.3))) ==> 6.75
+  tree = ET_arena_node(arena, OP_DIV,
+                       ET_arena_node(arena, OP_POWER,
+                                     ET_arena_node(arena, OP_ADD, ET_arena_value(arena, 2), ET_arena_value(arena, 1)),
+                                     ET_arena_node(arena, OP_MUL, ET_arena_value(arena, 1.5), ET_arena_value(arena, 2))),
+                       ET_arena_node(arena, OP_ADD, ET_arena_value(arena, -1.7),
+                                     ET_arena_node(arena, OP_SUB, ET_arena_value(arena, 6), ET_arena_value(arena, 0.3))));
+  test_assert(ET_count(tree) == 13);
+  test_assert(ET_depth(tree) == 4);
+  test_assert(fabs(ET_evaluate(tree) - 6.75) < 1e-9);
+  ET_tree2string(tree, buf, sizeof(buf));
+  test_assert(strcmp(buf, "(((2 + 1) ^ (1.5 * 2)) / (-1.7 + (6 - 0.3)))") == 0);
 
-  num_tests++;
-  passed += test_node_free();
+  // ET_free must leave arena nodes alone
+  ET_free(tree);
+  test_assert(fabs(ET_evaluate(tree) - 6.75) < 1e-9);
+
+  // after a reset the same memory is handed out again
+  ET_arena_reset(arena);
+  ExprTree first = ET_arena_value(arena, 1);
+  ET_arena_reset(arena);
+  test_assert(ET_arena_value(arena, 2) == first);
+  test_assert(ET_evaluate(first) == 2);
+  ET_arena_destroy(arena);
+
+  // the per-thread arena is created once and reused
+  ExprArena mine = ET_arena_thread();
+  test_assert(mine != NULL);
+  test_assert(ET_arena_thread() == mine);
+  tree = ET_arena_node(mine, UNARY_NEGATE, ET_arena_value(mine, 4), NULL);
+  test_assert(ET_evaluate(tree) == -4);
+  ET_arena_thread_release();
 
-  num_tests++;
-  passed += test_depth();
+  return 1;
+}
 
-  num_tests++;
-  passed += test_count();
+/*
+ * Helper function for test_compile: compiles tree and checks that
+ * running the program matches ET_evaluate.
+ *
+ * Parameters:
+ *  tree: the tree to test
+ *
+ * Returns:
+ *  true if the test passes, false otherwise
+ */
+bool test_compile_once(ExprTree tree)
+{
+  ExprProgram prog = ET_compile(tree);
+  double expected = ET_evaluate(tree);
+  double first = ET_run(prog);
+  double second = ET_run(prog); // programs are reusable
+  ET_program_free(prog);
+  return first == expected && second == expected;
+}
 
-  num_tests++;
-  passed += test_evaluate();
+/*
+ * Tests the ET_compile and ET_run functions.
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_compile()
+{
+  ExprTree tree = NULL;
 
-  num_tests++;
-  passed += test_tree2string();
+  test_assert(test_compile_once(tree));
+
+  tree = ET_value(-1000);
+  test_assert(test_compile_once(tree));
+  ET_free(tree);
+
+  tree = ET_node(OP_MUL, ET_value(5), ET_node(OP_SUB, ET_value(10), ET_value(3)));
+  test_assert(test_compile_once(tree));
+  ET_free(tree);
+
+  tree = ET_node(UNARY_NEGATE, ET_node(UNARY_NEGATE, ET_value(-0.125), NULL), NULL);
+  test_assert(test_compile_once(tree));
+  ET_free(tree);
+
+  // 2^(1.5 × 2) ÷ (−1.7 + (6 − 0.3)) ==> 2
+  tree = ET_node(OP_DIV, ET_node(OP_POWER, ET_value(2), ET_node(OP_MUL, ET_value(1.5), ET_value(2))), ET_node(OP_ADD, ET_value(-1.7), ET_node(OP_SUB, ET_value(6), ET_value(0.3))));
+  test_assert(test_compile_once(tree));
+  ET_free(tree);
+
+  // every NULL operand compiles to a push of its own
+  tree = ET_node(OP_ADD, ET_node(OP_SUB, NULL, NULL), ET_node(OP_MUL, NULL, NULL));
+  test_assert(test_compile_once(tree));
+  ET_free(tree);
+  tree = ET_node(OP_DIV, ET_node(UNARY_NEGATE, NULL, NULL), ET_node(OP_POWER, ET_node(OP_ADD, NULL, NULL), NULL));
+  test_assert(test_compile_once(tree));
+  ET_free(tree);
+
+  // right-deep chain needs a stack as deep as the tree
+  tree = ET_value(1);
+  for (int i = 0; i < 1000; i++)
+    tree = ET_node(i % 2 ? OP_SUB : OP_ADD, ET_value(i), tree);
+  test_assert(test_compile_once(tree));
+  ET_free(tree);
+
+  return 1;
+}
+
+/*
+ * Tests ET_var together with ET_evaluate_vars, ET_run_vars and
+ * ET_evaluate_batch.
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_variables()
+{
+  ExprTree tree = NULL;
+  char buf[64];
+
+  // ((x0 * x1) - (-x2)) with x = {2, 3, 4} ==> 10
+  tree = ET_node(OP_SUB, ET_node(OP_MUL, ET_var(0), ET_var(1)), ET_node(UNARY_NEGATE, ET_var(2), NULL));
+  double vars[] = {2, 3, 4};
+  test_assert(ET_count(tree) == 6);
+  test_assert(ET_depth(tree) == 3);
+  test_assert(ET_evaluate_vars(tree, vars) == 10);
+  test_assert(isnan(ET_evaluate(tree)));
+  ET_tree2string(tree, buf, sizeof(buf));
+  test_assert(strcmp(buf, "((x0 * x1) - (-x2))") == 0);
+
+  ExprProgram prog = ET_compile(tree);
+  test_assert(ET_run_vars(prog, vars) == 10);
+  test_assert(isnan(ET_run(prog)));
+  ET_program_free(prog);
+  ET_free(tree);
+
+  // a right-deep tree over every operator, so the batch evaluator sees
+  // the reversed opcodes as well as an odd-sized final block
+  tree = ET_node(OP_POWER, ET_var(1), ET_value(2));
+  tree = ET_node(OP_DIV, ET_var(0), tree);
+  tree = ET_node(OP_SUB, ET_value(7), ET_node(OP_MUL, ET_var(1), tree));
+  tree = ET_node(OP_ADD, ET_var(2), ET_node(UNARY_NEGATE, tree, NULL));
+  tree = ET_node(OP_POWER, ET_value(1.5), ET_node(OP_DIV, tree, ET_value(100)));
+
+  enum { ROWS = 1000 };
+  double *x0 = malloc(ROWS * sizeof(double));
+  double *x1 = malloc(ROWS * sizeof(double));
+  double *x2 = malloc(ROWS * sizeof(double));
+  double *out = malloc(ROWS * sizeof(double));
+  const double *columns[] = {x0, x1, x2};
+
+  for (int i = 0; i < ROWS; i++)
+  {
+    x0[i] = i * 0.25 - 30;
+    x1[i] = (i % 17) - 8.5;
+    x2[i] = i;
+  }
+
+  ET_evaluate_batch(tree, columns, ROWS, out);
+
+  int mismatches = 0;
+  for (int i = 0; i < ROWS; i++)
+  {
+    double row[] = {x0[i], x1[i], x2[i]};
+    if (out[i] != ET_evaluate_vars(tree, row))
+      mismatches++;
+  }
+
+  ET_evaluate_batch(tree, NULL, 3, out);
+  bool unbound_nan = isnan(out[0]) && isnan(out[1]) && isnan(out[2]);
+
+  free(x0);
+  free(x1);
+  free(x2);
+  free(out);
+  ET_free(tree);
+
+  test_assert(mismatches == 0);
+  test_assert(unbound_nan);
+
+  return 1;
+}
+
+/*
+ * Tests ET_tree2string with large buffers, deep trees, and truncation
+ * at every possible buffer size.
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_tree2string_large()
+{
+  enum { BIG = 65536 };
+  char *buf = malloc(BIG);
+  char *full = malloc(BIG);
+  ExprTree tree;
+  size_t length;
+
+  // (1 + (1 + ... (1 + 1)...)) nested 2000 deep fits in 64 KB
+  tree = ET_value(1);
+  for (int i = 0; i < 2000; i++)
+    tree = ET_node(OP_ADD, ET_value(1), tree);
+  length = ET_tree2string(tree, buf, BIG);
+  test_assert(length == 2000 * 6 + 1);
+  test_assert(strlen(buf) == length);
+  test_assert(strncmp(buf, "(1 + (1 + (1 + ", 15) == 0);
+  test_assert(buf[length - 2001] == '1' && buf[length - 2000] == ')' && buf[length - 1] == ')');
+  ET_free(tree);
+
+  // a chain far longer than the buffer is cut off without a full walk
+  tree = ET_value(2);
+  for (int i = 0; i < 100000; i++)
+    tree = ET_node(OP_MUL, tree, ET_value(3));
+  length = ET_tree2string(tree, buf, BIG);
+  test_assert(length == BIG - 1);
+  test_assert(buf[BIG - 2] == '$' && buf[BIG - 1] == '\0');
+  test_assert(buf[0] == '(' && buf[BIG - 3] == '(');
+  ET_free(tree);
+
+  // every buffer size gives a prefix of the full string followed by '$'
+  tree = ET_node(OP_DIV, ET_node(OP_POWER, ET_node(OP_ADD, ET_value(2), ET_value(1)), ET_node(OP_MUL, ET_value(1.5), ET_value(2))), ET_node(OP_ADD, ET_node(UNARY_NEGATE, ET_value(-1.7), NULL), ET_node(OP_SUB, ET_var(6), ET_value(0.3))));
+  size_t full_length = ET_tree2string(tree, full, BIG);
+  test_assert(strcmp(full, "(((2 + 1) ^ (1.5 * 2)) / ((--1.7) + (x6 - 0.3)))") == 0);
+  for (size_t sz = 2; sz < full_length + 4; sz++)
+  {
+    length = ET_tree2string(tree, buf, sz);
+    if (full_length < sz)
+    {
+      test_assert(length == full_length && strcmp(buf, full) == 0);
+    }
+    else
+    {
+      test_assert(length == sz - 1 && buf[sz - 2] == '$' && buf[sz - 1] == '\0');
+      test_assert(strncmp(buf, full, sz - 2) == 0);
+    }
+  }
+  ET_free(tree);
+
+  free(buf);
+  free(full);
+  return 1;
+}
+
+/*
+ * Stress tests ET_free, ET_count, ET_depth and ET_evaluate on chains
+ * of 10^7 nodes, far deeper than the machine stack could recurse.
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_deep_chains()
+{
+  enum { OPS = 5000000 }; // each link adds an operator and a leaf
+  ExprTree tree;
+  char buf[16];
+
+  // left-deep: ((((1 + 1) - 1) + 1) - 1) ... like folding a sum
+  tree = ET_value(1);
+  for (int i = 0; i < OPS; i++)
+    tree = ET_node(i % 2 ? OP_SUB : OP_ADD, tree, ET_value(1));
+  test_assert(ET_count(tree) == 2 * OPS + 1);
+  test_assert(ET_depth(tree) == OPS + 1);
+  test_assert(ET_evaluate(tree) == 1);
+  test_assert(ET_tree2string(tree, buf, sizeof(buf)) == sizeof(buf) - 1);
+  test_assert(strcmp(buf, "(((((((((((((($") == 0);
+  ET_free(tree);
+
+  // right-deep: (1 + (1 + (1 + ... (-1))))
+  tree = ET_node(UNARY_NEGATE, ET_value(1), NULL);
+  for (int i = 0; i < OPS; i++)
+    tree = ET_node(OP_ADD, ET_value(1), tree);
+  test_assert(ET_count(tree) == 2 * OPS + 2);
+  test_assert(ET_depth(tree) == OPS + 2);
+  test_assert(ET_evaluate(tree) == OPS - 1);
+  ET_free(tree);
+
+  // a DAG with 2^64 paths through 66 nodes evaluates each node once
+  double vars[] = {1};
+  tree = ET_var(0);
+  for (int i = 0; i < 63; i++)
+    tree = ET_node(OP_ADD, tree, ET_share(tree));
+  tree = ET_node(UNARY_NEGATE, ET_node(UNARY_NEGATE, tree, NULL), NULL);
+  test_assert(ET_evaluate_vars(tree, vars) == ldexp(1, 63));
+  test_assert(ET_hash(tree) != 0 && ET_count_distinct(tree) == 66);
+  ET_free(tree);
+
+  return 1;
+}
+
+/*
+ * Helper function for test_simplify: simplifies tree and compares the
+ * result's string form and the number of nodes removed.
+ *
+ * Parameters:
+ *  tree: the tree to simplify; freed by this function
+ *  strict: passed to ET_simplify
+ *  expected_str: the expected string form of the simplified tree
+ *  expected_removed: the expected number of removed nodes
+ *
+ * Returns:
+ *  true if the test passes, false otherwise
+ */
+bool test_simplify_once(ExprTree tree, bool strict, const char *expected_str, int expected_removed)
+{
+  char buf[64];
+  int before = ET_count(tree);
+  int removed = -1;
+
+  tree = ET_simplify(tree, strict, &removed);
+  ET_tree2string(tree, buf, sizeof(buf));
+  bool ok = strcmp(buf, expected_str) == 0 && removed == expected_removed &&
+            ET_count(tree) == before - removed;
+  if (!ok)
+    printf("ET_simplify gave %s, removed %d\n", buf, removed);
+  ET_free(tree);
+  return ok;
+}
+
+/*
+ * Tests the ET_simplify function.
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_simplify()
+{
+  ExprTree tree = NULL;
+  double vars[] = {-0.0};
+
+  test_assert(ET_simplify(NULL, true, NULL) == NULL);
+
+  // whole constant trees fold to their value
+  tree = ET_node(OP_DIV, ET_node(OP_POWER, ET_value(2), ET_node(OP_MUL, ET_value(1.5), ET_value(2))), ET_node(OP_ADD, ET_value(-1.7), ET_node(OP_SUB, ET_value(6), ET_value(0.3))));
+  test_assert(test_simplify_once(tree, true, "2", 10));
+
+  // partially constant trees fold what they can
+  tree = ET_node(OP_ADD, ET_node(OP_MUL, ET_value(2), ET_value(3)), ET_var(0));
+  test_assert(test_simplify_once(tree, true, "(6 + x0)", 2));
+
+  tree = ET_node(UNARY_NEGATE, ET_node(UNARY_NEGATE, ET_var(0), NULL), NULL);
+  test_assert(test_simplify_once(tree, true, "x0", 2));
+
+  tree = ET_node(OP_ADD, ET_node(OP_MUL, ET_var(0), ET_value(1)), ET_value(-0.0));
+  test_assert(test_simplify_once(tree, true, "x0", 4));
+
+  tree = ET_node(OP_DIV, ET_node(OP_POWER, ET_var(0), ET_value(1)), ET_node(OP_SUB, ET_value(4), ET_value(3)));
+  test_assert(test_simplify_once(tree, true, "x0", 6));
+
+  tree = ET_node(OP_POWER, ET_node(OP_ADD, ET_var(0), ET_var(1)), ET_value(0));
+  test_assert(test_simplify_once(tree, true, "1", 4));
+
+  // rewrites that change -0 or NaN results only happen when not strict
+  tree = ET_node(OP_ADD, ET_var(0), ET_value(0));
+  test_assert(test_simplify_once(tree, true, "(x0 + 0)", 0));
+  tree = ET_node(OP_ADD, ET_var(0), ET_value(0));
+  test_assert(test_simplify_once(tree, false, "x0", 2));
+
+  tree = ET_node(OP_MUL, ET_value(0), ET_var(0));
+  test_assert(test_simplify_once(tree, true, "(0 * x0)", 0));
+  tree = ET_node(OP_MUL, ET_value(0), ET_var(0));
+  test_assert(test_simplify_once(tree, false, "0", 2));
+
+  tree = ET_node(OP_MUL, ET_node(UNARY_NEGATE, ET_var(0), NULL), ET_value(-1));
+  test_assert(test_simplify_once(tree, true, "((-x0) * -1)", 0));
+  tree = ET_node(OP_MUL, ET_node(UNARY_NEGATE, ET_var(0), NULL), ET_value(-1));
+  test_assert(test_simplify_once(tree, false, "x0", 3));
+
+  // -0 - x0 passes a NaN through, while -x0 flips its sign
+  double nan_vars[] = {NAN};
+  tree = ET_node(OP_SUB, ET_value(-0.0), ET_var(0));
+  test_assert(!signbit(ET_evaluate_vars(tree, nan_vars)));
+  test_assert(test_simplify_once(tree, true, "(-0 - x0)", 0));
+  tree = ET_node(OP_SUB, ET_value(-0.0), ET_var(0));
+  test_assert(test_simplify_once(tree, false, "(-x0)", 1));
+
+  // a strict rewrite keeps the -0 result of (x0 - 0) with x0 = -0
+  tree = ET_node(OP_SUB, ET_var(0), ET_value(0));
+  tree = ET_simplify(tree, true, NULL);
+  test_assert(signbit(ET_evaluate_vars(tree, vars)));
+  ET_free(tree);
+
+  return 1;
+}
+
+/*
+ * Build a perfectly balanced tree of additions with 2^(depth - 1)
+ * leaves, all equal to leaf_value.
+ */
+ExprTree make_balanced_sum(int depth, double leaf_value)
+{
+  if (depth <= 1)
+    return ET_value(leaf_value);
+
+  return ET_node(OP_ADD, make_balanced_sum(depth - 1, leaf_value), make_balanced_sum(depth - 1, leaf_value));
+}
+
+/*
+ * Tests the ET_hash, ET_equal, ET_intern and ET_count_distinct
+ * functions.
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_intern()
+{
+  ExprTree tree, copy;
+  double vars[] = {1.5, 2.5};
+  char buf[64];
+
+  // ((x0 + x1) ^ 2) / (x0 + x1)
+  tree = ET_node(OP_DIV, ET_node(OP_POWER, ET_node(OP_ADD, ET_var(0), ET_var(1)), ET_value(2)), ET_node(OP_ADD, ET_var(0), ET_var(1)));
+  copy = ET_node(OP_DIV, ET_node(OP_POWER, ET_node(OP_ADD, ET_var(0), ET_var(1)), ET_value(2)), ET_node(OP_ADD, ET_var(0), ET_var(1)));
+  test_assert(ET_equal(tree, copy));
+  test_assert(ET_hash(tree) == ET_hash(copy));
+  test_assert(ET_count_distinct(tree) == 9);
+
+  tree = ET_intern(tree);
+  test_assert(ET_count(tree) == 9);
+  test_assert(ET_count_distinct(tree) == 6);
+  test_assert(ET_equal(tree, copy));
+  test_assert(ET_hash(tree) == ET_hash(copy));
+  test_assert(ET_evaluate_vars(tree, vars) == ET_evaluate_vars(copy, vars));
+  ET_tree2string(tree, buf, sizeof(buf));
+  test_assert(strcmp(buf, "(((x0 + x1) ^ 2) / (x0 + x1))") == 0);
+  ET_free(tree);
+  ET_free(copy);
+
+  // structural comparison sees signed zeros and variable indices
+  tree = ET_node(OP_ADD, ET_var(0), ET_value(0));
+  copy = ET_node(OP_ADD, ET_var(0), ET_value(-0.0));
+  test_assert(!ET_equal(tree, copy));
+  test_assert(ET_hash(tree) != ET_hash(copy));
+  ET_free(copy);
+  copy = ET_node(OP_ADD, ET_var(1), ET_value(0));
+  test_assert(!ET_equal(tree, copy));
+  ET_free(copy);
+  copy = ET_node(OP_SUB, ET_var(0), ET_value(0));
+  test_assert(!ET_equal(tree, copy));
+  ET_free(copy);
+  ET_free(tree);
+
+  // 2^16 identical leaves collapse to one node per level
+  tree = make_balanced_sum(17, 0.5);
+  test_assert(ET_count_distinct(tree) == 131071);
+  tree = ET_intern(tree);
+  test_assert(ET_count_distinct(tree) == 17);
+  test_assert(ET_count(tree) == 131071);
+  test_assert(ET_depth(tree) == 17);
+  test_assert(ET_evaluate(tree) == 32768);
+
+  // interning again changes nothing, and simplifying folds the DAG
+  tree = ET_intern(tree);
+  test_assert(ET_count_distinct(tree) == 17);
+  tree = ET_simplify(tree, true, NULL);
+  test_assert(ET_count(tree) == 1 && ET_evaluate(tree) == 32768);
+  ET_free(tree);
+
+  return 1;
+}
+
+/*
+ * Helper function for test_parse: parses str and compares the value
+ * and the ET_tree2string form of the result.
+ *
+ * Parameters:
+ *  str: the text to parse
+ *  expected_str: the expected ET_tree2string output
+ *  expected_value: the expected value, with variables x0 = 2, x1 = -3
+ *
+ * Returns:
+ *  true if the test passes, false otherwise
+ */
+bool test_parse_once(const char *str, const char *expected_str, double expected_value)
+{
+  double vars[] = {2, -3};
+  char buf[128];
+
+  ExprTree tree = ET_parse(str, strlen(str), NULL, NULL);
+  if (tree == NULL)
+  {
+    printf("ET_parse failed on %s\n", str);
+    return false;
+  }
+
+  ET_tree2string(tree, buf, sizeof(buf));
+  double value = ET_evaluate_vars(tree, vars);
+  ET_free(tree);
+
+  if (strcmp(buf, expected_str) != 0 || value != expected_value)
+  {
+    printf("ET_parse(%s) gave %s ==> %g\n", str, buf, value);
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Tests the ET_parse function.
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_parse()
+{
+  ExprTree trees[] = {
+      ET_value(2),
+      ET_value(-0.125),
+      ET_value(1e18),
+      ET_value(-0.0),
+      ET_value(INFINITY),
+      ET_node(UNARY_NEGATE, ET_value(3), NULL),
+      ET_node(UNARY_NEGATE, ET_node(UNARY_NEGATE, ET_value(-0.125), NULL), NULL),
+      ET_node(OP_MUL, ET_node(OP_ADD, ET_value(2), ET_node(OP_POWER, ET_value(-3), ET_value(2))), ET_node(OP_DIV, ET_node(OP_ADD, ET_value(-4), ET_value(1)), ET_value(2))),
+      ET_node(OP_DIV, ET_node(OP_POWER, ET_node(OP_ADD, ET_var(0), ET_value(1)), ET_node(OP_MUL, ET_value(1.5), ET_var(12))), ET_node(OP_ADD, ET_value(-1.7), ET_node(OP_SUB, ET_value(6), ET_value(0.3)))),
+      ET_node(OP_SUB, ET_node(OP_SUB, ET_value(3e-7), ET_node(UNARY_NEGATE, ET_var(1), NULL)), ET_value(123456)),
+  };
+  char buf[128];
+
+  // everything ET_tree2string prints parses back to the same tree
+  for (size_t i = 0; i < sizeof(trees) / sizeof(trees[0]); i++)
+  {
+    size_t length = ET_tree2string(trees[i], buf, sizeof(buf));
+    ExprTree parsed = ET_parse(buf, length, NULL, NULL);
+    bool same = parsed != NULL && ET_equal(parsed, trees[i]);
+    if (!same)
+      printf("round trip failed for %s\n", buf);
+    ET_free(parsed);
+    ET_free(trees[i]);
+    test_assert(same);
+  }
+
+  // precedence and associativity for unparenthesized input
+  test_assert(test_parse_once("1 + 2 * 3", "(1 + (2 * 3))", 7));
+  test_assert(test_parse_once("1 - 2 - 3", "((1 - 2) - 3)", -4));
+  test_assert(test_parse_once("8 / 4 / 2", "((8 / 4) / 2)", 1));
+  test_assert(test_parse_once("2 ^ 3 ^ 2", "(2 ^ (3 ^ 2))", 512));
+  test_assert(test_parse_once("(1 + 2) * 3", "((1 + 2) * 3)", 9));
+  test_assert(test_parse_once("-3 ^ 2", "(-3 ^ 2)", 9));
+  test_assert(test_parse_once("-x0 ^ 2", "(-(x0 ^ 2))", -4));
+  test_assert(test_parse_once("-x0 * x1", "((-x0) * x1)", 6));
+  test_assert(test_parse_once("2 ^ -x0", "(2 ^ (-x0))", 0.25));
+  test_assert(test_parse_once("x0-x1", "(x0 - x1)", 5));
+  test_assert(test_parse_once("x0 - -1.5e1", "(x0 - -15)", 17));
+  test_assert(test_parse_once("  ((x1))\n", "x1", -3));
+  test_assert(test_parse_once("0.1 + .25 * 1e2", "(0.1 + (0.25 * 100))", 25.1));
+  test_assert(test_parse_once("12345678901234567890123", "1.23457e+22", 12345678901234567890123.0));
+
+  // syntax errors
+  const char *bad[] = {"", "1 +", "(1 + 2", "1 + 2)", "* 2", "()", "x", "1 2", "(-)"};
+  for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++)
+    test_assert(ET_parse(bad[i], strlen(bad[i]), NULL, NULL) == NULL);
+
+  // with an end pointer, consecutive expressions are read one at a time
+  const char *lines = "(1 + 2)\n-x0 * 3\n4";
+  size_t len = strlen(lines), pos = 0, end;
+  double sum = 0;
+  double vars[] = {2};
+  ExprArena arena = ET_arena_create(0);
+  for (int n = 0; n < 3; n++)
+  {
+    ExprTree tree = ET_parse(lines + pos, len - pos, arena, &end);
+    test_assert(tree != NULL);
+    sum += ET_evaluate_vars(tree, vars);
+    pos += end;
+  }
+  test_assert(sum == 1);
+  test_assert(pos == len);
+  ET_arena_destroy(arena);
+
+  // deep nesting outgrows the parser's inline stacks
+  ExprTree deep = ET_var(0);
+  for (int i = 0; i < 1000; i++)
+    deep = ET_node(i % 2 ? OP_POWER : OP_SUB, ET_value(i), deep);
+  char *big = malloc(65536);
+  size_t big_len = ET_tree2string(deep, big, 65536);
+  ExprTree parsed = ET_parse(big, big_len, NULL, NULL);
+  bool same = ET_equal(parsed, deep);
+  ET_free(parsed);
+  ET_free(deep);
+  free(big);
+  test_assert(same);
+
+  // the input need not be terminated
+  ExprTree tree = ET_parse("x0 + 12", 6, NULL, NULL);
+  test_assert(ET_evaluate_vars(tree, vars) == 3);
+  ET_free(tree);
+
+  return 1;
+}
+
+/*
+ * Tests ET_serialize, ET_serialize_fd, ET_load, ET_evaluate_serialized
+ * and the ExprImage functions.
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_serialize()
+{
+  double vars[301] = {0};
+  vars[0] = 0.75;
+  vars[300] = -2;
+
+  ExprTree trees[] = {
+      ET_value(0.1),
+      ET_value(-0.0),
+      ET_value(NAN),
+      ET_var(300),
+      ET_node(UNARY_NEGATE, ET_node(UNARY_NEGATE, ET_value(1.0 / 3), NULL), NULL),
+      ET_node(OP_ADD, ET_var(0), NULL),
+      ET_node(OP_DIV, ET_node(OP_POWER, ET_var(0), ET_node(OP_MUL, ET_value(1.5), ET_var(300))), ET_node(OP_SUB, ET_value(-1.7e-300), ET_node(UNARY_NEGATE, ET_value(6), NULL))),
+  };
+  enum { N_TREES = sizeof(trees) / sizeof(trees[0]) };
+  unsigned char buf[256];
+
+  // round trips through a buffer are bit-exact
+  for (int i = 0; i < N_TREES; i++)
+  {
+    size_t size = ET_serialize(trees[i], NULL, 0);
+    test_assert(size <= sizeof(buf));
+    test_assert(ET_serialize(trees[i], buf, sizeof(buf)) == size);
+
+    size_t used = 0;
+    ExprTree loaded = ET_load(buf, size, NULL, &used);
+    bool same = ET_equal(loaded, trees[i]) && used == size;
+    double expected = ET_evaluate_vars(trees[i], vars);
+    double direct = ET_evaluate_serialized(buf, size, vars);
+    same = same && (direct == expected || (isnan(direct) && isnan(expected)));
+    ET_free(loaded);
+    test_assert(same);
+
+    // every truncation of the record is rejected
+    for (size_t len = 0; len < size; len++)
+      test_assert(ET_load(buf, len, NULL, NULL) == NULL);
+  }
+
+  // corrupt headers and streams are rejected
+  size_t size = ET_serialize(trees[N_TREES - 1], buf, sizeof(buf));
+  buf[0] = 'X';
+  test_assert(ET_load(buf, size, NULL, NULL) == NULL);
+  test_assert(isnan(ET_evaluate_serialized(buf, size, vars)));
+  buf[0] = 'E';
+  buf[4] = 2; // an unknown version
+  test_assert(ET_load(buf, size, NULL, NULL) == NULL);
+  buf[4] = 1;
+  buf[24] = 42; // an unknown opcode
+  test_assert(ET_load(buf, size, NULL, NULL) == NULL);
+
+  // a library of records written to a file and mapped back in
+  char path[] = "/tmp/et_test_XXXXXX";
+  int fd = mkstemp(path);
+  test_assert(fd >= 0);
+  for (int i = 0; i < N_TREES; i++)
+    test_assert(ET_serialize_fd(trees[i], fd) == 0);
+  close(fd);
+
+  ExprImage image = ET_image_open(path);
+  unlink(path);
+  test_assert(image != NULL);
+  test_assert(ET_image_count(image) == N_TREES);
+
+  ExprArena arena = ET_arena_create(0);
+  for (int i = 0; i < N_TREES; i++)
+  {
+    double expected = ET_evaluate_vars(trees[i], vars);
+    double direct = ET_image_evaluate(image, i, vars);
+    test_assert(direct == expected || (isnan(direct) && isnan(expected)));
+    test_assert(ET_equal(ET_image_load(image, i, arena), trees[i]));
+  }
+  ET_image_close(image);
+  ET_arena_destroy(arena);
+
+  test_assert(ET_image_open("/nonexistent/et_test") == NULL);
+
+  for (int i = 0; i < N_TREES; i++)
+    ET_free(trees[i]);
+
+  return 1;
+}
+
+/*
+ * Helper function for test_parallel: builds a balanced tree of the
+ * given depth cycling through every operator, with leaves 0.1, 0.2, ...
+ * so that the results depend on rounding.
+ *
+ * Parameters:
+ *   depth    Depth of the tree
+ *   next     Counter used to number the leaves and pick the operators
+ *
+ * Returns: The tree
+ */
+ExprTree make_mixed(int depth, int *next)
+{
+  static const ExprNodeType ops[] = {OP_ADD, OP_MUL, OP_SUB, OP_DIV, OP_ADD, OP_POWER, UNARY_NEGATE};
+  int n = (*next)++;
+
+  if (depth <= 1)
+    return ET_value(0.1 * (n % 97 + 1));
+
+  ExprNodeType op = ops[n % 7];
+  if (op == UNARY_NEGATE)
+    return ET_node(op, make_mixed(depth - 1, next), NULL);
+  if (op == OP_POWER) // keep the powers tame
+    return ET_node(op, make_mixed(depth - 1, next), ET_value(0.5));
+  return ET_node(op, make_mixed(depth - 1, next), make_mixed(depth - 1, next));
+}
+
+/*
+ * Helper function for test_parallel: evaluates tree in parallel with
+ * several thread counts and compares the bits with ET_evaluate.
+ *
+ * Returns: true if every result is bit-identical
+ */
+bool test_parallel_once(ExprTree tree)
+{
+  static const int threads[] = {1, 2, 3, 8, 0};
+  double expected = ET_evaluate(tree);
+
+  for (int i = 0; i < (int)(sizeof(threads) / sizeof(threads[0])); i++)
+  {
+    double got = ET_evaluate_parallel(tree, threads[i]);
+    if (memcmp(&got, &expected, sizeof(double)) != 0)
+      return false;
+  }
+  return true;
+}
+
+/*
+ * Tests the ET_evaluate_parallel function.
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_parallel()
+{
+  ExprTree tree;
+  int next = 0;
+
+  // too small to split
+  tree = ET_node(OP_MUL, ET_value(3), ET_node(UNARY_NEGATE, ET_value(0.5), NULL));
+  test_assert(ET_evaluate_parallel(tree, 4) == -1.5);
+  ET_free(tree);
+  test_assert(ET_evaluate_parallel(NULL, 4) == 0);
+
+  // balanced, every operator
+  tree = make_mixed(18, &next);
+  test_assert(test_parallel_once(tree));
+
+  // skewed: a big subtree next to a long chain
+  for (int i = 0; i < 40000; i++)
+    tree = ET_node(i % 3 ? OP_SUB : OP_MUL, tree, ET_value(1.0 + i % 5 * 0.25));
+  test_assert(test_parallel_once(tree));
+
+  // missing operands and variables, which ET_evaluate leaves at 0 and NAN
+  tree = ET_node(OP_ADD, ET_node(OP_SUB, tree, NULL), ET_node(OP_MUL, ET_var(0), ET_value(0)));
+  test_assert(test_parallel_once(tree));
+  test_assert(isnan(ET_evaluate_parallel(tree, 2)));
+  ET_free(tree);
+
+  // a DAG whose shared nodes are split several times over
+  tree = ET_intern(make_balanced_sum(22, 0.1));
+  test_assert(test_parallel_once(tree));
+  ET_free(tree);
+
+  return 1;
+}
+
+/*
+ * Tests the ET_evaluate_incremental and ET_set_value functions.
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_incremental()
+{
+  static const ExprNodeType ops[] = {OP_ADD, OP_MUL, OP_SUB, OP_DIV, OP_POWER};
+  enum { N_LEAVES = 1024 };
+  ExprTree leaves[N_LEAVES], level[N_LEAVES];
+  ExprTree tree;
+  double got, expected;
+
+  // a balanced tree over leaves we keep handles to
+  for (int i = 0; i < N_LEAVES; i++)
+    leaves[i] = level[i] = ET_value(0.1 * (i + 1));
+  for (int n = N_LEAVES; n > 1; n /= 2)
+    for (int i = 0; i < n / 2; i++)
+      level[i] = i % 3 == 0 ? ET_node(UNARY_NEGATE, ET_node(ops[(n + i) % 5], level[2 * i], level[2 * i + 1]), NULL)
+                            : ET_node(ops[(n + i) % 5], level[2 * i], level[2 * i + 1]);
+  tree = level[0];
+
+  expected = ET_evaluate(tree);
+  got = ET_evaluate_incremental(tree);
+  test_assert(memcmp(&got, &expected, sizeof(double)) == 0);
+  test_assert(ET_evaluate_incremental(tree) == got || isnan(got));
+
+  // single updates, and several updates between evaluations
+  srand(11);
+  for (int i = 0; i < 300; i++)
+  {
+    int updates = i % 4 == 0 ? 3 : 1;
+    for (int j = 0; j < updates; j++)
+      ET_set_value(leaves[rand() % N_LEAVES], (rand() % 200 - 100) / 16.0);
+    expected = ET_evaluate(tree);
+    got = ET_evaluate_incremental(tree);
+    test_assert(memcmp(&got, &expected, sizeof(double)) == 0);
+  }
+
+  ET_free(tree);
+
+  // a subtree evaluated on its own before it gets a parent
+  ExprTree a = ET_value(1.5);
+  ExprTree sub = ET_node(OP_ADD, a, ET_value(2));
+  test_assert(ET_evaluate_incremental(sub) == 3.5);
+  tree = ET_node(OP_MUL, sub, ET_value(2));
+  test_assert(ET_evaluate_incremental(tree) == 7);
+  ET_set_value(a, 3);
+  test_assert(ET_evaluate_incremental(tree) == 10);
+  test_assert(ET_evaluate_incremental(sub) == 5);
+  ET_free(tree);
+
+  // ET_simplify drops the caches it may have invalidated
+  tree = ET_node(UNARY_NEGATE, ET_node(OP_ADD, ET_node(OP_MUL, ET_node(OP_SUB, ET_var(0), ET_value(1)), ET_value(0)), ET_value(2)), NULL);
+  test_assert(isnan(ET_evaluate_incremental(tree)));
+  tree = ET_simplify(tree, false, NULL);
+  test_assert(ET_evaluate_incremental(tree) == -2);
+  ET_free(tree);
+
+  // updates below shared nodes
+  ExprTree x = ET_value(3);
+  tree = ET_intern(ET_node(OP_MUL, ET_node(OP_ADD, x, ET_value(1)), ET_node(OP_ADD, ET_value(3), ET_value(1))));
+  test_assert(ET_evaluate_incremental(tree) == 16);
+  ET_set_value(x, 4);
+  test_assert(ET_evaluate_incremental(tree) == 25);
+  test_assert(ET_evaluate(tree) == 25);
+  ET_free(tree);
+
+  // a leaf that outlives its parent
+  ExprArena arena = ET_arena_create(0);
+  ExprTree leaf = ET_arena_value(arena, 3);
+  tree = ET_node(UNARY_NEGATE, leaf, NULL);
+  test_assert(ET_evaluate_incremental(tree) == -3);
+  ET_free(tree);
+  ET_set_value(leaf, 4);
+  tree = ET_node(OP_MUL, leaf, leaf);
+  test_assert(ET_evaluate_incremental(tree) == 16);
+  ET_set_value(leaf, 5);
+  test_assert(ET_evaluate_incremental(tree) == 25);
+  ET_free(tree);
+  ET_arena_destroy(arena);
+
+  return 1;
+}
+
+/*
+ * Helper function for test_jit: builds a random tree with n_ops
+ * interior nodes over constants and variables x0..x3, using rand()
+ *
+ * Returns: The tree
+ */
+ExprTree make_random_tree(int n_ops)
+{
+  static const ExprNodeType ops[] = {OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_POWER, UNARY_NEGATE};
+
+  if (n_ops == 0)
+    return rand() % 2 ? ET_var(rand() % 4) : ET_value((rand() % 2000 - 1000) / 8.0);
+
+  ExprNodeType op = ops[rand() % 6];
+  if (op == UNARY_NEGATE)
+    return ET_node(op, make_random_tree(n_ops - 1), NULL);
+
+  int left = rand() % n_ops;
+  return ET_node(op, make_random_tree(left), make_random_tree(n_ops - 1 - left));
+}
+
+/*
+ * Helper function for test_jit: compiles tree and compares the results
+ * of the native function and ET_jit_run with ET_evaluate_vars, with and
+ * without variables.
+ *
+ * Returns: true if every result matches bit for bit (any NaN matches
+ * any other)
+ */
+bool test_jit_once(ExprTree tree, const double *vars)
+{
+  ExprJit jit = ET_jit(tree);
+  ExprJitFunction fn = ET_jit_function(jit);
+  const double *inputs[] = {vars, NULL};
+  bool ok = true;
+
+#if defined(__x86_64__) && defined(__linux__) && !defined(ET_NO_JIT)
+  ok = fn != NULL;
+#endif
+
+  for (int i = 0; i < 2 && ok; i++)
+  {
+    double expected = ET_evaluate_vars(tree, inputs[i]);
+    double got[] = {ET_jit_run(jit, inputs[i]), fn != NULL ? fn(inputs[i]) : expected};
+
+    for (int j = 0; j < 2; j++)
+      if (memcmp(&got[j], &expected, sizeof(double)) != 0 && !(isnan(got[j]) && isnan(expected)))
+        ok = false;
+  }
+
+  ET_jit_free(jit);
+  return ok;
+}
+
+/*
+ * Tests the ET_jit, ET_jit_function, ET_jit_run and ET_jit_free
+ * functions.
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_jit()
+{
+  double vars[] = {1.5, -2.25, 0.0, 7};
+  ExprTree tree;
+  int next = 0;
+
+  // leaves, and a missing operand
+  tree = ET_value(-0.0);
+  test_assert(test_jit_once(tree, vars));
+  ET_free(tree);
+  tree = ET_var(3);
+  test_assert(test_jit_once(tree, vars));
+  ET_free(tree);
+  tree = ET_node(OP_SUB, ET_var(1), NULL);
+  test_assert(test_jit_once(tree, vars));
+  ET_free(tree);
+  tree = ET_node(OP_ADD, ET_node(OP_SUB, NULL, NULL), ET_node(OP_MUL, NULL, NULL));
+  test_assert(test_jit_once(tree, vars));
+  ET_free(tree);
+
+  // randomized trees of every size up to a few hundred nodes
+  srand(12);
+  for (int i = 0; i < 2000; i++)
+  {
+    for (int j = 0; j < 4; j++)
+      vars[j] = (rand() % 4000 - 2000) / 64.0;
+    tree = make_random_tree(rand() % (i < 1000 ? 16 : 300));
+    test_assert(test_jit_once(tree, vars));
+    ET_free(tree);
+  }
+
+  // bushy enough to spill past the registers, with pow calls in between
+  tree = make_mixed(18, &next);
+  test_assert(test_jit_once(tree, vars));
+  ET_free(tree);
+
+  // a perfectly balanced tree keeps 17 entries live, and every other
+  // level calls pow with the registers below it full
+  static ExprTree level[1 << 16];
+  for (int i = 0; i < 1 << 16; i++)
+    level[i] = i % 3 ? ET_value(1 + i % 5 / 8.0) : ET_var(i % 4);
+  for (int n = 1 << 16, depth = 0; n > 1; n /= 2, depth++)
+    for (int i = 0; i < n / 2; i++)
+      level[i] = ET_node(depth % 2 ? OP_POWER : (i % 2 ? OP_SUB : OP_DIV), level[2 * i], level[2 * i + 1]);
+  test_assert(test_jit_once(level[0], vars));
+  ET_free(level[0]);
+
+  return 1;
+}
+
+/*
+ * Tests the ET_stats_get and ET_stats_reset functions.
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_stats()
+{
+  ExprStats before, after;
+  double vars[] = {4};
+
+  ET_stats_reset();
+  ET_stats_get(&before);
+  test_assert(before.allocations == 0 && before.evaluations == 0);
+
+  // x0 + 2 × 3
+  ExprTree tree = ET_node(OP_ADD, ET_var(0), ET_node(OP_MUL, ET_value(2), ET_value(3)));
+  ET_stats_get(&after);
+#ifdef ET_STATS
+  test_assert(after.live_nodes == before.live_nodes + 5);
+  test_assert(after.allocations >= 5 && after.bytes > 0);
+
+  test_assert(ET_evaluate_vars(tree, vars) == 10);
+  ET_stats_get(&after);
+  test_assert(after.evaluations == 1);
+  test_assert(after.ops[OP_ADD] == 1 && after.ops[OP_MUL] == 1);
+  test_assert(after.ops[VALUE] == 2 && after.ops[VARIABLE] == 1);
+
+  // evaluating, hashing and counting a small tree stay off the heap
+  ET_stats_get(&before);
+  test_assert(ET_evaluate_vars(tree, vars) == 10);
+  ET_hash(tree);
+  test_assert(ET_count_distinct(tree) == 5);
+  ET_stats_get(&after);
+  test_assert(after.allocations == before.allocations);
+  test_assert(after.evaluations == 2 && after.ops[OP_ADD] == 2);
+
+  // a compiled program counts the same operations on every run
+  ExprProgram prog = ET_compile(tree);
+  test_assert(ET_run_vars(prog, vars) == 10);
+  test_assert(ET_run_vars(prog, vars) == 10);
+  ET_program_free(prog);
+  ET_stats_get(&after);
+  test_assert(after.evaluations == 4 && after.ops[OP_MUL] == 4 && after.ops[VALUE] == 8);
+
+  // compiling to native code evaluates nothing
+  ExprJit jit = ET_jit(tree);
+  ET_stats_get(&before);
+  test_assert(before.evaluations == after.evaluations && before.ops[OP_MUL] == after.ops[OP_MUL]);
+  ET_jit_free(jit);
+
+  // an incremental evaluation counts only what it recomputes
+  ET_evaluate_incremental(tree);
+  ET_stats_get(&before);
+  ET_evaluate_incremental(tree);
+  ET_stats_get(&after);
+  test_assert(after.evaluations == before.evaluations + 1);
+  test_assert(after.ops[OP_ADD] == before.ops[OP_ADD]);
+
+  // resetting keeps the live node count
+  ET_stats_reset();
+  ET_stats_get(&before);
+  test_assert(before.evaluations == 0 && before.ops[OP_ADD] == 0);
+  test_assert(before.live_nodes == after.live_nodes);
+
+  ET_free(tree);
+  ET_stats_get(&after);
+  test_assert(after.live_nodes == before.live_nodes - 5);
+
+  // arena nodes go away with their arena
+  ExprArena arena = ET_arena_create(0);
+  for (int i = 0; i < 100; i++)
+    ET_arena_value(arena, i);
+  ET_stats_get(&before);
+  test_assert(before.live_nodes == after.live_nodes + 100);
+  ET_arena_destroy(arena);
+  ET_stats_get(&before);
+  test_assert(before.live_nodes == after.live_nodes);
+#else
+  test_assert(after.live_nodes == 0 && after.allocations == 0);
+  ET_free(tree);
+#endif
+
+  return 1;
+}
+
+/*
+ * Tests the ET_profile, ET_profile_count, ET_profile_entry,
+ * ET_profile_write and ET_profile_free functions.
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_profile()
+{
+  double vars[] = {1.5, -2.25, 0.0, 7};
+  ExprProfile prof;
+  char line[256];
+  int next = 0;
+
+  // a leaf is profiled as a single entry
+  ExprTree tree = ET_var(1);
+  prof = ET_profile(tree, vars, 3);
+  test_assert(ET_profile_count(prof) == 1);
+  test_assert(ET_profile_entry(prof, 0)->subtree == tree);
+  test_assert(ET_profile_entry(prof, 0)->calls == 3);
+  ET_profile_free(prof);
+  ET_free(tree);
+
+  // a small tree has every interior node timed, in preorder
+  tree = ET_node(OP_SUB, ET_node(OP_MUL, ET_var(0), ET_value(2)), ET_node(UNARY_NEGATE, ET_var(3), NULL));
+  prof = ET_profile(tree, vars, 5);
+  test_assert(ET_profile_count(prof) == 3);
+  const ExprProfileEntry *root = ET_profile_entry(prof, 0);
+  const ExprProfileEntry *mul = ET_profile_entry(prof, 1);
+  const ExprProfileEntry *neg = ET_profile_entry(prof, 2);
+  test_assert(root->subtree == tree && root->parent == SIZE_MAX && root->calls == 5);
+  test_assert(mul->parent == 0 && mul->calls == 5 && ET_count(mul->subtree) == 3);
+  test_assert(neg->parent == 0 && neg->calls == 5 && ET_count(neg->subtree) == 2);
+  test_assert(root->inclusive_ns >= mul->inclusive_ns);
+  ET_profile_free(prof);
+  ET_free(tree);
+
+  // a large tree times only its larger subtrees, each inside its parent
+  tree = make_mixed(18, &next);
+  int count = ET_count(tree);
+  prof = ET_profile(tree, vars, 2);
+  size_t n = ET_profile_count(prof);
+  test_assert(n > 1 && n < (size_t)count / 64);
+  for (size_t i = 1; i < n; i++)
+  {
+    const ExprProfileEntry *e = ET_profile_entry(prof, i);
+    test_assert(e->parent < i && e->calls == 2);
+    test_assert(ET_count(e->subtree) >= count / 1024);
+    test_assert(ET_count(e->subtree) < ET_count(ET_profile_entry(prof, e->parent)->subtree));
+  }
+
+  // folded stacks: each line is root-first frames and a count
+  FILE *out = tmpfile();
+  test_assert(out != NULL);
+  size_t lines = ET_profile_write(prof, out, 8);
+  test_assert(lines >= 1 && lines <= n);
+  rewind(out);
+  size_t read = 0;
+  while (fgets(line, sizeof(line), out) != NULL)
+  {
+    char *space = strrchr(line, ' ');
+    test_assert(space != NULL && atoll(space + 1) > 0);
+    test_assert(line[0] == '(' && strchr(line, '\n') != NULL);
+    read++;
+  }
+  test_assert(read == lines);
+  fclose(out);
+  test_assert(ET_profile_write(prof, stdout, 0) == 0);
+  ET_profile_free(prof);
+  ET_free(tree);
+
+  return 1;
+}
+
+/*
+ * Returns the distance between a and b in units in the last place:
+ * the number of doubles from one to the other
+ */
+static int64_t ulp_distance(double a, double b)
+{
+  int64_t ia, ib;
+  memcpy(&ia, &a, sizeof(ia));
+  memcpy(&ib, &b, sizeof(ib));
+  // map the sign-magnitude bits onto a monotonic integer line
+  if (ia < 0)
+    ia = INT64_MIN - ia;
+  if (ib < 0)
+    ib = INT64_MIN - ib;
+  return ia > ib ? ia - ib : ib - ia;
+}
+
+/*
+ * Returns true if compiled, batch, JIT and serialized evaluation of
+ * tree all agree bit for bit with ET_evaluate_vars
+ */
+static bool backends_agree(ExprTree tree, const double *vars, size_t n_vars)
+{
+  double expected = ET_evaluate_vars(tree, vars);
+  const double *columns[128];
+  unsigned char buf[4096];
+  double out;
+
+  assert(n_vars <= 128);
+  for (size_t i = 0; i < n_vars; i++)
+    columns[i] = &vars[i];
+
+  ExprProgram prog = ET_compile(tree);
+  bool same = ET_run_vars(prog, vars) == expected;
+  ET_run_batch(prog, columns, 1, &out);
+  same = same && out == expected;
+  ET_program_free(prog);
+
+  ExprJit jit = ET_jit(tree);
+  same = same && ET_jit_run(jit, vars) == expected;
+  ET_jit_free(jit);
+
+  size_t size = ET_serialize(tree, buf, sizeof(buf));
+  assert(size <= sizeof(buf));
+  same = same && ET_evaluate_serialized(buf, size, vars) == expected;
+  ExprTree loaded = ET_load(buf, size, NULL, NULL);
+  same = same && ET_equal(loaded, tree) && ET_evaluate_vars(loaded, vars) == expected;
+  ET_free(loaded);
+
+  return same;
+}
+
+/*
+ * Tests the ET_node_list and ET_fuse functions, and the list, FMA and
+ * integer power nodes in each evaluator.
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_fuse()
+{
+  enum { N = 100 };
+  double vars[N];
+  char buf[64];
+  int fused;
+
+  for (int i = 0; i < N; i++)
+    vars[i] = 1 + 1.0 / (i + 3);
+
+  // a left-deep sum becomes one list node, within n - 1 + ceil(log2 n)
+  // ULPs of the original
+  ExprTree tree = ET_var(0);
+  for (int i = 1; i < N; i++)
+    tree = ET_node(OP_ADD, tree, ET_var(i));
+  double before = ET_evaluate_vars(tree, vars);
+  tree = ET_fuse(tree, &fused);
+  test_assert(fused == N - 1);
+  test_assert(ET_count(tree) == N + 1 && ET_depth(tree) == 2);
+  test_assert(ulp_distance(ET_evaluate_vars(tree, vars), before) <= N - 1 + 7);
+  test_assert(backends_agree(tree, vars, N));
+  ET_free(tree);
+
+  // so does a right-deep product
+  tree = ET_var(19);
+  for (int i = 18; i >= 0; i--)
+    tree = ET_node(OP_MUL, ET_var(i), tree);
+  before = ET_evaluate_vars(tree, vars);
+  tree = ET_fuse(tree, &fused);
+  test_assert(fused == 19 && ET_count(tree) == 21);
+  test_assert(ulp_distance(ET_evaluate_vars(tree, vars), before) <= 19 + 5);
+  test_assert(backends_agree(tree, vars, N));
+  ET_free(tree);
+
+  // a chain below an operator of another kind is folded on its own
+  tree = ET_node(OP_DIV,
+                 ET_node(OP_ADD, ET_node(OP_ADD, ET_var(0), ET_var(1)), ET_node(OP_ADD, ET_var(2), ET_var(3))),
+                 ET_node(OP_ADD, ET_node(OP_MUL, ET_var(4), ET_var(5)), ET_var(6)));
+  before = ET_evaluate_vars(tree, vars);
+  tree = ET_fuse(tree, &fused);
+  test_assert(fused == 5);
+  test_assert(ET_count(tree) == 10 && ET_depth(tree) == 3);
+  test_assert(ulp_distance(ET_evaluate_vars(tree, vars), before) <= 8);
+  test_assert(backends_agree(tree, vars, N));
+  ET_free(tree);
+
+  // a * b + c rounds once, within 3 ULPs of the original
+  tree = ET_node(OP_ADD, ET_var(7), ET_node(OP_MUL, ET_var(8), ET_var(9)));
+  before = ET_evaluate_vars(tree, vars);
+  tree = ET_fuse(tree, &fused);
+  test_assert(fused == 2 && ET_count(tree) == 4);
+  test_assert(ET_evaluate_vars(tree, vars) == fma(vars[8], vars[9], vars[7]));
+  test_assert(ulp_distance(ET_evaluate_vars(tree, vars), before) <= 3);
+  test_assert(backends_agree(tree, vars, N));
+  ET_free(tree);
+
+  // small integer powers multiply, within |k| + 1 ULPs of pow()
+  double exponents[] = {7, -3, 16, 0};
+  for (int i = 0; i < 4; i++)
+  {
+    tree = ET_node(OP_POWER, ET_var(10), ET_value(exponents[i]));
+    tree = ET_fuse(tree, &fused);
+    test_assert(fused == 1);
+    test_assert(ulp_distance(ET_evaluate_vars(tree, vars), pow(vars[10], exponents[i])) <= fabs(exponents[i]) + 1);
+    test_assert(backends_agree(tree, vars, N));
+    ET_free(tree);
+  }
+
+  // other powers are left alone, as are arena nodes
+  tree = ET_fuse(ET_node(OP_POWER, ET_var(10), ET_value(2.5)), &fused);
+  test_assert(fused == 0);
+  ET_free(tree);
+  tree = ET_fuse(ET_node(OP_POWER, ET_var(10), ET_value(17)), &fused);
+  test_assert(fused == 0);
+  ET_free(tree);
+  ExprArena arena = ET_arena_create(0);
+  tree = ET_arena_node(arena, OP_ADD, ET_arena_node(arena, OP_ADD, ET_arena_var(arena, 0), ET_arena_var(arena, 1)), ET_arena_var(arena, 2));
+  test_assert(ET_fuse(tree, &fused) == tree && fused == 0);
+
+  // list nodes built directly, in an arena and on the heap
+  ExprTree args[] = {ET_arena_value(arena, 1), ET_arena_value(arena, 2), ET_arena_value(arena, 3), ET_arena_value(arena, 4), ET_arena_value(arena, 5)};
+  tree = ET_arena_node_list(arena, OP_SUM, args, 5);
+  test_assert(ET_evaluate(tree) == 15 && ET_count(tree) == 6 && ET_depth(tree) == 2);
+  ET_tree2string(tree, buf, sizeof(buf));
+  test_assert(strcmp(buf, "(1 + 2 + 3 + 4 + 5)") == 0);
+  ET_arena_destroy(arena);
+
+  ExprTree fma_args[] = {ET_value(2), ET_value(3), ET_node(UNARY_NEGATE, ET_value(1), NULL)};
+  tree = ET_node_list(OP_FMA, fma_args, 3);
+  test_assert(ET_evaluate(tree) == 5 && ET_count(tree) == 5);
+  ET_tree2string(tree, buf, sizeof(buf));
+  test_assert(strcmp(buf, "(2 * 3 + (-1))") == 0);
+  test_assert(backends_agree(tree, vars, 0));
+
+  ExprTree prod_args[] = {tree, ET_var(0)};
+  tree = ET_node_list(OP_PRODUCT, prod_args, 2);
+  test_assert(ET_evaluate_vars(tree, vars) == 5 * vars[0]);
+  test_assert(backends_agree(tree, vars, 1));
+
+  // a list of constants simplifies to a value
+  tree = ET_node(OP_ADD, tree, ET_node_list(OP_SUM, (ExprTree[]){ET_value(1), ET_value(2), ET_value(4)}, 3));
+  int removed;
+  tree = ET_simplify(tree, true, &removed);
+  test_assert(removed == 7 && ET_evaluate_vars(tree, vars) == 5 * vars[0] + 7);
+  ET_free(tree);
+
+  return 1;
+}
+
+/*
+ * Thread body for test_share: builds, evaluates and frees variants of
+ * a shared base tree
+ */
+static void *share_worker(void *arg)
+{
+  ExprTree base = arg;
+  double vars[] = {1, 2, 3};
+  intptr_t ok = 1;
+
+  for (int i = 0; i < 2000; i++)
+  {
+    ExprTree variant = ET_node(OP_ADD, ET_share(base), ET_value(i));
+    ExprTree twice = ET_node(OP_MUL, ET_share(variant), ET_share(base));
+    ok &= ET_evaluate_vars(twice, vars) == (ET_evaluate_vars(base, vars) + i) * ET_evaluate_vars(base, vars);
+    ET_free(variant);
+    ET_free(twice);
+  }
+  return (void *)ok;
+}
+
+/*
+ * Tests the ET_share and ET_clone functions, and copy-on-write in the
+ * rewrites of shared trees.
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_share()
+{
+  double vars[] = {1.5, -2, 4};
+
+  // variants of a base formula outlive it
+  ExprTree base = ET_node(OP_MUL, ET_node(OP_ADD, ET_var(0), ET_value(2)), ET_node(OP_SUB, ET_var(1), ET_value(3)));
+  double b = ET_evaluate_vars(base, vars);
+  ExprTree v1 = ET_node(OP_MUL, ET_share(base), ET_value(2));
+  ExprTree v2 = ET_node(OP_ADD, ET_share(base), ET_var(2));
+  ET_free(base);
+  test_assert(ET_count(v1) == 9 && ET_count(v2) == 9);
+  test_assert(ET_evaluate_vars(v1, vars) == b * 2);
+  ET_free(v1);
+  test_assert(ET_evaluate_vars(v2, vars) == b + 4);
+  test_assert(ET_count_distinct(v2) == 9);
+  ET_free(v2);
+
+  // rewriting one tree leaves the other as it was
+  base = ET_node(OP_ADD, ET_node(OP_MUL, ET_var(0), ET_value(1)), ET_node(OP_POWER, ET_var(1), ET_value(3)));
+  ExprTree expected = ET_node(OP_SUB, ET_node(OP_ADD, ET_node(OP_MUL, ET_var(0), ET_value(1)), ET_node(OP_POWER, ET_var(1), ET_value(3))), ET_value(2));
+  v1 = ET_node(OP_SUB, ET_share(base), ET_node(OP_ADD, ET_value(1), ET_value(1)));
+  v2 = ET_node(OP_SUB, base, ET_value(2));
+  int removed;
+  v1 = ET_simplify(v1, false, &removed);
+  test_assert(removed == 4 && ET_count(v1) == 7);
+  test_assert(ET_equal(v2, expected) && ET_count(v2) == 9);
+  test_assert(ET_evaluate_vars(v1, vars) == ET_evaluate_vars(v2, vars));
+
+  // unchanged shared nodes stay shared; the rewrite copies the path to
+  // the power it fuses and drops the old one
+  int fused;
+  v1 = ET_fuse(v1, &fused);
+  test_assert(fused == 1 && ET_count(v1) == 7);
+  test_assert(ET_equal(v2, expected));
+  test_assert(ET_evaluate_vars(v1, vars) == ET_evaluate_vars(v2, vars));
+  ET_free(v1);
+  ET_free(expected);
+
+  // a rewrite through a shared root returns a copy
+  ExprTree other = ET_share(v2);
+  v2 = ET_simplify(v2, false, &removed);
+  test_assert(v2 != other && removed == 2 && ET_count(v2) == 7 && ET_count(other) == 9);
+  ET_free(other);
+  ET_free(v2);
+
+  // clones are new roots over the same operands
+  ExprTree leaf = ET_value(5);
+  ExprTree clone = ET_clone(leaf);
+  ET_set_value(clone, 6);
+  test_assert(ET_evaluate(leaf) == 5 && ET_evaluate(clone) == 6);
+  ET_free(leaf);
+  ET_free(clone);
+  base = ET_node(OP_DIV, ET_var(0), ET_node(UNARY_NEGATE, ET_var(1), NULL));
+  clone = ET_clone(base);
+  test_assert(clone != base && ET_equal(clone, base) && ET_count(clone) == 4);
+  ET_free(base);
+  test_assert(ET_evaluate_vars(clone, vars) == 0.75);
+  ET_free(clone);
+  test_assert(ET_share(NULL) == NULL && ET_clone(NULL) == NULL);
+
+  // threads share and release the same nodes concurrently
+  base = ET_node(OP_SUB, ET_node(OP_MUL, ET_var(0), ET_var(1)), ET_var(2));
+  pthread_t threads[4];
+  for (int i = 0; i < 4; i++)
+    test_assert(pthread_create(&threads[i], NULL, share_worker, base) == 0);
+  bool all_ok = true;
+  for (int i = 0; i < 4; i++)
+  {
+    void *ok;
+    pthread_join(threads[i], &ok);
+    all_ok = all_ok && ok != NULL;
+  }
+  test_assert(all_ok);
+  test_assert(ET_evaluate_vars(base, vars) == -7);
+  ET_free(base);
+
+  return 1;
+}
+
+/*
+ * Returns true if a and b agree to within a relative tolerance
+ */
+static bool close_to(double a, double b, double tolerance)
+{
+  return fabs(a - b) <= tolerance * fmax(1, fmax(fabs(a), fabs(b)));
+}
+
+/*
+ * Helper function for test_gradient: checks the value and gradient of
+ * tree at vars against ET_evaluate_vars and central differences.
+ *
+ * Returns: true if they agree
+ */
+static bool test_gradient_numeric(ExprTree tree, const double *vars)
+{
+  double grad[3], shifted[3];
+  bool ok = ET_gradient(tree, vars, 3, grad) == ET_evaluate_vars(tree, vars);
+
+  for (int v = 0; v < 3; v++)
+  {
+    double h = 1e-6 * fmax(1, fabs(vars[v]));
+    memcpy(shifted, vars, sizeof(shifted));
+    shifted[v] = vars[v] + h;
+    double up = ET_evaluate_vars(tree, shifted);
+    shifted[v] = vars[v] - h;
+    double down = ET_evaluate_vars(tree, shifted);
+    ok = ok && close_to(grad[v], (up - down) / (2 * h), 1e-6);
+  }
+  return ok;
+}
+
+/*
+ * Tests the ET_gradient, ET_run_gradient and ET_run_gradient_batch
+ * functions.
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_gradient()
+{
+  double vars[] = {1.5, 2.5, -0.5};
+  double x = vars[0], y = vars[1], z = vars[2];
+  double grad[3];
+
+  // every operator against its derivative
+  struct
+  {
+    ExprTree tree;
+    double expected[3];
+  } cases[] = {
+      {ET_node(UNARY_NEGATE, ET_var(0), NULL), {-1, 0, 0}},
+      {ET_node(OP_ADD, ET_var(0), ET_var(1)), {1, 1, 0}},
+      {ET_node(OP_SUB, ET_var(0), ET_var(1)), {1, -1, 0}},
+      {ET_node(OP_MUL, ET_var(0), ET_var(2)), {z, 0, x}},
+      {ET_node(OP_DIV, ET_var(0), ET_var(1)), {1 / y, -x / (y * y), 0}},
+      {ET_node(OP_POWER, ET_var(0), ET_var(1)), {y * pow(x, y - 1), pow(x, y) * log(x), 0}},
+      {ET_node(OP_POWI, ET_var(2), ET_value(3)), {0, 0, 3 * z * z}},
+      {ET_node_list(OP_SUM, (ExprTree[]){ET_var(0), ET_var(1), ET_var(0)}, 3), {2, 1, 0}},
+      {ET_node_list(OP_PRODUCT, (ExprTree[]){ET_var(0), ET_var(1), ET_var(2), ET_value(2)}, 4), {2 * y * z, 2 * x * z, 2 * x * y}},
+      {ET_node_list(OP_FMA, (ExprTree[]){ET_var(0), ET_var(1), ET_var(2)}, 3), {y, x, 1}},
+      {ET_call(ET_FN_EXP, (ExprTree[]){ET_var(0)}, 1), {exp(x), 0, 0}},
+      {ET_call(ET_FN_LOG, (ExprTree[]){ET_var(1)}, 1), {0, 1 / y, 0}},
+      {ET_call(ET_FN_SQRT, (ExprTree[]){ET_var(1)}, 1), {0, 0.5 / sqrt(y), 0}},
+      {ET_call(ET_FN_SIN, (ExprTree[]){ET_var(2)}, 1), {0, 0, cos(z)}},
+      {ET_call(ET_FN_COS, (ExprTree[]){ET_var(2)}, 1), {0, 0, -sin(z)}},
+      {ET_call(ET_FN_ABS, (ExprTree[]){ET_var(2)}, 1), {0, 0, -1}},
+      {ET_call(ET_FN_MIN, (ExprTree[]){ET_var(1), ET_var(0)}, 2), {1, 0, 0}},
+      {ET_call(ET_FN_MAX, (ExprTree[]){ET_var(2), ET_var(1)}, 2), {0, 1, 0}},
+      {ET_call(ET_FN_EXP, (ExprTree[]){ET_node(OP_MUL, ET_call(ET_FN_SIN, (ExprTree[]){ET_var(0)}, 1), ET_var(1))}, 1),
+       {exp(sin(x) * y) * cos(x) * y, exp(sin(x) * y) * sin(x), 0}},
+      {ET_node(OP_ADD, ET_var(0), NULL), {1, 0, 0}},
+      {ET_node(OP_ADD, ET_node(OP_SUB, NULL, NULL), ET_node(OP_MUL, NULL, NULL)), {0, 0, 0}},
+      {ET_node(OP_MUL, ET_node(OP_SUB, NULL, ET_var(1)), ET_node(OP_ADD, ET_var(0), NULL)), {-y, -x, 0}},
+      {ET_value(4), {0, 0, 0}},
+  };
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+  {
+    bool ok = ET_gradient(cases[i].tree, vars, 3, grad) == ET_evaluate_vars(cases[i].tree, vars);
+    for (int v = 0; v < 3; v++)
+      ok = ok && close_to(grad[v], cases[i].expected[v], 1e-15);
+    ET_free(cases[i].tree);
+    test_assert(ok);
+  }
+
+  // operands compiled right first, and a larger mix of everything
+  ExprTree deep = ET_node(OP_MUL, ET_var(1), ET_node(OP_ADD, ET_var(2), ET_var(0)));
+  ExprTree reversed[] = {
+      ET_node(OP_SUB, ET_var(0), ET_clone(deep)),
+      ET_node(OP_DIV, ET_var(0), ET_clone(deep)),
+      ET_node(OP_POWER, ET_var(0), ET_clone(deep)),
+      ET_node(OP_POWI, ET_value(3), ET_clone(deep)),
+      ET_node(OP_MUL, ET_node(OP_POWER, ET_node(OP_ADD, ET_var(0), ET_value(4)), ET_value(0.5)),
+              ET_fuse(ET_node(OP_ADD, ET_node(OP_MUL, ET_var(2), ET_var(1)),
+                              ET_node(OP_SUB, ET_node(OP_MUL, ET_var(0), ET_node(OP_MUL, ET_var(0), ET_var(2))),
+                                      ET_node(OP_DIV, ET_value(1), ET_node(UNARY_NEGATE, ET_var(1), NULL)))), NULL)),
+  };
+  size_t n_reversed = sizeof(reversed) / sizeof(reversed[0]);
+  ET_free(deep);
+  for (size_t i = 0; i < n_reversed; i++)
+    test_assert(test_gradient_numeric(reversed[i], vars));
+  for (size_t i = 0; i + 1 < n_reversed; i++)
+    ET_free(reversed[i]);
+
+  // a zero factor does not hide the derivatives of the others
+  double zero_vars[] = {3, 4, 0};
+  ExprTree tree = ET_node_list(OP_PRODUCT, (ExprTree[]){ET_var(0), ET_var(1), ET_var(2)}, 3);
+  test_assert(ET_gradient(tree, zero_vars, 3, grad) == 0);
+  test_assert(grad[0] == 0 && grad[1] == 0 && grad[2] == 12);
+  ET_free(tree);
+
+  // variables beyond n_vars are NAN
+  tree = ET_node(OP_ADD, ET_var(0), ET_var(3));
+  test_assert(isnan(ET_gradient(tree, vars, 3, grad)));
+  ET_free(tree);
+
+  // batches agree bit for bit with one row at a time, across blocks
+  enum { ROWS = 300 };
+  tree = reversed[n_reversed - 1];
+  ExprProgram prog = ET_compile(tree);
+  double xs[ROWS], ys[ROWS], zs[ROWS], out[ROWS], gx[ROWS], gy[ROWS], gz[ROWS];
+  const double *columns[] = {xs, ys, zs};
+  double *grads[] = {gx, gy, gz};
+  for (int r = 0; r < ROWS; r++)
+  {
+    xs[r] = r * 0.01;
+    ys[r] = 1 + r * 0.003;
+    zs[r] = -2 + r * 0.02;
+  }
+  ET_run_gradient_batch(prog, columns, ROWS, 3, out, grads);
+  for (int r = 0; r < ROWS; r++)
+  {
+    double row[] = {xs[r], ys[r], zs[r]};
+    test_assert(ET_run_gradient(prog, row, 3, grad) == out[r]);
+    test_assert(grad[0] == gx[r] && grad[1] == gy[r] && grad[2] == gz[r]);
+    test_assert(out[r] == ET_evaluate_vars(tree, row));
+  }
+  ET_program_free(prog);
+  ET_free(tree);
+
+  return 1;
+}
+
+/*
+ * Tests the ET_pool_create, ET_pool_destroy and ET_evaluate_many
+ * functions.
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_many()
+{
+  enum { N = 5000 };
+  ExprTree *trees = malloc(N * sizeof(ExprTree));
+  double *results = malloc(N * sizeof(double));
+  int next = 0;
+
+  // thousands of small trees, a few missing or variable, one big one
+  // and one shared with its neighbour
+  for (int i = 0; i < N; i++)
+    trees[i] = make_mixed(i % 6, &next);
+  ET_free(trees[17]);
+  trees[17] = NULL;
+  ET_free(trees[18]);
+  trees[18] = ET_node(OP_ADD, ET_var(0), ET_value(1));
+  ET_free(trees[2500]);
+  trees[2500] = make_mixed(16, &next);
+  ET_free(trees[2501]);
+  trees[2501] = ET_share(trees[2500]);
+
+  ExprPool pool = ET_pool_create(4);
+  for (int round = 0; round < 3; round++)
+  {
+    for (int i = 0; i < N; i++)
+      results[i] = -1;
+    ET_evaluate_many(trees, N - round, results, round == 2 ? NULL : pool);
+    bool same = true;
+    for (int i = 0; i < N - round; i++)
+      same = same && ulp_distance(results[i], ET_evaluate(trees[i])) == 0;
+    test_assert(same);
+    test_assert(round == 0 || results[N - 1] == -1);
+  }
+  test_assert(results[17] == 0 && isnan(results[18]));
+
+  // fewer trees than threads, and none
+  ET_evaluate_many(trees + 3, 2, results, pool);
+  test_assert(ulp_distance(results[0], ET_evaluate(trees[3])) == 0);
+  test_assert(ulp_distance(results[1], ET_evaluate(trees[4])) == 0);
+  results[0] = 7;
+  ET_evaluate_many(trees, 0, results, pool);
+  test_assert(results[0] == 7);
+  ET_pool_destroy(pool);
+
+  // a pool of just the caller
+  pool = ET_pool_create(1);
+  ET_evaluate_many(trees + 2500, 1, results, pool);
+  test_assert(ulp_distance(results[0], ET_evaluate(trees[2500])) == 0);
+  ET_pool_destroy(pool);
+  ET_pool_destroy(NULL);
+
+  for (int i = 0; i < N; i++)
+    ET_free(trees[i]);
+  free(trees);
+  free(results);
+  return 1;
+}
+
+/*
+ * Helper function for test_frozen: freezes tree and compares the
+ * count, depth, value and string of the frozen tree with the tree's.
+ *
+ * Returns: true if they all agree
+ */
+bool test_frozen_once(ExprTree tree, const double *vars)
+{
+  static char expected[4096], got[4096];
+  ExprFrozen frozen = ET_freeze(tree);
+  bool same = frozen != NULL;
+
+  same = same && ET_frozen_count(frozen) == ET_count(tree);
+  same = same && ET_frozen_depth(frozen) == ET_depth(tree);
+  same = same && ulp_distance(ET_frozen_evaluate(frozen, vars), ET_evaluate_vars(tree, vars)) == 0;
+  same = same && ET_frozen_tree2string(frozen, got, sizeof(got)) == ET_tree2string(tree, expected, sizeof(expected));
+  same = same && strcmp(got, expected) == 0;
+  ET_frozen_free(frozen);
+  return same;
+}
+
+/*
+ * Tests the ET_freeze and ET_frozen_* functions.
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_frozen()
+{
+  double vars[8] = {1.5, -2, 3, 0.25, 5, 6, 7, 8};
+  char buf[16];
+  int next = 0;
+  int fused;
+
+  test_assert(ET_freeze(NULL) == NULL);
+  test_assert(ET_frozen_count(NULL) == 0 && ET_frozen_depth(NULL) == 0);
+  test_assert(ET_frozen_evaluate(NULL, vars) == 0);
+  test_assert(ET_frozen_tree2string(NULL, buf, sizeof(buf)) == 0);
+  ET_frozen_free(NULL);
+
+  // a lone leaf of each kind
+  ExprTree tree = ET_value(2.5);
+  test_assert(test_frozen_once(tree, vars));
+  ET_free(tree);
+  tree = ET_var(3);
+  test_assert(test_frozen_once(tree, vars));
+  ExprFrozen frozen = ET_freeze(tree);
+  test_assert(isnan(ET_frozen_evaluate(frozen, NULL)));
+  ET_frozen_free(frozen);
+  ET_free(tree);
+
+  // every binary operator and negation, and the tree may go first
+  tree = make_mixed(10, &next);
+  frozen = ET_freeze(tree);
+  double expected = ET_evaluate(tree);
+  test_assert(test_frozen_once(tree, NULL));
+  ET_free(tree);
+  test_assert(ulp_distance(ET_frozen_evaluate(frozen, NULL), expected) == 0);
+  ET_frozen_free(frozen);
+
+  // list, FMA and integer-power nodes
+  tree = ET_node(OP_ADD,
+                 ET_node(OP_ADD, ET_node(OP_MUL, ET_var(0), ET_var(1)), ET_var(2)),
+                 ET_node(OP_POWER, ET_node(OP_ADD, ET_var(3), ET_node(OP_ADD, ET_var(4), ET_var(5))), ET_value(3)));
+  tree = ET_fuse(tree, &fused);
+  test_assert(fused > 0);
+  test_assert(test_frozen_once(tree, vars));
+  ET_free(tree);
+
+  // shared and interned subtrees are copied at each place they appear
+  ExprTree shared = make_mixed(6, &next);
+  tree = ET_node(OP_SUB, ET_node(OP_MUL, ET_share(shared), ET_var(7)), shared);
+  test_assert(test_frozen_once(tree, vars));
+  tree = ET_intern(ET_node(OP_ADD, tree, make_mixed(6, &next)));
+  test_assert(test_frozen_once(tree, vars));
+  ET_free(tree);
+
+  // a chain far deeper than the C stack would allow to recurse
+  tree = ET_var(0);
+  for (int i = 0; i < 200000; i++)
+    tree = ET_node(i % 2 ? OP_ADD : OP_SUB, tree, ET_value(i % 5));
+  frozen = ET_freeze(tree);
+  test_assert(ET_frozen_count(frozen) == 400001 && ET_frozen_depth(frozen) == 200001);
+  test_assert(ulp_distance(ET_frozen_evaluate(frozen, vars), ET_evaluate_vars(tree, vars)) == 0);
+
+  // a truncated string ends in '$', as for ET_tree2string
+  char expected_buf[sizeof(buf)];
+  test_assert(ET_frozen_tree2string(frozen, buf, sizeof(buf)) == ET_tree2string(tree, expected_buf, sizeof(expected_buf)));
+  test_assert(strcmp(buf, expected_buf) == 0 && buf[sizeof(buf) - 2] == '$');
+  ET_frozen_free(frozen);
+  ET_free(tree);
+
+  return 1;
+}
+
+/*
+ * Output collected by collect_write for test_write
+ */
+typedef struct
+{
+  char *buf;
+  size_t len;
+  size_t cap;
+  int calls;
+  int stop_after;  // calls to accept before asking ET_write to stop
+} WriteCollector;
+
+/*
+ * ExprWriteFunction that appends each chunk to a WriteCollector
+ */
+static int collect_write(void *ctx, const char *data, size_t len)
+{
+  WriteCollector *c = ctx;
+
+  if (c->calls++ == c->stop_after)
+    return 1;
+  if (c->len + len + 1 > c->cap)
+  {
+    while (c->len + len + 1 > c->cap)
+      c->cap = c->cap ? 2 * c->cap : 256;
+    c->buf = realloc(c->buf, c->cap);
+  }
+  memcpy(c->buf + c->len, data, len);
+  c->len += len;
+  c->buf[c->len] = '\0';
+  return 0;
+}
+
+/*
+ * Tests the ET_write, ET_write_file and ET_write_fd functions.
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_write()
+{
+  WriteCollector c = {NULL, 0, 0, 0, -1};
+  char line[256];
+  int next = 0;
+
+  // ((2 + x1) ^ (-1.5)) / (x0 * 4)
+  ExprTree tree = ET_node(OP_DIV,
+                          ET_node(OP_POWER, ET_node(OP_ADD, ET_value(2), ET_var(1)),
+                                  ET_node(UNARY_NEGATE, ET_value(1.5), NULL)),
+                          ET_node(OP_MUL, ET_var(0), ET_value(4)));
+  test_assert(ET_write(tree, collect_write, &c, ET_FORMAT_INFIX) == 0);
+  test_assert(strcmp(c.buf, "(((2 + x1) ^ (-1.5)) / (x0 * 4))") == 0);
+  c.len = 0;
+  test_assert(ET_write(tree, collect_write, &c, ET_FORMAT_POSTFIX) == 0);
+  test_assert(strcmp(c.buf, "2 x1 + 1.5 neg ^ x0 4 * /") == 0);
+  c.len = 0;
+  test_assert(ET_write(tree, collect_write, &c, ET_FORMAT_JSON) == 0);
+  test_assert(strcmp(c.buf, "{\"op\":\"div\",\"args\":[{\"op\":\"pow\",\"args\":[{\"op\":\"add\",\"args\":"
+                            "[{\"value\":2},{\"var\":1}]},{\"op\":\"neg\",\"args\":[{\"value\":1.5}]}]},"
+                            "{\"op\":\"mul\",\"args\":[{\"var\":0},{\"value\":4}]}]}") == 0);
+  ET_free(tree);
+
+  // list, FMA and missing operands, and non-finite values
+  ExprTree args[3] = {ET_var(0), ET_value(INFINITY), ET_node(OP_SUB, NULL, ET_value(NAN))};
+  tree = ET_node_list(OP_SUM, args, 3);
+  c.len = 0;
+  test_assert(ET_write(tree, collect_write, &c, ET_FORMAT_POSTFIX) == 0);
+  test_assert(strcmp(c.buf, "x0 inf 0 nan - +3") == 0);
+  c.len = 0;
+  test_assert(ET_write(tree, collect_write, &c, ET_FORMAT_JSON) == 0);
+  test_assert(strcmp(c.buf, "{\"op\":\"sum\",\"args\":[{\"var\":0},{\"value\":\"Infinity\"},"
+                            "{\"op\":\"sub\",\"args\":[null,{\"value\":\"NaN\"}]}]}") == 0);
+  ET_free(tree);
+  ExprTree fma[3] = {ET_var(0), ET_var(1), ET_value(3)};
+  tree = ET_node_list(OP_FMA, fma, 3);
+  c.len = 0;
+  test_assert(ET_write(tree, collect_write, &c, ET_FORMAT_INFIX) == 0);
+  test_assert(strcmp(c.buf, "(x0 * x1 + 3)") == 0);
+  c.len = 0;
+  test_assert(ET_write(tree, collect_write, &c, ET_FORMAT_POSTFIX) == 0);
+  test_assert(strcmp(c.buf, "x0 x1 3 fma") == 0);
+  ET_free(tree);
+
+  // nothing at all for an empty tree
+  c.len = c.calls = 0;
+  test_assert(ET_write(NULL, collect_write, &c, ET_FORMAT_JSON) == 0 && c.calls == 0);
+
+  // a tree whose text runs to megabytes arrives in many chunks and
+  // matches ET_tree2string, however deep
+  tree = ET_var(0);
+  for (int i = 0; i < 200000; i++)
+    tree = ET_node(OP_ADD, make_mixed(2 + i % 3, &next), tree);
+  size_t buf_sz = 16 << 20;
+  char *expected = malloc(buf_sz);
+  size_t len = ET_tree2string(tree, expected, buf_sz);
+  test_assert(expected[len - 1] != '$');
+  c.len = c.calls = 0;
+  test_assert(ET_write(tree, collect_write, &c, ET_FORMAT_INFIX) == 0);
+  test_assert(c.len == len && memcmp(c.buf, expected, len) == 0 && c.calls > 100);
+
+  // the write function can stop the output
+  c.len = c.calls = 0;
+  c.stop_after = 3;
+  test_assert(ET_write(tree, collect_write, &c, ET_FORMAT_JSON) == -1 && c.calls == 4);
+  test_assert(c.len > 0 && memcmp(c.buf, "{\"op\":\"add\",\"args\":[", 20) == 0);
+
+  // to a stream and a file descriptor
+  FILE *out = tmpfile();
+  test_assert(out != NULL);
+  test_assert(ET_write_file(tree, out, ET_FORMAT_INFIX) == 0);
+  test_assert(ET_write_file(NULL, out, ET_FORMAT_INFIX) == 0);
+  test_assert(ftell(out) == (long)len);
+  rewind(out);
+  test_assert(fgets(line, sizeof(line), out) != NULL && strncmp(line, expected, sizeof(line) - 1) == 0);
+  fclose(out);
+
+  char path[] = "/tmp/et_test_XXXXXX";
+  int fd = mkstemp(path);
+  test_assert(fd >= 0);
+  unlink(path);
+  test_assert(ET_write_fd(tree, fd, ET_FORMAT_POSTFIX) == 0);
+  test_assert(lseek(fd, 0, SEEK_CUR) > (off_t)len / 2);
+  close(fd);
+  test_assert(ET_write_fd(tree, fd, ET_FORMAT_POSTFIX) == -1);
+
+  ET_free(tree);
+  free(expected);
+  free(c.buf);
+  return 1;
+}
+
+/*
+ * Helper function for test_format_double: returns the fewest
+ * significant digits with which printf's correctly rounded "%.*e"
+ * output reads back as value.
+ */
+static int shortest_digits(double value)
+{
+  char text[40];
+
+  for (int precision = 1; precision < 17; precision++)
+  {
+    snprintf(text, sizeof(text), "%.*e", precision - 1, value);
+    if (strtod(text, NULL) == value)
+      return precision;
+  }
+  return 17;
+}
+
+/*
+ * Tests the ET_format_double and ET_tree2string_format functions, and
+ * the ET_FORMAT_SHORTEST flag.
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_format_double()
+{
+  static const struct
+  {
+    double value;
+    const char *expected;
+  } cases[] = {
+      {0, "0"}, {-0.0, "-0"}, {1, "1"}, {-2.5, "-2.5"}, {0.1, "0.1"},
+      {1.0 / 3, "0.3333333333333333"}, {2.0 / 3, "0.6666666666666666"},
+      {123456, "123456"}, {1e16, "10000000000000000"}, {1e17, "1e+17"},
+      {0.0001, "0.0001"}, {0.00001, "1e-05"}, {1e-7, "1e-07"}, {1e300, "1e+300"},
+      {1152921504606846976.0, "1.152921504606847e+18"}, {9007199254740993.0, "9007199254740992"},
+      {5e-324, "5e-324"}, {2.2250738585072014e-308, "2.2250738585072014e-308"},
+      {1.7976931348623157e308, "1.7976931348623157e+308"}, {123.456, "123.456"},
+      {INFINITY, "inf"}, {-INFINITY, "-inf"}, {NAN, "nan"},
+  };
+  char buf[ET_DOUBLE_CHARS];
+
+  for (int i = 0; i < (int)(sizeof(cases) / sizeof(cases[0])); i++)
+  {
+    size_t len = ET_format_double(cases[i].value, buf);
+    if (strcmp(buf, cases[i].expected) != 0 || len != strlen(buf))
+    {
+      printf("FAIL %s: got %s, expected %s\n", __FUNCTION__, buf, cases[i].expected);
+      return 0;
+    }
+  }
+
+  // random bit patterns read back as the same double, bit for bit,
+  // with no more digits than printf needs
+  uint64_t state = 0x9e3779b97f4a7c15ULL;
+  for (int i = 0; i < 1 << 20; i++)
+  {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    double value;
+    memcpy(&value, &state, sizeof(value));
+    if (isnan(value))
+      continue;
+
+    size_t len = ET_format_double(value, buf);
+    test_assert(len < ET_DOUBLE_CHARS);
+    double back = strtod(buf, NULL);
+    test_assert(memcmp(&back, &value, sizeof(value)) == 0);
+
+    if (i % 64 == 0)
+    {
+      // significant digits: those of the mantissa without leading
+      // zeros, nor trailing ones when there is no point
+      size_t end = strcspn(buf, "e");
+      bool point = memchr(buf, '.', end) != NULL;
+      int digits = 0, zeros = 0;
+      for (size_t c = 0; c < end; c++)
+      {
+        if (buf[c] >= '1' && buf[c] <= '9')
+          digits += zeros + 1, zeros = 0;
+        else if (buf[c] == '0' && digits > 0)
+          zeros++;
+      }
+      digits += point ? zeros : 0;
+      test_assert(digits == shortest_digits(value));
+    }
+  }
+
+  // a tree printed with shortest values parses back to the same tree;
+  // with "%g" it does not
+  ExprTree tree = ET_node(OP_ADD, ET_node(OP_MUL, ET_value(0.1), ET_value(1.0 / 3)),
+                          ET_node(UNARY_NEGATE, ET_value(1e-310), NULL));
+  char text[256];
+  size_t len = ET_tree2string_format(tree, text, sizeof(text), ET_FORMAT_INFIX | ET_FORMAT_SHORTEST);
+  test_assert(strcmp(text, "((0.1 * 0.3333333333333333) + (-1e-310))") == 0 && len == strlen(text));
+  ExprTree back = ET_parse(text, len, NULL, NULL);
+  test_assert(ET_equal(back, tree));
+  ET_free(back);
+  char expected[256];
+  len = ET_tree2string_format(tree, text, sizeof(text), ET_FORMAT_INFIX);
+  test_assert(len == ET_tree2string(tree, expected, sizeof(expected)) && strcmp(text, expected) == 0);
+  test_assert(strcmp(text, "((0.1 * 0.333333) + (-1e-310))") == 0);
+  back = ET_parse(text, len, NULL, NULL);
+  test_assert(!ET_equal(back, tree));
+  ET_free(back);
+
+  len = ET_tree2string_format(tree, text, sizeof(text), ET_FORMAT_JSON | ET_FORMAT_SHORTEST);
+  test_assert(strstr(text, "{\"value\":0.3333333333333333}") != NULL);
+  len = ET_tree2string_format(tree, text, sizeof(text), ET_FORMAT_POSTFIX | ET_FORMAT_SHORTEST);
+  test_assert(strcmp(text, "0.1 0.3333333333333333 * 1e-310 neg +") == 0);
+
+  // truncated like ET_tree2string
+  len = ET_tree2string_format(tree, text, 10, ET_FORMAT_INFIX | ET_FORMAT_SHORTEST);
+  test_assert(len == 9 && strcmp(text, "((0.1 * $") == 0);
+  test_assert(ET_tree2string_format(NULL, text, sizeof(text), ET_FORMAT_INFIX) == 0);
+  ET_free(tree);
+
+  return 1;
+}
+
+/*
+ * Scalar kernel of the "hyp3" function that test_call registers: the
+ * length of a 3-vector
+ */
+static double hyp3(const double *args)
+{
+  return sqrt(args[0] * args[0] + args[1] * args[1] + args[2] * args[2]);
+}
+
+// Rows that the batch kernel of "lerp" has been called for
+static size_t lerp_batch_rows = 0;
+
+/*
+ * Scalar and batch kernels of the "lerp" function that test_call
+ * registers, with a derivative kernel: a + (b - a) * t
+ */
+static double lerp(const double *args)
+{
+  return args[0] + (args[1] - args[0]) * args[2];
+}
+
+static void lerp_batch(const double *const *args, size_t n_rows, double *out)
+{
+  lerp_batch_rows += n_rows;
+  for (size_t i = 0; i < n_rows; i++)
+    out[i] = args[0][i] + (args[1][i] - args[0][i]) * args[2][i];
+}
+
+/*
+ * Derivative kernel of "lerp"
+ */
+static void lerp_partials(const double *args, double *partials)
+{
+  partials[0] = 1 - args[2];
+  partials[1] = args[2];
+  partials[2] = args[1] - args[0];
+}
+
+/*
+ * Tests ET_register_fn, ET_find_fn, ET_fn_name, ET_call and OP_CALL
+ * nodes in each of the evaluators, printers and rewrites
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_call()
+{
+  double vars[] = {0.5, -2, 3, 1.25};
+  char buf[256];
+
+  // the built-in functions
+  test_assert(strcmp(ET_fn_name(ET_FN_EXP), "exp") == 0 && strcmp(ET_fn_name(ET_FN_MAX), "max") == 0);
+  test_assert(ET_find_fn("sqrt", 4) == ET_FN_SQRT && ET_find_fn("sqrtx", 4) == ET_FN_SQRT);
+  test_assert(ET_find_fn("sqr", 3) == -1 && ET_fn_name(-1) == NULL && ET_fn_name(ET_MAX_FUNCTIONS) == NULL);
+
+  // registration checks its arguments, and names are unique
+  test_assert(ET_register_fn("1st", 1, hyp3, NULL, NULL) == -1);
+  test_assert(ET_register_fn("a-b", 1, hyp3, NULL, NULL) == -1);
+  test_assert(ET_register_fn("", 1, hyp3, NULL, NULL) == -1);
+  test_assert(ET_register_fn("hyp3", 0, hyp3, NULL, NULL) == -1);
+  test_assert(ET_register_fn("hyp3", ET_MAX_ARITY + 1, hyp3, NULL, NULL) == -1);
+  test_assert(ET_register_fn("hyp3", 3, NULL, NULL, NULL) == -1);
+  test_assert(ET_register_fn("exp", 1, hyp3, NULL, NULL) == -1);
+  int hyp = ET_register_fn("hyp3", 3, hyp3, NULL, NULL);
+  int lrp = ET_register_fn("lerp", 3, lerp, lerp_batch, lerp_partials);
+  test_assert(hyp >= ET_FN_BUILTINS && lrp == hyp + 1);
+  test_assert(ET_register_fn("hyp3", 3, hyp3, NULL, NULL) == -1);
+  test_assert(ET_find_fn("hyp3", 4) == hyp && strcmp(ET_fn_name(lrp), "lerp") == 0);
+
+  // max(hyp3(x0, x1, x2), exp(-x3)) - lerp(x0, sqrt(x2), x3)
+  ExprTree tree = ET_node(
+      OP_SUB,
+      ET_call(ET_FN_MAX, (ExprTree[]){ET_call(hyp, (ExprTree[]){ET_var(0), ET_var(1), ET_var(2)}, 3),
+                                      ET_call(ET_FN_EXP, (ExprTree[]){ET_node(UNARY_NEGATE, ET_var(3), NULL)}, 1)}, 2),
+      ET_call(lrp, (ExprTree[]){ET_var(0), ET_call(ET_FN_SQRT, (ExprTree[]){ET_var(2)}, 1), ET_var(3)}, 3));
+  double expected = fmax(sqrt(0.25 + 4 + 9), exp(-1.25)) - (0.5 + (sqrt(3) - 0.5) * 1.25);
+  test_assert(ET_count(tree) == 14 && ET_depth(tree) == 5);
+  test_assert(ET_evaluate_vars(tree, vars) == expected);
+  test_assert(isnan(ET_evaluate_parallel(tree, 2)) && isnan(ET_evaluate(tree)));
+
+  ExprProgram prog = ET_compile(tree);
+  test_assert(ET_run_vars(prog, vars) == expected);
+  ExprJit jit = ET_jit(tree);
+  test_assert(ET_jit_run(jit, vars) == expected);
+  ET_jit_free(jit);
+  ExprFrozen frozen = ET_freeze(tree);
+  test_assert(ET_frozen_evaluate(frozen, vars) == expected);
+  test_assert(ET_frozen_count(frozen) == 14 && ET_frozen_depth(frozen) == 5);
+
+  // the batch kernel runs when there is one, and both agree with the
+  // scalar evaluators row by row
+  enum { N = 1000 };
+  double *cols[4], out[N];
+  for (int v = 0; v < 4; v++)
+  {
+    cols[v] = malloc(N * sizeof(double));
+    for (int i = 0; i < N; i++)
+      cols[v][i] = vars[v] + 0.01 * i * (v + 1);
+  }
+  lerp_batch_rows = 0;
+  ET_run_batch(prog, (const double *const *)cols, N, out);
+  test_assert(lerp_batch_rows == N);
+  for (int i = 0; i < N; i++)
+  {
+    double row[4] = {cols[0][i], cols[1][i], cols[2][i], cols[3][i]};
+    test_assert(out[i] == ET_evaluate_vars(tree, row));
+  }
+  for (int v = 0; v < 4; v++)
+    free(cols[v]);
+
+  // gradients against the exact derivatives: hyp3 has no derivative
+  // kernel, so it is differentiated by central differences
+  double grad[4];
+  test_assert(ET_run_gradient(prog, vars, 4, grad) == expected);
+  double h = sqrt(0.25 + 4 + 9);
+  test_assert(close_to(grad[0], 0.5 / h - (1 - 1.25), 1e-9));
+  test_assert(close_to(grad[1], -2 / h, 1e-9));
+  test_assert(close_to(grad[2], 3 / h - 1.25 / (2 * sqrt(3)), 1e-9));
+  test_assert(grad[3] == -(sqrt(3) - 0.5));
+  ET_program_free(prog);
+
+  // printed as name(args), which parses back; the other formats too
+  size_t len = ET_tree2string(tree, buf, sizeof(buf));
+  test_assert(strcmp(buf, "(max(hyp3(x0, x1, x2), exp((-x3))) - lerp(x0, sqrt(x2), x3))") == 0);
+  char frozen_buf[sizeof(buf)];
+  test_assert(ET_frozen_tree2string(frozen, frozen_buf, sizeof(frozen_buf)) == len && strcmp(frozen_buf, buf) == 0);
+  ET_frozen_free(frozen);
+  ExprTree back = ET_parse(buf, len, NULL, NULL);
+  test_assert(ET_equal(back, tree) && ET_hash(back) == ET_hash(tree));
+  ET_free(back);
+  ET_tree2string_format(tree, buf, sizeof(buf), ET_FORMAT_POSTFIX);
+  test_assert(strcmp(buf, "x0 x1 x2 hyp3 x3 neg exp max x0 x2 sqrt x3 lerp -") == 0);
+  ET_tree2string_format(tree, buf, sizeof(buf), ET_FORMAT_JSON);
+  test_assert(strncmp(buf, "{\"op\":\"sub\",\"args\":[{\"op\":\"call\",\"fn\":\"max\",\"args\":[", 51) == 0);
+
+  // negated calls of functions whose names start like inf and nan
+  // print and parse back, while -inf and -nan stay values
+  int nrm = ET_register_fn("nrm", 1, hyp3, NULL, NULL);
+  int infx = ET_register_fn("infx", 1, hyp3, NULL, NULL);
+  test_assert(nrm >= 0 && infx >= 0);
+  const char *negated[] = {"-nrm(x0)", "(-nrm(x0))", "-infx(x0) * -inf", "x1 - -nan"};
+  const char *printed[] = {"(-nrm(x0))", "(-nrm(x0))", "((-infx(x0)) * -inf)", "(x1 - -nan)"};
+  for (int i = 0; i < 4; i++)
+  {
+    back = ET_parse(negated[i], strlen(negated[i]), NULL, NULL);
+    test_assert(back != NULL);
+    len = ET_tree2string(back, buf, sizeof(buf));
+    test_assert(strcmp(buf, printed[i]) == 0);
+    ExprTree again = ET_parse(buf, len, NULL, NULL);
+    test_assert(ET_equal(again, back));
+    ET_free(again);
+    ET_free(back);
+  }
+
+  // the parser wants a known name, the right arity and a closing ')'
+  const char *bad[] = {"nosuch(x0)", "exp(x0, x1)", "max(x0)", "exp()", "exp(x0", "hyp3(1, 2, 3", "(x0, x1)"};
+  for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++)
+    test_assert(ET_parse(bad[i], strlen(bad[i]), NULL, NULL) == NULL);
+  ExprArena arena = ET_arena_create(0);
+  const char *text = "min(x0 + 1, 2 * max(x1, -x0)) ^ 2";
+  back = ET_parse(text, strlen(text), arena, NULL);
+  test_assert(back != NULL && ET_evaluate_vars(back, vars) == pow(fmin(1.5, 2 * fmax(-2, -0.5)), 2));
+  ET_arena_destroy(arena);
+
+  // functions of the same operands are only equal if they are the same
+  ExprTree a = ET_call(ET_FN_SIN, (ExprTree[]){ET_var(0)}, 1);
+  ExprTree b = ET_call(ET_FN_COS, (ExprTree[]){ET_var(0)}, 1);
+  test_assert(!ET_equal(a, b) && ET_hash(a) != ET_hash(b));
+  ExprTree both = ET_intern(ET_node(OP_ADD, a, b));
+  test_assert(ET_count_distinct(both) == 4);
+  ET_free(both);
+
+  // serialized by name, evaluated in place and loaded back
+  len = ET_serialize(tree, buf, sizeof(buf));
+  test_assert(len <= sizeof(buf));
+  test_assert(ET_evaluate_serialized(buf, len, vars) == expected);
+  back = ET_load(buf, len, NULL, NULL);
+  test_assert(back != NULL && ET_equal(back, tree));
+  ET_free(back);
+  ET_free(tree);
+
+  // calls of constants fold, whatever the function
+  tree = ET_node(OP_MUL, ET_call(hyp, (ExprTree[]){ET_value(2), ET_value(3), ET_value(6)}, 3), ET_var(0));
+  int removed = 0;
+  tree = ET_simplify(tree, true, &removed);
+  test_assert(removed == 3 && ET_tree2string(tree, buf, sizeof(buf)) > 0 && strcmp(buf, "(7 * x0)") == 0);
+  ET_free(tree);
+
+  return 1;
+}
+
+/*
+ * Tests the ET_specialize function.
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_specialize()
+{
+  char buf[256];
+  ExprBinding x1 = {1, 4};
+
+  test_assert(ET_specialize(NULL, &x1, 1) == NULL);
+
+  // bound variables become values, and what only depends on values folds
+  ExprTree tree = ET_parse("x0 * x1 + 2 * 3", 15, NULL, NULL);
+  ExprTree residual = ET_specialize(tree, &x1, 1);
+  test_assert(ET_tree2string(residual, buf, sizeof(buf)) > 0 && strcmp(buf, "((x0 * 4) + 6)") == 0);
+  test_assert(ET_tree2string(tree, buf, sizeof(buf)) > 0 && strcmp(buf, "((x0 * x1) + (2 * 3))") == 0);
+  ET_free(residual);
+
+  ET_free(tree);
+
+  // with nothing to bind or fold, the tree is its own residual
+  tree = ET_parse("x0 * x1 + 2", 11, NULL, NULL);
+  residual = ET_specialize(tree, NULL, 0);
+  test_assert(residual == tree);
+  ET_free(residual);
+  ET_free(tree);
+
+  // bindings of variables the tree does not read cost nothing, however
+  // large their index, and a later binding still wins
+  tree = ET_parse("x0 + 1", 6, NULL, NULL);
+  ExprBinding unused[] = {{SIZE_MAX, 2}, {1000000000, 3}};
+  residual = ET_specialize(tree, unused, 2);
+  test_assert(residual == tree);
+  ET_free(residual);
+  ExprBinding rebound[] = {{1000000000, 3}, {0, 2}, {SIZE_MAX, 2}, {0, 5}};
+  residual = ET_specialize(tree, rebound, 4);
+  test_assert(ET_count(residual) == 1 && ET_evaluate(residual) == 6);
+  ET_free(residual);
+  ET_free(tree);
+  tree = ET_node(OP_SUB, ET_var(SIZE_MAX), ET_var(1000000000));
+  residual = ET_specialize(tree, unused, 2);
+  test_assert(ET_count(residual) == 1 && ET_evaluate(residual) == -1);
+  ET_free(residual);
+  ET_free(tree);
+
+  // the residual evaluates as the original under the same bindings
+  const char *text = "(x0 * x1 + exp(x2) / (x1 - 2)) * x3 + sqrt(x2 * x2 + 1) ^ x1 - min(x1, x2 ^ 3) * -(x2 + x1)";
+  ExprBinding bindings[] = {{2, 9}, {1, 3.5}, {2, -0.75}};
+  tree = ET_parse(text, strlen(text), NULL, NULL);
+  test_assert(tree != NULL);
+  residual = ET_specialize(tree, bindings, 3);
+  test_assert(ET_count(residual) == 11);
+  test_assert(ET_tree2string(residual, buf, sizeof(buf)) > 0 && strstr(buf, "x1") == NULL && strstr(buf, "x2") == NULL);
+
+  static const double grid[] = {-2.5, -1, -0.0, 0.125, 1, 3, INFINITY, NAN};
+  for (size_t i = 0; i < 8; i++)
+    for (size_t j = 0; j < 8; j++)
+    {
+      double vars[] = {grid[i], 3.5, -0.75, grid[j]};
+      double expected = ET_evaluate_vars(tree, vars);
+      double got = ET_evaluate_vars(residual, vars);
+      test_assert(memcmp(&got, &expected, sizeof(double)) == 0 || (isnan(got) && isnan(expected)));
+    }
+  ET_free(residual);
+
+  // binding everything leaves a single value
+  ExprBinding all[] = {{0, 0.5}, {1, 3.5}, {2, -0.75}, {3, 2}};
+  residual = ET_specialize(tree, all, 4);
+  double vars[] = {0.5, 3.5, -0.75, 2};
+  test_assert(ET_count(residual) == 1 && ET_evaluate(residual) == ET_evaluate_vars(tree, vars));
+  ET_free(residual);
+  ET_free(tree);
+
+  // shared subtrees stay shared, and untouched ones are not copied
+  ExprTree free_part = ET_node(OP_ADD, ET_var(0), ET_var(3));
+  ExprTree bound_part = ET_node(OP_MUL, ET_var(0), ET_var(1));
+  tree = ET_node(OP_MUL, ET_node(OP_ADD, ET_share(bound_part), ET_share(free_part)), ET_node(OP_SUB, bound_part, free_part));
+  residual = ET_specialize(tree, &x1, 1);
+  test_assert(ET_count_distinct(residual) == 9 && ET_count_distinct(tree) == 9);
+  test_assert(ET_tree2string(residual, buf, sizeof(buf)) > 0 && strcmp(buf, "(((x0 * 4) + (x0 + x3)) * ((x0 * 4) - (x0 + x3)))") == 0);
+  ET_free(tree);
+  test_assert(ET_tree2string(residual, buf, sizeof(buf)) > 0 && strcmp(buf, "(((x0 * 4) + (x0 + x3)) * ((x0 * 4) - (x0 + x3)))") == 0);
+  ET_free(residual);
+
+  return 1;
+}
+
+int main()
+{
+  int passed = 0;
+  int num_tests = 0;
+
+  num_tests++;
+  passed += test_node_free();
+
+  num_tests++;
+  passed += test_depth();
+
+  num_tests++;
+  passed += test_count();
+
+  num_tests++;
+  passed += test_evaluate();
+
+  num_tests++;
+  passed += test_tree2string();
+
+  num_tests++;
+  passed += test_arena();
+
+  num_tests++;
+  passed += test_compile();
+
+  num_tests++;
+  passed += test_variables();
+
+  num_tests++;
+  passed += test_tree2string_large();
+
+  num_tests++;
+  passed += test_deep_chains();
+
+  num_tests++;
+  passed += test_simplify();
+
+  num_tests++;
+  passed += test_intern();
+
+  num_tests++;
+  passed += test_parse();
+
+  num_tests++;
+  passed += test_serialize();
+
+  num_tests++;
+  passed += test_parallel();
+
+  num_tests++;
+  passed += test_incremental();
+
+  num_tests++;
+  passed += test_jit();
+
+  num_tests++;
+  passed += test_stats();
+
+  num_tests++;
+  passed += test_profile();
+
+  num_tests++;
+  passed += test_fuse();
+
+  num_tests++;
+  passed += test_share();
+
+  num_tests++;
+  passed += test_gradient();
+
+  num_tests++;
+  passed += test_many();
+
+  num_tests++;
+  passed += test_frozen();
+
+  num_tests++;
+  passed += test_write();
+
+  num_tests++;
+  passed += test_format_double();
+
+  num_tests++;
+  passed += test_call();
+
+  num_tests++;
+  passed += test_specialize();
 
   printf("Passed %d/%d test cases\n", passed, num_tests);
   fflush(stdout);
@@ -0,0 +1,158 @@
+/*
+ * et_test_hpp.cpp
+ *
+ * Test cases for the static expressions of expr_tree.hpp
+ *
+ * Author: Howdy Pierce <howdy@sleepymoose.net>
+ * Contributor: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "expr_tree.hpp"
+
+// Checks that value is true; if not, prints a failure message and
+// returns 0 from this function
+#define test_assert(value)                                         \
+  {                                                                \
+    if (!(value))                                                  \
+    {                                                              \
+      printf("FAIL %s[%d]: %s\n", __FUNCTION__, __LINE__, #value); \
+      return 0;                                                    \
+    }                                                              \
+  }
+
+static constexpr auto x0 = et::var<0>;
+static constexpr auto x1 = et::var<1>;
+static constexpr auto x2 = et::var<2>;
+
+// Operators, integer powers and constants fold at compile time
+static constexpr double row[] = {3, -2, 0.5};
+static_assert(et::evaluate((x0 * 2 + 1) / x1, row) == -3.5, "operators");
+static_assert(et::evaluate(-(x0 - x1) * x2, row) == -2.5, "negation");
+static_assert(et::evaluate(et::powi(x1, 3) + et::powi(x2, -2), row) == -4, "powi");
+static_assert(et::evaluate(1 + x0 / 4, row) == 1.75, "numbers on either side");
+static_assert(decltype((x0 * 2 + 1) / x1)::count == 7 && decltype((x0 * 2 + 1) / x1)::depth == 4, "size");
+
+/*
+ * Return true if a and b are the same double, bit for bit, or both
+ * NAN; the sign of a NAN depends on how the library propagates it
+ */
+static bool same_bits(double a, double b)
+{
+  return memcmp(&a, &b, sizeof(double)) == 0 || (std::isnan(a) && std::isnan(b));
+}
+
+/*
+ * Helper for test_to_tree: checks that e evaluates, at every row of a
+ * grid of values of x0..x2 and with no variables, bit for bit as its
+ * runtime tree does under ET_evaluate_vars and ET_run_vars, that the
+ * sizes agree, and that the tree prints as expected
+ *
+ * Returns: true if all of that holds
+ */
+template <class E>
+static bool test_to_tree_once(const E &e, const char *expected)
+{
+  ExprTree tree = et::to_tree(e);
+  ExprProgram prog = ET_compile(tree);
+  char buf[256];
+  bool ok = ET_count(tree) == E::count && ET_depth(tree) == E::depth;
+
+  ET_tree2string(tree, buf, sizeof(buf));
+  ok = ok && strcmp(buf, expected) == 0;
+  ok = ok && same_bits(et::evaluate(e), ET_evaluate(tree));
+
+  static const double grid[] = {-3.75, -1, -0.1, 0, 0.3, 1, 2.5, 7};
+  for (double a : grid)
+    for (double b : grid)
+      for (double c : grid)
+      {
+        double vars[] = {a, b, c};
+        double value = et::evaluate(e, vars);
+        ok = ok && same_bits(value, ET_evaluate_vars(tree, vars)) && same_bits(value, ET_run_vars(prog, vars));
+      }
+
+  ET_program_free(prog);
+  ET_free(tree);
+  return ok;
+}
+
+/*
+ * Tests et::evaluate against et::to_tree and the runtime evaluators
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_to_tree()
+{
+  test_assert(test_to_tree_once(x0 + 1.5, "(x0 + 1.5)"));
+  test_assert(test_to_tree_once((x0 * 2 + 1) / x1, "(((x0 * 2) + 1) / x1)"));
+  test_assert(test_to_tree_once(-(x0 - x1) * x2, "((-(x0 - x1)) * x2)"));
+  test_assert(test_to_tree_once(et::pow(x0, x1) - et::pow(2, x2), "((x0 ^ x1) - (2 ^ x2))"));
+  test_assert(test_to_tree_once(et::powi(x0, 3) + et::powi(x1, x2), "((x0 ^ 3) + (x1 ^ x2))"));
+  test_assert(test_to_tree_once(et::fma(x0, x1, x2 / 3), "(x0 * x1 + (x2 / 3))"));
+  test_assert(test_to_tree_once(et::max(et::exp(-x0), et::log(x1)) * et::min(et::abs(x2), 2),
+                                "(max(exp((-x0)), log(x1)) * min(abs(x2), 2))"));
+  test_assert(test_to_tree_once(et::sqrt(x0 * x0 + x1 * x1) + et::sin(x2) * et::cos(x2),
+                                "(sqrt(((x0 * x0) + (x1 * x1))) + (sin(x2) * cos(x2)))"));
+
+  // arena trees are the same trees
+  auto e = (x0 - 1) * et::exp(x1) / (x2 + 4);
+  ExprArena arena = ET_arena_create(0);
+  ExprTree in_arena = et::to_tree(e, arena);
+  ExprTree on_heap = et::to_tree(e);
+  test_assert(ET_equal(in_arena, on_heap));
+  double vars[] = {0.25, -1, 3};
+  test_assert(same_bits(ET_evaluate_vars(in_arena, vars), et::evaluate(e, vars)));
+  ET_free(on_heap);
+  ET_arena_destroy(arena);
+
+  return 1;
+}
+
+/*
+ * Tests that expressions are plain values, built and evaluated with no
+ * tree behind them
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_values()
+{
+  // constants are kept by value, so an expression outlives its parts
+  auto make = [](double scale) { return x0 * scale + scale; };
+  auto e = make(3);
+  double vars[] = {2};
+  test_assert(et::evaluate(e, vars) == 9);
+  auto copy = e;
+  test_assert(et::evaluate(copy - e, vars) == 0);
+
+  // nothing to own or free
+  test_assert(std::is_trivially_copyable<decltype(e)>::value && std::is_trivially_destructible<decltype(e)>::value);
+
+  // integers become values, and variables with nothing to read are NAN
+  auto f = x1 / 2 + 1;
+  test_assert(decltype(f)::count == 5);
+  double more_vars[] = {0, 5};
+  test_assert(et::evaluate(f, more_vars) == 3.5);
+  test_assert(std::isnan(et::evaluate(f)));
+
+  return 1;
+}
+
+int main()
+{
+  int passed = 0;
+  int num_tests = 0;
+
+  num_tests++;
+  passed += test_to_tree();
+
+  num_tests++;
+  passed += test_values();
+
+  printf("Passed %d/%d test cases\n", passed, num_tests);
+  fflush(stdout);
+  return 0;
+}
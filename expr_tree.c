@@ -11,22 +11,155 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <math.h>
+#include <float.h>
+#include <limits.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define ET_HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+// ET_jit emits SysV x86-64 code; elsewhere it falls back to ET_run_vars
+#if defined(__x86_64__) && defined(__linux__) && !defined(ET_NO_JIT)
+#define ET_HAVE_JIT 1
+#endif
 
 #include "expr_tree.h"
 
+#ifdef ET_STATS
+// Counters behind ET_stats_get; relaxed atomics, since evaluation may
+// run on several threads
+static struct
+{
+  atomic_size_t live_nodes;
+  atomic_size_t allocations;
+  atomic_size_t bytes;
+  atomic_size_t evaluations;
+  atomic_size_t ops[ET_NODE_TYPES];
+} stats;
+
+#define STATS_ADD(counter, n) atomic_fetch_add_explicit(&stats.counter, (n), memory_order_relaxed)
+#define STATS_SUB(counter, n) atomic_fetch_sub_explicit(&stats.counter, (n), memory_order_relaxed)
+
+static void *stats_malloc(size_t size)
+{
+  STATS_ADD(allocations, 1);
+  STATS_ADD(bytes, size);
+  return malloc(size);
+}
+
+static void *stats_calloc(size_t n, size_t size)
+{
+  STATS_ADD(allocations, 1);
+  STATS_ADD(bytes, n * size);
+  return calloc(n, size);
+}
+
+static void *stats_realloc(void *ptr, size_t size)
+{
+  STATS_ADD(allocations, 1);
+  STATS_ADD(bytes, size);
+  return realloc(ptr, size);
+}
+
+// every allocation the library makes below this point is counted
+#define malloc(size) stats_malloc(size)
+#define calloc(n, size) stats_calloc(n, size)
+#define realloc(ptr, size) stats_realloc(ptr, size)
+#else
+#define STATS_ADD(counter, n) ((void)0)
+#define STATS_SUB(counter, n) ((void)0)
+#endif
+
 #define LEFT 0
 #define RIGHT 1
 
+// Node flags
+#define ET_FLAG_ARENA 0x01 // node was carved out of an ExprArena
+#define ET_FLAG_SHARED 0x02 // node has had more than one parent, or
+                            // been passed to ET_share, so its parent
+                            // pointer is not kept
+
+// Nodes per arena block when the caller does not specify one
+#define ET_ARENA_DEFAULT_BLOCK 4096
+
+// Rows processed per pass over the program in ET_run_batch
+#define ET_BATCH_BLOCK 256
+
+// Opcodes of a compiled ExprProgram
+enum
+{
+  BC_PUSH,   // push the constant in the next slot
+  BC_LOAD,   // push the variable whose index is in the next slot
+  BC_NEGATE,
+  BC_ADD,
+  BC_SUB,
+  BC_MUL,
+  BC_DIV,
+  BC_POWER,
+  BC_RSUB,   // as BC_SUB, BC_DIV and BC_POWER, but with the left
+  BC_RDIV,   // operand on top of the stack
+  BC_RPOWER,
+  BC_SUM,    // reduce as many entries as the next slot says
+  BC_PRODUCT,
+  BC_FMA,
+  BC_POWI,
+  BC_RPOWI,
+  BC_CALL,   // apply the registered function whose id is in the next slot
+  BC_HALT,
+  BC_COUNT
+};
+
+/*
+ * Return the number of slots an instruction with opcode op takes
+ */
+static inline size_t instr_slots(long op)
+{
+  return op == BC_PUSH || op == BC_LOAD || op == BC_SUM || op == BC_PRODUCT || op == BC_CALL ? 2 : 1;
+}
+
 struct _expr_tree_node
 {
-  ExprNodeType type;
+  unsigned char type;   // an ExprNodeType
+  unsigned char flags;
+  atomic_uint refs;     // references from parents and callers
   union
   {
     struct _expr_tree_node *child[2];
+    struct
+    {
+      struct _expr_tree_node **args; // operands of a list node
+      uint32_t n_args;
+      uint32_t fn;                   // the function of an OP_CALL node
+    } list;
     double value;
+    size_t var;
   } n;
+  struct _expr_tree_node *parent; // NULL for roots and shared nodes
+  double cache;         // last value from ET_evaluate_incremental
+  unsigned int epoch;   // cache is valid while this equals cache_epoch
+  unsigned int depth;   // ET_depth of the subtree rooted here
+  size_t count;         // ET_count of the subtree rooted here
 };
 
+_Static_assert(sizeof(struct _expr_tree_node) <= 64, "a node must fit in a cache line");
+
+// Bumped whenever a change may have reached parents that cannot be
+// found, which invalidates every cached value at once. Never 0, so
+// new nodes start out uncached.
+static atomic_uint cache_epoch = 1;
+
 /*
  * Convert an ExprNodeType into a printable character
  *
@@ -49,88 +182,249 @@ static char ExprNodeType_to_char(ExprNodeType ent)
   case OP_DIV:
     return '/';
   case OP_POWER:
+  case OP_POWI:
     return '^';
+  case OP_SUM:
+    return '+';
+  case OP_PRODUCT:
+    return '*';
   default:
     assert(0);
   }
 }
 
-// Documented in .h file
-ExprTree ET_value(double value)
+/*
+ * Return true if tree is a leaf, i.e. has no children
+ */
+static inline bool is_leaf(ExprTree tree)
 {
-  ExprTree tree = malloc(sizeof(struct _expr_tree_node));
-  assert(tree != NULL);
-  tree->type = VALUE;
-  tree->n.value = value;
-  return tree;
+  return tree->type == VALUE || tree->type == VARIABLE;
 }
 
-// Documented in .h file
-ExprTree ET_node(ExprNodeType op, ExprTree left, ExprTree right)
+/*
+ * Return true if tree keeps its operands in an array (see ET_node_list)
+ * rather than as a left and right child
+ */
+static inline bool is_list(ExprTree tree)
 {
-  ExprTree tree = malloc(sizeof(struct _expr_tree_node));
-  assert(tree != NULL);
-  tree->type = op;
-  tree->n.child[LEFT] = left;
-  tree->n.child[RIGHT] = right;
-  return tree;
+  return tree->type == OP_SUM || tree->type == OP_PRODUCT || tree->type == OP_FMA || tree->type == OP_CALL;
 }
 
-// Documented in .h file
-void ET_free(ExprTree tree)
+/*
+ * Return the children of an interior node: the operands of a list node,
+ * or the left and right child of any other
+ */
+static inline ExprTree *children(ExprTree tree)
 {
-  if (tree == NULL)
-    return;
+  return is_list(tree) ? tree->n.list.args : tree->n.child;
+}
 
-  if (tree->type != VALUE)
-  {
-    ET_free(tree->n.child[LEFT]);
-    ET_free(tree->n.child[RIGHT]);
+/*
+ * Return the number of children of tree: none for a leaf, two for a
+ * node with a left and right child, even UNARY_NEGATE, whose right
+ * child is not an operand
+ */
+static inline size_t n_children(ExprTree tree)
+{
+  if (is_leaf(tree))
+    return 0;
+  return is_list(tree) ? tree->n.list.n_args : 2;
+}
+
+/*
+ * Return the number of children of tree that are evaluated as operands
+ */
+static inline size_t n_operands(ExprTree tree)
+{
+  return tree->type == UNARY_NEGATE ? 1 : n_children(tree);
+}
+
+/*
+ * A function registered for OP_CALL nodes
+ */
+typedef struct
+{
+  char name[ET_FUNCTION_NAME_MAX + 1];
+  size_t arity;
+  ExprScalarFunction scalar;
+  ExprBatchFunction batch;    // NULL to run scalar per row
+  ExprPartialsFunction partials;  // NULL to take central differences
+} FnEntry;
+
+// Define the scalar, batch and derivative kernels of a built-in
+// function that applies the math.h function fn to one operand x, and
+// whose derivative is the expression dfdx
+#define BUILTIN_UNARY(name, fn, dfdx)                                                   \
+  static double builtin_##name(const double *args)                                      \
+  {                                                                                     \
+    return fn(args[0]);                                                                 \
+  }                                                                                     \
+  static void builtin_##name##_batch(const double *const *args, size_t n_rows, double *out) \
+  {                                                                                     \
+    const double *x = args[0];                                                          \
+    for (size_t i = 0; i < n_rows; i++)                                                 \
+      out[i] = fn(x[i]);                                                                \
+  }                                                                                     \
+  static void builtin_##name##_partials(const double *args, double *partials)           \
+  {                                                                                     \
+    double x = args[0];                                                                 \
+    partials[0] = (dfdx);                                                               \
   }
 
-  free(tree);
+// Define the scalar and batch kernels of a built-in function that
+// applies the math.h function fn to two operands
+#define BUILTIN_BINARY(name, fn)                                                        \
+  static double builtin_##name(const double *args)                                      \
+  {                                                                                     \
+    return fn(args[0], args[1]);                                                        \
+  }                                                                                     \
+  static void builtin_##name##_batch(const double *const *args, size_t n_rows, double *out) \
+  {                                                                                     \
+    const double *x = args[0], *y = args[1];                                            \
+    for (size_t i = 0; i < n_rows; i++)                                                 \
+      out[i] = fn(x[i], y[i]);                                                          \
+  }
+
+BUILTIN_UNARY(exp, exp, exp(x))
+BUILTIN_UNARY(log, log, 1 / x)
+BUILTIN_UNARY(sqrt, sqrt, 0.5 / sqrt(x))
+BUILTIN_UNARY(sin, sin, cos(x))
+BUILTIN_UNARY(cos, cos, -sin(x))
+BUILTIN_UNARY(abs, fabs, isnan(x) ? x : (x > 0) - (x < 0))
+BUILTIN_BINARY(min, fmin)
+BUILTIN_BINARY(max, fmax)
+
+// The derivative kernels of min and max: the operand fmin or fmax
+// returns, the first on a tie, has derivative 1 and the other 0
+static void builtin_min_partials(const double *args, double *partials)
+{
+  bool first = isnan(args[1]) || args[0] <= args[1];
+  partials[0] = first;
+  partials[1] = !first;
 }
 
-// Documented in .h file
-int ET_count(ExprTree tree)
+static void builtin_max_partials(const double *args, double *partials)
 {
-  if (tree == NULL)
-    return 0;
+  bool first = isnan(args[1]) || args[0] >= args[1];
+  partials[0] = first;
+  partials[1] = !first;
+}
 
-  if (tree->type == VALUE)
-    return 1;
+// The registry. Entries are filled in under fn_lock before fn_count
+// is raised past them, and never change after that, so lookups take
+// no lock.
+static FnEntry fn_table[ET_MAX_FUNCTIONS] = {
+    [ET_FN_EXP] = {"exp", 1, builtin_exp, builtin_exp_batch, builtin_exp_partials},
+    [ET_FN_LOG] = {"log", 1, builtin_log, builtin_log_batch, builtin_log_partials},
+    [ET_FN_SQRT] = {"sqrt", 1, builtin_sqrt, builtin_sqrt_batch, builtin_sqrt_partials},
+    [ET_FN_SIN] = {"sin", 1, builtin_sin, builtin_sin_batch, builtin_sin_partials},
+    [ET_FN_COS] = {"cos", 1, builtin_cos, builtin_cos_batch, builtin_cos_partials},
+    [ET_FN_ABS] = {"abs", 1, builtin_abs, builtin_abs_batch, builtin_abs_partials},
+    [ET_FN_MIN] = {"min", 2, builtin_min, builtin_min_batch, builtin_min_partials},
+    [ET_FN_MAX] = {"max", 2, builtin_max, builtin_max_batch, builtin_max_partials},
+};
+static atomic_int fn_count = ET_FN_BUILTINS;
+static pthread_mutex_t fn_lock = PTHREAD_MUTEX_INITIALIZER;
 
-  return 1 + ET_count(tree->n.child[LEFT]) + ET_count(tree->n.child[RIGHT]);
+/*
+ * Return the registry entry of an OP_CALL node's function
+ */
+static inline const FnEntry *call_entry(ExprTree tree)
+{
+  return &fn_table[tree->n.list.fn];
 }
 
-// Documented in .h file
-int ET_depth(ExprTree tree)
+/*
+ * Return true if name[0..len) can name a function: a letter or '_',
+ * then letters, digits and '_'
+ */
+static bool fn_name_valid(const char *name, size_t len)
 {
-  if (tree == NULL)
-    return 0;
+  if (len == 0 || len > ET_FUNCTION_NAME_MAX || !(isalpha((unsigned char)name[0]) || name[0] == '_'))
+    return false;
+  for (size_t i = 1; i < len; i++)
+    if (!(isalnum((unsigned char)name[i]) || name[i] == '_'))
+      return false;
+  return true;
+}
 
-  if (tree->type == VALUE)
-    return 1;
+// Documented in .h file
+int ET_find_fn(const char *name, size_t len)
+{
+  int n = atomic_load_explicit(&fn_count, memory_order_acquire);
 
-  int left = ET_depth(tree->n.child[LEFT]);
-  int right = ET_depth(tree->n.child[RIGHT]);
+  for (int fn = 0; fn < n; fn++)
+    if (len <= ET_FUNCTION_NAME_MAX && strncmp(fn_table[fn].name, name, len) == 0 && fn_table[fn].name[len] == '\0')
+      return fn;
+  return -1;
+}
 
-  return 1 + (left > right ? left : right);
+// Documented in .h file
+const char *ET_fn_name(int fn)
+{
+  if (fn < 0 || fn >= atomic_load_explicit(&fn_count, memory_order_acquire))
+    return NULL;
+  return fn_table[fn].name;
 }
 
 // Documented in .h file
-double ET_evaluate(ExprTree tree)
+int ET_register_fn(const char *name, size_t arity, ExprScalarFunction scalar_fn, ExprBatchFunction batch_fn,
+                   ExprPartialsFunction partials_fn)
 {
-  if (tree == NULL)
-    return 0;
+  if (name == NULL || !fn_name_valid(name, strlen(name)) || arity < 1 || arity > ET_MAX_ARITY || scalar_fn == NULL)
+    return -1;
 
-  if (tree->type == VALUE)
-    return tree->n.value;
+  pthread_mutex_lock(&fn_lock);
+  int fn = atomic_load_explicit(&fn_count, memory_order_relaxed);
+  if (fn == ET_MAX_FUNCTIONS || ET_find_fn(name, strlen(name)) >= 0)
+    fn = -1;
+  else
+  {
+    strcpy(fn_table[fn].name, name);
+    fn_table[fn].arity = arity;
+    fn_table[fn].scalar = scalar_fn;
+    fn_table[fn].batch = batch_fn;
+    fn_table[fn].partials = partials_fn;
+    atomic_store_explicit(&fn_count, fn + 1, memory_order_release);
+  }
+  pthread_mutex_unlock(&fn_lock);
+  return fn;
+}
 
-  double left = ET_evaluate(tree->n.child[LEFT]);
-  double right = ET_evaluate(tree->n.child[RIGHT]);
+/*
+ * Raise x to the power y, by repeated squaring when y is an integer of
+ * at most ET_POWI_MAX in magnitude and with pow() otherwise. Agrees
+ * with pow() on zeros, infinities and NaN.
+ */
+static inline double power_int(double x, double y)
+{
+  if (!(fabs(y) <= ET_POWI_MAX) || y != (int)y)
+    return pow(x, y);
 
-  switch (tree->type)
+  double result = 1, base = x;
+  for (int k = (int)fabs(y); k > 0; k >>= 1)
+  {
+    if (k & 1)
+      result *= base;
+    base *= base;
+  }
+  return y < 0 ? 1 / result : result;
+}
+
+/*
+ * Apply a binary or unary operator to already computed operands, with
+ * the semantics ET_evaluate gives each ExprNodeType
+ *
+ * Parameters:
+ *   op       The operator
+ *   left     Value of the left operand
+ *   right    Value of the right operand (ignored for UNARY_NEGATE)
+ *
+ * Returns: The result of the operation
+ */
+static inline double apply_op(ExprNodeType op, double left, double right)
+{
+  switch (op)
   {
   case OP_ADD:
     return left + right;
@@ -142,6 +436,8 @@ double ET_evaluate(ExprTree tree)
     return left / right;
   case OP_POWER:
     return pow(left, right);
+  case OP_POWI:
+    return power_int(left, right);
   case UNARY_NEGATE:
     return -left;
   default:
@@ -149,63 +445,6964 @@ double ET_evaluate(ExprTree tree)
   }
 }
 
-// Documented in .h file
-size_t ET_tree2string(ExprTree tree, char *buf, size_t buf_sz)
+/*
+ * Reduce the operands of an OP_SUM or OP_PRODUCT node pairwise, in the
+ * order ET_node_list documents. Each pass combines two contiguous
+ * halves element by element, which the compiler can vectorize.
+ *
+ * Parameters:
+ *   op       OP_SUM or OP_PRODUCT
+ *   vals     The operand values, overwritten with partial results
+ *   n        Number of operands, at least 1
+ *
+ * Returns: The sum or product
+ */
+static double reduce_list(ExprNodeType op, double *vals, size_t n)
 {
-  if (tree == NULL || buf == NULL || buf_sz == 0)
-    return 0;
+  while (n > 1)
+  {
+    size_t half = (n + 1) / 2;
 
-  size_t length = 0;
-  char leftBuffer[buf_sz];
-  char rightBuffer[buf_sz];
+    if (op == OP_SUM)
+      for (size_t i = 0; i + half < n; i++)
+        vals[i] += vals[i + half];
+    else
+      for (size_t i = 0; i + half < n; i++)
+        vals[i] *= vals[i + half];
+    n = half;
+  }
 
-  // write to buffer if it is a value
-  if (tree->type == VALUE)
-    length = snprintf(buf, buf_sz, "%g", tree->n.value);
+  return vals[0];
+}
+
+/*
+ * Apply an operator to its already computed operands, with the
+ * semantics ET_evaluate gives its ExprNodeType
+ *
+ * Parameters:
+ *   op       The operator
+ *   vals     Values of its operands, which list operators overwrite
+ *   n_vals   The number of operands
+ *
+ * Returns: The result of the operation
+ */
+static inline double apply_args(ExprNodeType op, double *vals, size_t n_vals)
+{
+  switch (op)
+  {
+  case UNARY_NEGATE:
+    return -vals[0];
+  case OP_SUM:
+  case OP_PRODUCT:
+    return reduce_list(op, vals, n_vals);
+  case OP_FMA:
+    return fma(vals[0], vals[1], vals[2]);
+  default:
+    return apply_op(op, vals[0], vals[1]);
+  }
+}
+
+/*
+ * Apply an interior node to the values of its n_operands(tree)
+ * operands; see apply_args
+ */
+static inline double apply_node(ExprTree tree, double *vals)
+{
+  if (tree->type == OP_CALL)
+    return call_entry(tree)->scalar(vals);
+  return apply_args(tree->type, vals, is_list(tree) ? tree->n.list.n_args : 0);
+}
+
+/*
+ * An entry of a WalkStack: a node plus per-node traversal state, such
+ * as its depth or which of its children is being visited
+ */
+typedef struct
+{
+  ExprTree node;
+  size_t aux;
+} WalkEntry;
+
+// Entries a WalkStack or value stack holds on the C stack before it
+// moves to the heap
+#define WALK_INLINE_STACK 64
+
+/*
+ * Double the capacity of a stack that may start out in an inline
+ * array, moving it to the heap
+ */
+static void *stack_grow(void *items, const void *inline_items, size_t *cap, size_t item_sz)
+{
+  void *bigger;
+
+  if (items == inline_items)
+  {
+    bigger = malloc(2 * *cap * item_sz);
+    assert(bigger != NULL);
+    memcpy(bigger, items, *cap * item_sz);
+  }
   else
   {
-    // process the left child
-    size_t leftLength = ET_tree2string(tree->n.child[LEFT], leftBuffer, buf_sz);
+    bigger = realloc(items, 2 * *cap * item_sz);
+    assert(bigger != NULL);
+  }
 
-    // print to the buffer if unary negate
-    if (tree->type == UNARY_NEGATE)
-      length = snprintf(buf, buf_sz, "(-%s)", leftBuffer);
+  *cap *= 2;
+  return bigger;
+}
 
-    else
-    {
-      // process the right child
-      size_t rightLength = ET_tree2string(tree->n.child[RIGHT], rightBuffer, buf_sz);
+/*
+ * A growable stack for walking trees without recursion, so that tree
+ * depth is limited only by memory. It lives on the heap, or starts out
+ * in an inline array (see walk_init_inline) so that walking a small
+ * tree does not touch the heap.
+ */
+typedef struct
+{
+  WalkEntry *items;
+  size_t top;
+  size_t cap;
+  WalkEntry *inline_items;  // the initial array, or NULL
+} WalkStack;
 
-      // print to the buffer both children
-      if (tree->n.child[LEFT]->type != VALUE)
-      {
-        char tempBuffer[buf_sz];
-        snprintf(tempBuffer, buf_sz, "%s", leftBuffer);
-        strcpy(leftBuffer, tempBuffer);
-        leftLength += 2;
-      }
+static void walk_init(WalkStack *s)
+{
+  s->top = 0;
+  s->cap = 64;
+  s->items = malloc(s->cap * sizeof(WalkEntry));
+  assert(s->items != NULL);
+  s->inline_items = NULL;
+}
 
-      if (tree->n.child[RIGHT]->type != VALUE)
-      {
-        char tempBuffer[buf_sz];
-        snprintf(tempBuffer, buf_sz, "%s", rightBuffer);
-        strcpy(rightBuffer, tempBuffer);
-        rightLength += 2;
-      }
+/*
+ * Start s out in the caller's array of n entries, which must outlive it
+ */
+static void walk_init_inline(WalkStack *s, WalkEntry *inline_items, size_t n)
+{
+  s->top = 0;
+  s->cap = n;
+  s->items = s->inline_items = inline_items;
+}
 
-      // finally print to the buffer the whole expression
-      length = snprintf(buf, buf_sz, "(%s %c %s)", leftBuffer, ExprNodeType_to_char(tree->type), rightBuffer);
-    }
+static void walk_push(WalkStack *s, ExprTree node, size_t aux)
+{
+  if (s->top == s->cap)
+    s->items = stack_grow(s->items, s->inline_items, &s->cap, sizeof(WalkEntry));
+  s->items[s->top++] = (WalkEntry){node, aux};
+}
+
+static void walk_free(WalkStack *s)
+{
+  if (s->items != s->inline_items)
+    free(s->items);
+}
+
+/*
+ * Allocate a heap node with a single reference
+ *
+ * Parameters:
+ *   type     The node's ExprNodeType
+ *
+ * Returns: The new node; its payload is left for the caller to fill
+ */
+static ExprTree node_alloc(ExprNodeType type)
+{
+  ExprTree tree = malloc(sizeof(struct _expr_tree_node));
+  assert(tree != NULL);
+  STATS_ADD(live_nodes, 1);
+  tree->type = type;
+  tree->flags = 0;
+  tree->refs = 1;
+  tree->parent = NULL;
+  tree->epoch = 0;
+  tree->depth = 1;
+  tree->count = 1;
+  return tree;
+}
+
+/*
+ * Recompute the cached count and depth of tree from those of its
+ * children. The count saturates at SIZE_MAX, which a DAG of shared
+ * nodes that doubles at every level reaches in 64 levels.
+ */
+static inline void update_size(ExprTree tree)
+{
+  size_t count = 1;
+  unsigned int depth = 0;
+
+  for (size_t i = 0; i < n_children(tree); i++)
+  {
+    ExprTree child = children(tree)[i];
+    if (child == NULL)
+      continue;
+    count = child->count > SIZE_MAX - count ? SIZE_MAX : count + child->count;
+    if (child->depth > depth)
+      depth = child->depth;
   }
 
-  // truncate the string if it is too long for the buffer
-  if (length >= buf_sz)
+  tree->count = count;
+  tree->depth = depth + 1;
+}
+
+/*
+ * Record that parent now refers to child. A node with a second parent
+ * is flagged as shared and stops tracking its parent. Shared nodes are
+ * not written to, so trees on several threads can link the same one.
+ */
+static inline void link_child(ExprTree parent, ExprTree child)
+{
+  if (child == NULL || (child->flags & ET_FLAG_SHARED) || child->parent == parent)
+    return;
+
+  if (child->parent == NULL && !(child->flags & ET_FLAG_SHARED))
+    child->parent = parent;
+  else
   {
-    buf[buf_sz - 2] = '$';
-    buf[buf_sz - 1] = '\0';
-    return buf_sz - 1;
+    child->flags |= ET_FLAG_SHARED;
+    child->parent = NULL;
   }
+}
+
+/*
+ * Forget the parent of a node that is losing it. Shared nodes have no
+ * parent pointer to forget.
+ */
+static inline void orphan(ExprTree child)
+{
+  if (child != NULL && !(child->flags & ET_FLAG_SHARED))
+    child->parent = NULL;
+}
 
-  buf[length] = '\0';
-  return length;
-}
\ No newline at end of file
+/*
+ * Scramble the bits of x (the MurmurHash3 finalizer)
+ */
+static inline uint64_t hash_u64(uint64_t x)
+{
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+/*
+ * Combine the hash h with the value v
+ */
+static inline uint64_t hash_combine(uint64_t h, uint64_t v)
+{
+  return hash_u64(h ^ (v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2)));
+}
+
+/*
+ * Return the bit pattern of a double
+ */
+static inline uint64_t double_bits(double d)
+{
+  uint64_t bits;
+  memcpy(&bits, &d, sizeof(bits));
+  return bits;
+}
+
+/*
+ * An entry of a NodeMap: a node and a value computed for it
+ */
+typedef struct
+{
+  ExprTree key;
+  union
+  {
+    double d;
+    uint64_t u;
+  } val;
+} NodeMapEntry;
+
+/*
+ * An open-addressing hash map keyed by node address. Used to visit each
+ * shared node of a DAG once; it allocates nothing until first insert.
+ */
+typedef struct
+{
+  NodeMapEntry *entries;
+  size_t cap;    // zero or a power of two
+  size_t used;
+} NodeMap;
+
+static void map_init(NodeMap *m)
+{
+  m->entries = NULL;
+  m->cap = 0;
+  m->used = 0;
+}
+
+static void map_free(NodeMap *m)
+{
+  free(m->entries);
+}
+
+/*
+ * Return the entry for key, or NULL if there is none
+ */
+static NodeMapEntry *map_find(const NodeMap *m, ExprTree key)
+{
+  if (m->cap == 0)
+    return NULL;
+
+  for (size_t i = hash_u64((uintptr_t)key) & (m->cap - 1);; i = (i + 1) & (m->cap - 1))
+  {
+    if (m->entries[i].key == key)
+      return &m->entries[i];
+    if (m->entries[i].key == NULL)
+      return NULL;
+  }
+}
+
+/*
+ * Return the entry for key, adding it if there is none yet
+ */
+static NodeMapEntry *map_insert(NodeMap *m, ExprTree key)
+{
+  if (2 * (m->used + 1) > m->cap)
+  {
+    NodeMap bigger = {NULL, m->cap == 0 ? 64 : 2 * m->cap, 0};
+    bigger.entries = calloc(bigger.cap, sizeof(NodeMapEntry));
+    assert(bigger.entries != NULL);
+    for (size_t i = 0; i < m->cap; i++)
+      if (m->entries[i].key != NULL)
+        *map_insert(&bigger, m->entries[i].key) = m->entries[i];
+    free(m->entries);
+    *m = bigger;
+  }
+
+  size_t i = hash_u64((uintptr_t)key) & (m->cap - 1);
+  while (m->entries[i].key != NULL && m->entries[i].key != key)
+    i = (i + 1) & (m->cap - 1);
+
+  if (m->entries[i].key == NULL)
+  {
+    m->entries[i].key = key;
+    m->used++;
+  }
+  return &m->entries[i];
+}
+
+// Documented in .h file
+ExprTree ET_value(double value)
+{
+  ExprTree tree = node_alloc(VALUE);
+  tree->n.value = value;
+  return tree;
+}
+
+// Documented in .h file
+ExprTree ET_var(size_t index)
+{
+  ExprTree tree = node_alloc(VARIABLE);
+  tree->n.var = index;
+  return tree;
+}
+
+// Documented in .h file
+ExprTree ET_node(ExprNodeType op, ExprTree left, ExprTree right)
+{
+  assert(op != OP_SUM && op != OP_PRODUCT && op != OP_FMA && op != OP_CALL);
+
+  ExprTree tree = node_alloc(op);
+  tree->n.child[LEFT] = left;
+  tree->n.child[RIGHT] = right;
+  link_child(tree, left);
+  link_child(tree, right);
+  update_size(tree);
+  return tree;
+}
+
+/*
+ * Fill in the operands of a list node whose args array is allocated
+ */
+static void list_init(ExprTree tree, ExprTree *args, size_t n_args)
+{
+  assert(n_args >= 1 && (tree->type != OP_FMA || n_args == 3));
+  assert(tree->type != OP_CALL || n_args == call_entry(tree)->arity);
+
+  tree->n.list.n_args = n_args;
+  for (size_t i = 0; i < n_args; i++)
+  {
+    assert(args[i] != NULL);
+    tree->n.list.args[i] = args[i];
+    link_child(tree, args[i]);
+  }
+  update_size(tree);
+}
+
+// Documented in .h file
+ExprTree ET_node_list(ExprNodeType op, ExprTree *args, size_t n_args)
+{
+  ExprTree tree = node_alloc(op);
+  assert(is_list(tree) && op != OP_CALL);
+
+  tree->n.list.args = malloc(n_args * sizeof(ExprTree));
+  assert(tree->n.list.args != NULL);
+  list_init(tree, args, n_args);
+  return tree;
+}
+
+// Documented in .h file
+ExprTree ET_call(int fn, ExprTree *args, size_t n_args)
+{
+  assert(ET_fn_name(fn) != NULL);
+
+  ExprTree tree = node_alloc(OP_CALL);
+  tree->n.list.fn = fn;
+  tree->n.list.args = malloc(n_args * sizeof(ExprTree));
+  assert(tree->n.list.args != NULL);
+  list_init(tree, args, n_args);
+  return tree;
+}
+
+/*
+ * Free a heap node whose last reference is gone, but not its children
+ */
+static inline void node_release(ExprTree tree)
+{
+  STATS_SUB(live_nodes, 1);
+  if (is_list(tree))
+    free(tree->n.list.args);
+  free(tree);
+}
+
+/*
+ * Drop one reference to a heap node
+ *
+ * Returns: true if it was the last, so that the caller now owns tree
+ *   outright and must release it
+ */
+static inline bool ref_drop(ExprTree tree)
+{
+  // a sole reference cannot gain company: only its holder could share
+  // it, so the atomic update is only needed when there are others
+  if (atomic_load_explicit(&tree->refs, memory_order_acquire) == 1)
+    return true;
+  if (atomic_fetch_sub_explicit(&tree->refs, 1, memory_order_acq_rel) != 1)
+    return false;
+  atomic_store_explicit(&tree->refs, 1, memory_order_relaxed);
+  return true;
+}
+
+/*
+ * Drop one reference to a single node, freeing it (but not its
+ * children) when that was the last one. Arena nodes are left to their
+ * arena.
+ */
+static inline void free_node(ExprTree tree)
+{
+  if (!(tree->flags & ET_FLAG_ARENA) && ref_drop(tree))
+    node_release(tree);
+}
+
+/*
+ * Drop the caller's reference to tree for ET_free
+ *
+ * Returns: true if ET_free now owns tree and should free it, and its
+ *   children; false if it belongs to an arena or to someone else
+ */
+static inline bool free_claim(ExprTree tree)
+{
+  return !(tree->flags & ET_FLAG_ARENA) && ref_drop(tree);
+}
+
+/*
+ * Make a heap node with the same type, value and children as tree,
+ * taking a reference to each child. The children keep their parent:
+ * link_children records the copy as a second one.
+ */
+static ExprTree node_copy(ExprTree tree)
+{
+  ExprTree copy = node_alloc(tree->type);
+
+  copy->n = tree->n;
+  if (is_list(tree))
+  {
+    copy->n.list.args = malloc(tree->n.list.n_args * sizeof(ExprTree));
+    assert(copy->n.list.args != NULL);
+    memcpy(copy->n.list.args, tree->n.list.args, tree->n.list.n_args * sizeof(ExprTree));
+  }
+
+  for (size_t i = 0; i < n_children(tree); i++)
+    if (children(tree)[i] != NULL)
+      atomic_fetch_add_explicit(&children(tree)[i]->refs, 1, memory_order_relaxed);
+  copy->depth = tree->depth;
+  copy->count = tree->count;
+  return copy;
+}
+
+/*
+ * Record tree as a parent of each of its children
+ */
+static void link_children(ExprTree tree)
+{
+  for (size_t i = 0; i < n_children(tree); i++)
+    link_child(tree, children(tree)[i]);
+}
+
+/*
+ * Free a node_copy that was never linked, returning the references it
+ * took, none of which can be the last
+ */
+static void node_discard(ExprTree copy)
+{
+  for (size_t i = 0; i < n_children(copy); i++)
+    if (children(copy)[i] != NULL)
+      atomic_fetch_sub_explicit(&children(copy)[i]->refs, 1, memory_order_relaxed);
+  node_release(copy);
+}
+
+// Documented in .h file
+void ET_free(ExprTree tree)
+{
+  // Rotate left children up into a right-linked chain, freeing each
+  // node once it has no left child left. This needs no stack at all
+  // unless the tree has list nodes, which have no right child to chain
+  // through: their operands wait on a stack to be freed in turn. Arena
+  // nodes (and everything below them) belong to their arena, and shared
+  // nodes only lose a reference.
+  WalkStack lists = {NULL, 0, 0, NULL};
+  bool root = true;
+
+  for (;;)
+  {
+    while (tree != NULL)
+    {
+      // a surviving child must not point back at its freed parent; it
+      // can only be forgotten while this reference still holds it
+      if (!root)
+        orphan(tree);
+      if (!free_claim(tree))
+        break;
+      root = false;
+
+      if (is_leaf(tree))
+      {
+        node_release(tree);
+        break;
+      }
+
+      // list nodes are never rotated, so nothing is chained after one
+      if (is_list(tree))
+      {
+        if (lists.items == NULL)
+          walk_init(&lists);
+        for (size_t i = 0; i < tree->n.list.n_args; i++)
+          walk_push(&lists, tree->n.list.args[i], 0);
+        node_release(tree);
+        break;
+      }
+
+      ExprTree left = tree->n.child[LEFT];
+
+      if (left == NULL)
+      {
+        ExprTree right = tree->n.child[RIGHT];
+        node_release(tree);
+        tree = right;
+        continue;
+      }
+
+      // a claimed left child stays claimed, so whichever way it goes on
+      // from here, claiming it again is a no-op
+      orphan(left);
+      if (!free_claim(left))
+        tree->n.child[LEFT] = NULL;
+      else if (is_leaf(left))
+      {
+        node_release(left);
+        tree->n.child[LEFT] = NULL;
+      }
+      else if (is_list(left))
+      {
+        if (lists.items == NULL)
+          walk_init(&lists);
+        walk_push(&lists, left, 0);
+        tree->n.child[LEFT] = NULL;
+      }
+      else
+      {
+        tree->n.child[LEFT] = left->n.child[RIGHT];
+        left->n.child[RIGHT] = tree;
+        tree = left;
+      }
+    }
+
+    if (lists.top == 0)
+      break;
+    tree = lists.items[--lists.top].node;
+  }
+
+  if (lists.items != NULL)
+    walk_free(&lists);
+}
+
+// Documented in .h file
+ExprTree ET_share(ExprTree tree)
+{
+  if (tree == NULL)
+    return NULL;
+
+  // the new holder may link tree under a parent of its own, so its
+  // parent pointer can no longer be trusted
+  if (!(tree->flags & ET_FLAG_SHARED))
+  {
+    tree->flags |= ET_FLAG_SHARED;
+    tree->parent = NULL;
+  }
+  atomic_fetch_add_explicit(&tree->refs, 1, memory_order_relaxed);
+  return tree;
+}
+
+// Documented in .h file
+ExprTree ET_clone(ExprTree tree)
+{
+  if (tree == NULL)
+    return NULL;
+
+  ExprTree copy = node_copy(tree);
+  link_children(copy);
+  return copy;
+}
+
+#ifdef ET_CHECK_SIZES
+// ET_count and ET_depth only cross-check trees up to this size, since
+// a DAG of shared nodes can count far more nodes than a walk can visit
+#define ET_CHECK_COUNT_MAX (1 << 24)
+
+/*
+ * Count the nodes of tree by walking it; ET_count's cross-check
+ */
+static size_t count_walk(ExprTree tree)
+{
+  if (tree == NULL)
+    return 0;
+
+  WalkStack stack;
+  walk_init(&stack);
+  walk_push(&stack, tree, 0);
+  size_t count = 0;
+
+  while (stack.top > 0)
+  {
+    ExprTree t = stack.items[--stack.top].node;
+    count++;
+
+    for (size_t i = n_children(t); i-- > 0;)
+      if (children(t)[i] != NULL)
+        walk_push(&stack, children(t)[i], 0);
+  }
+
+  walk_free(&stack);
+  return count;
+}
+
+/*
+ * Measure the depth of tree by walking it; ET_depth's cross-check
+ */
+static size_t depth_walk(ExprTree tree)
+{
+  if (tree == NULL)
+    return 0;
+
+  WalkStack stack;
+  walk_init(&stack);
+  walk_push(&stack, tree, 1);
+  size_t depth = 0;
+
+  while (stack.top > 0)
+  {
+    WalkEntry e = stack.items[--stack.top];
+
+    if (e.aux > depth)
+      depth = e.aux;
+
+    for (size_t i = n_children(e.node); i-- > 0;)
+      if (children(e.node)[i] != NULL)
+        walk_push(&stack, children(e.node)[i], e.aux + 1);
+  }
+
+  walk_free(&stack);
+  return depth;
+}
+
+#endif /* ET_CHECK_SIZES */
+
+// Documented in .h file
+int ET_count(ExprTree tree)
+{
+  if (tree == NULL)
+    return 0;
+
+#ifdef ET_CHECK_SIZES
+  assert(tree->count > ET_CHECK_COUNT_MAX || tree->count == count_walk(tree));
+#endif
+  return tree->count > INT_MAX ? INT_MAX : (int)tree->count;
+}
+
+// Documented in .h file
+int ET_depth(ExprTree tree)
+{
+  if (tree == NULL)
+    return 0;
+
+#ifdef ET_CHECK_SIZES
+  assert(tree->count > ET_CHECK_COUNT_MAX || tree->depth == depth_walk(tree));
+#endif
+  return tree->depth;
+}
+
+// Documented in .h file
+double ET_evaluate(ExprTree tree)
+{
+  return ET_evaluate_vars(tree, NULL);
+}
+
+/*
+ * Evaluate a tree of at most WALK_INLINE_STACK nodes by recursion, as
+ * evaluate_tree does. Its count bounds both the depth of the recursion
+ * and the nodes visited, shared ones included, so it needs no memo.
+ * That holds only because counts saturate rather than wrap (see
+ * update_size): a small count is never a huge DAG's wrapped one.
+ */
+static double evaluate_small(ExprTree tree, const double *vars)
+{
+  // a missing operand evaluates to 0
+  if (tree == NULL)
+    return 0;
+
+  STATS_ADD(ops[tree->type], 1);
+  if (tree->type == VALUE)
+    return tree->n.value;
+  if (tree->type == VARIABLE)
+    return vars == NULL ? NAN : vars[tree->n.var];
+
+  if (!is_list(tree))
+  {
+    double left = evaluate_small(tree->n.child[LEFT], vars);
+    if (tree->type == UNARY_NEGATE)
+      return -left;
+    return apply_op(tree->type, left, evaluate_small(tree->n.child[RIGHT], vars));
+  }
+
+  double vals[WALK_INLINE_STACK];
+  for (size_t i = 0; i < tree->n.list.n_args; i++)
+    vals[i] = evaluate_small(tree->n.list.args[i], vars);
+  return apply_node(tree, vals);
+}
+
+/*
+ * Evaluate tree as ET_evaluate_vars does, without counting an
+ * evaluation in the stats
+ */
+static double evaluate_tree(ExprTree tree, const double *vars)
+{
+  // a saturated count is at least SIZE_MAX, so it never takes this path
+  if (tree == NULL || tree->count <= WALK_INLINE_STACK)
+    return evaluate_small(tree, vars);
+
+  // the path from the root to the current node; aux says which child
+  // of each node on it is being evaluated
+  WalkEntry path_inline[WALK_INLINE_STACK];
+  WalkStack path;
+  walk_init_inline(&path, path_inline, WALK_INLINE_STACK);
+
+  // operands computed so far, in postorder
+  double vals_inline[WALK_INLINE_STACK];
+  size_t n_vals = 0, vals_cap = WALK_INLINE_STACK;
+  double *vals = vals_inline;
+
+  // values of shared interior nodes, so a DAG computes each one once
+  NodeMap memo;
+  map_init(&memo);
+  NodeMapEntry *hit = NULL;
+
+  ExprTree t = tree;
+  for (;;)
+  {
+    while (t != NULL && !is_leaf(t))
+    {
+      if (t->refs > 1 && (hit = map_find(&memo, t)) != NULL)
+        break;
+      walk_push(&path, t, LEFT);
+      t = children(t)[0];
+    }
+
+    // a missing operand evaluates to 0
+    if (n_vals == vals_cap)
+      vals = stack_grow(vals, vals_inline, &vals_cap, sizeof(double));
+    if (t == NULL)
+      vals[n_vals++] = 0;
+    else if (t->type == VALUE)
+      vals[n_vals++] = t->n.value;
+    else if (t->type == VARIABLE)
+      vals[n_vals++] = vars == NULL ? NAN : vars[t->n.var];
+    else
+      vals[n_vals++] = hit->val.d;
+    if (t != NULL && is_leaf(t))
+      STATS_ADD(ops[t->type], 1);
+
+    // climb while the node on top of the path has all its operands
+    t = NULL;
+    while (path.top > 0)
+    {
+      WalkEntry *e = &path.items[path.top - 1];
+
+      if (e->aux + 1 < n_operands(e->node))
+      {
+        t = children(e->node)[++e->aux];
+        break;
+      }
+
+      size_t k = n_operands(e->node);
+      vals[n_vals - k] = apply_node(e->node, vals + n_vals - k);
+      n_vals -= k - 1;
+      STATS_ADD(ops[e->node->type], 1);
+      if (e->node->refs > 1)
+        map_insert(&memo, e->node)->val.d = vals[n_vals - 1];
+      path.top--;
+    }
+
+    if (path.top == 0)
+      break;
+  }
+
+  double result = vals[0];
+  map_free(&memo);
+  if (vals != vals_inline)
+    free(vals);
+  walk_free(&path);
+  return result;
+}
+
+// Documented in .h file
+double ET_evaluate_vars(ExprTree tree, const double *vars)
+{
+  STATS_ADD(evaluations, 1);
+  return evaluate_tree(tree, vars);
+}
+
+// Subtrees with at least this many nodes are split across threads
+#define ET_PARALLEL_CUTOFF 16384
+
+// How many tasks ET_evaluate_parallel aims to create per thread
+#define ET_PARALLEL_TASKS_PER_THREAD 8
+
+/*
+ * A node that ET_evaluate_parallel either evaluates as one sequential
+ * task or splits, combining its operands' slots once they are known
+ */
+typedef struct
+{
+  ExprTree node;
+  size_t left;    // slots of the operands of a split node
+  size_t right;
+  bool split;
+} ParallelSlot;
+
+/*
+ * One worker's share of the tasks. The owner takes from the front and
+ * idle workers steal from the back.
+ */
+typedef struct
+{
+  pthread_mutex_t lock;
+  size_t *tasks;     // slot indices
+  size_t head, tail;
+} ParallelDeque;
+
+typedef struct
+{
+  ParallelSlot *slots;
+  double *values;    // one per slot
+  ParallelDeque *deques;
+  int n_workers;
+} ParallelJob;
+
+typedef struct
+{
+  ParallelJob *job;
+  int id;
+} ParallelWorker;
+
+/*
+ * Take the next task for worker id: from the front of its own deque,
+ * otherwise from the back of another worker's
+ *
+ * Returns: true and the task's slot in *slot, or false when no task is
+ * left anywhere
+ */
+static bool parallel_take(ParallelJob *job, int id, size_t *slot)
+{
+  for (int i = 0; i < job->n_workers; i++)
+  {
+    ParallelDeque *d = &job->deques[(id + i) % job->n_workers];
+    bool found = false;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->head < d->tail)
+    {
+      *slot = i == 0 ? d->tasks[d->head++] : d->tasks[--d->tail];
+      found = true;
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    if (found)
+      return true;
+  }
+  return false;
+}
+
+/*
+ * Thread body of ET_evaluate_parallel: evaluate tasks until there are
+ * none left
+ */
+static void *parallel_worker(void *arg)
+{
+  ParallelWorker *w = arg;
+  ParallelJob *job = w->job;
+  size_t slot;
+
+  while (parallel_take(job, w->id, &slot))
+    job->values[slot] = evaluate_tree(job->slots[slot].node, NULL);
+
+  return NULL;
+}
+
+// Documented in .h file
+double ET_evaluate_parallel(ExprTree tree, int n_threads)
+{
+  if (n_threads <= 0)
+    n_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (n_threads <= 1 || tree == NULL || tree->count < ET_PARALLEL_CUTOFF)
+    return ET_evaluate(tree);
+  STATS_ADD(evaluations, 1);
+
+  // Split breadth-first from the root so the tasks come out of similar
+  // sizes on balanced trees. Every slot's operands get higher indices
+  // than the slot itself, so combining in reverse order is a postorder.
+  size_t max_split = (size_t)n_threads * ET_PARALLEL_TASKS_PER_THREAD;
+  size_t n_slots = 1, n_split = 0, n_tasks = 0, slots_cap = 64;
+  ParallelSlot *slots = malloc(slots_cap * sizeof(ParallelSlot));
+  assert(slots != NULL);
+  slots[0].node = tree;
+
+  for (size_t i = 0; i < n_slots; i++)
+  {
+    ExprTree t = slots[i].node;
+    // list nodes are left whole, to be reduced in one task
+    slots[i].split = t != NULL && !is_leaf(t) && !is_list(t) && n_split < max_split &&
+                     t->count >= ET_PARALLEL_CUTOFF;
+    if (!slots[i].split)
+    {
+      n_tasks += t != NULL && !is_leaf(t);
+      continue;
+    }
+
+    n_split++;
+    if (n_slots + 2 > slots_cap)
+    {
+      slots_cap *= 2;
+      slots = realloc(slots, slots_cap * sizeof(ParallelSlot));
+      assert(slots != NULL);
+    }
+    slots[i].left = n_slots;
+    slots[n_slots++].node = t->n.child[LEFT];
+    slots[i].right = n_slots;
+    slots[n_slots++].node = t->type == UNARY_NEGATE ? NULL : t->n.child[RIGHT];
+  }
+
+  // deal the interior subtrees out round-robin; leaves and missing
+  // operands are resolved by the caller when combining
+  double *values = malloc(n_slots * sizeof(double));
+  size_t per = (n_tasks + n_threads - 1) / n_threads, dealt = 0;
+  size_t *tasks = malloc((per * n_threads + 1) * sizeof(size_t));
+  ParallelDeque *deques = malloc(n_threads * sizeof(ParallelDeque));
+  ParallelWorker *workers = malloc(n_threads * sizeof(ParallelWorker));
+  pthread_t *threads = malloc(n_threads * sizeof(pthread_t));
+  assert(values != NULL && tasks != NULL && deques != NULL && workers != NULL && threads != NULL);
+
+  for (int w = 0; w < n_threads; w++)
+  {
+    pthread_mutex_init(&deques[w].lock, NULL);
+    deques[w].tasks = tasks + per * w;
+    deques[w].head = deques[w].tail = 0;
+  }
+  for (size_t i = 0; i < n_slots; i++)
+  {
+    ExprTree t = slots[i].node;
+    if (!slots[i].split && t != NULL && !is_leaf(t))
+    {
+      ParallelDeque *d = &deques[dealt++ % n_threads];
+      d->tasks[d->tail++] = i;
+    }
+  }
+
+  ParallelJob job = {slots, values, deques, n_threads};
+  int n_started = 0;
+  for (int w = 0; w < n_threads; w++)
+  {
+    workers[w].job = &job;
+    workers[w].id = w;
+  }
+  for (int w = 1; w < n_threads; w++)
+    if (pthread_create(&threads[w], NULL, parallel_worker, &workers[w]) == 0)
+      n_started = w;
+    else
+      break;
+
+  // the calling thread works too, and whatever threads failed to start
+  // have their tasks stolen
+  parallel_worker(&workers[0]);
+  for (int w = 1; w <= n_started; w++)
+    pthread_join(threads[w], NULL);
+
+  for (size_t i = n_slots; i-- > 0;)
+  {
+    ExprTree t = slots[i].node;
+    if (slots[i].split)
+      values[i] = apply_op(t->type, values[slots[i].left], values[slots[i].right]);
+    else if (t == NULL)
+      values[i] = 0;
+    else if (t->type == VALUE)
+      values[i] = t->n.value;
+    else if (t->type == VARIABLE)
+      values[i] = NAN;
+  }
+
+  double result = values[0];
+  for (int w = 0; w < n_threads; w++)
+    pthread_mutex_destroy(&deques[w].lock);
+  free(threads);
+  free(workers);
+  free(deques);
+  free(tasks);
+  free(values);
+  free(slots);
+  return result;
+}
+
+// ET_evaluate_many aims for this many chunks per thread, so threads
+// that draw small chunks keep busy while others finish large ones
+#define ET_MANY_CHUNKS_PER_THREAD 16
+
+// ...but no chunk is made smaller than this many nodes, so that taking
+// one costs little next to evaluating it
+#define ET_MANY_MIN_CHUNK 2048
+
+// Results per cache line; chunk boundaries fall on line boundaries
+#define ET_MANY_LINE (64 / sizeof(double))
+
+/*
+ * A run of consecutive trees that ET_evaluate_many hands to one thread,
+ * and its weight in nodes
+ */
+typedef struct
+{
+  size_t begin, end;
+  size_t weight;
+} ManyChunk;
+
+/*
+ * One call of ET_evaluate_many. The chunks are sorted heaviest first,
+ * and taking one is a single atomic increment of next.
+ */
+typedef struct
+{
+  const ExprTree *trees;
+  double *results;
+  ManyChunk *chunks;
+  size_t n_chunks;
+  atomic_size_t next;
+} ManyJob;
+
+struct _expr_pool
+{
+  pthread_mutex_t run;    // held for the whole of one ET_evaluate_many
+  pthread_mutex_t lock;   // guards the fields below
+  pthread_cond_t start;   // signalled when a job is posted or on stop
+  pthread_cond_t done;    // signalled when the last worker finishes a job
+  ManyJob *job;
+  unsigned long generation;
+  int active;             // workers still on the current job
+  bool stop;
+  int n_workers;          // threads started, not counting callers
+  pthread_t *threads;
+};
+
+/*
+ * Evaluate chunks of job until none are left
+ */
+static void many_work(ManyJob *job)
+{
+  for (;;)
+  {
+    size_t c = atomic_fetch_add_explicit(&job->next, 1, memory_order_relaxed);
+    if (c >= job->n_chunks)
+      return;
+    for (size_t i = job->chunks[c].begin; i < job->chunks[c].end; i++)
+      job->results[i] = evaluate_tree(job->trees[i], NULL);
+  }
+}
+
+/*
+ * Thread body of an ExprPool worker: wait for each new job, work on it
+ * and report back, until the pool is destroyed
+ */
+static void *pool_worker(void *arg)
+{
+  ExprPool pool = arg;
+  unsigned long seen = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;)
+  {
+    while (!pool->stop && pool->generation == seen)
+      pthread_cond_wait(&pool->start, &pool->lock);
+    if (pool->stop)
+      break;
+    seen = pool->generation;
+    ManyJob *job = pool->job;
+    pthread_mutex_unlock(&pool->lock);
+
+    many_work(job);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->active == 0)
+      pthread_cond_signal(&pool->done);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+// Documented in .h file
+ExprPool ET_pool_create(int n_threads)
+{
+  if (n_threads <= 0)
+    n_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (n_threads < 1)
+    n_threads = 1;
+
+  ExprPool pool = malloc(sizeof(struct _expr_pool));
+  assert(pool != NULL);
+  pool->threads = malloc(n_threads * sizeof(pthread_t));
+  assert(pool->threads != NULL);
+  pthread_mutex_init(&pool->run, NULL);
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->start, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  pool->job = NULL;
+  pool->generation = 0;
+  pool->active = 0;
+  pool->stop = false;
+
+  // the caller of ET_evaluate_many is the last thread; if some workers
+  // fail to start, the pool simply has fewer
+  pool->n_workers = 0;
+  for (int w = 0; w + 1 < n_threads; w++)
+  {
+    if (pthread_create(&pool->threads[w], NULL, pool_worker, pool) != 0)
+      break;
+    pool->n_workers++;
+  }
+  return pool;
+}
+
+// Documented in .h file
+void ET_pool_destroy(ExprPool pool)
+{
+  if (pool == NULL)
+    return;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = true;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+  for (int w = 0; w < pool->n_workers; w++)
+    pthread_join(pool->threads[w], NULL);
+
+  pthread_cond_destroy(&pool->done);
+  pthread_cond_destroy(&pool->start);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_mutex_destroy(&pool->run);
+  free(pool->threads);
+  free(pool);
+}
+
+/*
+ * qsort comparator putting heavier chunks first
+ */
+static int chunk_heavier(const void *a, const void *b)
+{
+  size_t wa = ((const ManyChunk *)a)->weight, wb = ((const ManyChunk *)b)->weight;
+  return (wa < wb) - (wa > wb);
+}
+
+// Documented in .h file
+void ET_evaluate_many(const ExprTree *trees, size_t n, double *results, ExprPool pool)
+{
+  if (n == 0)
+    return;
+  STATS_ADD(evaluations, n);
+  if (pool == NULL || pool->n_workers == 0)
+  {
+    for (size_t i = 0; i < n; i++)
+      results[i] = evaluate_tree(trees[i], NULL);
+    return;
+  }
+
+  // ET_count is constant time, so weighing every tree up front is cheap
+  size_t total = 0;
+  for (size_t i = 0; i < n; i++)
+  {
+    size_t w = trees[i] == NULL ? 1 : trees[i]->count;
+    total = w > SIZE_MAX - total ? SIZE_MAX : total + w;
+  }
+  size_t target = total / ((size_t)(pool->n_workers + 1) * ET_MANY_CHUNKS_PER_THREAD);
+  if (target < ET_MANY_MIN_CHUNK)
+    target = ET_MANY_MIN_CHUNK;
+
+  // Cut the trees into chunks of about target nodes that end on cache
+  // line boundaries of results, so no two threads write the same line.
+  // A tree heavier than target becomes a chunk of its own, so it can be
+  // started first instead of straggling behind its neighbours.
+  size_t n_chunks = 0, chunks_cap = 64;
+  ManyChunk *chunks = malloc(chunks_cap * sizeof(ManyChunk));
+  assert(chunks != NULL);
+  size_t begin = 0, weight = 0;
+  for (size_t i = 0; i < n; i++)
+  {
+    size_t w = trees[i] == NULL ? 1 : trees[i]->count;
+    bool alone = w >= target;
+    bool line_end = ((uintptr_t)&results[i + 1] / sizeof(double)) % ET_MANY_LINE == 0;
+
+    if (n_chunks + 2 > chunks_cap)
+    {
+      chunks_cap *= 2;
+      chunks = realloc(chunks, chunks_cap * sizeof(ManyChunk));
+      assert(chunks != NULL);
+    }
+    if (alone)
+    {
+      if (begin < i)
+        chunks[n_chunks++] = (ManyChunk){begin, i, weight};
+      chunks[n_chunks++] = (ManyChunk){i, i + 1, w};
+      begin = i + 1;
+      weight = 0;
+    }
+    else if ((weight += w) >= target && line_end)
+    {
+      chunks[n_chunks++] = (ManyChunk){begin, i + 1, weight};
+      begin = i + 1;
+      weight = 0;
+    }
+  }
+  if (begin < n)
+    chunks[n_chunks++] = (ManyChunk){begin, n, weight};
+  qsort(chunks, n_chunks, sizeof(ManyChunk), chunk_heavier);
+
+  ManyJob job = {trees, results, chunks, n_chunks};
+  atomic_init(&job.next, 0);
+
+  pthread_mutex_lock(&pool->run);
+  pthread_mutex_lock(&pool->lock);
+  pool->job = &job;
+  pool->active = pool->n_workers;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+
+  many_work(&job);
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->active > 0)
+    pthread_cond_wait(&pool->done, &pool->lock);
+  pool->job = NULL;
+  pthread_mutex_unlock(&pool->lock);
+  pthread_mutex_unlock(&pool->run);
+
+  free(chunks);
+}
+
+/*
+ * Return true if tree holds a cached value from the current epoch
+ */
+static inline bool cache_valid(ExprTree tree, unsigned int epoch)
+{
+  return tree->epoch == epoch;
+}
+
+/*
+ * Invalidate the cached values that depend on tree: those of tree and
+ * of its ancestors. Stops at the first ancestor without a valid cache,
+ * since ET_evaluate_incremental only caches a node after its operands,
+ * and so no node above it can have one either. A shared node's parents
+ * cannot be found, so reaching one invalidates every cache instead.
+ */
+static void mark_dirty(ExprTree tree)
+{
+  unsigned int epoch = atomic_load(&cache_epoch);
+
+  for (ExprTree t = tree; t != NULL; t = t->parent)
+  {
+    if (t != tree && !cache_valid(t, epoch))
+      return;
+    t->epoch = 0;
+
+    if (t->flags & ET_FLAG_SHARED)
+    {
+      // 0 means "never cached"
+      if (atomic_fetch_add(&cache_epoch, 1) + 1 == 0)
+        atomic_fetch_add(&cache_epoch, 1);
+      return;
+    }
+  }
+}
+
+// Documented in .h file
+void ET_set_value(ExprTree leaf, double value)
+{
+  assert(leaf != NULL && leaf->type == VALUE);
+
+  leaf->n.value = value;
+  mark_dirty(leaf);
+}
+
+// Documented in .h file
+double ET_evaluate_incremental(ExprTree tree)
+{
+  unsigned int epoch = atomic_load(&cache_epoch);
+  STATS_ADD(evaluations, 1);
+
+  // postorder walk as in ET_evaluate_vars, which neither descends into
+  // nor recomputes nodes whose cached value is still valid; the caches
+  // also stand in for its memo of shared nodes
+  WalkEntry path_inline[WALK_INLINE_STACK];
+  WalkStack path;
+  walk_init_inline(&path, path_inline, WALK_INLINE_STACK);
+  double vals_inline[WALK_INLINE_STACK];
+  size_t n_vals = 0, vals_cap = WALK_INLINE_STACK;
+  double *vals = vals_inline;
+
+  ExprTree t = tree;
+  for (;;)
+  {
+    while (t != NULL && !is_leaf(t) && !cache_valid(t, epoch))
+    {
+      walk_push(&path, t, LEFT);
+      t = children(t)[0];
+    }
+
+    if (n_vals == vals_cap)
+      vals = stack_grow(vals, vals_inline, &vals_cap, sizeof(double));
+    if (t == NULL)
+      vals[n_vals++] = 0;
+    else if (t->type == VALUE)
+      vals[n_vals++] = t->n.value;
+    else if (t->type == VARIABLE)
+      vals[n_vals++] = NAN;
+    else
+      vals[n_vals++] = t->cache;
+    if (t != NULL && is_leaf(t))
+      STATS_ADD(ops[t->type], 1);
+
+    t = NULL;
+    while (path.top > 0)
+    {
+      WalkEntry *e = &path.items[path.top - 1];
+
+      if (e->aux + 1 < n_operands(e->node))
+      {
+        t = children(e->node)[++e->aux];
+        break;
+      }
+
+      size_t k = n_operands(e->node);
+      vals[n_vals - k] = apply_node(e->node, vals + n_vals - k);
+      n_vals -= k - 1;
+      STATS_ADD(ops[e->node->type], 1);
+      e->node->cache = vals[n_vals - 1];
+      e->node->epoch = epoch;
+      path.top--;
+    }
+
+    if (path.top == 0)
+      break;
+  }
+
+  double result = vals[0];
+  if (vals != vals_inline)
+    free(vals);
+  walk_free(&path);
+  return result;
+}
+
+/*
+ * A floating-point number f * 2^e with a 64-bit significand, the
+ * working type of format_shortest
+ */
+typedef struct
+{
+  uint64_t f;
+  int e;
+} DiyFp;
+
+// Powers of ten 10^-348, 10^-340, ..., 10^340 as normalized DiyFps
+// rounded to nearest, each with its decimal exponent
+static const struct
+{
+  uint64_t f;
+  int16_t e;
+  int16_t k;
+} grisu_powers[] = {
+    {0xfa8fd5a0081c0288, -1220, -348}, {0xbaaee17fa23ebf76, -1193, -340},
+    {0x8b16fb203055ac76, -1166, -332}, {0xcf42894a5dce35ea, -1140, -324},
+    {0x9a6bb0aa55653b2d, -1113, -316}, {0xe61acf033d1a45df, -1087, -308},
+    {0xab70fe17c79ac6ca, -1060, -300}, {0xff77b1fcbebcdc4f, -1034, -292},
+    {0xbe5691ef416bd60c, -1007, -284}, {0x8dd01fad907ffc3c, -980, -276},
+    {0xd3515c2831559a83, -954, -268}, {0x9d71ac8fada6c9b5, -927, -260},
+    {0xea9c227723ee8bcb, -901, -252}, {0xaecc49914078536d, -874, -244},
+    {0x823c12795db6ce57, -847, -236}, {0xc21094364dfb5637, -821, -228},
+    {0x9096ea6f3848984f, -794, -220}, {0xd77485cb25823ac7, -768, -212},
+    {0xa086cfcd97bf97f4, -741, -204}, {0xef340a98172aace5, -715, -196},
+    {0xb23867fb2a35b28e, -688, -188}, {0x84c8d4dfd2c63f3b, -661, -180},
+    {0xc5dd44271ad3cdba, -635, -172}, {0x936b9fcebb25c996, -608, -164},
+    {0xdbac6c247d62a584, -582, -156}, {0xa3ab66580d5fdaf6, -555, -148},
+    {0xf3e2f893dec3f126, -529, -140}, {0xb5b5ada8aaff80b8, -502, -132},
+    {0x87625f056c7c4a8b, -475, -124}, {0xc9bcff6034c13053, -449, -116},
+    {0x964e858c91ba2655, -422, -108}, {0xdff9772470297ebd, -396, -100},
+    {0xa6dfbd9fb8e5b88f, -369, -92}, {0xf8a95fcf88747d94, -343, -84},
+    {0xb94470938fa89bcf, -316, -76}, {0x8a08f0f8bf0f156b, -289, -68},
+    {0xcdb02555653131b6, -263, -60}, {0x993fe2c6d07b7fac, -236, -52},
+    {0xe45c10c42a2b3b06, -210, -44}, {0xaa242499697392d3, -183, -36},
+    {0xfd87b5f28300ca0e, -157, -28}, {0xbce5086492111aeb, -130, -20},
+    {0x8cbccc096f5088cc, -103, -12}, {0xd1b71758e219652c, -77, -4},
+    {0x9c40000000000000, -50, 4}, {0xe8d4a51000000000, -24, 12},
+    {0xad78ebc5ac620000, 3, 20}, {0x813f3978f8940984, 30, 28},
+    {0xc097ce7bc90715b3, 56, 36}, {0x8f7e32ce7bea5c70, 83, 44},
+    {0xd5d238a4abe98068, 109, 52}, {0x9f4f2726179a2245, 136, 60},
+    {0xed63a231d4c4fb27, 162, 68}, {0xb0de65388cc8ada8, 189, 76},
+    {0x83c7088e1aab65db, 216, 84}, {0xc45d1df942711d9a, 242, 92},
+    {0x924d692ca61be758, 269, 100}, {0xda01ee641a708dea, 295, 108},
+    {0xa26da3999aef774a, 322, 116}, {0xf209787bb47d6b85, 348, 124},
+    {0xb454e4a179dd1877, 375, 132}, {0x865b86925b9bc5c2, 402, 140},
+    {0xc83553c5c8965d3d, 428, 148}, {0x952ab45cfa97a0b3, 455, 156},
+    {0xde469fbd99a05fe3, 481, 164}, {0xa59bc234db398c25, 508, 172},
+    {0xf6c69a72a3989f5c, 534, 180}, {0xb7dcbf5354e9bece, 561, 188},
+    {0x88fcf317f22241e2, 588, 196}, {0xcc20ce9bd35c78a5, 614, 204},
+    {0x98165af37b2153df, 641, 212}, {0xe2a0b5dc971f303a, 667, 220},
+    {0xa8d9d1535ce3b396, 694, 228}, {0xfb9b7cd9a4a7443c, 720, 236},
+    {0xbb764c4ca7a44410, 747, 244}, {0x8bab8eefb6409c1a, 774, 252},
+    {0xd01fef10a657842c, 800, 260}, {0x9b10a4e5e9913129, 827, 268},
+    {0xe7109bfba19c0c9d, 853, 276}, {0xac2820d9623bf429, 880, 284},
+    {0x80444b5e7aa7cf85, 907, 292}, {0xbf21e44003acdd2d, 933, 300},
+    {0x8e679c2f5e44ff8f, 960, 308}, {0xd433179d9c8cb841, 986, 316},
+    {0x9e19db92b4e31ba9, 1013, 324}, {0xeb96bf6ebadf77d9, 1039, 332},
+    {0xaf87023b9bf0ee6b, 1066, 340},
+};
+
+// Range of binary exponents that Grisu scales values into, so that
+// the integral part of a scaled value fits in 32 bits
+#define GRISU_MIN_EXP (-60)
+#define GRISU_MAX_EXP (-32)
+
+/*
+ * Return x * y, rounded to 64 bits of significand
+ */
+static DiyFp diy_times(DiyFp x, DiyFp y)
+{
+  uint64_t a = x.f >> 32, b = x.f & 0xffffffff, c = y.f >> 32, d = y.f & 0xffffffff;
+  uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+  uint64_t mid = (bd >> 32) + (ad & 0xffffffff) + (bc & 0xffffffff) + (1ULL << 31);
+  return (DiyFp){ac + (ad >> 32) + (bc >> 32) + (mid >> 32), x.e + y.e + 64};
+}
+
+/*
+ * Shift x left until the top bit of its significand is set
+ */
+static DiyFp diy_normalize(DiyFp x)
+{
+  while (!(x.f >> 63))
+  {
+    x.f <<= 1;
+    x.e--;
+  }
+  return x;
+}
+
+/*
+ * Move the last digit of the Grisu3 output towards the scaled value w
+ * as far as it can go while staying inside the unsafe interval, and
+ * check that the result is provably the closest such digit string
+ *
+ * Parameters:
+ *   digits     The digits generated so far
+ *   len        Number of digits
+ *   too_high   Distance of the top of the unsafe interval from w
+ *   unsafe     Width of the unsafe interval
+ *   rest       Distance of the digits from the top of the interval
+ *   ten_kappa  Weight of the last digit
+ *   unit       Error bound of the scaled values
+ *
+ * Returns: false if the digits cannot be proven correct
+ */
+static bool grisu_round_weed(char *digits, int len, uint64_t too_high, uint64_t unsafe,
+                             uint64_t rest, uint64_t ten_kappa, uint64_t unit)
+{
+  uint64_t small = too_high - unit, big = too_high + unit;
+
+  while (rest < small && unsafe - rest >= ten_kappa &&
+         (rest + ten_kappa < small || small - rest >= rest + ten_kappa - small))
+  {
+    digits[len - 1]--;
+    rest += ten_kappa;
+  }
+
+  if (rest < big && unsafe - rest >= ten_kappa &&
+      (rest + ten_kappa < big || big - rest > rest + ten_kappa - big))
+    return false;
+
+  return 2 * unit <= rest && rest <= unsafe - 4 * unit;
+}
+
+/*
+ * Grisu3: find the shortest digit string that reads back as v, a
+ * positive finite double, in a few 64-bit multiplications. Fails for
+ * a percent or two of doubles, where the 64-bit approximations cannot
+ * decide between candidates.
+ *
+ * Parameters:
+ *   v        The value
+ *   digits   Receives up to 17 digits, not terminated
+ *   len      Receives the number of digits
+ *   exp10    Receives the power of ten of the last digit
+ *
+ * Returns: false if the result could not be proven shortest and correct
+ */
+static bool grisu3(double v, char *digits, int *len, int *exp10)
+{
+  uint64_t bits;
+  memcpy(&bits, &v, sizeof(bits));
+  uint64_t frac = bits & ((1ULL << 52) - 1);
+  int biased = (int)(bits >> 52) & 0x7ff;
+
+  DiyFp raw = biased == 0 ? (DiyFp){frac, -1074} : (DiyFp){frac | (1ULL << 52), biased - 1075};
+  DiyFp w = diy_normalize(raw);
+
+  // the neighbours halfway to the next doubles down and up; the lower
+  // one is closer at a power of two
+  DiyFp plus = diy_normalize((DiyFp){(raw.f << 1) + 1, raw.e - 1});
+  DiyFp minus = frac == 0 && biased > 1 ? (DiyFp){(raw.f << 2) - 1, raw.e - 2}
+                                        : (DiyFp){(raw.f << 1) - 1, raw.e - 1};
+  minus.f <<= minus.e - plus.e;
+  minus.e = plus.e;
+
+  // a cached power 10^k that scales w into [GRISU_MIN_EXP, GRISU_MAX_EXP]
+  int k = (int)ceil((GRISU_MIN_EXP - (w.e + 64) + 63) * 0.30102999566398114);
+  int index = (348 + k - 1) / 8 + 1;
+  DiyFp c = {grisu_powers[index].f, grisu_powers[index].e};
+  assert(c.e + w.e + 64 >= GRISU_MIN_EXP && c.e + w.e + 64 <= GRISU_MAX_EXP);
+
+  w = diy_times(w, c);
+  DiyFp low = diy_times(minus, c), high = diy_times(plus, c);
+
+  // each product is off by at most one unit, so widen the interval by
+  // that much and generate digits of its top until they fall inside
+  uint64_t unit = 1;
+  uint64_t too_low = low.f - unit, too_high = high.f + unit;
+  uint64_t unsafe = too_high - too_low;
+  int shift = -w.e;
+  uint64_t one = 1ULL << shift;
+  uint32_t integrals = (uint32_t)(too_high >> shift);
+  uint64_t fractionals = too_high & (one - 1);
+
+  uint32_t divisor = 1;
+  int kappa = 1;
+  while ((uint64_t)divisor * 10 <= integrals)
+  {
+    divisor *= 10;
+    kappa++;
+  }
+
+  *len = 0;
+  while (kappa > 0)
+  {
+    digits[(*len)++] = '0' + integrals / divisor;
+    integrals %= divisor;
+    kappa--;
+    uint64_t rest = ((uint64_t)integrals << shift) + fractionals;
+    if (rest < unsafe)
+    {
+      *exp10 = kappa - grisu_powers[index].k;
+      return grisu_round_weed(digits, *len, too_high - w.f, unsafe, rest, (uint64_t)divisor << shift, unit);
+    }
+    divisor /= 10;
+  }
+
+  for (;;)
+  {
+    fractionals *= 10;
+    unit *= 10;
+    unsafe *= 10;
+    digits[(*len)++] = '0' + (int)(fractionals >> shift);
+    fractionals &= one - 1;
+    kappa--;
+    if (fractionals < unsafe)
+    {
+      *exp10 = kappa - grisu_powers[index].k;
+      return grisu_round_weed(digits, *len, (too_high - w.f) * unit, unsafe, fractionals, one, unit);
+    }
+  }
+}
+
+/*
+ * Find the shortest digit string that reads back as v, a positive
+ * finite double, falling back to printf's correctly rounded output at
+ * increasing precision where Grisu3 gives up
+ *
+ * Parameters:
+ *   v        The value
+ *   digits   Receives up to 17 digits, not terminated
+ *   exp10    Receives the power of ten of the last digit
+ *
+ * Returns: The number of digits
+ */
+static int format_shortest(double v, char *digits, int *exp10)
+{
+  int len;
+  if (grisu3(v, digits, &len, exp10))
+    return len;
+
+  // a precision that reads back makes any higher one read back too, so
+  // search for the lowest, starting from the length Grisu3 reached,
+  // which is usually right. Only at a power of two, where the next
+  // double down is nearer than the next one up, can a rounding upwards
+  // fail where a shorter one downwards succeeds, so scan there.
+  char text[40], tried[40];
+  int lo = 1, hi = 17, guess = len;
+  bool power_of_two = frexp(v, &len) == 0.5;
+  text[0] = '\0';
+  while (lo < hi)
+  {
+    int precision = power_of_two ? lo : guess >= lo && guess < hi ? guess : (lo + hi) / 2;
+    guess = precision - 1;
+    snprintf(tried, sizeof(tried), "%.*e", precision - 1, v);
+    if (strtod(tried, NULL) == v)
+    {
+      hi = precision;
+      memcpy(text, tried, sizeof(text));
+    }
+    else
+      lo = precision + 1;
+  }
+  if (text[0] == '\0')
+    snprintf(text, sizeof(text), "%.*e", lo - 1, v);
+
+  // d.ddde+XX, with whatever decimal point the locale uses
+  const char *p = text;
+  len = 0;
+  for (; *p != 'e'; p++)
+    if (*p >= '0' && *p <= '9')
+      digits[len++] = *p;
+  *exp10 = atoi(p + 1) - (len - 1);
+  return len;
+}
+
+// Documented in .h file
+size_t ET_format_double(double value, char *buf)
+{
+  char *p = buf;
+
+  if (isnan(value))
+    return (size_t)(stpcpy(buf, "nan") - buf);
+  if (signbit(value))
+    *p++ = '-';
+  if (isinf(value))
+    return (size_t)(stpcpy(p, "inf") - buf);
+  if (value == 0)
+    return (size_t)(stpcpy(p, "0") - buf);
+
+  char digits[17];
+  int exp10;
+  int len = format_shortest(fabs(value), digits, &exp10);
+  int point = exp10 + len - 1;  // power of ten of the first digit
+
+  // laid out as "%.17g" would, without its trailing zeros
+  if (point < -4 || point >= 17)
+  {
+    *p++ = digits[0];
+    if (len > 1)
+    {
+      *p++ = '.';
+      memcpy(p, digits + 1, len - 1);
+      p += len - 1;
+    }
+    int e = abs(point);
+    *p++ = 'e';
+    *p++ = point < 0 ? '-' : '+';
+    if (e >= 100)
+      *p++ = '0' + e / 100;
+    *p++ = '0' + e / 10 % 10;
+    *p++ = '0' + e % 10;
+  }
+  else if (point < 0)
+  {
+    *p++ = '0';
+    *p++ = '.';
+    memset(p, '0', -point - 1);
+    p += -point - 1;
+    memcpy(p, digits, len);
+    p += len;
+  }
+  else if (len <= point + 1)
+  {
+    memcpy(p, digits, len);
+    memset(p + len, '0', point + 1 - len);
+    p += point + 1;
+  }
+  else
+  {
+    memcpy(p, digits, point + 1);
+    p += point + 1;
+    *p++ = '.';
+    memcpy(p, digits + point + 1, len - point - 1);
+    p += len - point - 1;
+  }
+
+  *p = '\0';
+  return (size_t)(p - buf);
+}
+
+/*
+ * Return the character ET_tree2string prints between operands k - 1
+ * and k of an interior node of the given type: its operator, or ','
+ * between the operands of a call
+ */
+static inline char operand_separator(ExprNodeType type, size_t k)
+{
+  if (type == OP_CALL)
+    return ',';
+  return type == OP_FMA ? "*+"[k - 1] : ExprNodeType_to_char(type);
+}
+
+/*
+ * An output cursor into the caller's buffer for ET_tree2string
+ */
+typedef struct
+{
+  char *buf;
+  size_t buf_sz;
+  size_t pos;       // characters written so far
+  bool truncated;   // the output did not fit
+} StringWriter;
+
+/*
+ * Append len characters of str to the writer, flagging truncation if
+ * they do not all fit ahead of the \0 terminator.
+ *
+ * Parameters:
+ *   w        The writer
+ *   str      The characters to append
+ *   len      Number of characters to append
+ */
+static void writer_append(StringWriter *w, const char *str, size_t len)
+{
+  size_t room = w->buf_sz - 1 - w->pos;
+
+  if (len > room)
+  {
+    len = room;
+    w->truncated = true;
+  }
+
+  memcpy(w->buf + w->pos, str, len);
+  w->pos += len;
+}
+
+/*
+ * Terminate the writer's string, marking a truncated one with a
+ * trailing '$' as ET_tree2string documents
+ *
+ * Returns: The length of the string
+ */
+static size_t writer_finish(StringWriter *w)
+{
+  if (w->truncated)
+  {
+    if (w->buf_sz < 2)
+    {
+      w->buf[0] = '\0';
+      return 0;
+    }
+    w->buf[w->buf_sz - 2] = '$';
+    w->buf[w->buf_sz - 1] = '\0';
+    return w->buf_sz - 1;
+  }
+
+  w->buf[w->pos] = '\0';
+  return w->pos;
+}
+
+/*
+ * A pending piece of output for ET_tree2string: a whole subtree, or
+ * an operator or closing parenthesis of an interior node.
+ */
+typedef struct
+{
+  ExprTree tree;
+  enum
+  {
+    EMIT_TREE,
+    EMIT_OP,
+    EMIT_CLOSE
+  } part;
+  char op;    // the operator, for EMIT_OP
+} StringItem;
+
+// Documented in .h file
+size_t ET_tree2string(ExprTree tree, char *buf, size_t buf_sz)
+{
+  if (tree == NULL || buf == NULL || buf_sz == 0)
+    return 0;
+
+  StringWriter w = {buf, buf_sz, 0, false};
+
+  // every pending subtree sits below a '(' already written, so the
+  // stack only grows as deep as the output is long
+  size_t cap = 64, top = 0;
+  StringItem *stack = malloc(cap * sizeof(StringItem));
+  assert(stack != NULL);
+  stack[top++] = (StringItem){tree, EMIT_TREE, 0};
+
+  while (top > 0 && !w.truncated)
+  {
+    StringItem item = stack[--top];
+    ExprTree t = item.tree;
+    char num[32];
+
+    if (item.part == EMIT_CLOSE)
+    {
+      writer_append(&w, ")", 1);
+      continue;
+    }
+
+    if (item.part == EMIT_OP)
+    {
+      char op[3] = {' ', item.op, ' '};
+      writer_append(&w, op + (item.op == ','), sizeof(op) - (item.op == ','));
+      continue;
+    }
+
+    if (t == NULL)
+      continue;
+
+    if (is_leaf(t))
+    {
+      int len = t->type == VALUE ? snprintf(num, sizeof(num), "%g", t->n.value)
+                                 : snprintf(num, sizeof(num), "x%zu", t->n.var);
+      writer_append(&w, num, len);
+      continue;
+    }
+
+    size_t n = n_operands(t);
+    if (top + 2 * n + 1 > cap)
+    {
+      while (top + 2 * n + 1 > cap)
+        cap *= 2;
+      stack = realloc(stack, cap * sizeof(StringItem));
+      assert(stack != NULL);
+    }
+
+    // pushed in reverse order of output; list nodes print as the flat
+    // expression they compute, an FMA as (a * b + c) and a call as
+    // name(a, b)
+    stack[top++] = (StringItem){t, EMIT_CLOSE, 0};
+    for (size_t i = n; i-- > 0;)
+    {
+      stack[top++] = (StringItem){children(t)[i], EMIT_TREE, 0};
+      if (i > 0)
+        stack[top++] = (StringItem){t, EMIT_OP, operand_separator(t->type, i)};
+    }
+    if (t->type == OP_CALL)
+      writer_append(&w, call_entry(t)->name, strlen(call_entry(t)->name));
+    writer_append(&w, t->type == UNARY_NEGATE ? "(-" : "(", t->type == UNARY_NEGATE ? 2 : 1);
+  }
+
+  free(stack);
+  return writer_finish(&w);
+}
+
+// Bytes ET_write buffers before each call of its write function
+#define WRITE_CHUNK 4096
+
+/*
+ * Output state of ET_write: a fixed-size buffer that is passed to the
+ * caller's write function whenever it fills
+ */
+typedef struct
+{
+  ExprWriteFunction write_fn;
+  void *ctx;
+  size_t used;     // bytes waiting in buf
+  bool failed;     // write_fn asked to stop
+  char buf[WRITE_CHUNK];
+} ChunkWriter;
+
+/*
+ * Hand the buffered bytes to the write function
+ */
+static void chunk_flush(ChunkWriter *w)
+{
+  if (!w->failed && w->used > 0 && w->write_fn(w->ctx, w->buf, w->used) != 0)
+    w->failed = true;
+  w->used = 0;
+}
+
+/*
+ * Append len characters of str to the output
+ */
+static void chunk_append(ChunkWriter *w, const char *str, size_t len)
+{
+  while (len > 0 && !w->failed)
+  {
+    size_t n = WRITE_CHUNK - w->used < len ? WRITE_CHUNK - w->used : len;
+    memcpy(w->buf + w->used, str, n);
+    w->used += n;
+    str += n;
+    len -= n;
+    if (w->used == WRITE_CHUNK)
+      chunk_flush(w);
+  }
+}
+
+// Operator names of the JSON format, by node type
+static const char *const json_op_names[ET_NODE_TYPES] = {
+    [UNARY_NEGATE] = "neg",
+    [OP_ADD] = "add",
+    [OP_SUB] = "sub",
+    [OP_MUL] = "mul",
+    [OP_DIV] = "div",
+    [OP_POWER] = "pow",
+    [OP_SUM] = "sum",
+    [OP_PRODUCT] = "product",
+    [OP_FMA] = "fma",
+    [OP_POWI] = "powi",
+};
+
+/*
+ * Write a leaf, or a missing operand if tree is NULL, in format
+ */
+static void write_leaf(ChunkWriter *w, ExprTree tree, ExprFormat format, bool shortest)
+{
+  char num[48], value[ET_DOUBLE_CHARS];
+  int len = 0;
+
+  if (tree == NULL)
+  {
+    if (format == ET_FORMAT_POSTFIX)
+      chunk_append(w, "0", 1);
+    else if (format == ET_FORMAT_JSON)
+      chunk_append(w, "null", 4);
+    return;
+  }
+
+  if (tree->type == VARIABLE)
+  {
+    len = snprintf(num, sizeof(num), format == ET_FORMAT_JSON ? "{\"var\":%zu}" : "x%zu", tree->n.var);
+    chunk_append(w, num, len);
+    return;
+  }
+
+  size_t value_len = shortest ? ET_format_double(tree->n.value, value)
+                              : (size_t)snprintf(value, sizeof(value), "%g", tree->n.value);
+  if (format != ET_FORMAT_JSON)
+  {
+    chunk_append(w, value, value_len);
+    return;
+  }
+
+  if (isfinite(tree->n.value))
+    len = snprintf(num, sizeof(num), "{\"value\":%s}", value);
+  else
+    len = snprintf(num, sizeof(num), "{\"value\":\"%s\"}",
+                   isnan(tree->n.value) ? "NaN" : tree->n.value > 0 ? "Infinity" : "-Infinity");
+  chunk_append(w, num, len);
+}
+
+/*
+ * Write what comes before operand k of the interior node tree in
+ * format: its opening for k == 0, or the separator ahead of operand k
+ */
+static void write_before(ChunkWriter *w, ExprTree tree, size_t k, ExprFormat format)
+{
+  char text[32];
+  int len;
+
+  switch (format)
+  {
+  case ET_FORMAT_INFIX:
+    if (k == 0)
+    {
+      if (tree->type == OP_CALL)
+        chunk_append(w, call_entry(tree)->name, strlen(call_entry(tree)->name));
+      chunk_append(w, tree->type == UNARY_NEGATE ? "(-" : "(", tree->type == UNARY_NEGATE ? 2 : 1);
+      return;
+    }
+    char op[3] = {' ', operand_separator(tree->type, k), ' '};
+    chunk_append(w, op + (op[1] == ','), sizeof(op) - (op[1] == ','));
+    return;
+  case ET_FORMAT_POSTFIX:
+    if (k > 0)
+      chunk_append(w, " ", 1);
+    return;
+  case ET_FORMAT_JSON:
+    if (k > 0)
+    {
+      chunk_append(w, ",", 1);
+      return;
+    }
+    if (tree->type == OP_CALL)
+    {
+      chunk_append(w, "{\"op\":\"call\",\"fn\":\"", 19);
+      chunk_append(w, call_entry(tree)->name, strlen(call_entry(tree)->name));
+      chunk_append(w, "\",\"args\":[", 10);
+      return;
+    }
+    len = snprintf(text, sizeof(text), "{\"op\":\"%s\",\"args\":[", json_op_names[tree->type]);
+    chunk_append(w, text, len);
+    return;
+  default:
+    assert(0);
+  }
+}
+
+/*
+ * Write what follows the last operand of the interior node tree in
+ * format
+ */
+static void write_after(ChunkWriter *w, ExprTree tree, ExprFormat format)
+{
+  char text[ET_FUNCTION_NAME_MAX + 8];
+  int len;
+
+  switch (format)
+  {
+  case ET_FORMAT_INFIX:
+    chunk_append(w, ")", 1);
+    return;
+  case ET_FORMAT_POSTFIX:
+    if (tree->type == UNARY_NEGATE)
+      len = snprintf(text, sizeof(text), " neg");
+    else if (tree->type == OP_FMA)
+      len = snprintf(text, sizeof(text), " fma");
+    else if (tree->type == OP_CALL)
+      len = snprintf(text, sizeof(text), " %s", call_entry(tree)->name);
+    else if (is_list(tree))
+      len = snprintf(text, sizeof(text), " %c%u", ExprNodeType_to_char(tree->type), (unsigned int)tree->n.list.n_args);
+    else
+      len = snprintf(text, sizeof(text), " %c", ExprNodeType_to_char(tree->type));
+    chunk_append(w, text, len);
+    return;
+  case ET_FORMAT_JSON:
+    chunk_append(w, "]}", 2);
+    return;
+  default:
+    assert(0);
+  }
+}
+
+// Documented in .h file
+int ET_write(ExprTree tree, ExprWriteFunction write_fn, void *ctx, ExprFormat format)
+{
+  bool shortest = format & ET_FORMAT_SHORTEST;
+  format &= ~ET_FORMAT_SHORTEST;
+  assert(write_fn != NULL);
+  assert(format == ET_FORMAT_INFIX || format == ET_FORMAT_POSTFIX || format == ET_FORMAT_JSON);
+  if (tree == NULL)
+    return 0;
+
+  ChunkWriter *w = malloc(sizeof(ChunkWriter));
+  assert(w != NULL);
+  w->write_fn = write_fn;
+  w->ctx = ctx;
+  w->used = 0;
+  w->failed = false;
+
+  // aux counts the operands of an interior node visited so far
+  WalkStack stack;
+  walk_init(&stack);
+  walk_push(&stack, tree, 0);
+
+  while (stack.top > 0 && !w->failed)
+  {
+    WalkEntry *e = &stack.items[stack.top - 1];
+    ExprTree t = e->node;
+
+    if (t == NULL || is_leaf(t))
+    {
+      write_leaf(w, t, format, shortest);
+      stack.top--;
+      continue;
+    }
+
+    size_t k = e->aux++;
+    if (k == n_operands(t))
+    {
+      write_after(w, t, format);
+      stack.top--;
+      continue;
+    }
+    write_before(w, t, k, format);
+    walk_push(&stack, children(t)[k], 0);
+  }
+  walk_free(&stack);
+
+  chunk_flush(w);
+  int result = w->failed ? -1 : 0;
+  free(w);
+  return result;
+}
+
+/*
+ * ExprWriteFunction for ET_write_file; ctx is the FILE *
+ */
+static int write_to_file(void *ctx, const char *data, size_t len)
+{
+  return fwrite(data, 1, len, ctx) == len ? 0 : -1;
+}
+
+/*
+ * ExprWriteFunction for ET_write_fd; ctx points to the descriptor
+ */
+static int write_to_fd(void *ctx, const char *data, size_t len)
+{
+  int fd = *(int *)ctx;
+  size_t done = 0;
+
+  while (done < len)
+  {
+    ssize_t n = write(fd, data + done, len - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    done += n;
+  }
+  return 0;
+}
+
+// Documented in .h file
+int ET_write_file(ExprTree tree, FILE *out, ExprFormat format)
+{
+  return ET_write(tree, write_to_file, out, format);
+}
+
+// Documented in .h file
+int ET_write_fd(ExprTree tree, int fd, ExprFormat format)
+{
+  return ET_write(tree, write_to_fd, &fd, format);
+}
+
+/*
+ * ExprWriteFunction for ET_tree2string_format; ctx is a StringWriter,
+ * and the output stops once it is full
+ */
+static int write_to_string(void *ctx, const char *data, size_t len)
+{
+  StringWriter *w = ctx;
+  writer_append(w, data, len);
+  return w->truncated ? -1 : 0;
+}
+
+// Documented in .h file
+size_t ET_tree2string_format(ExprTree tree, char *buf, size_t buf_sz, ExprFormat format)
+{
+  if (tree == NULL || buf == NULL || buf_sz == 0)
+    return 0;
+
+  StringWriter w = {buf, buf_sz, 0, false};
+  ET_write(tree, write_to_string, &w, format);
+  return writer_finish(&w);
+}
+
+/*
+ * A block of nodes owned by an arena. Blocks are chained so that a
+ * reset can rewind to the first block and reuse all of them.
+ */
+struct _expr_arena_block
+{
+  struct _expr_arena_block *next;
+  struct _expr_tree_node nodes[];
+};
+
+/*
+ * The operand array of an arena list node, chained to the arena's
+ * others so that a reset can free them all
+ */
+struct _expr_arena_args
+{
+  struct _expr_arena_args *next;
+  struct _expr_tree_node *args[];
+};
+
+struct _expr_arena
+{
+  size_t block_nodes;               // nodes per block
+  size_t used;                      // nodes handed out from cur
+  struct _expr_arena_block *first;  // head of the block chain
+  struct _expr_arena_block *cur;    // block currently being carved
+  struct _expr_arena_args *args;    // operand arrays of list nodes
+};
+
+/*
+ * Return the next free node in arena, moving on to the next block in
+ * the chain (allocating it if needed) when the current one is full.
+ *
+ * Parameters:
+ *   arena    The arena
+ *
+ * Returns: An uninitialized node flagged as arena-owned
+ */
+static ExprTree arena_alloc(ExprArena arena)
+{
+  assert(arena != NULL);
+
+  if (arena->used == arena->block_nodes)
+  {
+    if (arena->cur->next == NULL)
+    {
+      struct _expr_arena_block *block = malloc(sizeof(struct _expr_arena_block) +
+                                               arena->block_nodes * sizeof(struct _expr_tree_node));
+      assert(block != NULL);
+      block->next = NULL;
+      arena->cur->next = block;
+    }
+    arena->cur = arena->cur->next;
+    arena->used = 0;
+  }
+
+  ExprTree tree = &arena->cur->nodes[arena->used++];
+  STATS_ADD(live_nodes, 1);
+  tree->flags = ET_FLAG_ARENA;
+  tree->refs = 1;
+  tree->parent = NULL;
+  tree->epoch = 0;
+  tree->depth = 1;
+  tree->count = 1;
+  return tree;
+}
+
+// Documented in .h file
+ExprArena ET_arena_create(size_t block_nodes)
+{
+  if (block_nodes == 0)
+    block_nodes = ET_ARENA_DEFAULT_BLOCK;
+
+  ExprArena arena = malloc(sizeof(struct _expr_arena));
+  assert(arena != NULL);
+
+  arena->first = malloc(sizeof(struct _expr_arena_block) +
+                        block_nodes * sizeof(struct _expr_tree_node));
+  assert(arena->first != NULL);
+  arena->first->next = NULL;
+
+  arena->block_nodes = block_nodes;
+  arena->cur = arena->first;
+  arena->used = 0;
+  arena->args = NULL;
+  return arena;
+}
+
+/*
+ * Free the operand arrays of the list nodes handed out by arena
+ */
+static void arena_free_args(ExprArena arena)
+{
+  while (arena->args != NULL)
+  {
+    struct _expr_arena_args *next = arena->args->next;
+    free(arena->args);
+    arena->args = next;
+  }
+}
+
+#ifdef ET_STATS
+/*
+ * Return the number of nodes arena has handed out since it was created
+ * or last reset
+ */
+static size_t arena_live(ExprArena arena)
+{
+  size_t live = arena->used;
+  for (struct _expr_arena_block *b = arena->first; b != arena->cur; b = b->next)
+    live += arena->block_nodes;
+  return live;
+}
+#endif
+
+// Documented in .h file
+void ET_arena_reset(ExprArena arena)
+{
+  if (arena == NULL)
+    return;
+
+  STATS_SUB(live_nodes, arena_live(arena));
+  arena_free_args(arena);
+  arena->cur = arena->first;
+  arena->used = 0;
+}
+
+// Documented in .h file
+void ET_arena_destroy(ExprArena arena)
+{
+  if (arena == NULL)
+    return;
+
+  STATS_SUB(live_nodes, arena_live(arena));
+  arena_free_args(arena);
+  struct _expr_arena_block *block = arena->first;
+  while (block != NULL)
+  {
+    struct _expr_arena_block *next = block->next;
+    free(block);
+    block = next;
+  }
+
+  free(arena);
+}
+
+// Documented in .h file
+ExprTree ET_arena_value(ExprArena arena, double value)
+{
+  ExprTree tree = arena_alloc(arena);
+  tree->type = VALUE;
+  tree->n.value = value;
+  return tree;
+}
+
+// Documented in .h file
+ExprTree ET_arena_var(ExprArena arena, size_t index)
+{
+  ExprTree tree = arena_alloc(arena);
+  tree->type = VARIABLE;
+  tree->n.var = index;
+  return tree;
+}
+
+// Documented in .h file
+ExprTree ET_arena_node(ExprArena arena, ExprNodeType op, ExprTree left, ExprTree right)
+{
+  assert(op != OP_SUM && op != OP_PRODUCT && op != OP_FMA && op != OP_CALL);
+
+  ExprTree tree = arena_alloc(arena);
+  tree->type = op;
+  tree->n.child[LEFT] = left;
+  tree->n.child[RIGHT] = right;
+  link_child(tree, left);
+  link_child(tree, right);
+  update_size(tree);
+  return tree;
+}
+
+/*
+ * Allocate a list node in arena, with room for n_args operands that
+ * are left for the caller to fill in
+ */
+static ExprTree arena_list_alloc(ExprArena arena, ExprNodeType op, size_t n_args)
+{
+  ExprTree tree = arena_alloc(arena);
+  tree->type = op;
+  assert(is_list(tree));
+
+  struct _expr_arena_args *array = malloc(sizeof(struct _expr_arena_args) + n_args * sizeof(ExprTree));
+  assert(array != NULL);
+  array->next = arena->args;
+  arena->args = array;
+  tree->n.list.args = array->args;
+  return tree;
+}
+
+// Documented in .h file
+ExprTree ET_arena_node_list(ExprArena arena, ExprNodeType op, ExprTree *args, size_t n_args)
+{
+  assert(op != OP_CALL);
+  ExprTree tree = arena_list_alloc(arena, op, n_args);
+  list_init(tree, args, n_args);
+  return tree;
+}
+
+// Documented in .h file
+ExprTree ET_arena_call(ExprArena arena, int fn, ExprTree *args, size_t n_args)
+{
+  assert(ET_fn_name(fn) != NULL);
+  ExprTree tree = arena_list_alloc(arena, OP_CALL, n_args);
+  tree->n.list.fn = fn;
+  list_init(tree, args, n_args);
+  return tree;
+}
+
+// The calling thread's arena; the key only exists to run the destructor
+static _Thread_local ExprArena thread_arena = NULL;
+static pthread_key_t thread_arena_key;
+static pthread_once_t thread_arena_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Destructor for the per-thread arena, run when a thread exits
+ *
+ * Parameters:
+ *   arena    The exiting thread's arena
+ */
+static void thread_arena_destructor(void *arena)
+{
+  ET_arena_destroy(arena);
+}
+
+/*
+ * Create the key used to tear down per-thread arenas; run once.
+ */
+static void thread_arena_key_init(void)
+{
+  int rc = pthread_key_create(&thread_arena_key, thread_arena_destructor);
+  assert(rc == 0);
+  (void)rc;
+}
+
+// Documented in .h file
+ExprArena ET_arena_thread(void)
+{
+  if (thread_arena == NULL)
+  {
+    pthread_once(&thread_arena_once, thread_arena_key_init);
+    thread_arena = ET_arena_create(0);
+    pthread_setspecific(thread_arena_key, thread_arena);
+  }
+
+  return thread_arena;
+}
+
+// Documented in .h file
+void ET_arena_thread_release(void)
+{
+  if (thread_arena == NULL)
+    return;
+
+  pthread_setspecific(thread_arena_key, NULL);
+  ET_arena_destroy(thread_arena);
+  thread_arena = NULL;
+}
+
+/*
+ * One slot of a compiled program: either an opcode or the constant
+ * that follows a BC_PUSH, so constants live inline with the code.
+ */
+typedef union
+{
+  long op;
+  double value;
+} ProgramSlot;
+
+/*
+ * What reverse-mode differentiation of a program needs beyond the
+ * program: where each instruction starts, so that the reverse sweep can
+ * step back through them, and room for a block of rows of the value
+ * stack, the adjoint stack and the tape
+ */
+typedef struct
+{
+  size_t n_instrs;    // instructions, not counting BC_HALT
+  size_t n_pops;      // operands they pop in one run: the tape length
+  size_t *starts;     // slot of each instruction
+  double *mem;        // rows * (2 * max_stack + n_pops) doubles, or NULL
+} GradientTape;
+
+static void gradient_tape_free(GradientTape *tape)
+{
+  free(tape->starts);
+  free(tape->mem);
+  free(tape);
+}
+
+struct _expr_program
+{
+  size_t n_slots;     // slots used in code, including BC_HALT
+  size_t max_stack;   // deepest the value stack gets while running
+  double *stack;      // preallocated value stack of max_stack entries
+  GradientTape *tape; // ET_run_gradient's, made on its first call
+#ifdef ET_STATS
+  size_t ops[ET_NODE_TYPES]; // operations one run executes
+#endif
+  ProgramSlot code[];
+};
+
+#ifdef ET_STATS
+/*
+ * Fill in prog->ops. Programs are straight-line code, so every run
+ * executes each instruction exactly once.
+ */
+static void program_count_ops(ExprProgram prog)
+{
+  static const unsigned char types[BC_COUNT] = {
+      [BC_PUSH] = VALUE, [BC_LOAD] = VARIABLE, [BC_NEGATE] = UNARY_NEGATE,
+      [BC_ADD] = OP_ADD, [BC_SUB] = OP_SUB, [BC_MUL] = OP_MUL, [BC_DIV] = OP_DIV,
+      [BC_POWER] = OP_POWER, [BC_RSUB] = OP_SUB, [BC_RDIV] = OP_DIV, [BC_RPOWER] = OP_POWER,
+      [BC_SUM] = OP_SUM, [BC_PRODUCT] = OP_PRODUCT, [BC_FMA] = OP_FMA, [BC_POWI] = OP_POWI,
+      [BC_RPOWI] = OP_POWI, [BC_CALL] = OP_CALL};
+
+  memset(prog->ops, 0, sizeof(prog->ops));
+  for (const ProgramSlot *pc = prog->code; pc->op != BC_HALT; pc += instr_slots(pc->op))
+    prog->ops[types[pc->op]]++;
+}
+
+/*
+ * Add runs evaluations, each executing the operations in counts, to
+ * the stats
+ */
+static void stats_add_runs(const size_t *counts, size_t runs)
+{
+  STATS_ADD(evaluations, runs);
+  for (int type = 0; type < ET_NODE_TYPES; type++)
+    if (counts[type] != 0)
+      STATS_ADD(ops[type], counts[type] * runs);
+}
+#endif
+
+/*
+ * Per-node facts gathered before code generation, stored in postorder
+ */
+typedef struct
+{
+  size_t size;   // nodes in the subtree, counting a NULL operand as one
+  size_t need;   // stack slots needed to evaluate the subtree
+} CompileInfo;
+
+/*
+ * A pending visit during compilation. Both passes walk the tree with an
+ * explicit stack so that compiling does not overflow on deep trees.
+ */
+typedef struct
+{
+  ExprTree tree;
+  size_t idx;    // postorder index of tree (code generation only)
+  bool done;     // children already visited
+} CompileFrame;
+
+/*
+ * Make room for n more entries of size elem_sz in the array *items of
+ * capacity *cap, which is used up to used
+ */
+static void compile_reserve(void **items, size_t *cap, size_t used, size_t n, size_t elem_sz)
+{
+  if (used + n <= *cap)
+    return;
+
+  while (used + n > *cap)
+    *cap *= 2;
+  *items = realloc(*items, *cap * elem_sz);
+  assert(*items != NULL);
+}
+
+/*
+ * Fill info in postorder with the size and stack need of every node.
+ * The need is the Sethi-Ullman number: emitting the needier operand
+ * first keeps the stack at O(log n) even for right-deep trees.
+ *
+ * NULL operands, which ET_count does not count, get entries of their
+ * own, so info and frames grow as needed. compile_emit never needs more
+ * frames than this pass did.
+ *
+ * Parameters:
+ *   tree        The tree to measure
+ *   info        In/out: the array to fill, and its capacity
+ *   info_cap
+ *   frames      In/out: a scratch stack, and its capacity
+ *   frames_cap
+ *
+ * Returns: The number of entries written to info
+ */
+static size_t compile_measure(ExprTree tree, CompileInfo **info, size_t *info_cap,
+                              CompileFrame **frames, size_t *frames_cap)
+{
+  size_t idx = 0, top = 0;
+  (*frames)[top++] = (CompileFrame){tree, 0, false};
+
+  while (top > 0)
+  {
+    CompileFrame f = (*frames)[--top];
+    ExprTree t = f.tree;
+
+    compile_reserve((void **)info, info_cap, idx, 1, sizeof(CompileInfo));
+    if (t == NULL || is_leaf(t))
+    {
+      (*info)[idx++] = (CompileInfo){1, 1};
+      continue;
+    }
+
+    if (!f.done)
+    {
+      compile_reserve((void **)frames, frames_cap, top, 1 + n_operands(t), sizeof(CompileFrame));
+      (*frames)[top++] = (CompileFrame){t, 0, true};
+      for (size_t i = n_operands(t); i-- > 0;)
+        (*frames)[top++] = (CompileFrame){children(t)[i], 0, false};
+      continue;
+    }
+
+    CompileInfo ci;
+    if (t->type == UNARY_NEGATE)
+    {
+      ci.size = 1 + (*info)[idx - 1].size;
+      ci.need = (*info)[idx - 1].need;
+    }
+    else if (is_list(t))
+    {
+      // operands are pushed in order, so operand i sits on i others
+      ci.size = 1;
+      ci.need = 0;
+      size_t j = idx;
+      for (size_t i = n_operands(t); i-- > 0;)
+      {
+        j--;
+        ci.size += (*info)[j].size;
+        if ((*info)[j].need + i > ci.need)
+          ci.need = (*info)[j].need + i;
+        j -= (*info)[j].size - 1;
+      }
+    }
+    else
+    {
+      CompileInfo right = (*info)[idx - 1];
+      CompileInfo left = (*info)[idx - 1 - right.size];
+      ci.size = 1 + left.size + right.size;
+      if (left.need == right.need)
+        ci.need = left.need + 1;
+      else
+        ci.need = left.need > right.need ? left.need : right.need;
+    }
+    (*info)[idx++] = ci;
+  }
+
+  return idx;
+}
+
+/*
+ * Fill code with tree in postfix order, evaluating the operand that
+ * needs more stack first and using a reversed opcode when that is the
+ * right operand.
+ *
+ * Parameters:
+ *   tree     The tree to emit
+ *   info     Results of compile_measure
+ *   n_info   Number of entries in info
+ *   frames   Scratch stack, as for compile_measure
+ *   code     The program's code array
+ *
+ * Returns: The number of slots written to code
+ */
+static size_t compile_emit(ExprTree tree, const CompileInfo *info, size_t n_info,
+                           CompileFrame *frames, ProgramSlot *code)
+{
+  size_t pc = 0, top = 0;
+  frames[top++] = (CompileFrame){tree, n_info - 1, false};
+
+  while (top > 0)
+  {
+    CompileFrame f = frames[--top];
+    ExprTree t = f.tree;
+
+    // a missing operand evaluates to 0, as in ET_evaluate
+    if (t == NULL || t->type == VALUE)
+    {
+      code[pc++].op = BC_PUSH;
+      code[pc++].value = t == NULL ? 0 : t->n.value;
+      continue;
+    }
+
+    if (t->type == VARIABLE)
+    {
+      code[pc++].op = BC_LOAD;
+      code[pc++].op = t->n.var;
+      continue;
+    }
+
+    if (t->type == UNARY_NEGATE)
+    {
+      if (f.done)
+        code[pc++].op = BC_NEGATE;
+      else
+      {
+        frames[top++] = (CompileFrame){t, f.idx, true};
+        frames[top++] = (CompileFrame){t->n.child[LEFT], f.idx - 1, false};
+      }
+      continue;
+    }
+
+    if (is_list(t))
+    {
+      if (f.done)
+      {
+        if (t->type == OP_CALL)
+        {
+          code[pc++].op = BC_CALL;
+          code[pc++].op = t->n.list.fn;
+          continue;
+        }
+        code[pc++].op = t->type == OP_SUM ? BC_SUM : t->type == OP_PRODUCT ? BC_PRODUCT : BC_FMA;
+        if (t->type != OP_FMA)
+          code[pc++].op = t->n.list.n_args;
+        continue;
+      }
+
+      // operands in order, pushed last first
+      frames[top++] = (CompileFrame){t, f.idx, true};
+      size_t j = f.idx - 1;
+      for (size_t i = t->n.list.n_args; i-- > 0;)
+      {
+        frames[top++] = (CompileFrame){t->n.list.args[i], j, false};
+        j -= info[j].size;
+      }
+      continue;
+    }
+
+    size_t right = f.idx - 1;
+    size_t left = right - info[right].size;
+    bool reversed = info[right].need > info[left].need;
+
+    if (!f.done)
+    {
+      frames[top++] = (CompileFrame){t, f.idx, true};
+      if (reversed)
+      {
+        frames[top++] = (CompileFrame){t->n.child[LEFT], left, false};
+        frames[top++] = (CompileFrame){t->n.child[RIGHT], right, false};
+      }
+      else
+      {
+        frames[top++] = (CompileFrame){t->n.child[RIGHT], right, false};
+        frames[top++] = (CompileFrame){t->n.child[LEFT], left, false};
+      }
+      continue;
+    }
+
+    // addition and multiplication commute, so they need no reversed form
+    switch (t->type)
+    {
+    case OP_ADD:
+      code[pc++].op = BC_ADD;
+      break;
+    case OP_SUB:
+      code[pc++].op = reversed ? BC_RSUB : BC_SUB;
+      break;
+    case OP_MUL:
+      code[pc++].op = BC_MUL;
+      break;
+    case OP_DIV:
+      code[pc++].op = reversed ? BC_RDIV : BC_DIV;
+      break;
+    case OP_POWER:
+      code[pc++].op = reversed ? BC_RPOWER : BC_POWER;
+      break;
+    case OP_POWI:
+      code[pc++].op = reversed ? BC_RPOWI : BC_POWI;
+      break;
+    default:
+      assert(0);
+    }
+  }
+
+  return pc;
+}
+
+// Documented in .h file
+ExprProgram ET_compile(ExprTree tree)
+{
+  // room for every node and a NULL tree; NULL operands grow the arrays
+  size_t info_cap = (size_t)ET_count(tree) + 1;
+  size_t frames_cap = 2 * info_cap + 1;
+
+  CompileInfo *info = malloc(info_cap * sizeof(CompileInfo));
+  CompileFrame *frames = malloc(frames_cap * sizeof(CompileFrame));
+  assert(info != NULL && frames != NULL);
+  size_t n_info = compile_measure(tree, &info, &info_cap, &frames, &frames_cap);
+
+  // every entry takes at most two slots, plus the halt
+  size_t max_slots = 2 * n_info + 1;
+  ExprProgram prog = malloc(sizeof(struct _expr_program) + max_slots * sizeof(ProgramSlot));
+  assert(prog != NULL);
+
+  size_t pc = compile_emit(tree, info, n_info, frames, prog->code);
+  prog->code[pc++].op = BC_HALT;
+
+  prog->n_slots = pc;
+  prog->max_stack = info[n_info - 1].need;
+  prog->stack = malloc(prog->max_stack * sizeof(double));
+  assert(prog->stack != NULL);
+  prog->tape = NULL;
+#ifdef ET_STATS
+  program_count_ops(prog);
+#endif
+  free(frames);
+  free(info);
+  return prog;
+}
+
+// Documented in .h file
+void ET_program_free(ExprProgram prog)
+{
+  if (prog == NULL)
+    return;
+
+  if (prog->tape != NULL)
+    gradient_tape_free(prog->tape);
+  free(prog->stack);
+  free(prog);
+}
+
+// Documented in .h file
+double ET_run(ExprProgram prog)
+{
+  return ET_run_vars(prog, NULL);
+}
+
+/*
+ * Run prog as ET_run_vars does, without counting an evaluation in the
+ * stats
+ */
+static double run_program(ExprProgram prog, const double *vars)
+{
+  const ProgramSlot *pc = prog->code;
+  double *sp = prog->stack; // points one past the top of the stack
+
+#if defined(__GNUC__)
+  // threaded dispatch: each handler jumps straight to the next one
+  static void *const dispatch[BC_COUNT] = {
+      [BC_PUSH] = &&do_BC_PUSH,
+      [BC_LOAD] = &&do_BC_LOAD,
+      [BC_NEGATE] = &&do_BC_NEGATE,
+      [BC_ADD] = &&do_BC_ADD,
+      [BC_SUB] = &&do_BC_SUB,
+      [BC_MUL] = &&do_BC_MUL,
+      [BC_DIV] = &&do_BC_DIV,
+      [BC_POWER] = &&do_BC_POWER,
+      [BC_RSUB] = &&do_BC_RSUB,
+      [BC_RDIV] = &&do_BC_RDIV,
+      [BC_RPOWER] = &&do_BC_RPOWER,
+      [BC_SUM] = &&do_BC_SUM,
+      [BC_PRODUCT] = &&do_BC_PRODUCT,
+      [BC_FMA] = &&do_BC_FMA,
+      [BC_POWI] = &&do_BC_POWI,
+      [BC_RPOWI] = &&do_BC_RPOWI,
+      [BC_CALL] = &&do_BC_CALL,
+      [BC_HALT] = &&do_BC_HALT,
+  };
+#define NEXT() goto *dispatch[(pc++)->op]
+#define CASE(opcode) do_##opcode:
+  NEXT();
+#else
+#define NEXT() continue
+#define CASE(opcode) case opcode:
+  for (;;)
+    switch ((pc++)->op)
+#endif
+  {
+    CASE(BC_PUSH)
+    *sp++ = (pc++)->value;
+    NEXT();
+    CASE(BC_LOAD)
+    *sp++ = vars == NULL ? NAN : vars[pc->op];
+    pc++;
+    NEXT();
+    CASE(BC_NEGATE)
+    sp[-1] = -sp[-1];
+    NEXT();
+    CASE(BC_ADD)
+    sp--;
+    sp[-1] = sp[-1] + sp[0];
+    NEXT();
+    CASE(BC_SUB)
+    sp--;
+    sp[-1] = sp[-1] - sp[0];
+    NEXT();
+    CASE(BC_MUL)
+    sp--;
+    sp[-1] = sp[-1] * sp[0];
+    NEXT();
+    CASE(BC_DIV)
+    sp--;
+    sp[-1] = sp[-1] / sp[0];
+    NEXT();
+    CASE(BC_POWER)
+    sp--;
+    sp[-1] = pow(sp[-1], sp[0]);
+    NEXT();
+    CASE(BC_RSUB)
+    sp--;
+    sp[-1] = sp[0] - sp[-1];
+    NEXT();
+    CASE(BC_RDIV)
+    sp--;
+    sp[-1] = sp[0] / sp[-1];
+    NEXT();
+    CASE(BC_RPOWER)
+    sp--;
+    sp[-1] = pow(sp[0], sp[-1]);
+    NEXT();
+    CASE(BC_SUM)
+    sp -= pc->op - 1;
+    sp[-1] = reduce_list(OP_SUM, sp - 1, (pc++)->op);
+    NEXT();
+    CASE(BC_PRODUCT)
+    sp -= pc->op - 1;
+    sp[-1] = reduce_list(OP_PRODUCT, sp - 1, (pc++)->op);
+    NEXT();
+    CASE(BC_FMA)
+    sp -= 2;
+    sp[-1] = fma(sp[-1], sp[0], sp[1]);
+    NEXT();
+    CASE(BC_POWI)
+    sp--;
+    sp[-1] = power_int(sp[-1], sp[0]);
+    NEXT();
+    CASE(BC_RPOWI)
+    sp--;
+    sp[-1] = power_int(sp[0], sp[-1]);
+    NEXT();
+    CASE(BC_CALL)
+    {
+      const FnEntry *f = &fn_table[(pc++)->op];
+      sp -= f->arity - 1;
+      sp[-1] = f->scalar(sp - 1);
+    }
+    NEXT();
+    CASE(BC_HALT)
+    return sp[-1];
+  }
+
+#undef NEXT
+#undef CASE
+}
+
+// Documented in .h file
+double ET_run_vars(ExprProgram prog, const double *vars)
+{
+  assert(prog != NULL);
+#ifdef ET_STATS
+  stats_add_runs(prog->ops, 1);
+#endif
+  return run_program(prog, vars);
+}
+
+
+/*
+ * Element-wise kernels used by ET_run_batch. Each computes
+ * out[i] = a[i] op b[i] (or -a[i]) for i < n; out may alias a or b.
+ */
+typedef struct
+{
+  void (*add)(double *out, const double *a, const double *b, size_t n);
+  void (*sub)(double *out, const double *a, const double *b, size_t n);
+  void (*mul)(double *out, const double *a, const double *b, size_t n);
+  void (*div)(double *out, const double *a, const double *b, size_t n);
+  void (*negate)(double *out, const double *a, size_t n);
+} BatchKernels;
+
+#define SCALAR_KERNEL(name, expr)                                             \
+  static void name(double *out, const double *a, const double *b, size_t n)   \
+  {                                                                           \
+    for (size_t i = 0; i < n; i++)                                            \
+      out[i] = (expr);                                                        \
+  }
+
+SCALAR_KERNEL(scalar_add, a[i] + b[i])
+SCALAR_KERNEL(scalar_sub, a[i] - b[i])
+SCALAR_KERNEL(scalar_mul, a[i] * b[i])
+SCALAR_KERNEL(scalar_div, a[i] / b[i])
+SCALAR_KERNEL(scalar_power, pow(a[i], b[i]))
+SCALAR_KERNEL(scalar_power_int, power_int(a[i], b[i]))
+
+static void scalar_negate(double *out, const double *a, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    out[i] = -a[i];
+}
+
+static void scalar_fma(double *out, const double *a, const double *b, const double *c, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    out[i] = fma(a[i], b[i], c[i]);
+}
+
+static const BatchKernels scalar_kernels = {
+    scalar_add, scalar_sub, scalar_mul, scalar_div, scalar_negate};
+
+#ifdef ET_HAVE_X86_SIMD
+
+/*
+ * Generate a vector kernel: width lanes at a time through the given
+ * intrinsic, then a scalar loop for the tail.
+ */
+#define SIMD_KERNEL(name, isa, vec, width, loadu, storeu, intrin, op)                 \
+  __attribute__((target(isa))) static void name(double *out, const double *a,         \
+                                               const double *b, size_t n)             \
+  {                                                                                   \
+    size_t i = 0;                                                                     \
+    for (; i + (width) <= n; i += (width))                                            \
+    {                                                                                 \
+      vec va = loadu(a + i);                                                          \
+      vec vb = loadu(b + i);                                                          \
+      storeu(out + i, intrin(va, vb));                                                \
+    }                                                                                 \
+    for (; i < n; i++)                                                                \
+      out[i] = a[i] op b[i];                                                          \
+  }
+
+SIMD_KERNEL(avx2_add, "avx2", __m256d, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_add_pd, +)
+SIMD_KERNEL(avx2_sub, "avx2", __m256d, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_sub_pd, -)
+SIMD_KERNEL(avx2_mul, "avx2", __m256d, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_mul_pd, *)
+SIMD_KERNEL(avx2_div, "avx2", __m256d, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_div_pd, /)
+
+__attribute__((target("avx2"))) static void avx2_negate(double *out, const double *a, size_t n)
+{
+  const __m256d sign = _mm256_set1_pd(-0.0);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4)
+    _mm256_storeu_pd(out + i, _mm256_xor_pd(_mm256_loadu_pd(a + i), sign));
+  for (; i < n; i++)
+    out[i] = -a[i];
+}
+
+static const BatchKernels avx2_kernels = {
+    avx2_add, avx2_sub, avx2_mul, avx2_div, avx2_negate};
+
+SIMD_KERNEL(avx512_add, "avx512f", __m512d, 8, _mm512_loadu_pd, _mm512_storeu_pd, _mm512_add_pd, +)
+SIMD_KERNEL(avx512_sub, "avx512f", __m512d, 8, _mm512_loadu_pd, _mm512_storeu_pd, _mm512_sub_pd, -)
+SIMD_KERNEL(avx512_mul, "avx512f", __m512d, 8, _mm512_loadu_pd, _mm512_storeu_pd, _mm512_mul_pd, *)
+SIMD_KERNEL(avx512_div, "avx512f", __m512d, 8, _mm512_loadu_pd, _mm512_storeu_pd, _mm512_div_pd, /)
+
+__attribute__((target("avx512f"))) static void avx512_negate(double *out, const double *a, size_t n)
+{
+  // AVX-512F has no double-precision xor, so flip the sign bit as integers
+  const __m512i sign = _mm512_set1_epi64((long long)0x8000000000000000ULL);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8)
+    _mm512_storeu_si512(out + i, _mm512_xor_si512(_mm512_loadu_si512(a + i), sign));
+  for (; i < n; i++)
+    out[i] = -a[i];
+}
+
+static const BatchKernels avx512_kernels = {
+    avx512_add, avx512_sub, avx512_mul, avx512_div, avx512_negate};
+
+#endif /* ET_HAVE_X86_SIMD */
+
+/*
+ * Pick the widest kernel set the running CPU supports
+ *
+ * Returns: The kernels to use
+ */
+static const BatchKernels *batch_kernels()
+{
+#ifdef ET_HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+    return &avx512_kernels;
+  if (__builtin_cpu_supports("avx2"))
+    return &avx2_kernels;
+#endif
+  return &scalar_kernels;
+}
+
+/*
+ * Apply a binary opcode element-wise to the top two stack entries
+ *
+ * Parameters:
+ *   k        The kernels to use
+ *   op       The opcode
+ *   out      Where to store the result
+ *   a        The entry below the top of the stack
+ *   b        The top of the stack
+ *   n        Number of rows
+ */
+static void batch_binary(const BatchKernels *k, long op, double *out,
+                         const double *a, const double *b, size_t n)
+{
+  switch (op)
+  {
+  case BC_ADD:
+    k->add(out, a, b, n);
+    break;
+  case BC_SUB:
+    k->sub(out, a, b, n);
+    break;
+  case BC_MUL:
+    k->mul(out, a, b, n);
+    break;
+  case BC_DIV:
+    k->div(out, a, b, n);
+    break;
+  case BC_POWER:
+    scalar_power(out, a, b, n);
+    break;
+  case BC_RSUB:
+    k->sub(out, b, a, n);
+    break;
+  case BC_RDIV:
+    k->div(out, b, a, n);
+    break;
+  case BC_RPOWER:
+    scalar_power(out, b, a, n);
+    break;
+  case BC_POWI:
+    scalar_power_int(out, a, b, n);
+    break;
+  case BC_RPOWI:
+    scalar_power_int(out, b, a, n);
+    break;
+  default:
+    assert(0);
+  }
+}
+
+// Documented in .h file
+void ET_run_batch(ExprProgram prog, const double *const *columns, size_t n_rows, double *out)
+{
+  assert(prog != NULL);
+
+  if (n_rows == 0)
+    return;
+#ifdef ET_STATS
+  stats_add_runs(prog->ops, n_rows);
+#endif
+
+  const BatchKernels *k = batch_kernels();
+
+  // stack entry i points either straight into a column or at scratch[i];
+  // the block past the stack takes batch kernel results, which may not
+  // alias their operands
+  double *scratch = malloc((prog->max_stack + 1) * ET_BATCH_BLOCK * sizeof(double));
+  const double **stack = malloc(prog->max_stack * sizeof(double *));
+  assert(scratch != NULL && stack != NULL);
+
+  for (size_t row = 0; row < n_rows; row += ET_BATCH_BLOCK)
+  {
+    size_t n = n_rows - row < ET_BATCH_BLOCK ? n_rows - row : ET_BATCH_BLOCK;
+    const ProgramSlot *pc = prog->code;
+    size_t sp = 0;
+    bool running = true;
+
+    while (running)
+    {
+      long op = (pc++)->op;
+      double *dst;
+
+      switch (op)
+      {
+      case BC_PUSH:
+      {
+        double value = (pc++)->value;
+        dst = scratch + sp * ET_BATCH_BLOCK;
+        for (size_t i = 0; i < n; i++)
+          dst[i] = value;
+        stack[sp++] = dst;
+        break;
+      }
+      case BC_LOAD:
+      {
+        long var = (pc++)->op;
+        if (columns != NULL)
+        {
+          stack[sp++] = columns[var] + row;
+          break;
+        }
+        dst = scratch + sp * ET_BATCH_BLOCK;
+        for (size_t i = 0; i < n; i++)
+          dst[i] = NAN;
+        stack[sp++] = dst;
+        break;
+      }
+      case BC_NEGATE:
+        dst = scratch + (sp - 1) * ET_BATCH_BLOCK;
+        k->negate(dst, stack[sp - 1], n);
+        stack[sp - 1] = dst;
+        break;
+      case BC_SUM:
+      case BC_PRODUCT:
+      {
+        // pairwise as in reduce_list, each step over a block of rows
+        size_t n_args = (pc++)->op, base = sp - n_args;
+        for (size_t len = n_args; len > 1; len = (len + 1) / 2)
+          for (size_t i = 0; i + (len + 1) / 2 < len; i++)
+          {
+            dst = scratch + (base + i) * ET_BATCH_BLOCK;
+            (op == BC_SUM ? k->add : k->mul)(dst, stack[base + i], stack[base + i + (len + 1) / 2], n);
+            stack[base + i] = dst;
+          }
+        sp = base + 1;
+        break;
+      }
+      case BC_FMA:
+        dst = scratch + (sp - 3) * ET_BATCH_BLOCK;
+        scalar_fma(dst, stack[sp - 3], stack[sp - 2], stack[sp - 1], n);
+        stack[sp - 3] = dst;
+        sp -= 2;
+        break;
+      case BC_CALL:
+      {
+        const FnEntry *f = &fn_table[(pc++)->op];
+        size_t base = sp - f->arity;
+        dst = scratch + base * ET_BATCH_BLOCK;
+        if (f->batch != NULL)
+        {
+          double *spare = scratch + prog->max_stack * ET_BATCH_BLOCK;
+          f->batch(stack + base, n, spare);
+          memcpy(dst, spare, n * sizeof(double));
+        }
+        else
+          for (size_t i = 0; i < n; i++)
+          {
+            double args[ET_MAX_ARITY];
+            for (size_t j = 0; j < f->arity; j++)
+              args[j] = stack[base + j][i];
+            dst[i] = f->scalar(args);
+          }
+        stack[base] = dst;
+        sp = base + 1;
+        break;
+      }
+      case BC_HALT:
+        running = false;
+        break;
+      default:
+        dst = scratch + (sp - 2) * ET_BATCH_BLOCK;
+        batch_binary(k, op, dst, stack[sp - 2], stack[sp - 1], n);
+        stack[sp - 2] = dst;
+        sp--;
+        break;
+      }
+    }
+
+    memcpy(out + row, stack[0], n * sizeof(double));
+  }
+
+  free(stack);
+  free(scratch);
+}
+
+// Documented in .h file
+void ET_evaluate_batch(ExprTree tree, const double *const *columns, size_t n_rows, double *out)
+{
+  ExprProgram prog = ET_compile(tree);
+  ET_run_batch(prog, columns, n_rows, out);
+  ET_program_free(prog);
+}
+
+// Doubles of stack and tape that ET_run_gradient_batch works in at
+// most, which limits the rows per block for large programs
+#define ET_GRADIENT_BUDGET (1 << 22)
+
+/*
+ * Return the number of operands the instruction at pc pops
+ */
+static inline size_t program_pops(const ProgramSlot *pc)
+{
+  switch (pc->op)
+  {
+  case BC_PUSH:
+  case BC_LOAD:
+    return 0;
+  case BC_NEGATE:
+    return 1;
+  case BC_SUM:
+  case BC_PRODUCT:
+    return pc[1].op;
+  case BC_FMA:
+    return 3;
+  case BC_CALL:
+    return fn_table[pc[1].op].arity;
+  default:
+    return 2;
+  }
+}
+
+/*
+ * Index the instructions of prog for gradient_block, leaving the memory
+ * for the caller to allocate
+ */
+static GradientTape *gradient_tape(ExprProgram prog)
+{
+  GradientTape *tape = malloc(sizeof(GradientTape));
+  assert(tape != NULL);
+  tape->n_instrs = 0;
+  tape->n_pops = 0;
+  tape->mem = NULL;
+
+  // an instruction takes at least one slot
+  tape->starts = malloc(prog->n_slots * sizeof(size_t));
+  assert(tape->starts != NULL);
+  for (const ProgramSlot *pc = prog->code; pc->op != BC_HALT;)
+  {
+    tape->starts[tape->n_instrs++] = pc - prog->code;
+    tape->n_pops += program_pops(pc);
+    pc += instr_slots(pc->op);
+  }
+  return tape;
+}
+
+/*
+ * Where gradient_block reads variables and adds up their partial
+ * derivatives: one row, or a block of rows of columns
+ */
+typedef struct
+{
+  const double *vars;             // the row, or NULL
+  double *grad;
+  const double *const *columns;   // the columns, or NULL for a row
+  double *const *grads;
+  size_t row;                     // first row of the block
+  size_t n_vars;
+} GradientIO;
+
+static inline double gradient_load(const GradientIO *io, size_t var, size_t r)
+{
+  if (var >= io->n_vars)
+    return NAN;
+  if (io->columns != NULL)
+    return io->columns[var][io->row + r];
+  return io->vars != NULL ? io->vars[var] : NAN;
+}
+
+static inline void gradient_store(const GradientIO *io, size_t var, size_t r, double adjoint)
+{
+  if (var >= io->n_vars)
+    return;
+  if (io->columns != NULL)
+    io->grads[var][io->row + r] += adjoint;
+  else
+    io->grad[var] += adjoint;
+}
+
+/*
+ * The partial derivatives of base ^ exponent, scaled by adjoint. The
+ * one for the exponent is base ^ exponent * log(base): NaN for negative
+ * bases, where the power is only defined at integers, and 0 where the
+ * power is 0.
+ */
+static inline void power_partials(double base, double exponent, double adjoint, bool integer,
+                                  double *d_base, double *d_exponent)
+{
+  double (*power)(double, double) = integer ? power_int : pow;
+  double result = power(base, exponent);
+
+  *d_base = exponent == 0 ? 0 : adjoint * exponent * power(base, exponent - 1);
+  *d_exponent = result == 0 ? 0 : adjoint * result * log(base);
+}
+
+/*
+ * Differentiate prog on a block of n rows: a forward sweep computes
+ * the value of each row exactly as ET_run_vars would, recording every
+ * operand an instruction pops on the tape, and a reverse sweep then
+ * runs the instructions backwards, taking each result's adjoint off
+ * the adjoint stack and pushing its operands' adjoints in its place.
+ * Entry d of a stack is the n doubles at d * n.
+ *
+ * Parameters:
+ *   prog     The program
+ *   tape     Its instruction index
+ *   mem      Room for n * (2 * prog->max_stack + tape->n_pops) doubles
+ *   n        Number of rows
+ *   io       The variables, and the gradients to add to
+ *
+ * Returns: The values of the rows, at the start of mem
+ */
+static const double *gradient_block(ExprProgram prog, const GradientTape *tape, double *mem, size_t n,
+                                    const GradientIO *io)
+{
+  double *stack = mem;
+  double *adjoints = mem + prog->max_stack * n;
+  double *popped = adjoints + prog->max_stack * n;
+  size_t sp = 0, tp = 0;
+
+  for (size_t i = 0; i < tape->n_instrs; i++)
+  {
+    const ProgramSlot *pc = prog->code + tape->starts[i];
+    double *x = stack + sp * n;
+
+    if (pc->op == BC_PUSH || pc->op == BC_LOAD)
+    {
+      for (size_t r = 0; r < n; r++)
+        x[r] = pc->op == BC_PUSH ? pc[1].value : gradient_load(io, pc[1].op, r);
+      sp++;
+      continue;
+    }
+
+    size_t k = program_pops(pc);
+    x -= k * n;
+    memcpy(popped + tp * n, x, k * n * sizeof(double));
+    tp += k;
+    double *y = x + n, *z = y + n;
+
+    switch (pc->op)
+    {
+    case BC_NEGATE:
+      for (size_t r = 0; r < n; r++)
+        x[r] = -x[r];
+      break;
+    case BC_ADD:
+      for (size_t r = 0; r < n; r++)
+        x[r] = x[r] + y[r];
+      break;
+    case BC_SUB:
+      for (size_t r = 0; r < n; r++)
+        x[r] = x[r] - y[r];
+      break;
+    case BC_MUL:
+      for (size_t r = 0; r < n; r++)
+        x[r] = x[r] * y[r];
+      break;
+    case BC_DIV:
+      for (size_t r = 0; r < n; r++)
+        x[r] = x[r] / y[r];
+      break;
+    case BC_POWER:
+      for (size_t r = 0; r < n; r++)
+        x[r] = pow(x[r], y[r]);
+      break;
+    case BC_RSUB:
+      for (size_t r = 0; r < n; r++)
+        x[r] = y[r] - x[r];
+      break;
+    case BC_RDIV:
+      for (size_t r = 0; r < n; r++)
+        x[r] = y[r] / x[r];
+      break;
+    case BC_RPOWER:
+      for (size_t r = 0; r < n; r++)
+        x[r] = pow(y[r], x[r]);
+      break;
+    case BC_POWI:
+      for (size_t r = 0; r < n; r++)
+        x[r] = power_int(x[r], y[r]);
+      break;
+    case BC_RPOWI:
+      for (size_t r = 0; r < n; r++)
+        x[r] = power_int(y[r], x[r]);
+      break;
+    case BC_FMA:
+      for (size_t r = 0; r < n; r++)
+        x[r] = fma(x[r], y[r], z[r]);
+      break;
+    case BC_SUM:
+    case BC_PRODUCT:
+      // pairwise, as reduce_list does for a single row
+      for (size_t len = k; len > 1; len = (len + 1) / 2)
+        for (size_t j = 0; j + (len + 1) / 2 < len; j++)
+        {
+          double *a = x + j * n, *b = x + (j + (len + 1) / 2) * n;
+          if (pc->op == BC_SUM)
+            for (size_t r = 0; r < n; r++)
+              a[r] += b[r];
+          else
+            for (size_t r = 0; r < n; r++)
+              a[r] *= b[r];
+        }
+      break;
+    case BC_CALL:
+    {
+      const FnEntry *f = &fn_table[pc[1].op];
+      for (size_t r = 0; r < n; r++)
+      {
+        double args[ET_MAX_ARITY];
+        for (size_t j = 0; j < k; j++)
+          args[j] = x[j * n + r];
+        x[r] = f->scalar(args);
+      }
+      break;
+    }
+    default:
+      assert(0);
+    }
+    sp -= k - 1;
+  }
+
+  // the result's own adjoint is 1
+  size_t asp = 1;
+  for (size_t r = 0; r < n; r++)
+    adjoints[r] = 1;
+
+  for (size_t i = tape->n_instrs; i-- > 0;)
+  {
+    const ProgramSlot *pc = prog->code + tape->starts[i];
+
+    if (pc->op == BC_PUSH || pc->op == BC_LOAD)
+    {
+      asp--;
+      if (pc->op == BC_LOAD)
+        for (size_t r = 0; r < n; r++)
+          gradient_store(io, pc[1].op, r, adjoints[asp * n + r]);
+      continue;
+    }
+
+    // the operands' adjoints replace the result's
+    size_t k = program_pops(pc);
+    tp -= k;
+    const double *x = popped + tp * n, *y = x + n;
+    double *dx = adjoints + (asp - 1) * n, *dy = dx + n, *dz = dy + n;
+    asp += k - 1;
+
+    for (size_t r = 0; r < n; r++)
+    {
+      double g = dx[r];
+
+      switch (pc->op)
+      {
+      case BC_NEGATE:
+        dx[r] = -g;
+        break;
+      case BC_ADD:
+        dy[r] = g;
+        break;
+      case BC_SUB:
+        dy[r] = -g;
+        break;
+      case BC_RSUB:
+        dx[r] = -g;
+        dy[r] = g;
+        break;
+      case BC_MUL:
+        dx[r] = g * y[r];
+        dy[r] = g * x[r];
+        break;
+      case BC_DIV:
+        dx[r] = g / y[r];
+        dy[r] = -g * (x[r] / y[r]) / y[r];
+        break;
+      case BC_RDIV:
+        dx[r] = -g * (y[r] / x[r]) / x[r];
+        dy[r] = g / x[r];
+        break;
+      case BC_POWER:
+      case BC_POWI:
+        power_partials(x[r], y[r], g, pc->op == BC_POWI, &dx[r], &dy[r]);
+        break;
+      case BC_RPOWER:
+      case BC_RPOWI:
+        power_partials(y[r], x[r], g, pc->op == BC_RPOWI, &dy[r], &dx[r]);
+        break;
+      case BC_FMA:
+        dx[r] = g * y[r];
+        dy[r] = g * x[r];
+        dz[r] = g;
+        break;
+      case BC_SUM:
+        for (size_t j = 0; j < k; j++)
+          dx[j * n + r] = g;
+        break;
+      case BC_PRODUCT:
+      {
+        // the product of the other operands, without dividing, which a
+        // zero operand would break: prefix products times suffix ones
+        double prefix = 1, suffix = g;
+        for (size_t j = 0; j < k; j++)
+        {
+          dx[j * n + r] = prefix;
+          prefix *= x[j * n + r];
+        }
+        for (size_t j = k; j-- > 0;)
+        {
+          dx[j * n + r] *= suffix;
+          suffix *= x[j * n + r];
+        }
+        break;
+      }
+      case BC_CALL:
+      {
+        // a function registered without a derivative kernel is
+        // differentiated by central differences, with the step that
+        // balances truncation against rounding error
+        const FnEntry *f = &fn_table[pc[1].op];
+        double args[ET_MAX_ARITY], partials[ET_MAX_ARITY];
+        for (size_t j = 0; j < k; j++)
+          args[j] = x[j * n + r];
+        if (f->partials != NULL)
+          f->partials(args, partials);
+        else
+          for (size_t j = 0; j < k; j++)
+          {
+            double a = args[j], h = cbrt(DBL_EPSILON) * fmax(1, fabs(a));
+            args[j] = a + h;
+            double up = f->scalar(args);
+            args[j] = a - h;
+            double down = f->scalar(args);
+            args[j] = a;
+            partials[j] = (up - down) / (2 * h);
+          }
+        for (size_t j = 0; j < k; j++)
+          dx[j * n + r] = g * partials[j];
+        break;
+      }
+      default:
+        assert(0);
+      }
+    }
+  }
+
+  return stack;
+}
+
+// Documented in .h file
+double ET_run_gradient(ExprProgram prog, const double *vars, size_t n_vars, double *grad)
+{
+  assert(prog != NULL && (grad != NULL || n_vars == 0));
+#ifdef ET_STATS
+  stats_add_runs(prog->ops, 1);
+#endif
+
+  if (prog->tape == NULL)
+  {
+    prog->tape = gradient_tape(prog);
+    prog->tape->mem = malloc((2 * prog->max_stack + prog->tape->n_pops) * sizeof(double));
+    assert(prog->tape->mem != NULL);
+  }
+
+  for (size_t v = 0; v < n_vars; v++)
+    grad[v] = 0;
+  GradientIO io = {vars, grad, NULL, NULL, 0, n_vars};
+  return gradient_block(prog, prog->tape, prog->tape->mem, 1, &io)[0];
+}
+
+// Documented in .h file
+void ET_run_gradient_batch(ExprProgram prog, const double *const *columns, size_t n_rows, size_t n_vars,
+                           double *out, double *const *grads)
+{
+  assert(prog != NULL && (grads != NULL || n_vars == 0));
+
+  if (n_rows == 0)
+    return;
+#ifdef ET_STATS
+  stats_add_runs(prog->ops, n_rows);
+#endif
+
+  GradientTape *tape = gradient_tape(prog);
+  size_t per_row = 2 * prog->max_stack + tape->n_pops;
+  size_t block = ET_GRADIENT_BUDGET / per_row;
+  if (block > ET_BATCH_BLOCK)
+    block = ET_BATCH_BLOCK;
+  if (block > n_rows)
+    block = n_rows;
+  if (block == 0)
+    block = 1;
+  tape->mem = malloc(block * per_row * sizeof(double));
+  assert(tape->mem != NULL);
+
+  for (size_t v = 0; v < n_vars; v++)
+    memset(grads[v], 0, n_rows * sizeof(double));
+
+  for (size_t row = 0; row < n_rows; row += block)
+  {
+    size_t n = n_rows - row < block ? n_rows - row : block;
+    GradientIO io = {NULL, NULL, columns, grads, row, n_vars};
+    const double *values = gradient_block(prog, tape, tape->mem, n, &io);
+    if (out != NULL)
+      memcpy(out + row, values, n * sizeof(double));
+  }
+
+  gradient_tape_free(tape);
+}
+
+// Documented in .h file
+double ET_gradient(ExprTree tree, const double *vars, size_t n_vars, double *grad)
+{
+  ExprProgram prog = ET_compile(tree);
+  double value = ET_run_gradient(prog, vars, n_vars, grad);
+  ET_program_free(prog);
+  return value;
+}
+
+// Child index of a missing operand in an ExprFrozen
+#define FROZEN_NONE UINT32_MAX
+
+/*
+ * An immutable tree in structure-of-arrays form, nodes in preorder so
+ * that every child comes after its parent. For interior nodes left and
+ * right are child indices (FROZEN_NONE for a missing operand); for list
+ * nodes left is the offset of the child indices in args and right their
+ * number, or for OP_CALL the function, whose arity gives the number.
+ * For VALUE leaves left indexes values, and for VARIABLE leaves it is
+ * the variable.
+ */
+struct _expr_frozen
+{
+  uint32_t n_nodes;
+  uint32_t n_values;
+  uint32_t n_args;
+  uint32_t max_args;     // operands of the largest list node
+  unsigned char *types;  // one ExprNodeType per node
+  uint32_t *left;
+  uint32_t *right;
+  double *values;
+  uint32_t *args;
+#ifdef ET_STATS
+  size_t ops[ET_NODE_TYPES]; // operations one evaluation executes
+#endif
+};
+
+/*
+ * Return the number of operands of the frozen list node i
+ */
+static inline uint32_t frozen_n_args(ExprFrozen frozen, uint32_t i)
+{
+  return frozen->types[i] == OP_CALL ? fn_table[frozen->right[i]].arity : frozen->right[i];
+}
+
+// Documented in .h file
+ExprFrozen ET_freeze(ExprTree tree)
+{
+  if (tree == NULL || tree->count >= FROZEN_NONE)
+    return NULL;
+
+  uint32_t n = tree->count;
+  ExprFrozen frozen = calloc(1, sizeof(struct _expr_frozen));
+  assert(frozen != NULL);
+  frozen->n_nodes = n;
+  frozen->types = malloc(n);
+  frozen->left = malloc(n * sizeof(uint32_t));
+  frozen->right = malloc(n * sizeof(uint32_t));
+  frozen->values = malloc(n * sizeof(double));
+  size_t args_cap = 16;
+  frozen->args = malloc(args_cap * sizeof(uint32_t));
+  assert(frozen->types != NULL && frozen->left != NULL && frozen->right != NULL &&
+         frozen->values != NULL && frozen->args != NULL);
+
+  // Nodes are numbered in the order they are popped, which is preorder,
+  // so each child's index follows from the counts of its elder siblings.
+  // Shared subtrees are copied wherever they appear.
+  WalkStack stack;
+  walk_init(&stack);
+  walk_push(&stack, tree, 0);
+  bool fits = true;
+
+  while (stack.top > 0 && fits)
+  {
+    WalkEntry e = stack.items[--stack.top];
+    ExprTree t = e.node;
+    uint32_t i = e.aux;
+
+    frozen->types[i] = t->type;
+#ifdef ET_STATS
+    frozen->ops[t->type]++;
+#endif
+    if (t->type == VALUE)
+    {
+      frozen->values[frozen->n_values] = t->n.value;
+      frozen->left[i] = frozen->n_values++;
+      continue;
+    }
+    if (t->type == VARIABLE)
+    {
+      fits = t->n.var < FROZEN_NONE;
+      frozen->left[i] = t->n.var;
+      continue;
+    }
+
+    size_t n_kids = n_children(t);
+    uint32_t *kids = NULL;    // where list nodes keep their child indices
+    if (is_list(t))
+    {
+      if (frozen->n_args + n_kids > args_cap)
+      {
+        while (frozen->n_args + n_kids > args_cap)
+          args_cap *= 2;
+        frozen->args = realloc(frozen->args, args_cap * sizeof(uint32_t));
+        assert(frozen->args != NULL);
+      }
+      frozen->left[i] = frozen->n_args;
+      frozen->right[i] = t->type == OP_CALL ? t->n.list.fn : n_kids;
+      kids = frozen->args + frozen->n_args;
+      frozen->n_args += n_kids;
+      if (n_kids > frozen->max_args)
+        frozen->max_args = n_kids;
+    }
+    else
+    {
+      ExprTree l = children(t)[LEFT], r = children(t)[RIGHT];
+      frozen->left[i] = l == NULL ? FROZEN_NONE : i + 1;
+      frozen->right[i] = r == NULL ? FROZEN_NONE : i + 1 + (l == NULL ? 0 : l->count);
+    }
+
+    uint32_t next = i + 1;
+    for (size_t k = 0; k < n_kids; k++)
+    {
+      ExprTree child = children(t)[k];
+      if (kids != NULL)
+        kids[k] = next;
+      if (child != NULL)
+        next += child->count;
+    }
+    for (size_t k = n_kids; k-- > 0;)
+    {
+      ExprTree child = children(t)[k];
+      if (child == NULL)
+        continue;
+      next -= child->count;
+      walk_push(&stack, child, next);
+    }
+  }
+  walk_free(&stack);
+
+  if (!fits)
+  {
+    ET_frozen_free(frozen);
+    return NULL;
+  }
+
+  // give back what the constants and list operands did not use
+  frozen->values = realloc(frozen->values, (frozen->n_values ? frozen->n_values : 1) * sizeof(double));
+  frozen->args = realloc(frozen->args, (frozen->n_args ? frozen->n_args : 1) * sizeof(uint32_t));
+  assert(frozen->values != NULL && frozen->args != NULL);
+  return frozen;
+}
+
+// Documented in .h file
+void ET_frozen_free(ExprFrozen frozen)
+{
+  if (frozen == NULL)
+    return;
+
+  free(frozen->types);
+  free(frozen->left);
+  free(frozen->right);
+  free(frozen->values);
+  free(frozen->args);
+  free(frozen);
+}
+
+// Documented in .h file
+int ET_frozen_count(ExprFrozen frozen)
+{
+  return frozen == NULL ? 0 : frozen->n_nodes;
+}
+
+// Documented in .h file
+int ET_frozen_depth(ExprFrozen frozen)
+{
+  if (frozen == NULL)
+    return 0;
+
+  // children come after their parents, so a backward scan sees every
+  // child's depth before its parent's
+  uint32_t *depth = malloc(frozen->n_nodes * sizeof(uint32_t));
+  assert(depth != NULL);
+
+  for (uint32_t i = frozen->n_nodes; i-- > 0;)
+  {
+    ExprNodeType type = frozen->types[i];
+    uint32_t d = 0;
+
+    if (type == VALUE || type == VARIABLE)
+    {
+      depth[i] = 1;
+      continue;
+    }
+    if (type == OP_SUM || type == OP_PRODUCT || type == OP_FMA || type == OP_CALL)
+    {
+      const uint32_t *kids = frozen->args + frozen->left[i];
+      for (uint32_t k = 0; k < frozen_n_args(frozen, i); k++)
+        if (depth[kids[k]] > d)
+          d = depth[kids[k]];
+    }
+    else
+    {
+      if (frozen->left[i] != FROZEN_NONE && depth[frozen->left[i]] > d)
+        d = depth[frozen->left[i]];
+      if (frozen->right[i] != FROZEN_NONE && depth[frozen->right[i]] > d)
+        d = depth[frozen->right[i]];
+    }
+    depth[i] = d + 1;
+  }
+
+  int result = depth[0];
+  free(depth);
+  return result;
+}
+
+// Documented in .h file
+double ET_frozen_evaluate(ExprFrozen frozen, const double *vars)
+{
+  if (frozen == NULL)
+    return 0;
+#ifdef ET_STATS
+  stats_add_runs(frozen->ops, 1);
+#endif
+
+  // one value per node, filled in a backward scan as for ET_frozen_depth;
+  // list operands are gathered into scratch, which reduction overwrites
+  double *vals = malloc((frozen->n_nodes + frozen->max_args) * sizeof(double));
+  assert(vals != NULL);
+  double *scratch = vals + frozen->n_nodes;
+
+  for (uint32_t i = frozen->n_nodes; i-- > 0;)
+  {
+    ExprNodeType type = frozen->types[i];
+    uint32_t l = frozen->left[i], r = frozen->right[i];
+
+    switch (type)
+    {
+    case VALUE:
+      vals[i] = frozen->values[l];
+      break;
+    case VARIABLE:
+      vals[i] = vars == NULL ? NAN : vars[l];
+      break;
+    case OP_SUM:
+    case OP_PRODUCT:
+    case OP_FMA:
+      for (uint32_t k = 0; k < r; k++)
+        scratch[k] = vals[frozen->args[l + k]];
+      vals[i] = apply_args(type, scratch, r);
+      break;
+    case OP_CALL:
+      for (uint32_t k = 0; k < fn_table[r].arity; k++)
+        scratch[k] = vals[frozen->args[l + k]];
+      vals[i] = fn_table[r].scalar(scratch);
+      break;
+    default:
+      vals[i] = apply_op(type, l == FROZEN_NONE ? 0 : vals[l], r == FROZEN_NONE ? 0 : vals[r]);
+      break;
+    }
+  }
+
+  double result = vals[0];
+  free(vals);
+  return result;
+}
+
+/*
+ * A pending piece of output for ET_frozen_tree2string, as StringItem
+ * is for ET_tree2string
+ */
+typedef struct
+{
+  uint32_t node;
+  unsigned char part;
+  char op;
+} FrozenStringItem;
+
+// Documented in .h file
+size_t ET_frozen_tree2string(ExprFrozen frozen, char *buf, size_t buf_sz)
+{
+  if (frozen == NULL || buf == NULL || buf_sz == 0)
+    return 0;
+
+  StringWriter w = {buf, buf_sz, 0, false};
+  size_t cap = 64, top = 0;
+  FrozenStringItem *stack = malloc(cap * sizeof(FrozenStringItem));
+  assert(stack != NULL);
+  stack[top++] = (FrozenStringItem){0, EMIT_TREE, 0};
+
+  while (top > 0 && !w.truncated)
+  {
+    FrozenStringItem item = stack[--top];
+    uint32_t i = item.node;
+    char num[32];
+
+    if (item.part == EMIT_CLOSE)
+    {
+      writer_append(&w, ")", 1);
+      continue;
+    }
+
+    if (item.part == EMIT_OP)
+    {
+      char op[3] = {' ', item.op, ' '};
+      writer_append(&w, op + (item.op == ','), sizeof(op) - (item.op == ','));
+      continue;
+    }
+
+    if (i == FROZEN_NONE)
+      continue;
+
+    ExprNodeType type = frozen->types[i];
+    if (type == VALUE || type == VARIABLE)
+    {
+      int len = type == VALUE ? snprintf(num, sizeof(num), "%g", frozen->values[frozen->left[i]])
+                              : snprintf(num, sizeof(num), "x%u", (unsigned int)frozen->left[i]);
+      writer_append(&w, num, len);
+      continue;
+    }
+
+    bool list = type == OP_SUM || type == OP_PRODUCT || type == OP_FMA || type == OP_CALL;
+    const uint32_t *kids = list ? frozen->args + frozen->left[i] : (uint32_t[]){frozen->left[i], frozen->right[i]};
+    size_t n = list ? frozen_n_args(frozen, i) : type == UNARY_NEGATE ? 1 : 2;
+    if (top + 2 * n + 1 > cap)
+    {
+      while (top + 2 * n + 1 > cap)
+        cap *= 2;
+      stack = realloc(stack, cap * sizeof(FrozenStringItem));
+      assert(stack != NULL);
+    }
+
+    stack[top++] = (FrozenStringItem){i, EMIT_CLOSE, 0};
+    for (size_t k = n; k-- > 0;)
+    {
+      stack[top++] = (FrozenStringItem){kids[k], EMIT_TREE, 0};
+      if (k > 0)
+        stack[top++] = (FrozenStringItem){i, EMIT_OP, operand_separator(type, k)};
+    }
+    if (type == OP_CALL)
+      writer_append(&w, fn_table[frozen->right[i]].name, strlen(fn_table[frozen->right[i]].name));
+    writer_append(&w, type == UNARY_NEGATE ? "(-" : "(", type == UNARY_NEGATE ? 2 : 1);
+  }
+
+  free(stack);
+  return writer_finish(&w);
+}
+
+struct _expr_jit
+{
+  ExprJitFunction fn;   // native code, or NULL to fall back to prog
+  void *mem;            // the executable mapping holding fn
+  size_t mem_sz;
+  ExprProgram prog;     // kept only when fn is NULL
+#ifdef ET_STATS
+  size_t ops[ET_NODE_TYPES]; // operations one run executes
+#endif
+};
+
+#ifdef ET_HAVE_JIT
+
+// The top JIT_REGS entries of the value stack live in xmm0..xmm13, and
+// the rest in the frame at [rsp + 8 * depth]. xmm14 and xmm15 are
+// scratch registers.
+#define JIT_REGS 14
+#define JIT_SCRATCH 14
+#define JIT_SCRATCH2 15
+
+// Constant pool entries that every function has
+#define JIT_POOL_SIGN 0   // 16-byte sign mask for xorpd
+#define JIT_POOL_NULL 2   // the result when vars is NULL
+
+// SSE2 opcodes, following a 0x0F escape
+#define SSE_MOVSD_LOAD 0x10  // F2
+#define SSE_MOVSD_STORE 0x11 // F2
+#define SSE_MOVAPD 0x28      // 66
+#define SSE_XORPD 0x57       // 66
+#define SSE_ADDSD 0x58       // F2
+#define SSE_MULSD 0x59       // F2
+#define SSE_SUBSD 0x5C       // F2
+#define SSE_DIVSD 0x5E       // F2
+
+// Kinds of the ModRM rm operand of jit_sse
+enum
+{
+  JIT_XMM,  // an xmm register
+  JIT_RSP,  // [rsp + disp32], the stack frame
+  JIT_RBX,  // [rbx + disp32], the vars array
+  JIT_POOL  // [rip + disp32] pointing into the constant pool
+};
+
+/*
+ * Machine code being generated, with its constant pool. The pool is
+ * placed after the code, so rip-relative references to it are patched
+ * once the code size is known.
+ */
+typedef struct
+{
+  unsigned char *code;
+  size_t len, cap;
+  uint64_t *pool;
+  size_t n_pool, pool_cap;
+  size_t *fixups;       // pairs of (code offset of a disp32, pool index)
+  size_t n_fixups, fixups_cap;
+} JitBuf;
+
+/*
+ * Append n bytes to the code
+ */
+static void jit_bytes(JitBuf *b, const void *bytes, size_t n)
+{
+  if (b->len + n > b->cap)
+  {
+    while (b->len + n > b->cap)
+      b->cap *= 2;
+    b->code = realloc(b->code, b->cap);
+    assert(b->code != NULL);
+  }
+  memcpy(b->code + b->len, bytes, n);
+  b->len += n;
+}
+
+static void jit_byte(JitBuf *b, unsigned char byte)
+{
+  jit_bytes(b, &byte, 1);
+}
+
+static void jit_u32(JitBuf *b, uint32_t v)
+{
+  unsigned char bytes[4] = {v, v >> 8, v >> 16, v >> 24};
+  jit_bytes(b, bytes, 4);
+}
+
+/*
+ * Add a 64-bit entry to the constant pool
+ *
+ * Returns: Its index
+ */
+static size_t jit_pool(JitBuf *b, uint64_t bits)
+{
+  if (b->n_pool == b->pool_cap)
+  {
+    b->pool_cap *= 2;
+    b->pool = realloc(b->pool, b->pool_cap * sizeof(uint64_t));
+    assert(b->pool != NULL);
+  }
+  b->pool[b->n_pool] = bits;
+  return b->n_pool++;
+}
+
+/*
+ * Emit the SSE2 instruction "prefix [REX] 0F opcode ModRM", with the
+ * xmm register reg in the ModRM reg field and an rm operand of the
+ * given kind; arg is the register, displacement or pool index
+ */
+static void jit_sse(JitBuf *b, unsigned char prefix, unsigned char opcode, int reg, int kind, size_t arg)
+{
+  int rm = kind == JIT_XMM ? (int)arg : 0;
+  unsigned char rex = 0x40 | (reg >= 8 ? 0x04 : 0) | (rm >= 8 ? 0x01 : 0);
+
+  jit_byte(b, prefix);
+  if (rex != 0x40)
+    jit_byte(b, rex);
+  jit_byte(b, 0x0F);
+  jit_byte(b, opcode);
+
+  switch (kind)
+  {
+  case JIT_XMM:
+    jit_byte(b, 0xC0 | (reg & 7) << 3 | (rm & 7));
+    break;
+  case JIT_RSP:
+    jit_byte(b, 0x84 | (reg & 7) << 3);
+    jit_byte(b, 0x24);
+    jit_u32(b, arg);
+    break;
+  case JIT_RBX:
+    jit_byte(b, 0x83 | (reg & 7) << 3);
+    jit_u32(b, arg);
+    break;
+  case JIT_POOL:
+    jit_byte(b, 0x05 | (reg & 7) << 3);
+    if (b->n_fixups + 2 > b->fixups_cap)
+    {
+      b->fixups_cap *= 2;
+      b->fixups = realloc(b->fixups, b->fixups_cap * sizeof(size_t));
+      assert(b->fixups != NULL);
+    }
+    b->fixups[b->n_fixups++] = b->len;
+    b->fixups[b->n_fixups++] = arg;
+    jit_u32(b, 0);
+    break;
+  default:
+    assert(0);
+  }
+}
+
+/*
+ * Move stack entry i into xmm register reg, if it is not there already
+ */
+static void jit_load_slot(JitBuf *b, int reg, size_t i)
+{
+  if (i >= JIT_REGS)
+    jit_sse(b, 0xF2, SSE_MOVSD_LOAD, reg, JIT_RSP, 8 * i);
+  else if ((int)i != reg)
+    jit_sse(b, 0x66, SSE_MOVAPD, reg, JIT_XMM, i);
+}
+
+/*
+ * Move xmm register reg into stack entry i, if it is not there already
+ */
+static void jit_store_slot(JitBuf *b, size_t i, int reg)
+{
+  if (i >= JIT_REGS)
+    jit_sse(b, 0xF2, SSE_MOVSD_STORE, reg, JIT_RSP, 8 * i);
+  else if ((int)i != reg)
+    jit_sse(b, 0x66, SSE_MOVAPD, i, JIT_XMM, reg);
+}
+
+/*
+ * Emit "reg = reg op stack entry i" for a scalar arithmetic opcode
+ */
+static void jit_op_slot(JitBuf *b, unsigned char opcode, int reg, size_t i)
+{
+  if (i >= JIT_REGS)
+    jit_sse(b, 0xF2, opcode, reg, JIT_RSP, 8 * i);
+  else
+    jit_sse(b, 0xF2, opcode, reg, JIT_XMM, i);
+}
+
+/*
+ * The register an operation on stack entry i computes in: its own, or
+ * scratch if the entry lives in memory
+ */
+static inline int jit_work_reg(size_t i)
+{
+  return i < JIT_REGS ? (int)i : JIT_SCRATCH;
+}
+
+/*
+ * Emit a call to the function at addr, passing stack entries args as
+ * its double arguments and leaving the result in entry dst. Every xmm
+ * register is caller-saved, so the depth entries on the stack that live
+ * in registers are spilled around the call, and the arguments loaded
+ * back from the frame. With args NULL the function instead takes a
+ * pointer to the entries from dst up, which the spill leaves in order
+ * in the frame.
+ */
+static void jit_call(JitBuf *b, uint64_t addr, size_t dst, const size_t *args, int n_args, size_t depth)
+{
+  static const unsigned char call_rax[] = {0xFF, 0xD0};
+  static const unsigned char lea_rdi_rsp[] = {0x48, 0x8D, 0xBC, 0x24}; // lea rdi, [rsp + disp32]
+  size_t live = depth < JIT_REGS ? depth : JIT_REGS;
+  size_t kept = dst < JIT_REGS ? dst : JIT_REGS;
+
+  for (size_t i = 0; i < live; i++)
+    jit_sse(b, 0xF2, SSE_MOVSD_STORE, i, JIT_RSP, 8 * i);
+  if (args == NULL)
+  {
+    jit_bytes(b, lea_rdi_rsp, sizeof(lea_rdi_rsp));
+    jit_u32(b, 8 * dst);
+  }
+  for (int i = 0; args != NULL && i < n_args; i++)
+    jit_sse(b, 0xF2, SSE_MOVSD_LOAD, i, JIT_RSP, 8 * args[i]);
+
+  // mov rax, imm64; call rax
+  jit_byte(b, 0x48);
+  jit_byte(b, 0xB8);
+  jit_bytes(b, &addr, 8);
+  jit_bytes(b, call_rax, sizeof(call_rax));
+
+  jit_sse(b, 0x66, SSE_MOVAPD, JIT_SCRATCH, JIT_XMM, 0);
+  for (size_t i = 0; i < kept; i++)
+    jit_sse(b, 0xF2, SSE_MOVSD_LOAD, i, JIT_RSP, 8 * i);
+  jit_store_slot(b, dst, JIT_SCRATCH);
+}
+
+/*
+ * Translate a compiled program into x86-64 machine code in b. The
+ * value stack maps onto registers and the frame as described above, so
+ * each bytecode becomes one or a few SSE2 instructions.
+ *
+ * Returns: false if the program cannot be translated
+ */
+static bool jit_translate(JitBuf *b, ExprProgram prog, double null_result)
+{
+  static const unsigned char prologue[] = {
+      0x53,             // push rbx
+      0x48, 0x89, 0xFB, // mov rbx, rdi
+      0x48, 0x81, 0xEC, // sub rsp, imm32
+  };
+  static const unsigned char epilogue[] = {
+      0x48, 0x81, 0xC4, // add rsp, imm32
+  };
+  static const unsigned char test_rdi_jz[] = {
+      0x48, 0x85, 0xFF, // test rdi, rdi
+      0x0F, 0x84,       // jz rel32
+  };
+
+  // rsp is 16-byte aligned after the push, and stays so for calls
+  size_t frame = (8 * prog->max_stack + 15) & ~(size_t)15;
+  if (frame > INT32_MAX)
+    return false;
+
+  jit_pool(b, 0x8000000000000000ull);
+  jit_pool(b, 0);
+  uint64_t null_bits;
+  memcpy(&null_bits, &null_result, sizeof(double));
+  jit_pool(b, null_bits);
+
+  // with no vars every variable is NAN, so the result is a constant
+  jit_bytes(b, test_rdi_jz, sizeof(test_rdi_jz));
+  size_t jz_at = b->len;
+  jit_u32(b, 0);
+  jit_bytes(b, prologue, sizeof(prologue));
+  jit_u32(b, frame);
+
+  size_t depth = 0;
+  for (const ProgramSlot *pc = prog->code; pc->op != BC_HALT; pc++)
+  {
+    switch (pc->op)
+    {
+    case BC_PUSH:
+    {
+      uint64_t bits;
+      pc++;
+      memcpy(&bits, &pc->value, sizeof(double));
+      jit_sse(b, 0xF2, SSE_MOVSD_LOAD, jit_work_reg(depth), JIT_POOL, jit_pool(b, bits));
+      jit_store_slot(b, depth, jit_work_reg(depth));
+      depth++;
+      break;
+    }
+    case BC_LOAD:
+      pc++;
+      if ((size_t)pc->op > INT32_MAX / 8)
+        return false;
+      jit_sse(b, 0xF2, SSE_MOVSD_LOAD, jit_work_reg(depth), JIT_RBX, 8 * pc->op);
+      jit_store_slot(b, depth, jit_work_reg(depth));
+      depth++;
+      break;
+    case BC_NEGATE:
+      jit_load_slot(b, jit_work_reg(depth - 1), depth - 1);
+      jit_sse(b, 0x66, SSE_XORPD, jit_work_reg(depth - 1), JIT_POOL, JIT_POOL_SIGN);
+      jit_store_slot(b, depth - 1, jit_work_reg(depth - 1));
+      break;
+    case BC_ADD:
+    case BC_SUB:
+    case BC_MUL:
+    case BC_DIV:
+    {
+      static const unsigned char ops[] = {
+          [BC_ADD] = SSE_ADDSD, [BC_SUB] = SSE_SUBSD, [BC_MUL] = SSE_MULSD, [BC_DIV] = SSE_DIVSD};
+      int reg = jit_work_reg(depth - 2);
+      jit_load_slot(b, reg, depth - 2);
+      jit_op_slot(b, ops[pc->op], reg, depth - 1);
+      jit_store_slot(b, depth - 2, reg);
+      depth--;
+      break;
+    }
+    case BC_RSUB:
+    case BC_RDIV:
+    {
+      // the left operand is on top; compute in scratch to keep the
+      // operand order, which decides which NaN comes out
+      jit_load_slot(b, JIT_SCRATCH, depth - 1);
+      jit_op_slot(b, pc->op == BC_RSUB ? SSE_SUBSD : SSE_DIVSD, JIT_SCRATCH, depth - 2);
+      jit_store_slot(b, depth - 2, JIT_SCRATCH);
+      depth--;
+      break;
+    }
+    case BC_POWER:
+    case BC_RPOWER:
+    case BC_POWI:
+    case BC_RPOWI:
+    {
+      double (*fn)(double, double) = pc->op == BC_POWER || pc->op == BC_RPOWER ? pow : power_int;
+      bool reversed = pc->op == BC_RPOWER || pc->op == BC_RPOWI;
+      size_t args[] = {reversed ? depth - 1 : depth - 2, reversed ? depth - 2 : depth - 1};
+      jit_call(b, (uintptr_t)fn, depth - 2, args, 2, depth);
+      depth--;
+      break;
+    }
+    case BC_FMA:
+    {
+      double (*fn)(double, double, double) = fma;
+      size_t args[] = {depth - 3, depth - 2, depth - 1};
+      jit_call(b, (uintptr_t)fn, depth - 3, args, 3, depth);
+      depth -= 2;
+      break;
+    }
+    case BC_CALL:
+    {
+      const FnEntry *f = &fn_table[(++pc)->op];
+      jit_call(b, (uintptr_t)f->scalar, depth - f->arity, NULL, 0, depth);
+      depth -= f->arity - 1;
+      break;
+    }
+    case BC_SUM:
+    case BC_PRODUCT:
+    {
+      // pairwise as in reduce_list, in place on the stack entries
+      unsigned char opcode = pc->op == BC_SUM ? SSE_ADDSD : SSE_MULSD;
+      size_t n_args = (++pc)->op, base = depth - n_args;
+      for (size_t len = n_args; len > 1; len = (len + 1) / 2)
+        for (size_t i = 0; i + (len + 1) / 2 < len; i++)
+        {
+          int reg = jit_work_reg(base + i);
+          jit_load_slot(b, reg, base + i);
+          jit_op_slot(b, opcode, reg, base + i + (len + 1) / 2);
+          jit_store_slot(b, base + i, reg);
+        }
+      depth = base + 1;
+      break;
+    }
+    default:
+      assert(0);
+    }
+  }
+
+  // the result is entry 0, which is xmm0
+  jit_bytes(b, epilogue, sizeof(epilogue));
+  jit_u32(b, frame);
+  jit_byte(b, 0x5B); // pop rbx
+  jit_byte(b, 0xC3); // ret
+
+  uint32_t rel = b->len - (jz_at + 4);
+  memcpy(b->code + jz_at, &rel, 4);
+  jit_sse(b, 0xF2, SSE_MOVSD_LOAD, 0, JIT_POOL, JIT_POOL_NULL);
+  jit_byte(b, 0xC3); // ret
+  return true;
+}
+
+/*
+ * Generate native code for prog into jit->fn, in a fresh mapping that
+ * is made executable (and no longer writable) once filled in
+ *
+ * Returns: true on success
+ */
+static bool jit_build(ExprJit jit, ExprProgram prog)
+{
+  JitBuf b = {NULL, 0, 256, NULL, 0, 16, NULL, 0, 16};
+  b.code = malloc(b.cap);
+  b.pool = malloc(b.pool_cap * sizeof(uint64_t));
+  b.fixups = malloc(b.fixups_cap * sizeof(size_t));
+  assert(b.code != NULL && b.pool != NULL && b.fixups != NULL);
+
+  bool ok = jit_translate(&b, prog, run_program(prog, NULL));
+  if (ok)
+  {
+    size_t pool_at = (b.len + 15) & ~(size_t)15;
+    long page = sysconf(_SC_PAGESIZE);
+    jit->mem_sz = (pool_at + b.n_pool * sizeof(uint64_t) + page - 1) / page * page;
+    jit->mem = mmap(NULL, jit->mem_sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ok = jit->mem != MAP_FAILED;
+  }
+
+  if (ok)
+  {
+    size_t pool_at = (b.len + 15) & ~(size_t)15;
+    unsigned char *mem = jit->mem;
+
+    memcpy(mem, b.code, b.len);
+    memcpy(mem + pool_at, b.pool, b.n_pool * sizeof(uint64_t));
+    for (size_t i = 0; i < b.n_fixups; i += 2)
+    {
+      // rip-relative to the end of the disp32, which ends the instruction
+      uint32_t rel = pool_at + 8 * b.fixups[i + 1] - (b.fixups[i] + 4);
+      memcpy(mem + b.fixups[i], &rel, 4);
+    }
+
+    if (mprotect(jit->mem, jit->mem_sz, PROT_READ | PROT_EXEC) == 0)
+      jit->fn = (ExprJitFunction)jit->mem;
+    else
+    {
+      munmap(jit->mem, jit->mem_sz);
+      ok = false;
+    }
+  }
+
+  if (!ok)
+    jit->mem = NULL;
+  free(b.code);
+  free(b.pool);
+  free(b.fixups);
+  return ok;
+}
+
+#endif /* ET_HAVE_JIT */
+
+// Documented in .h file
+ExprJit ET_jit(ExprTree tree)
+{
+  ExprJit jit = malloc(sizeof(struct _expr_jit));
+  assert(jit != NULL);
+  jit->fn = NULL;
+  jit->mem = NULL;
+  jit->mem_sz = 0;
+  jit->prog = ET_compile(tree);
+#ifdef ET_STATS
+  memcpy(jit->ops, jit->prog->ops, sizeof(jit->ops));
+#endif
+
+#ifdef ET_HAVE_JIT
+  if (jit_build(jit, jit->prog))
+  {
+    ET_program_free(jit->prog);
+    jit->prog = NULL;
+  }
+#endif
+
+  return jit;
+}
+
+// Documented in .h file
+ExprJitFunction ET_jit_function(ExprJit jit)
+{
+  assert(jit != NULL);
+  return jit->fn;
+}
+
+// Documented in .h file
+double ET_jit_run(ExprJit jit, const double *vars)
+{
+  assert(jit != NULL);
+
+  if (jit->fn != NULL)
+  {
+#ifdef ET_STATS
+    stats_add_runs(jit->ops, 1);
+#endif
+    return jit->fn(vars);
+  }
+  return ET_run_vars(jit->prog, vars);
+}
+
+// Documented in .h file
+void ET_jit_free(ExprJit jit)
+{
+  if (jit == NULL)
+    return;
+
+  if (jit->mem != NULL)
+    munmap(jit->mem, jit->mem_sz);
+  ET_program_free(jit->prog);
+  free(jit);
+}
+
+
+/*
+ * Release a subtree discarded by ET_simplify and add its size to
+ * *removed
+ */
+static void simplify_discard(ExprTree tree, int *removed)
+{
+  *removed += ET_count(tree);
+  orphan(tree);
+  ET_free(tree);
+}
+
+/*
+ * Turn the interior node tree into a constant leaf, discarding its
+ * children
+ */
+static ExprTree simplify_to_value(ExprTree tree, double value, int *removed)
+{
+  for (size_t i = 0; i < n_operands(tree); i++)
+    simplify_discard(children(tree)[i], removed);
+  if (is_list(tree) && !(tree->flags & ET_FLAG_ARENA))
+    free(tree->n.list.args);
+  tree->type = VALUE;
+  tree->n.value = value;
+  return tree;
+}
+
+/*
+ * Replace the interior node tree by one of its children, discarding
+ * tree and its other child
+ */
+static ExprTree simplify_to_child(ExprTree tree, int keep, int *removed)
+{
+  ExprTree kept = tree->n.child[keep];
+  simplify_discard(tree->n.child[1 - keep], removed);
+  free_node(tree);
+  (*removed)++;
+  return kept;
+}
+
+/*
+ * Simplify a single node whose children have already been simplified
+ *
+ * Parameters:
+ *   tree     The node
+ *   strict   Only apply rewrites that are exact for NaN, infinities
+ *            and signed zeros
+ *   removed  In/out: number of nodes removed so far
+ *
+ * Returns: The node that replaces tree (possibly tree itself)
+ */
+static ExprTree simplify_node(ExprTree tree, bool strict, int *removed)
+{
+  if (is_list(tree))
+  {
+    // constant operands fold as ET_evaluate would reduce them
+    size_t n = tree->n.list.n_args;
+    for (size_t i = 0; i < n; i++)
+      if (tree->n.list.args[i]->type != VALUE)
+        return tree;
+
+    double *vals = malloc(n * sizeof(double));
+    assert(vals != NULL);
+    for (size_t i = 0; i < n; i++)
+      vals[i] = tree->n.list.args[i]->n.value;
+    double value = apply_node(tree, vals);
+    free(vals);
+    return simplify_to_value(tree, value, removed);
+  }
+
+  ExprTree left = tree->n.child[LEFT];
+
+  if (tree->type == UNARY_NEGATE)
+  {
+    if (left == NULL)
+      return tree;
+
+    if (left->type == VALUE)
+      return simplify_to_value(tree, -left->n.value, removed);
+
+    // -(-x) ==> x
+    if (left->type == UNARY_NEGATE && tree->refs == 1 && left->refs == 1)
+    {
+      ExprTree inner = left->n.child[LEFT];
+      free_node(left);
+      free_node(tree);
+      *removed += 2;
+      return inner;
+    }
+    return tree;
+  }
+
+  ExprTree right = tree->n.child[RIGHT];
+  if (left == NULL || right == NULL)
+    return tree;
+
+  // constant subtrees fold to exactly what ET_evaluate would compute
+  if (left->type == VALUE && right->type == VALUE)
+    return simplify_to_value(tree, apply_op(tree->type, left->n.value, right->n.value), removed);
+
+  if (right->type == VALUE)
+  {
+    double c = right->n.value;
+
+    switch (tree->type)
+    {
+    case OP_ADD:
+      // x + -0 is exact; x + 0 turns -0 into +0
+      if (c == 0 && (signbit(c) || !strict))
+        return simplify_to_child(tree, LEFT, removed);
+      break;
+    case OP_SUB:
+      // x - 0 is exact; x - -0 turns -0 into +0
+      if (c == 0 && (!signbit(c) || !strict))
+        return simplify_to_child(tree, LEFT, removed);
+      break;
+    case OP_MUL:
+      if (c == 1)
+        return simplify_to_child(tree, LEFT, removed);
+      // x * 0 is not 0 for NaN, infinities or negative x
+      if (c == 0 && !strict)
+        return simplify_to_value(tree, 0, removed);
+      // x * -1 may differ from -x in the sign of a NaN
+      if (c == -1 && !strict)
+      {
+        simplify_discard(right, removed);
+        tree->type = UNARY_NEGATE;
+        tree->n.child[RIGHT] = NULL;
+        return simplify_node(tree, strict, removed);
+      }
+      break;
+    case OP_DIV:
+      if (c == 1)
+        return simplify_to_child(tree, LEFT, removed);
+      break;
+    case OP_POWER:
+    case OP_POWI:
+      if (c == 1)
+        return simplify_to_child(tree, LEFT, removed);
+      // pow(x, 0) is 1 for every x, even NaN
+      if (c == 0)
+        return simplify_to_value(tree, 1, removed);
+      break;
+    default:
+      break;
+    }
+  }
+
+  if (left->type == VALUE)
+  {
+    double c = left->n.value;
+
+    switch (tree->type)
+    {
+    case OP_ADD:
+      // -0 + x is exact; 0 + x turns -0 into +0
+      if (c == 0 && (signbit(c) || !strict))
+        return simplify_to_child(tree, RIGHT, removed);
+      break;
+    case OP_SUB:
+      // -0 - x is -x but for the sign of a NaN, which negation flips;
+      // 0 - x also turns -0 into +0
+      if (c == 0 && !strict)
+      {
+        simplify_discard(left, removed);
+        tree->type = UNARY_NEGATE;
+        tree->n.child[LEFT] = right;
+        tree->n.child[RIGHT] = NULL;
+        return simplify_node(tree, strict, removed);
+      }
+      break;
+    case OP_MUL:
+      if (c == 1)
+        return simplify_to_child(tree, RIGHT, removed);
+      if (c == 0 && !strict)
+        return simplify_to_value(tree, 0, removed);
+      break;
+    case OP_POWER:
+    case OP_POWI:
+      // pow(1, y) is 1 for every y, even NaN
+      if (c == 1)
+        return simplify_to_value(tree, 1, removed);
+      break;
+    default:
+      break;
+    }
+  }
+
+  return tree;
+}
+
+/*
+ * State of a rewrite_tree walk
+ */
+typedef struct
+{
+  ExprTree root;  // the tree being rewritten
+  bool strict;    // ET_simplify: only rewrites exact for every input
+  int count;      // nodes removed or rewritten so far
+} RewriteCtx;
+
+/*
+ * Rewrite a tree in place, bottom-up: fn is given each node once its
+ * children have been rewritten, and returns the node that replaces it
+ * (possibly the node itself).
+ *
+ * Nodes that other trees can reach, those with several references and
+ * everything below them, are copied on write: fn is given a copy, which
+ * replaces the node only if fn changed it, and then the nodes above it
+ * are copied in turn to point at the replacement. So fn only ever sees
+ * nodes whose references all come from the walk itself.
+ *
+ * Parameters:
+ *   tree     The tree to rewrite
+ *   fn       The rewrite of a single node
+ *   ctx      Passed on to fn; ctx->root is set to tree
+ *
+ * Returns: The rewritten tree
+ */
+static ExprTree rewrite_tree(ExprTree tree, ExprTree (*fn)(ExprTree, RewriteCtx *), RewriteCtx *ctx)
+{
+  ctx->root = tree;
+
+  // postorder walk; aux is the child of each path node being visited
+  WalkStack path;
+  walk_init(&path);
+  // the path entries that are copies made by the walk, by index (aux)
+  WalkStack copies;
+  walk_init(&copies);
+  // index of the highest path entry with other references, if any
+  size_t shared_from = SIZE_MAX;
+
+  ExprTree t = tree;
+  for (;;)
+  {
+    while (t != NULL && !is_leaf(t))
+    {
+      if (shared_from == SIZE_MAX && t->refs > 1)
+        shared_from = path.top;
+      walk_push(&path, t, LEFT);
+      t = children(t)[0];
+    }
+
+    // climb while the node on top of the path has all its children done
+    t = NULL;
+    while (path.top > 0)
+    {
+      WalkEntry *e = &path.items[path.top - 1];
+
+      if (e->aux + 1 < n_operands(e->node))
+      {
+        t = children(e->node)[++e->aux];
+        break;
+      }
+
+      size_t index = path.top - 1;
+      bool copied = copies.top > 0 && copies.items[copies.top - 1].aux == index;
+      bool shared = shared_from <= index && !copied;
+      ExprTree replacement;
+
+      if (shared)
+      {
+        ExprTree copy = node_copy(e->node);
+        replacement = fn(copy, ctx);
+        if (replacement == copy)
+        {
+          bool same = copy->type == e->node->type &&
+                      (is_list(copy) ? copy->n.list.n_args == e->node->n.list.n_args &&
+                                           memcmp(copy->n.list.args, e->node->n.list.args,
+                                                  copy->n.list.n_args * sizeof(ExprTree)) == 0
+                                     : memcmp(&copy->n, &e->node->n, sizeof(copy->n)) == 0);
+          if (same)
+          {
+            node_discard(copy);
+            replacement = e->node;
+          }
+          else
+            link_children(copy);
+        }
+      }
+      else
+      {
+        e->node->epoch = 0;
+        replacement = fn(e->node, ctx);
+        // a replacement's old parent is gone
+        if (replacement != e->node)
+          orphan(replacement);
+      }
+      update_size(replacement);
+
+      if (copied)
+        copies.top--;
+      if (shared_from == index)
+        shared_from = SIZE_MAX;
+      path.top--;
+
+      ExprTree *slot = path.top > 0 ? &children(path.items[path.top - 1].node)[path.items[path.top - 1].aux] : &tree;
+      if (replacement == *slot)
+        continue;
+
+      if (path.top > 0)
+      {
+        // a parent that other trees can reach is copied before it is
+        // changed; its children, the old one included, gain a reference
+        WalkEntry *parent = &path.items[path.top - 1];
+        if (shared_from <= index - 1 && !(copies.top > 0 && copies.items[copies.top - 1].aux == index - 1))
+        {
+          parent->node = node_copy(parent->node);
+          link_children(parent->node);
+          walk_push(&copies, parent->node, index - 1);
+          if (shared_from == index - 1)
+            shared_from = SIZE_MAX;
+          slot = &children(parent->node)[parent->aux];
+        }
+      }
+
+      // fn had a copy rather than the old node, which is left to its
+      // other holders
+      if (shared || copied)
+        atomic_fetch_sub_explicit(&(*slot)->refs, 1, memory_order_relaxed);
+      *slot = replacement;
+      if (path.top > 0)
+        link_child(path.items[path.top - 1].node, replacement);
+    }
+
+    if (path.top == 0)
+      break;
+  }
+
+  walk_free(&copies);
+  walk_free(&path);
+  // the walk dropped the cached values below tree, which may have
+  // changed, so those above it go too; the sizes above it change
+  if (tree != NULL)
+  {
+    mark_dirty(tree);
+    for (ExprTree t = tree->parent; t != NULL; t = t->parent)
+      update_size(t);
+  }
+  return tree;
+}
+
+/*
+ * The rewrite_tree step of ET_simplify
+ */
+static ExprTree simplify_step(ExprTree tree, RewriteCtx *ctx)
+{
+  return simplify_node(tree, ctx->strict, &ctx->count);
+}
+
+// Documented in .h file
+ExprTree ET_simplify(ExprTree tree, bool strict, int *removed)
+{
+  RewriteCtx ctx = {tree, strict, 0};
+
+  tree = rewrite_tree(tree, simplify_step, &ctx);
+  if (removed != NULL)
+    *removed = ctx.count;
+  return tree;
+}
+
+/*
+ * Specialize a single node of the original tree, given what ET_specialize
+ * made of its operands: each either the operand itself, which holds no
+ * reference, or a replacement holding one
+ *
+ * Parameters:
+ *   tree     The node
+ *   ops      Its n_operands(tree) specialized operands
+ *
+ * Returns: tree itself if no operand changed, otherwise a new value or
+ *   node holding a reference of its own. The references held by ops are
+ *   passed on to the new node or dropped.
+ */
+static ExprTree specialize_node(ExprTree tree, const WalkEntry *ops)
+{
+  size_t k = n_operands(tree);
+  bool constant = true, same = true;
+
+  for (size_t i = 0; i < k; i++)
+  {
+    if (ops[i].node != NULL && ops[i].node->type != VALUE)
+      constant = false;
+    if (ops[i].node != children(tree)[i])
+      same = false;
+  }
+
+  // every operand is known, so fold to exactly what ET_evaluate would
+  // compute here; a missing operand evaluates to 0
+  if (constant)
+  {
+    double small[4];
+    double *vals = k <= 4 ? small : malloc(k * sizeof(double));
+    assert(vals != NULL);
+    for (size_t i = 0; i < k; i++)
+    {
+      vals[i] = ops[i].node == NULL ? 0 : ops[i].node->n.value;
+      if (ops[i].node != children(tree)[i])
+        ET_free(ops[i].node);
+    }
+    double value = apply_node(tree, vals);
+    if (vals != small)
+      free(vals);
+    return ET_value(value);
+  }
+
+  if (same)
+    return tree;
+
+  // the copy points at the replacements instead of the operands they
+  // replace, which are left to the original tree
+  ExprTree copy = node_copy(tree);
+  for (size_t i = 0; i < k; i++)
+    if (ops[i].node != children(tree)[i])
+    {
+      atomic_fetch_sub_explicit(&children(copy)[i]->refs, 1, memory_order_relaxed);
+      children(copy)[i] = ops[i].node;
+    }
+  link_children(copy);
+  update_size(copy);
+  return copy;
+}
+
+/*
+ * qsort comparator ordering pointers into one array of bindings by
+ * variable, and bindings of the same variable by their place in the array
+ */
+static int binding_before(const void *a, const void *b)
+{
+  const ExprBinding *x = *(const ExprBinding *const *)a, *y = *(const ExprBinding *const *)b;
+  if (x->var != y->var)
+    return (x->var > y->var) - (x->var < y->var);
+  return (x > y) - (x < y);
+}
+
+/*
+ * Return the binding of var among n bindings sorted by variable, or NULL
+ * if it is unbound
+ */
+static const ExprBinding *binding_find(const ExprBinding *sorted, size_t n, size_t var)
+{
+  size_t lo = 0, hi = n;
+  while (lo < hi)
+  {
+    size_t mid = lo + (hi - lo) / 2;
+    if (sorted[mid].var < var)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo < n && sorted[lo].var == var ? &sorted[lo] : NULL;
+}
+
+// Documented in .h file
+ExprTree ET_specialize(ExprTree tree, const ExprBinding *bindings, size_t n_bindings)
+{
+  if (tree == NULL)
+    return NULL;
+
+  // the bindings sorted by variable, one per variable, so that their
+  // size follows n_bindings rather than the variable indices; a later
+  // binding of the same variable wins
+  const ExprBinding **order = malloc((n_bindings + 1) * sizeof(ExprBinding *));
+  ExprBinding *sorted = malloc((n_bindings + 1) * sizeof(ExprBinding));
+  assert(order != NULL && sorted != NULL);
+  for (size_t i = 0; i < n_bindings; i++)
+    order[i] = &bindings[i];
+  qsort(order, n_bindings, sizeof(ExprBinding *), binding_before);
+  size_t n_bound = 0;
+  for (size_t i = 0; i < n_bindings; i++)
+    if (i + 1 == n_bindings || order[i + 1]->var != order[i]->var)
+      sorted[n_bound++] = *order[i];
+  free(order);
+
+  // postorder walk as in ET_evaluate_vars; aux says which child of each
+  // node on the path is being specialized
+  WalkStack path;
+  walk_init(&path);
+  // the specialized operands so far, in postorder, as specialize_node
+  // takes them
+  WalkStack done;
+  walk_init(&done);
+  // what shared nodes became, each holding a reference unless it is
+  // the node itself, so that a DAG is specialized into a DAG
+  NodeMap memo;
+  map_init(&memo);
+  NodeMapEntry *hit = NULL;
+
+  ExprTree t = tree;
+  for (;;)
+  {
+    while (t != NULL && !is_leaf(t))
+    {
+      if (t->refs > 1 && (hit = map_find(&memo, t)) != NULL)
+        break;
+      walk_push(&path, t, LEFT);
+      t = children(t)[0];
+    }
+
+    ExprTree r = t;
+    const ExprBinding *b = NULL;
+    if (t != NULL && t->type == VARIABLE && (b = binding_find(sorted, n_bound, t->n.var)) != NULL)
+      r = ET_value(b->value);
+    else if (t != NULL && !is_leaf(t))
+    {
+      r = (ExprTree)(uintptr_t)hit->val.u;
+      if (r != t)
+        ET_share(r);
+    }
+    walk_push(&done, r, 0);
+
+    // climb while the node on top of the path has all its operands
+    t = NULL;
+    while (path.top > 0)
+    {
+      WalkEntry *e = &path.items[path.top - 1];
+
+      if (e->aux + 1 < n_operands(e->node))
+      {
+        t = children(e->node)[++e->aux];
+        break;
+      }
+
+      ExprTree node = e->node;
+      done.top -= n_operands(node);
+      r = specialize_node(node, done.items + done.top);
+      walk_push(&done, r, 0);
+      if (node->refs > 1)
+        map_insert(&memo, node)->val.u = (uintptr_t)(r == node ? r : ET_share(r));
+      path.top--;
+    }
+
+    if (path.top == 0)
+      break;
+  }
+
+  ExprTree result = done.items[0].node;
+  for (size_t i = 0; i < memo.cap; i++)
+    if (memo.entries[i].key != NULL && memo.entries[i].val.u != (uintptr_t)memo.entries[i].key)
+      ET_free((ExprTree)(uintptr_t)memo.entries[i].val.u);
+  map_free(&memo);
+  walk_free(&done);
+  walk_free(&path);
+  free(sorted);
+
+  // the caller owns the result, even when nothing was bound
+  return result == tree ? ET_share(tree) : result;
+}
+
+/*
+ * Return true if ET_fuse may rewrite tree or fold it into another
+ * node: a heap node with a single reference
+ */
+static inline bool fuse_owned(ExprTree tree)
+{
+  return tree->refs == 1 && !(tree->flags & ET_FLAG_ARENA);
+}
+
+/*
+ * Return the list node type that ET_fuse folds chains of tree's type
+ * into, or VALUE if there is none
+ */
+static inline ExprNodeType fuse_group(ExprTree tree)
+{
+  switch (tree->type)
+  {
+  case OP_ADD:
+  case OP_SUM:
+    return OP_SUM;
+  case OP_MUL:
+  case OP_PRODUCT:
+    return OP_PRODUCT;
+  default:
+    return VALUE;
+  }
+}
+
+/*
+ * Return true if ET_fuse folds tree into the list node that its parent
+ * becomes, rather than making tree a list node of its own
+ */
+static bool fuse_absorbed(ExprTree tree, const RewriteCtx *ctx)
+{
+  ExprTree parent = tree->parent;
+
+  return tree != ctx->root && parent != NULL && fuse_group(tree) != VALUE &&
+         fuse_group(tree) == fuse_group(parent) && fuse_owned(tree) && fuse_owned(parent);
+}
+
+/*
+ * Turn the interior node tree into a list node of the given type and
+ * operands, whose parents are forgotten first
+ */
+static void fuse_to_list(ExprTree tree, ExprNodeType type, ExprTree *args, size_t n_args)
+{
+  for (size_t i = 0; i < n_args; i++)
+    orphan(args[i]);
+  if (is_list(tree))
+    free(tree->n.list.args);
+
+  tree->type = type;
+  tree->n.list.args = args;
+  list_init(tree, args, n_args);
+}
+
+/*
+ * The first rewrite_tree step of ET_fuse: fold the chain of additions
+ * or multiplications that tree tops into a single list node, and turn
+ * a power with a small integer exponent into OP_POWI. The nodes of a
+ * chain below its top are left for the top to fold, so that each chain
+ * is gathered once, in time linear in its length.
+ */
+static ExprTree fuse_chain(ExprTree tree, RewriteCtx *ctx)
+{
+  if (!fuse_owned(tree))
+    return tree;
+
+  if (tree->type == OP_POWER)
+  {
+    ExprTree right = tree->n.child[RIGHT];
+    if (tree->n.child[LEFT] != NULL && right != NULL && right->type == VALUE &&
+        fabs(right->n.value) <= ET_POWI_MAX && right->n.value == (int)right->n.value)
+    {
+      tree->type = OP_POWI;
+      ctx->count++;
+    }
+    return tree;
+  }
+
+  if (fuse_group(tree) == VALUE || fuse_absorbed(tree, ctx))
+    return tree;
+
+  // the operands of the chain from left to right, and the chain's
+  // nodes below tree
+  WalkStack pending, absorbed;
+  walk_init(&pending);
+  walk_init(&absorbed);
+  size_t n_args = 0, cap = 16;
+  ExprTree *args = malloc(cap * sizeof(ExprTree));
+  assert(args != NULL);
+  bool ok = true;
+
+  for (size_t i = n_children(tree); i-- > 0;)
+    walk_push(&pending, children(tree)[i], 0);
+  while (ok && pending.top > 0)
+  {
+    ExprTree t = pending.items[--pending.top].node;
+
+    // a missing operand is not worth a special case
+    if (t == NULL)
+      ok = false;
+    else if (fuse_absorbed(t, ctx))
+    {
+      walk_push(&absorbed, t, 0);
+      for (size_t i = n_children(t); i-- > 0;)
+        walk_push(&pending, children(t)[i], 0);
+    }
+    else
+    {
+      if (n_args == cap)
+      {
+        cap *= 2;
+        args = realloc(args, cap * sizeof(ExprTree));
+        assert(args != NULL);
+      }
+      args[n_args++] = t;
+    }
+  }
+
+  if (ok && absorbed.top > 0)
+  {
+    for (size_t i = 0; i < absorbed.top; i++)
+      node_release(absorbed.items[i].node);
+    fuse_to_list(tree, fuse_group(tree), args, n_args);
+    ctx->count += 1 + absorbed.top;
+  }
+  else
+    free(args);
+
+  walk_free(&absorbed);
+  walk_free(&pending);
+  return tree;
+}
+
+/*
+ * The second rewrite_tree step of ET_fuse: turn an addition with a
+ * multiplication as either operand into OP_FMA
+ */
+static ExprTree fuse_fma(ExprTree tree, RewriteCtx *ctx)
+{
+  if (tree->type != OP_ADD || !fuse_owned(tree))
+    return tree;
+
+  for (int side = LEFT; side <= RIGHT; side++)
+  {
+    ExprTree mul = tree->n.child[side], addend = tree->n.child[1 - side];
+
+    if (mul == NULL || addend == NULL || mul->type != OP_MUL || !fuse_owned(mul) ||
+        mul->n.child[LEFT] == NULL || mul->n.child[RIGHT] == NULL)
+      continue;
+
+    ExprTree *args = malloc(3 * sizeof(ExprTree));
+    assert(args != NULL);
+    args[0] = mul->n.child[LEFT];
+    args[1] = mul->n.child[RIGHT];
+    args[2] = addend;
+    node_release(mul);
+    fuse_to_list(tree, OP_FMA, args, 3);
+    ctx->count += 2;
+    break;
+  }
+
+  return tree;
+}
+
+// Documented in .h file
+ExprTree ET_fuse(ExprTree tree, int *fused)
+{
+  RewriteCtx ctx = {tree, false, 0};
+
+  // chains first, so that an addition is only left for an FMA when it
+  // is not part of a longer sum
+  tree = rewrite_tree(tree, fuse_chain, &ctx);
+  tree = rewrite_tree(tree, fuse_fma, &ctx);
+  if (fused != NULL)
+    *fused = ctx.count;
+  return tree;
+}
+
+
+/*
+ * Hash a single node from its type, its payload and the addresses of
+ * its children. Once the children are interned, equal hashes (and
+ * intern_equal) mean equal subtrees.
+ */
+static uint64_t intern_hash(ExprTree tree)
+{
+  uint64_t h = hash_u64(tree->type + 1);
+
+  switch (tree->type)
+  {
+  case VALUE:
+    return hash_combine(h, double_bits(tree->n.value));
+  case VARIABLE:
+    return hash_combine(h, tree->n.var);
+  default:
+    if (tree->type == OP_CALL)
+      h = hash_combine(h, tree->n.list.fn);
+    for (size_t i = 0; i < n_operands(tree); i++)
+      h = hash_combine(h, (uintptr_t)children(tree)[i]);
+    return h;
+  }
+}
+
+/*
+ * Return true if a and b have the same type, payload and children
+ */
+static bool intern_equal(ExprTree a, ExprTree b)
+{
+  if (a->type != b->type)
+    return false;
+
+  switch (a->type)
+  {
+  case VALUE:
+    return double_bits(a->n.value) == double_bits(b->n.value);
+  case VARIABLE:
+    return a->n.var == b->n.var;
+  default:
+    if (n_operands(a) != n_operands(b) || (a->type == OP_CALL && a->n.list.fn != b->n.list.fn))
+      return false;
+    for (size_t i = 0; i < n_operands(a); i++)
+      if (children(a)[i] != children(b)[i])
+        return false;
+    return true;
+  }
+}
+
+/*
+ * The set of canonical nodes built up by ET_intern, keyed by
+ * intern_hash, with open addressing
+ */
+typedef struct
+{
+  ExprTree *slots;
+  size_t cap;    // a power of two
+  size_t used;
+} InternTable;
+
+/*
+ * Return the canonical node equal to tree, making tree canonical if
+ * there is none yet
+ */
+static ExprTree intern_lookup(InternTable *table, ExprTree tree)
+{
+  if (2 * (table->used + 1) > table->cap)
+  {
+    InternTable bigger = {NULL, 2 * table->cap, 0};
+    bigger.slots = calloc(bigger.cap, sizeof(ExprTree));
+    assert(bigger.slots != NULL);
+    for (size_t i = 0; i < table->cap; i++)
+      if (table->slots[i] != NULL)
+        intern_lookup(&bigger, table->slots[i]);
+    free(table->slots);
+    *table = bigger;
+  }
+
+  size_t i = intern_hash(tree) & (table->cap - 1);
+  for (; table->slots[i] != NULL; i = (i + 1) & (table->cap - 1))
+    if (table->slots[i] == tree || intern_equal(table->slots[i], tree))
+      return table->slots[i];
+
+  table->slots[i] = tree;
+  table->used++;
+  return tree;
+}
+
+/*
+ * Replace tree by its canonical equivalent, moving the reference tree
+ * held over to the canonical node
+ */
+static ExprTree intern_node(InternTable *table, ExprTree tree)
+{
+  ExprTree canonical = intern_lookup(table, tree);
+
+  if (canonical != tree)
+  {
+    canonical->refs++;
+    ET_free(tree);
+  }
+  return canonical;
+}
+
+// Documented in .h file
+ExprTree ET_intern(ExprTree tree)
+{
+  InternTable table = {NULL, 64, 0};
+  table.slots = calloc(table.cap, sizeof(ExprTree));
+  assert(table.slots != NULL);
+
+  // shared nodes that are already canonical, so a DAG input is only
+  // walked once per distinct node
+  NodeMap done;
+  map_init(&done);
+
+  // postorder walk; aux is the child of each path node being visited
+  WalkStack path;
+  walk_init(&path);
+
+  ExprTree t = tree;
+  for (;;)
+  {
+    // arena nodes are left alone
+    while (t != NULL && !is_leaf(t) && !(t->flags & ET_FLAG_ARENA) &&
+           !(t->refs > 1 && map_find(&done, t) != NULL))
+    {
+      walk_push(&path, t, LEFT);
+      t = children(t)[0];
+    }
+
+    if (t != NULL && is_leaf(t) && !(t->flags & ET_FLAG_ARENA))
+    {
+      ExprTree leaf = intern_node(&table, t);
+      if (path.top > 0)
+      {
+        children(path.items[path.top - 1].node)[path.items[path.top - 1].aux] = leaf;
+        link_child(path.items[path.top - 1].node, leaf);
+      }
+      else
+        tree = leaf;
+    }
+
+    // climb while the node on top of the path has all its children done
+    t = NULL;
+    while (path.top > 0)
+    {
+      WalkEntry *e = &path.items[path.top - 1];
+
+      if (e->aux + 1 < n_operands(e->node))
+      {
+        t = children(e->node)[++e->aux];
+        break;
+      }
+
+      ExprTree canonical = intern_node(&table, e->node);
+      if (canonical->refs > 1)
+        map_insert(&done, canonical);
+      path.top--;
+      if (path.top > 0)
+      {
+        children(path.items[path.top - 1].node)[path.items[path.top - 1].aux] = canonical;
+        link_child(path.items[path.top - 1].node, canonical);
+      }
+      else
+        tree = canonical;
+    }
+
+    if (path.top == 0)
+      break;
+  }
+
+  walk_free(&path);
+  map_free(&done);
+  free(table.slots);
+  return tree;
+}
+
+// Documented in .h file
+uint64_t ET_hash(ExprTree tree)
+{
+  // postorder walk as in ET_evaluate_vars, with hashes for values and a
+  // memo so that each shared node is hashed once
+  WalkEntry path_inline[WALK_INLINE_STACK];
+  WalkStack path;
+  walk_init_inline(&path, path_inline, WALK_INLINE_STACK);
+  uint64_t vals_inline[WALK_INLINE_STACK];
+  size_t n_vals = 0, vals_cap = WALK_INLINE_STACK;
+  uint64_t *vals = vals_inline;
+  NodeMap memo;
+  map_init(&memo);
+  NodeMapEntry *hit = NULL;
+
+  ExprTree t = tree;
+  for (;;)
+  {
+    while (t != NULL && !is_leaf(t))
+    {
+      if (t->refs > 1 && (hit = map_find(&memo, t)) != NULL)
+        break;
+      walk_push(&path, t, LEFT);
+      t = children(t)[0];
+    }
+
+    if (n_vals == vals_cap)
+      vals = stack_grow(vals, vals_inline, &vals_cap, sizeof(uint64_t));
+    if (t == NULL)
+      vals[n_vals++] = 0;
+    else if (is_leaf(t))
+      vals[n_vals++] = intern_hash(t);
+    else
+      vals[n_vals++] = hit->val.u;
+
+    t = NULL;
+    while (path.top > 0)
+    {
+      WalkEntry *e = &path.items[path.top - 1];
+
+      if (e->aux + 1 < n_operands(e->node))
+      {
+        t = children(e->node)[++e->aux];
+        break;
+      }
+
+      uint64_t h = hash_u64(e->node->type + 1);
+      if (e->node->type == OP_CALL)
+        h = hash_combine(h, e->node->n.list.fn);
+      size_t k = n_operands(e->node);
+      for (size_t i = n_vals - k; i < n_vals; i++)
+        h = hash_combine(h, vals[i]);
+      n_vals -= k;
+      vals[n_vals++] = h;
+      if (e->node->refs > 1)
+        map_insert(&memo, e->node)->val.u = vals[n_vals - 1];
+      path.top--;
+    }
+
+    if (path.top == 0)
+      break;
+  }
+
+  uint64_t result = vals[0];
+  map_free(&memo);
+  if (vals != vals_inline)
+    free(vals);
+  walk_free(&path);
+  return result;
+}
+
+// Documented in .h file
+bool ET_equal(ExprTree a, ExprTree b)
+{
+  // pairs of nodes still to compare, pushed two at a time
+  WalkStack pending;
+  walk_init(&pending);
+  walk_push(&pending, a, 0);
+  walk_push(&pending, b, 0);
+  bool equal = true;
+
+  while (equal && pending.top > 0)
+  {
+    ExprTree y = pending.items[--pending.top].node;
+    ExprTree x = pending.items[--pending.top].node;
+
+    if (x == y)
+      continue;
+
+    if (x == NULL || y == NULL || x->type != y->type)
+      equal = false;
+    else if (x->type == VALUE)
+      equal = double_bits(x->n.value) == double_bits(y->n.value);
+    else if (x->type == VARIABLE)
+      equal = x->n.var == y->n.var;
+    else if (n_operands(x) != n_operands(y) || (x->type == OP_CALL && x->n.list.fn != y->n.list.fn))
+      equal = false;
+    else
+      for (size_t i = 0; i < n_operands(x); i++)
+      {
+        walk_push(&pending, children(x)[i], 0);
+        walk_push(&pending, children(y)[i], 0);
+      }
+  }
+
+  walk_free(&pending);
+  return equal;
+}
+
+// Documented in .h file
+int ET_count_distinct(ExprTree tree)
+{
+  if (tree == NULL)
+    return 0;
+
+  // only shared nodes can be reached twice, so only they are recorded
+  NodeMap seen;
+  map_init(&seen);
+  WalkEntry stack_inline[WALK_INLINE_STACK];
+  WalkStack stack;
+  walk_init_inline(&stack, stack_inline, WALK_INLINE_STACK);
+  walk_push(&stack, tree, 0);
+  int count = 0;
+
+  while (stack.top > 0)
+  {
+    ExprTree t = stack.items[--stack.top].node;
+
+    if (t->refs > 1)
+    {
+      if (map_find(&seen, t) != NULL)
+        continue;
+      map_insert(&seen, t);
+    }
+    count++;
+
+    for (size_t i = n_operands(t); i-- > 0;)
+      if (children(t)[i] != NULL)
+        walk_push(&stack, children(t)[i], 0);
+  }
+
+  walk_free(&stack);
+  map_free(&seen);
+  return count;
+}
+
+
+// Exact powers of ten for the fast path of parse_number
+static const double pow10_table[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+/*
+ * Return true if p starts an unsigned number literal. inf and nan only
+ * count as whole words, so "nrm(x0)" and "inf(x0)" start calls.
+ */
+static inline bool starts_number(const char *p, const char *end)
+{
+  if (p < end && ((*p >= '0' && *p <= '9') || *p == '.'))
+    return true;
+  return end - p >= 3 && (memcmp(p, "inf", 3) == 0 || memcmp(p, "nan", 3) == 0) &&
+         !(end - p > 3 && (isalnum((unsigned char)p[3]) || p[3] == '_' || p[3] == '('));
+}
+
+/*
+ * Scan a number literal, optionally signed, in the forms "%g" prints:
+ * decimal or scientific notation, inf or nan.
+ *
+ * Parameters:
+ *   p        Start of the literal
+ *   end      End of the input
+ *   value    Receives the value
+ *
+ * Returns: The first character after the literal, or NULL if p does
+ *   not start a valid literal
+ */
+static const char *parse_number(const char *p, const char *end, double *value)
+{
+  bool negative = false;
+  if (p < end && *p == '-')
+  {
+    negative = true;
+    p++;
+  }
+
+  if (end - p >= 3 && (memcmp(p, "inf", 3) == 0 || memcmp(p, "nan", 3) == 0))
+  {
+    *value = *p == 'i' ? INFINITY : NAN;
+    *value = negative ? -*value : *value;
+    return p + 3;
+  }
+
+  const char *start = p;
+  uint64_t mantissa = 0;
+  int digits = 0, exp10 = 0;
+  bool any = false;
+
+  for (; p < end && *p >= '0' && *p <= '9'; p++, any = true)
+  {
+    if (mantissa == 0 && *p == '0')
+      continue;
+    if (digits < 19)
+      mantissa = mantissa * 10 + (*p - '0'), digits++;
+    else
+      exp10++;
+  }
+  if (p < end && *p == '.')
+  {
+    for (p++; p < end && *p >= '0' && *p <= '9'; p++, any = true)
+    {
+      if (mantissa == 0 && *p == '0')
+        exp10--;
+      else if (digits < 19)
+        mantissa = mantissa * 10 + (*p - '0'), digits++, exp10--;
+    }
+  }
+  if (!any)
+    return NULL;
+
+  if (p < end && (*p == 'e' || *p == 'E'))
+  {
+    const char *q = p + 1;
+    bool exp_negative = false;
+    if (q < end && (*q == '+' || *q == '-'))
+      exp_negative = *q++ == '-';
+    if (q < end && *q >= '0' && *q <= '9')
+    {
+      int e = 0;
+      for (; q < end && *q >= '0' && *q <= '9'; q++)
+        if (e < 100000)
+          e = e * 10 + (*q - '0');
+      exp10 += exp_negative ? -e : e;
+      p = q;
+    }
+  }
+
+  // Clinger's fast path: a mantissa below 2^53 and a power of ten that
+  // is exact in a double give a correctly rounded result
+  if (digits < 19 && mantissa <= (1ULL << 53) && exp10 >= -22 && exp10 <= 22)
+  {
+    double d = (double)mantissa;
+    d = exp10 < 0 ? d / pow10_table[-exp10] : d * pow10_table[exp10];
+    *value = negative ? -d : d;
+    return p;
+  }
+
+  // otherwise let strtod round it, from a terminated copy of the token
+  char token[128];
+  size_t len = p - start;
+  if (len >= sizeof(token))
+    return NULL;
+  memcpy(token, start, len);
+  token[len] = '\0';
+  *value = strtod(token, NULL);
+  *value = negative ? -*value : *value;
+  return p;
+}
+
+/*
+ * If p starts a function call, a name directly followed by '(', return
+ * the end of the name, where the '(' is
+ */
+static const char *parse_call(const char *p, const char *end)
+{
+  const char *q = p;
+
+  if (q == end || !(isalpha((unsigned char)*q) || *q == '_'))
+    return NULL;
+  while (q < end && (isalnum((unsigned char)*q) || *q == '_'))
+    q++;
+  return q < end && *q == '(' ? q : NULL;
+}
+
+/*
+ * Operators on the ET_parse operator stack
+ */
+typedef enum
+{
+  PARSE_PAREN,   // an open parenthesis
+  PARSE_CALL,    // the open parenthesis of a function call
+  PARSE_NEGATE,  // prefix minus
+  PARSE_BINARY   // a binary operator, stored alongside
+} ParseOpKind;
+
+typedef struct
+{
+  ParseOpKind kind;
+  ExprNodeType op;
+  int fn;        // for PARSE_CALL, the function
+  size_t base;   // for PARSE_CALL, operands below its first argument
+} ParseOp;
+
+/*
+ * Return true if op is an open parenthesis, which operators are not
+ * reduced past
+ */
+static inline bool parse_opens(ParseOp op)
+{
+  return op.kind == PARSE_PAREN || op.kind == PARSE_CALL;
+}
+
+/*
+ * Return the binding strength of an operator on the parse stack
+ */
+static int parse_precedence(ParseOp op)
+{
+  if (op.kind == PARSE_NEGATE)
+    return 3;
+
+  switch (op.op)
+  {
+  case OP_ADD:
+  case OP_SUB:
+    return 1;
+  case OP_MUL:
+  case OP_DIV:
+    return 2;
+  case OP_POWER:
+    return 4;
+  default:
+    assert(0);
+  }
+}
+
+// Stack entries a Parser holds inline before it moves to the heap
+#define PARSE_INLINE_STACK 32
+
+/*
+ * The state of an ET_parse call: operand and operator stacks, and where
+ * new nodes come from. The stacks start out inline so that parsing a
+ * typical expression does not touch the heap except for its nodes.
+ */
+typedef struct
+{
+  ExprTree *operands;
+  size_t n_operands, operands_cap;
+  ParseOp *ops;
+  size_t n_ops, ops_cap;
+  ExprArena arena;
+  ExprTree operands_inline[PARSE_INLINE_STACK];
+  ParseOp ops_inline[PARSE_INLINE_STACK];
+} Parser;
+
+static void parser_push_operand(Parser *ps, ExprTree tree)
+{
+  if (ps->n_operands == ps->operands_cap)
+    ps->operands = stack_grow(ps->operands, ps->operands_inline, &ps->operands_cap, sizeof(ExprTree));
+  ps->operands[ps->n_operands++] = tree;
+}
+
+static void parser_push_op(Parser *ps, ParseOpKind kind, ExprNodeType op)
+{
+  if (ps->n_ops == ps->ops_cap)
+    ps->ops = stack_grow(ps->ops, ps->ops_inline, &ps->ops_cap, sizeof(ParseOp));
+  ps->ops[ps->n_ops++] = (ParseOp){kind, op, -1, 0};
+}
+
+/*
+ * Replace the arguments of the function call whose parenthesis has
+ * just been popped, op, with the call node
+ *
+ * Returns: false if they do not match the function's arity
+ */
+static bool parser_call(Parser *ps, ParseOp op)
+{
+  ExprTree *args = ps->operands + op.base;
+  size_t n_args = ps->n_operands - op.base;
+
+  if (n_args != fn_table[op.fn].arity)
+    return false;
+  ExprTree call = ps->arena != NULL ? ET_arena_call(ps->arena, op.fn, args, n_args) : ET_call(op.fn, args, n_args);
+  ps->n_operands = op.base;
+  parser_push_operand(ps, call);
+  return true;
+}
+
+/*
+ * Build a node from the parser's arena, or the heap if it has none
+ */
+static ExprTree parser_node(Parser *ps, ExprNodeType op, ExprTree left, ExprTree right)
+{
+  return ps->arena != NULL ? ET_arena_node(ps->arena, op, left, right) : ET_node(op, left, right);
+}
+
+/*
+ * Pop the operator on top of the stack and apply it to the operands
+ */
+static void parser_reduce(Parser *ps)
+{
+  ParseOp op = ps->ops[--ps->n_ops];
+
+  if (op.kind == PARSE_NEGATE)
+  {
+    ExprTree *top = &ps->operands[ps->n_operands - 1];
+    *top = parser_node(ps, UNARY_NEGATE, *top, NULL);
+    return;
+  }
+
+  ExprTree right = ps->operands[--ps->n_operands];
+  ExprTree *left = &ps->operands[ps->n_operands - 1];
+  *left = parser_node(ps, op.op, *left, right);
+}
+
+/*
+ * Return the ExprNodeType for a binary operator character, or VALUE if
+ * c is not one
+ */
+static ExprNodeType parse_binary_op(char c)
+{
+  switch (c)
+  {
+  case '+':
+    return OP_ADD;
+  case '-':
+    return OP_SUB;
+  case '*':
+    return OP_MUL;
+  case '/':
+    return OP_DIV;
+  case '^':
+    return OP_POWER;
+  default:
+    return VALUE;
+  }
+}
+
+// Documented in .h file
+ExprTree ET_parse(const char *str, size_t len, ExprArena arena, size_t *end)
+{
+  Parser ps;
+  ps.operands = ps.operands_inline;
+  ps.ops = ps.ops_inline;
+  ps.n_operands = ps.n_ops = 0;
+  ps.operands_cap = ps.ops_cap = PARSE_INLINE_STACK;
+  ps.arena = arena;
+
+  const char *p = str, *stop = str + len;
+  bool want_operand = true, ok = true;
+
+  for (;;)
+  {
+    if (want_operand)
+    {
+      // an operand may continue on the next line
+      while (p < stop && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+        p++;
+
+      if (p == stop)
+      {
+        ok = false;
+        break;
+      }
+
+      double value;
+      const char *next;
+      int fn;
+
+      if (*p == '(')
+      {
+        // "(-3)" is how ET_tree2string prints the negation of a value
+        const char *q = p + 1;
+        while (q < stop && (*q == ' ' || *q == '\t'))
+          q++;
+        if (q < stop && *q == '-' && (next = parse_number(q + 1, stop, &value)) != NULL)
+        {
+          while (next < stop && (*next == ' ' || *next == '\t'))
+            next++;
+          if (next < stop && *next == ')')
+          {
+            ExprTree leaf = arena != NULL ? ET_arena_value(arena, value) : ET_value(value);
+            parser_push_operand(&ps, parser_node(&ps, UNARY_NEGATE, leaf, NULL));
+            p = next + 1;
+            want_operand = false;
+            continue;
+          }
+        }
+        parser_push_op(&ps, PARSE_PAREN, VALUE);
+        p++;
+      }
+      else if ((next = parse_call(p, stop)) != NULL && (fn = ET_find_fn(p, next - p)) >= 0)
+      {
+        parser_push_op(&ps, PARSE_CALL, VALUE);
+        ps.ops[ps.n_ops - 1].fn = fn;
+        ps.ops[ps.n_ops - 1].base = ps.n_operands;
+        p = next + 1;
+      }
+      else if (*p == 'x' && p + 1 < stop && p[1] >= '0' && p[1] <= '9')
+      {
+        size_t index = 0;
+        for (p++; p < stop && *p >= '0' && *p <= '9'; p++)
+          index = index * 10 + (*p - '0');
+        parser_push_operand(&ps, arena != NULL ? ET_arena_var(arena, index) : ET_var(index));
+        want_operand = false;
+      }
+      else if (*p == '-' && !starts_number(p + 1, stop))
+      {
+        parser_push_op(&ps, PARSE_NEGATE, UNARY_NEGATE);
+        p++;
+      }
+      else if ((next = parse_number(p, stop, &value)) != NULL)
+      {
+        // a '-' directly before a number is its sign, as in "%g" output
+        parser_push_operand(&ps, arena != NULL ? ET_arena_value(arena, value) : ET_value(value));
+        p = next;
+        want_operand = false;
+      }
+      else
+      {
+        ok = false;
+        break;
+      }
+      continue;
+    }
+
+    // an operator must be on the same line as its left operand
+    while (p < stop && (*p == ' ' || *p == '\t' || *p == '\r'))
+      p++;
+
+    ExprNodeType op = p < stop ? parse_binary_op(*p) : VALUE;
+
+    if (op != VALUE)
+    {
+      ParseOp incoming = {PARSE_BINARY, op};
+      int prec = parse_precedence(incoming);
+      bool right_assoc = op == OP_POWER;
+
+      while (ps.n_ops > 0 && !parse_opens(ps.ops[ps.n_ops - 1]) &&
+             (parse_precedence(ps.ops[ps.n_ops - 1]) > prec ||
+              (parse_precedence(ps.ops[ps.n_ops - 1]) == prec && !right_assoc)))
+        parser_reduce(&ps);
+
+      parser_push_op(&ps, PARSE_BINARY, op);
+      p++;
+      want_operand = true;
+      continue;
+    }
+
+    if (p < stop && (*p == ')' || *p == ','))
+    {
+      while (ps.n_ops > 0 && !parse_opens(ps.ops[ps.n_ops - 1]))
+        parser_reduce(&ps);
+
+      // a ',' separates the arguments of a call
+      if (*p == ',' && ps.n_ops > 0 && ps.ops[ps.n_ops - 1].kind == PARSE_CALL)
+      {
+        p++;
+        want_operand = true;
+        continue;
+      }
+
+      // an unmatched ')' ends the expression, as does a ',' outside a call
+      if (*p == ')' && ps.n_ops > 0)
+      {
+        ParseOp open = ps.ops[--ps.n_ops];
+        if (open.kind == PARSE_CALL && !parser_call(&ps, open))
+        {
+          ok = false;
+          break;
+        }
+        p++;
+        continue;
+      }
+    }
+    break;
+  }
+
+  while (ok && ps.n_ops > 0)
+  {
+    if (parse_opens(ps.ops[ps.n_ops - 1]))
+      ok = false;
+    else
+      parser_reduce(&ps);
+  }
+
+  // without an end pointer the whole input must be one expression
+  if (ok && end == NULL)
+  {
+    while (p < stop && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+      p++;
+    ok = p == stop;
+  }
+
+  ExprTree tree = NULL;
+  if (ok)
+    tree = ps.operands[0];
+  else
+  {
+    for (size_t i = 0; i < ps.n_operands; i++)
+      ET_free(ps.operands[i]);
+  }
+
+  if (end != NULL)
+    *end = p - str;
+  if (ps.operands != ps.operands_inline)
+    free(ps.operands);
+  if (ps.ops != ps.ops_inline)
+    free(ps.ops);
+  return tree;
+}
+
+
+/*
+ * Serialized format, version 1. All integers are little-endian.
+ *
+ *   offset 0   "ETRB"   magic
+ *   offset 4   u16      format version
+ *   offset 6   u16      reserved, 0
+ *   offset 8   u64      number of nodes, counting NULL operands
+ *   offset 16  u64      length of the node stream in bytes
+ *   offset 24           node stream
+ *
+ * The node stream holds the tree in pre-order. Each node is one opcode
+ * byte (its ExprNodeType, or SERIAL_NIL for a NULL operand), followed
+ * for VALUE by the 8 raw bytes of the double and for VARIABLE by the
+ * index as an LEB128 varint. UNARY_NEGATE has one child in the stream,
+ * the binary operators two; the list operators give their operand
+ * count as a varint after the opcode. OP_CALL gives its function by
+ * name instead, as a length byte and the characters, and has as many
+ * operands as the function of that name has in the reading process.
+ * Records can be concatenated into a file.
+ */
+#define SERIAL_MAGIC "ETRB"
+#define SERIAL_VERSION 1
+#define SERIAL_HEADER_SZ 24
+#define SERIAL_NIL 0xFF
+
+// Bytes buffered by ET_serialize_fd before each write()
+#define SERIAL_FD_CHUNK 65536
+
+/*
+ * Destination of a serialization: either a caller's buffer, which only
+ * receives the output if all of it fits, or a file descriptor that is
+ * written one buffered chunk at a time
+ */
+typedef struct
+{
+  unsigned char *buf;
+  size_t buf_sz;
+  size_t used;     // bytes waiting in buf (file descriptor only)
+  size_t total;    // bytes produced so far
+  int fd;          // -1 when writing to buf
+  bool failed;     // a write() failed
+} SerialWriter;
+
+/*
+ * Write out the bytes buffered for a file descriptor
+ */
+static void serial_flush(SerialWriter *w)
+{
+  size_t done = 0;
+
+  while (!w->failed && done < w->used)
+  {
+    ssize_t n = write(w->fd, w->buf + done, w->used - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      w->failed = true;
+    else
+      done += n;
+  }
+  w->used = 0;
+}
+
+/*
+ * Append n bytes to the output
+ */
+static void serial_put(SerialWriter *w, const void *bytes, size_t n)
+{
+  if (w->fd < 0)
+  {
+    if (w->total + n <= w->buf_sz)
+      memcpy(w->buf + w->total, bytes, n);
+    w->total += n;
+    return;
+  }
+
+  const unsigned char *src = bytes;
+  w->total += n;
+  while (n > 0)
+  {
+    size_t chunk = w->buf_sz - w->used < n ? w->buf_sz - w->used : n;
+    memcpy(w->buf + w->used, src, chunk);
+    w->used += chunk;
+    src += chunk;
+    n -= chunk;
+    if (w->used == w->buf_sz)
+      serial_flush(w);
+  }
+}
+
+static void serial_put_u64(SerialWriter *w, uint64_t v, int n_bytes)
+{
+  unsigned char bytes[8];
+  for (int i = 0; i < n_bytes; i++)
+    bytes[i] = (unsigned char)(v >> (8 * i));
+  serial_put(w, bytes, n_bytes);
+}
+
+static uint64_t serial_get_u64(const unsigned char *p, int n_bytes)
+{
+  uint64_t v = 0;
+  for (int i = 0; i < n_bytes; i++)
+    v |= (uint64_t)p[i] << (8 * i);
+  return v;
+}
+
+/*
+ * Append v to record at len as a little-endian base-128 varint, and
+ * return the new length
+ */
+static size_t serial_put_varint(unsigned char *record, size_t len, uint64_t v)
+{
+  do
+  {
+    record[len++] = (v & 0x7F) | (v >= 0x80 ? 0x80 : 0);
+    v >>= 7;
+  } while (v != 0);
+  return len;
+}
+
+/*
+ * Read a varint written by serial_put_varint from *p, advancing it
+ *
+ * Returns: false if the stream ends at *p or the varint overflows
+ */
+static bool serial_get_varint(const unsigned char **p, const unsigned char *end, uint64_t *v)
+{
+  *v = 0;
+  for (int shift = 0;; shift += 7)
+  {
+    if (*p >= end || shift > 63)
+      return false;
+    unsigned char byte = *(*p)++;
+    *v |= (uint64_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80))
+      return true;
+  }
+}
+
+/*
+ * Walk tree in pre-order, emitting the node stream to w (which may be
+ * NULL to only measure it)
+ *
+ * Parameters:
+ *   tree     The tree
+ *   w        Where to write, or NULL
+ *   n_nodes  Receives the number of nodes in the stream
+ *
+ * Returns: The length of the node stream in bytes
+ */
+static uint64_t serial_nodes(ExprTree tree, SerialWriter *w, uint64_t *n_nodes)
+{
+  WalkStack stack;
+  walk_init(&stack);
+  walk_push(&stack, tree, 0);
+  uint64_t bytes = 0;
+  *n_nodes = 0;
+
+  while (stack.top > 0)
+  {
+    ExprTree t = stack.items[--stack.top].node;
+    unsigned char record[2 + ET_FUNCTION_NAME_MAX];
+    size_t len = 1;
+
+    (*n_nodes)++;
+    if (t == NULL)
+      record[0] = SERIAL_NIL;
+    else
+    {
+      record[0] = t->type;
+      if (t->type == VALUE)
+      {
+        uint64_t bits = double_bits(t->n.value);
+        for (int i = 0; i < 8; i++)
+          record[len++] = (unsigned char)(bits >> (8 * i));
+      }
+      else if (t->type == VARIABLE)
+        len = serial_put_varint(record, len, t->n.var);
+      else
+      {
+        // list nodes give their operand count up front, and calls
+        // their function's name
+        if (t->type == OP_CALL)
+        {
+          const char *name = call_entry(t)->name;
+          record[len++] = strlen(name);
+          memcpy(record + len, name, strlen(name));
+          len += strlen(name);
+        }
+        else if (is_list(t))
+          len = serial_put_varint(record, len, t->n.list.n_args);
+        for (size_t i = n_operands(t); i-- > 0;)
+          walk_push(&stack, children(t)[i], 0);
+      }
+    }
+
+    if (w != NULL)
+      serial_put(w, record, len);
+    bytes += len;
+  }
+
+  walk_free(&stack);
+  return bytes;
+}
+
+/*
+ * Serialize tree into w: the header, then the node stream
+ */
+static void serial_tree(ExprTree tree, SerialWriter *w)
+{
+  uint64_t n_nodes;
+  uint64_t stream_len = serial_nodes(tree, NULL, &n_nodes);
+
+  serial_put(w, SERIAL_MAGIC, 4);
+  serial_put_u64(w, SERIAL_VERSION, 2);
+  serial_put_u64(w, 0, 2);
+  serial_put_u64(w, n_nodes, 8);
+  serial_put_u64(w, stream_len, 8);
+  serial_nodes(tree, w, &n_nodes);
+}
+
+// Documented in .h file
+size_t ET_serialize(ExprTree tree, void *buf, size_t buf_sz)
+{
+  SerialWriter w = {buf, buf == NULL ? 0 : buf_sz, 0, 0, -1, false};
+  serial_tree(tree, &w);
+  return w.total;
+}
+
+// Documented in .h file
+int ET_serialize_fd(ExprTree tree, int fd)
+{
+  SerialWriter w = {malloc(SERIAL_FD_CHUNK), SERIAL_FD_CHUNK, 0, 0, fd, false};
+  assert(w.buf != NULL);
+
+  serial_tree(tree, &w);
+  serial_flush(&w);
+
+  free(w.buf);
+  return w.failed ? -1 : 0;
+}
+
+/*
+ * Check the header of the record at the start of buf
+ *
+ * Parameters:
+ *   buf      The record
+ *   len      Bytes available at buf
+ *   n_nodes  Receives the number of nodes
+ *
+ * Returns: The total length of the record, or 0 if it is malformed
+ */
+static size_t serial_check_header(const unsigned char *buf, size_t len, uint64_t *n_nodes)
+{
+  if (buf == NULL || len < SERIAL_HEADER_SZ || memcmp(buf, SERIAL_MAGIC, 4) != 0 ||
+      serial_get_u64(buf + 4, 2) != SERIAL_VERSION)
+    return 0;
+
+  uint64_t stream_len = serial_get_u64(buf + 16, 8);
+  *n_nodes = serial_get_u64(buf + 8, 8);
+
+  // every node takes at least one byte
+  if (stream_len > len - SERIAL_HEADER_SZ || *n_nodes == 0 || *n_nodes > stream_len)
+    return 0;
+
+  return SERIAL_HEADER_SZ + stream_len;
+}
+
+/*
+ * Decode the node at *p in a node stream ending at end
+ *
+ * Parameters:
+ *   p        In/out: position in the stream
+ *   end      End of the stream
+ *   type     Receives the opcode
+ *   value    Receives the value of a VALUE node
+ *   var      Receives the index of a VARIABLE node, or the function
+ *            of an OP_CALL node
+ *   n_args   Receives the number of operands that follow the node
+ *
+ * Returns: false if the stream is malformed at *p
+ */
+static bool serial_next(const unsigned char **p, const unsigned char *end,
+                        int *type, double *value, size_t *var, size_t *n_args)
+{
+  if (*p >= end)
+    return false;
+
+  *type = *(*p)++;
+  *n_args = 0;
+
+  if (*type == VALUE)
+  {
+    if (end - *p < 8)
+      return false;
+    uint64_t bits = serial_get_u64(*p, 8);
+    memcpy(value, &bits, sizeof(*value));
+    *p += 8;
+  }
+  else if (*type == VARIABLE)
+  {
+    uint64_t v;
+    if (!serial_get_varint(p, end, &v))
+      return false;
+    *var = v;
+  }
+  else if (*type == OP_SUM || *type == OP_PRODUCT || *type == OP_FMA)
+  {
+    // every operand takes at least one byte
+    uint64_t n;
+    if (!serial_get_varint(p, end, &n) || n == 0 || n > (uint64_t)(end - *p) ||
+        (*type == OP_FMA && n != 3))
+      return false;
+    *n_args = n;
+  }
+  else if (*type == OP_CALL)
+  {
+    // the function must be registered here too
+    if (*p >= end || **p > end - *p - 1)
+      return false;
+    size_t name_len = *(*p)++;
+    int fn = ET_find_fn((const char *)*p, name_len);
+    if (fn < 0 || fn_table[fn].arity > (size_t)(end - *p - name_len))
+      return false;
+    *p += name_len;
+    *var = fn;
+    *n_args = fn_table[fn].arity;
+  }
+  else if (*type == UNARY_NEGATE)
+    *n_args = 1;
+  else if (*type != SERIAL_NIL)
+  {
+    if (*type > OP_POWI)
+      return false;
+    *n_args = 2;
+  }
+
+  return true;
+}
+
+/*
+ * Allocate a list node of n_args operands, all NULL for ET_load to
+ * fill in, in arena or on the heap if it is NULL
+ */
+static ExprTree load_list(ExprArena arena, ExprNodeType op, size_t n_args)
+{
+  ExprTree tree;
+
+  if (arena != NULL)
+    tree = arena_list_alloc(arena, op, n_args);
+  else
+  {
+    tree = node_alloc(op);
+    tree->n.list.args = malloc(n_args * sizeof(ExprTree));
+    assert(tree->n.list.args != NULL);
+  }
+
+  tree->n.list.n_args = n_args;
+  for (size_t i = 0; i < n_args; i++)
+    tree->n.list.args[i] = NULL;
+  return tree;
+}
+
+// Documented in .h file
+ExprTree ET_load(const void *buf, size_t len, ExprArena arena, size_t *used)
+{
+  uint64_t n_nodes;
+  size_t record_len = serial_check_header(buf, len, &n_nodes);
+  if (record_len == 0)
+    return NULL;
+
+  const unsigned char *p = (const unsigned char *)buf + SERIAL_HEADER_SZ;
+  const unsigned char *end = (const unsigned char *)buf + record_len;
+
+  // interior nodes still waiting for children; aux is the next child
+  WalkStack pending;
+  walk_init(&pending);
+  ExprTree root = NULL;
+  bool ok = true;
+
+  for (uint64_t i = 0; i < n_nodes; i++)
+  {
+    int type;
+    double value = 0;
+    size_t var = 0, n_args;
+    ExprTree t = NULL;
+
+    if (!serial_next(&p, end, &type, &value, &var, &n_args) || (i > 0 && pending.top == 0))
+    {
+      ok = false;
+      break;
+    }
+
+    if (type == VALUE)
+      t = arena != NULL ? ET_arena_value(arena, value) : ET_value(value);
+    else if (type == VARIABLE)
+      t = arena != NULL ? ET_arena_var(arena, var) : ET_var(var);
+    else if (type == OP_SUM || type == OP_PRODUCT || type == OP_FMA || type == OP_CALL)
+    {
+      t = load_list(arena, type, n_args);
+      t->n.list.fn = type == OP_CALL ? var : 0;
+    }
+    else if (type != SERIAL_NIL)
+      t = arena != NULL ? ET_arena_node(arena, type, NULL, NULL) : ET_node(type, NULL, NULL);
+
+    if (pending.top == 0)
+      root = t;
+    else
+    {
+      WalkEntry *parent = &pending.items[pending.top - 1];
+      children(parent->node)[parent->aux++] = t;
+      link_child(parent->node, t);
+      // list nodes have no missing operands
+      if (t == NULL && is_list(parent->node))
+      {
+        ok = false;
+        break;
+      }
+    }
+
+    if (t != NULL && !is_leaf(t))
+    {
+      walk_push(&pending, t, LEFT);
+      continue;
+    }
+
+    // nodes whose last operand is now complete are complete themselves
+    while (pending.top > 0)
+    {
+      WalkEntry *e = &pending.items[pending.top - 1];
+      if (e->aux < n_operands(e->node))
+        break;
+      update_size(e->node);
+      pending.top--;
+    }
+  }
+
+  // the stream must describe exactly one complete tree
+  if (!ok || pending.top != 0 || p != end)
+  {
+    ET_free(root);
+    root = NULL;
+  }
+  else if (used != NULL)
+    *used = record_len;
+
+  walk_free(&pending);
+  return root;
+}
+
+/*
+ * An operator of a pre-order node stream still waiting for operands
+ */
+typedef struct
+{
+  ExprNodeType op;
+  size_t n_args;
+  size_t base;      // where its operands start on the value stack
+  size_t fn;        // the function of an OP_CALL
+} SerialFrame;
+
+// Documented in .h file
+double ET_evaluate_serialized(const void *buf, size_t len, const double *vars)
+{
+  uint64_t n_nodes;
+  size_t record_len = serial_check_header(buf, len, &n_nodes);
+  if (record_len == 0)
+    return NAN;
+  STATS_ADD(evaluations, 1);
+
+  const unsigned char *p = (const unsigned char *)buf + SERIAL_HEADER_SZ;
+  const unsigned char *end = (const unsigned char *)buf + record_len;
+
+  size_t top = 0, cap = 64, n_vals = 0, vals_cap = 64;
+  SerialFrame *frames = malloc(cap * sizeof(SerialFrame));
+  double *vals = malloc(vals_cap * sizeof(double));
+  assert(frames != NULL && vals != NULL);
+  double result = NAN;
+
+  for (uint64_t i = 0; i < n_nodes; i++)
+  {
+    int type;
+    double value = 0;
+    size_t var = 0, n_args;
+
+    if (!serial_next(&p, end, &type, &value, &var, &n_args) || (i > 0 && top == 0))
+      break;
+    if (type != SERIAL_NIL)
+      STATS_ADD(ops[type], 1);
+
+    if (n_args > 0)
+    {
+      if (top == cap)
+      {
+        cap *= 2;
+        frames = realloc(frames, cap * sizeof(SerialFrame));
+        assert(frames != NULL);
+      }
+      frames[top++] = (SerialFrame){type, n_args, n_vals, var};
+      continue;
+    }
+
+    if (type == VARIABLE)
+      value = vars == NULL ? NAN : vars[var];
+    else if (type == SERIAL_NIL)
+      value = 0;
+
+    // hand the operand to the waiting operators, completing those that
+    // now have all of theirs
+    for (;;)
+    {
+      if (top == 0)
+      {
+        if (i + 1 == n_nodes && p == end)
+          result = value;
+        break;
+      }
+
+      if (n_vals == vals_cap)
+      {
+        vals_cap *= 2;
+        vals = realloc(vals, vals_cap * sizeof(double));
+        assert(vals != NULL);
+      }
+      vals[n_vals++] = value;
+
+      SerialFrame *f = &frames[top - 1];
+      if (n_vals - f->base < f->n_args)
+        break;
+
+      value = f->op == OP_CALL ? fn_table[f->fn].scalar(vals + f->base) : apply_args(f->op, vals + f->base, f->n_args);
+      n_vals = f->base;
+      top--;
+    }
+  }
+
+  free(vals);
+  free(frames);
+  return result;
+}
+
+struct _expr_image
+{
+  const unsigned char *data;   // the mapped file
+  size_t len;
+  size_t n_trees;
+  size_t *offsets;             // start of each record in data
+};
+
+// Documented in .h file
+ExprImage ET_image_open(const char *path)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size == 0)
+  {
+    close(fd);
+    return NULL;
+  }
+
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return NULL;
+
+  ExprImage image = malloc(sizeof(struct _expr_image));
+  assert(image != NULL);
+  image->data = data;
+  image->len = st.st_size;
+  image->n_trees = 0;
+
+  // index the records by hopping from header to header; the node
+  // streams themselves are not read until a tree is used
+  size_t cap = 64;
+  image->offsets = malloc(cap * sizeof(size_t));
+  assert(image->offsets != NULL);
+
+  for (size_t pos = 0; pos < image->len;)
+  {
+    uint64_t n_nodes;
+    size_t record_len = serial_check_header(image->data + pos, image->len - pos, &n_nodes);
+    if (record_len == 0)
+    {
+      ET_image_close(image);
+      return NULL;
+    }
+
+    if (image->n_trees == cap)
+    {
+      cap *= 2;
+      image->offsets = realloc(image->offsets, cap * sizeof(size_t));
+      assert(image->offsets != NULL);
+    }
+    image->offsets[image->n_trees++] = pos;
+    pos += record_len;
+  }
+
+  return image;
+}
+
+// Documented in .h file
+void ET_image_close(ExprImage image)
+{
+  if (image == NULL)
+    return;
+
+  munmap((void *)image->data, image->len);
+  free(image->offsets);
+  free(image);
+}
+
+// Documented in .h file
+size_t ET_image_count(ExprImage image)
+{
+  return image == NULL ? 0 : image->n_trees;
+}
+
+// Documented in .h file
+double ET_image_evaluate(ExprImage image, size_t i, const double *vars)
+{
+  assert(image != NULL && i < image->n_trees);
+  size_t pos = image->offsets[i];
+  return ET_evaluate_serialized(image->data + pos, image->len - pos, vars);
+}
+
+// Documented in .h file
+ExprTree ET_image_load(ExprImage image, size_t i, ExprArena arena)
+{
+  assert(image != NULL && i < image->n_trees);
+  size_t pos = image->offsets[i];
+  return ET_load(image->data + pos, image->len - pos, arena, NULL);
+}
+
+// Documented in .h file
+void ET_stats_get(ExprStats *out)
+{
+  assert(out != NULL);
+  memset(out, 0, sizeof(ExprStats));
+
+#ifdef ET_STATS
+  out->live_nodes = atomic_load(&stats.live_nodes);
+  out->allocations = atomic_load(&stats.allocations);
+  out->bytes = atomic_load(&stats.bytes);
+  out->evaluations = atomic_load(&stats.evaluations);
+  for (int type = 0; type < ET_NODE_TYPES; type++)
+    out->ops[type] = atomic_load(&stats.ops[type]);
+#endif
+}
+
+// Documented in .h file
+void ET_stats_reset(void)
+{
+#ifdef ET_STATS
+  // live nodes are a level, not an event count
+  atomic_store(&stats.allocations, 0);
+  atomic_store(&stats.bytes, 0);
+  atomic_store(&stats.evaluations, 0);
+  for (int type = 0; type < ET_NODE_TYPES; type++)
+    atomic_store(&stats.ops[type], 0);
+#endif
+}
+
+
+// ET_profile times on their own the subtrees holding at least this
+// fraction of the tree's nodes; smaller ones count towards the
+// enclosing subtree, so that the timer calls stay cheap next to the
+// work they measure
+#define ET_PROFILE_SPAN 1024
+
+// Longest subtree label ET_profile_write prints, including the '$'
+#define ET_PROFILE_LABEL 40
+
+struct _expr_profile
+{
+  size_t n_entries;
+  ExprProfileEntry entries[]; // timed subtrees, in preorder
+};
+
+/*
+ * Return a monotonic timestamp in nanoseconds
+ */
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Return true if ET_profile times the subtree tree on its own
+ */
+static inline bool profile_timed(ExprTree tree, size_t cutoff)
+{
+  return tree != NULL && !is_leaf(tree) && tree->count >= cutoff;
+}
+
+// Documented in .h file
+ExprProfile ET_profile(ExprTree tree, const double *vars, int reps)
+{
+  size_t cutoff = tree == NULL || tree->count < ET_PROFILE_SPAN ? 1 : tree->count / ET_PROFILE_SPAN;
+
+  // list the timed subtrees in the order the evaluation enters them;
+  // they form the top of the tree, since a subtree is never larger
+  // than the one enclosing it
+  size_t n_entries = 0, cap = 16;
+  ExprProfile prof = malloc(sizeof(struct _expr_profile) + cap * sizeof(ExprProfileEntry));
+  assert(prof != NULL);
+
+  WalkStack stack;
+  walk_init(&stack);
+  if (profile_timed(tree, cutoff))
+    walk_push(&stack, tree, SIZE_MAX);
+  else
+    prof->entries[n_entries++] = (ExprProfileEntry){tree, SIZE_MAX, 0, 0};
+
+  while (stack.top > 0)
+  {
+    WalkEntry e = stack.items[--stack.top];
+    if (n_entries == cap)
+    {
+      cap *= 2;
+      prof = realloc(prof, sizeof(struct _expr_profile) + cap * sizeof(ExprProfileEntry));
+      assert(prof != NULL);
+    }
+    prof->entries[n_entries] = (ExprProfileEntry){e.node, e.aux, 0, 0};
+
+    for (size_t i = n_operands(e.node); i-- > 0;)
+      if (profile_timed(children(e.node)[i], cutoff))
+        walk_push(&stack, children(e.node)[i], n_entries);
+    n_entries++;
+  }
+  prof->n_entries = n_entries;
+
+  // the ET_evaluate_vars walk, without the memo so that every subtree
+  // is entered in that order, and with a stack of the timed subtrees
+  // being evaluated
+  WalkStack path;
+  walk_init(&path);
+  size_t n_vals = 0, vals_cap = 64, n_timed = 0;
+  double *vals = malloc(vals_cap * sizeof(double));
+  uint64_t *started = malloc(n_entries * sizeof(uint64_t));
+  size_t *timed = malloc(n_entries * sizeof(size_t));
+  assert(vals != NULL && started != NULL && timed != NULL);
+
+  for (int rep = 0; rep < reps; rep++)
+  {
+    size_t next = 0;
+    n_vals = 0;
+
+    if (!profile_timed(tree, cutoff))
+    {
+      uint64_t start = now_ns();
+      evaluate_tree(tree, vars);
+      prof->entries[0].inclusive_ns += now_ns() - start;
+      prof->entries[0].calls++;
+      continue;
+    }
+
+    ExprTree t = tree;
+    for (;;)
+    {
+      while (t != NULL && !is_leaf(t))
+      {
+        if (t->count >= cutoff)
+        {
+          timed[n_timed++] = next;
+          started[next++] = now_ns();
+        }
+        walk_push(&path, t, LEFT);
+        t = children(t)[0];
+      }
+
+      if (n_vals == vals_cap)
+      {
+        vals_cap *= 2;
+        vals = realloc(vals, vals_cap * sizeof(double));
+        assert(vals != NULL);
+      }
+      if (t == NULL)
+        vals[n_vals++] = 0;
+      else if (t->type == VALUE)
+        vals[n_vals++] = t->n.value;
+      else
+        vals[n_vals++] = vars == NULL ? NAN : vars[t->n.var];
+
+      t = NULL;
+      while (path.top > 0)
+      {
+        WalkEntry *e = &path.items[path.top - 1];
+
+        if (e->aux + 1 < n_operands(e->node))
+        {
+          t = children(e->node)[++e->aux];
+          break;
+        }
+
+        size_t k = n_operands(e->node);
+        vals[n_vals - k] = apply_node(e->node, vals + n_vals - k);
+        n_vals -= k - 1;
+        if (e->node->count >= cutoff)
+        {
+          size_t i = timed[--n_timed];
+          prof->entries[i].inclusive_ns += now_ns() - started[i];
+          prof->entries[i].calls++;
+        }
+        path.top--;
+      }
+
+      if (path.top == 0)
+        break;
+    }
+  }
+
+  free(timed);
+  free(started);
+  free(vals);
+  walk_free(&path);
+  walk_free(&stack);
+  return prof;
+}
+
+// Documented in .h file
+size_t ET_profile_count(ExprProfile prof)
+{
+  return prof == NULL ? 0 : prof->n_entries;
+}
+
+// Documented in .h file
+const ExprProfileEntry *ET_profile_entry(ExprProfile prof, size_t i)
+{
+  assert(prof != NULL && i < prof->n_entries);
+  return &prof->entries[i];
+}
+
+/*
+ * Write the label ET_profile_write gives a subtree: its text, without
+ * spaces, cut short with a '$' if it is long
+ */
+static void profile_label(FILE *out, ExprTree tree)
+{
+  char buf[ET_PROFILE_LABEL + 1];
+  ET_tree2string(tree, buf, sizeof(buf));
+
+  for (const char *c = buf; *c != '\0'; c++)
+    if (*c != ' ')
+      fputc(*c, out);
+}
+
+/*
+ * qsort comparator putting the entries with the most inclusive time
+ * first, and the enclosing subtree first on ties
+ */
+static int profile_hotter(const void *a, const void *b)
+{
+  const uint64_t *x = a, *y = b;
+
+  if (x[0] != y[0])
+    return x[0] > y[0] ? -1 : 1;
+  return x[1] < y[1] ? -1 : x[1] > y[1];
+}
+
+// Documented in .h file
+size_t ET_profile_write(ExprProfile prof, FILE *out, size_t max_subtrees)
+{
+  assert(prof != NULL && out != NULL);
+  size_t n = prof->n_entries;
+  if (n == 0 || max_subtrees == 0)
+    return 0;
+
+  // (inclusive time, index) pairs, hottest first
+  uint64_t *order = malloc(2 * n * sizeof(uint64_t));
+  uint64_t *self = malloc(n * sizeof(uint64_t));
+  size_t *frames = malloc(n * sizeof(size_t));
+  bool *shown = calloc(n, sizeof(bool));
+  assert(order != NULL && self != NULL && frames != NULL && shown != NULL);
+
+  for (size_t i = 0; i < n; i++)
+  {
+    order[2 * i] = prof->entries[i].inclusive_ns;
+    order[2 * i + 1] = i;
+  }
+  qsort(order, n, 2 * sizeof(uint64_t), profile_hotter);
+
+  // show the hottest subtrees, and whatever encloses them so that each
+  // one's stack is complete
+  size_t n_shown = 0;
+  for (size_t k = 0; k < n && n_shown < max_subtrees; k++)
+    for (size_t i = order[2 * k + 1]; i != SIZE_MAX && !shown[i]; i = prof->entries[i].parent)
+    {
+      shown[i] = true;
+      n_shown++;
+    }
+
+  // the self time of a shown subtree includes that of the subtrees
+  // below it that are not shown
+  for (size_t i = 0; i < n; i++)
+    self[i] = shown[i] ? prof->entries[i].inclusive_ns : 0;
+  for (size_t i = 1; i < n; i++)
+    if (shown[i])
+    {
+      size_t parent = prof->entries[i].parent;
+      uint64_t inclusive = prof->entries[i].inclusive_ns;
+      self[parent] = self[parent] > inclusive ? self[parent] - inclusive : 0;
+    }
+
+  // one folded-stack line per shown subtree: the labels of its
+  // enclosing subtrees from the root down, then its self time
+  size_t lines = 0;
+  for (size_t i = 0; i < n; i++)
+  {
+    if (!shown[i] || self[i] == 0)
+      continue;
+
+    size_t depth = 0;
+    for (size_t j = i; j != SIZE_MAX; j = prof->entries[j].parent)
+      frames[depth++] = j;
+    while (depth > 0)
+    {
+      profile_label(out, prof->entries[frames[--depth]].subtree);
+      fputc(depth > 0 ? ';' : ' ', out);
+    }
+    fprintf(out, "%llu\n", (unsigned long long)self[i]);
+    lines++;
+  }
+
+  free(shown);
+  free(frames);
+  free(self);
+  free(order);
+  return lines;
+}
+
+// Documented in .h file
+void ET_profile_free(ExprProfile prof)
+{
+  free(prof);
+}
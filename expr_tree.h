@@ -13,8 +13,26 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 typedef struct _expr_tree_node * ExprTree;
+typedef struct _expr_arena * ExprArena;
+typedef struct _expr_program * ExprProgram;
+typedef struct _expr_image * ExprImage;
+typedef struct _expr_jit * ExprJit;
+typedef struct _expr_profile * ExprProfile;
+typedef struct _expr_pool * ExprPool;
+typedef struct _expr_frozen * ExprFrozen;
+typedef double (*ExprJitFunction)(const double *vars);
+typedef int (*ExprWriteFunction)(void *ctx, const char *data, size_t len);
+typedef double (*ExprScalarFunction)(const double *args);
+typedef void (*ExprBatchFunction)(const double *const *args, size_t n_rows, double *out);
+typedef void (*ExprPartialsFunction)(const double *args, double *partials);
 
 typedef enum {
   VALUE,
@@ -23,9 +41,85 @@ typedef enum {
   OP_SUB,
   OP_MUL,
   OP_DIV,
-  OP_POWER
+  OP_POWER,
+  VARIABLE,
+  OP_SUM,       // the sum of any number of operands; see ET_node_list
+  OP_PRODUCT,   // the product of any number of operands
+  OP_FMA,       // a * b + c of three operands, rounded once
+  OP_POWI,      // left ^ right, by multiplication when right is an integer
+  OP_CALL       // a registered function of its operands; see ET_call
 } ExprNodeType;
 
+#define ET_NODE_TYPES (OP_CALL + 1)
+
+// Largest |exponent| OP_POWI computes by repeated multiplication; it
+// falls back to pow() beyond that, and for exponents that are not
+// integers
+#define ET_POWI_MAX 16
+
+// Limits of the function registry; see ET_register_fn
+#define ET_MAX_FUNCTIONS 256
+#define ET_MAX_ARITY 16
+#define ET_FUNCTION_NAME_MAX 31
+
+// Functions registered in every process, in this order: exp, log,
+// sqrt, sin, cos and abs of one operand, and min and max (as fmin and
+// fmax) of two
+enum {
+  ET_FN_EXP,
+  ET_FN_LOG,
+  ET_FN_SQRT,
+  ET_FN_SIN,
+  ET_FN_COS,
+  ET_FN_ABS,
+  ET_FN_MIN,
+  ET_FN_MAX,
+  ET_FN_BUILTINS
+};
+
+/*
+ * Output formats of ET_write and ET_tree2string_format. Values print
+ * as "%g" does unless ET_FORMAT_SHORTEST is or'ed into the format.
+ */
+typedef enum {
+  ET_FORMAT_INFIX,    // fully parenthesized, as ET_tree2string prints
+  ET_FORMAT_POSTFIX,  // reverse Polish tokens separated by spaces
+  ET_FORMAT_JSON,     // nested objects, one per node
+  ET_FORMAT_SHORTEST = 0x10  // flag: print values with ET_format_double
+} ExprFormat;
+
+// Size of a buffer that holds any ET_format_double output and its \0
+#define ET_DOUBLE_CHARS 25
+
+/*
+ * Counters kept by a library built with -DET_STATS; see ET_stats_get.
+ */
+typedef struct {
+  size_t live_nodes;          // nodes allocated and not yet freed
+  size_t allocations;         // calls to malloc, calloc and realloc
+  size_t bytes;               // bytes requested by those calls
+  size_t evaluations;         // whole-tree evaluations, of any kind
+  size_t ops[ET_NODE_TYPES];  // nodes evaluated, by type
+} ExprStats;
+
+/*
+ * One timed subtree of an ExprProfile; see ET_profile.
+ */
+typedef struct {
+  ExprTree subtree;       // root of the subtree
+  size_t parent;          // index of the enclosing entry, or SIZE_MAX
+  uint64_t calls;         // times the subtree was evaluated
+  uint64_t inclusive_ns;  // time spent in it, its own subtrees included
+} ExprProfileEntry;
+
+/*
+ * The value a variable is bound to; see ET_specialize.
+ */
+typedef struct {
+  size_t var;    // index of the variable, as for ET_var
+  double value;  // its value
+} ExprBinding;
+
 
 /*
  * Create a value node on the tree. A value node is always a leaf.
@@ -42,6 +136,22 @@ typedef enum {
 ExprTree ET_value(double value);
 
 
+/*
+ * Create a variable node on the tree. A variable node is always a
+ * leaf; its value is looked up by index when the tree is evaluated.
+ *
+ * Parameters:
+ *   index    Index of the variable in the vars array (or column)
+ *
+ * Returns:
+ *   The new tree, which will consist of a single leaf node
+ *
+ * It is the responsibility of the caller to call ET_free on a tree
+ * that contains this leaf.
+ */
+ExprTree ET_var(size_t index);
+
+
 /*
  * Create an interior node on tree. An interior node always represents
  * an arithmetic operation.
@@ -61,7 +171,103 @@ ExprTree ET_node(ExprNodeType op, ExprTree left, ExprTree right);
 
 
 /*
- * Destroy an ExprTree, calling free() on all malloc'd memory
+ * Create a list node, whose operands are held in an array rather than
+ * as a left and right child: OP_SUM and OP_PRODUCT, of one or more
+ * operands, or OP_FMA, of exactly three.
+ *
+ * Sums and products are reduced pairwise, first operand i with operand
+ * i + ceil(n/2), then again on the first ceil(n/2) results, and so on.
+ * This keeps the chain of dependent operations, and the rounding error,
+ * at ceil(log2 n) operations deep rather than the n - 1 of a chain of
+ * OP_ADD or OP_MUL nodes. Every way of evaluating a tree reduces in
+ * this same order, so they all agree bit for bit.
+ *
+ * Parameters:
+ *   op       OP_SUM, OP_PRODUCT or OP_FMA
+ *   args     The operands, none of them NULL; the array is copied
+ *   n_args   Number of operands
+ *
+ * Returns: The new tree
+ *
+ * It is the responsibility of the caller to call ET_free on a tree
+ * that contains this node
+ */
+ExprTree ET_node_list(ExprNodeType op, ExprTree *args, size_t n_args);
+
+
+/*
+ * Register a function for OP_CALL nodes. Its scalar kernel computes
+ * one result from arity operand values; its optional batch kernel
+ * computes n_rows results at once from arity columns of operands, and
+ * is what ET_evaluate_batch and ET_run_batch call, so a vectorized
+ * implementation can be plugged in. Both must compute the same pure
+ * function of the operands, as ET_simplify folds calls of constants
+ * and the evaluators may use either kernel. Its optional derivative
+ * kernel stores the partial derivatives of the function with respect
+ * to each of the arity operands in partials, for ET_gradient and its
+ * relatives. Functions stay registered for the life of the process,
+ * and registering is thread-safe.
+ *
+ * Parameters:
+ *   name         Name the function prints and parses as: a letter or
+ *                '_', then letters, digits and '_', at most
+ *                ET_FUNCTION_NAME_MAX characters, not already
+ *                registered
+ *   arity        Number of operands, 1 to ET_MAX_ARITY
+ *   scalar_fn    The scalar kernel
+ *   batch_fn     The batch kernel, or NULL to call scalar_fn per row
+ *   partials_fn  The derivative kernel, or NULL to differentiate by
+ *                central differences of scalar_fn
+ *
+ * Returns: The function's id, or -1 if an argument is invalid or
+ *   ET_MAX_FUNCTIONS functions are already registered
+ */
+int ET_register_fn(const char *name, size_t arity, ExprScalarFunction scalar_fn, ExprBatchFunction batch_fn,
+                   ExprPartialsFunction partials_fn);
+
+
+/*
+ * Look up a registered function
+ *
+ * Parameters:
+ *   name     The name
+ *   len      Length of name
+ *
+ * Returns: The function's id, or -1 if there is none by that name
+ */
+int ET_find_fn(const char *name, size_t len);
+
+
+/*
+ * Return the name of a registered function, or NULL if fn is not the
+ * id of one
+ */
+const char *ET_fn_name(int fn);
+
+
+/*
+ * Create an OP_CALL node, a list node that applies a registered
+ * function to its operands. ET_tree2string prints it as
+ * "name(arg, arg)", and ET_parse reads that back.
+ *
+ * Parameters:
+ *   fn       The function's id, from ET_register_fn or ET_FN_BUILTINS
+ *   args     Its operands, none of them NULL; the array is copied
+ *   n_args   Number of operands, which must be the function's arity
+ *
+ * Returns: The new tree
+ *
+ * It is the responsibility of the caller to call ET_free on a tree
+ * that contains this node
+ */
+ExprTree ET_call(int fn, ExprTree *args, size_t n_args);
+
+
+/*
+ * Destroy an ExprTree, calling free() on all malloc'd memory. Nodes
+ * are reference counted: a node that is also part of another tree, or
+ * that was passed to ET_share, only loses the reference held through
+ * tree, and is freed along with its children when the last one goes.
  *
  * Parameters:
  *   tree     The tree
@@ -71,21 +277,63 @@ ExprTree ET_node(ExprNodeType op, ExprTree left, ExprTree right);
 void ET_free(ExprTree tree);
 
 
+/*
+ * Take another reference to an ExprTree, in constant time. The result
+ * is tree itself, and can be used as an operand of other trees or kept
+ * on its own; each reference is released by its own ET_free.
+ *
+ * Shared nodes are immutable as far as the tree rewrites go: ET_simplify
+ * and ET_fuse copy the nodes they change that other trees can reach,
+ * along with the path to them, and leave the originals alone.
+ * ET_set_value does change a shared leaf for every tree that holds it.
+ *
+ * The reference counts are atomic, so trees that share nodes can be
+ * built, shared, evaluated and freed on different threads, although
+ * ET_evaluate_incremental and the rewrites need the tree to themselves.
+ *
+ * Parameters:
+ *   tree     The tree, or NULL
+ *
+ * Returns: tree
+ */
+ExprTree ET_share(ExprTree tree);
+
+
+/*
+ * Make a new root node with the same type, value and operands as tree,
+ * sharing the operands rather than copying them, so it takes constant
+ * time (linear in the number of operands of a list node). The clone is
+ * a heap node even if tree is an arena node. A cloned leaf is a new,
+ * unshared leaf, whose value can be set without affecting tree.
+ *
+ * Parameters:
+ *   tree     The tree, or NULL
+ *
+ * Returns: The clone, which the caller must ET_free
+ */
+ExprTree ET_clone(ExprTree tree);
+
+
 /*
  * Return the number of nodes in the tree, including both leaf and
- * interior nodes in the count.
+ * interior nodes in the count. Takes constant time: every node keeps
+ * the count of its subtree, computed when it is built. A node shared
+ * by several parents is counted once per parent (see
+ * ET_count_distinct), so a DAG can count more nodes than an int holds.
  *
  * Parameters:
  *   tree     The tree 
  * 
- * Returns: The number of nodes
+ * Returns: The number of nodes, or INT_MAX if there are more
  */
 int ET_count(ExprTree tree);
 
 
 /*
  * Return the maximum depth for the tree. A tree that contains just a
- * single leaf node has a depth of 1.
+ * single leaf node has a depth of 1. Takes constant time, like
+ * ET_count. Builds with ET_CHECK_SIZES defined check both against a
+ * walk of the whole tree.
  *
  * Parameters:
  *   tree     The tree 
@@ -105,10 +353,127 @@ int ET_depth(ExprTree tree);
  */
 double ET_evaluate(ExprTree tree);
 
+
+/*
+ * Evaluate an ExprTree with the given variable values
+ *
+ * Parameters:
+ *   tree     The tree to compute
+ *   vars     Variable values, indexed by the index passed to ET_var.
+ *            May be NULL, in which case every variable is NAN.
+ *
+ * Returns: The computed value
+ */
+double ET_evaluate_vars(ExprTree tree, const double *vars);
+
+
+/*
+ * Evaluate a large ExprTree on several threads. The top of the tree is
+ * split into independent subtrees of at least a few thousand nodes,
+ * which idle threads steal from each other's queues; smaller trees are
+ * evaluated sequentially. The result is bit-identical to ET_evaluate.
+ *
+ * Parameters:
+ *   tree       The tree to compute
+ *   n_threads  Number of threads to use, including the caller's.
+ *              0 uses one per online CPU.
+ *
+ * Returns: The computed value
+ */
+double ET_evaluate_parallel(ExprTree tree, int n_threads);
+
+
+/*
+ * Create a pool of threads for ET_evaluate_many. The threads are
+ * started once here and sleep between calls.
+ *
+ * Parameters:
+ *   n_threads  Number of threads to use, including the thread that
+ *              calls ET_evaluate_many. 0 uses one per online CPU.
+ *
+ * Returns: The new pool
+ */
+ExprPool ET_pool_create(int n_threads);
+
+
+/*
+ * Stop the threads of a pool and free it. The pool must not be in use.
+ *
+ * Parameters:
+ *   pool     The pool to destroy; may be NULL
+ */
+void ET_pool_destroy(ExprPool pool);
+
+
+/*
+ * Evaluate many independent trees on the threads of a pool, with the
+ * calling thread joining in. The trees are cut into chunks of similar
+ * node counts (a tree much larger than the rest gets a chunk of its
+ * own) and the threads take chunks, largest first, until none are
+ * left. Each result is bit-identical to ET_evaluate's. Calls on the
+ * same pool from several threads run one at a time.
+ *
+ * Parameters:
+ *   trees    The trees to compute; any may be NULL. Trees may share
+ *            nodes, but must not change during the call.
+ *   n        Number of trees
+ *   results  Receives the value of trees[i] in results[i]
+ *   pool     The pool to run on, or NULL to evaluate on the calling
+ *            thread alone
+ */
+void ET_evaluate_many(const ExprTree *trees, size_t n, double *results, ExprPool pool);
+
+
+/*
+ * Evaluate an ExprTree, reusing the values cached by earlier calls for
+ * every subtree that has not changed since. Each interior node caches
+ * its value and knows its parent, so after ET_set_value only the path
+ * from the changed leaf to the root is recomputed. The result is the
+ * same as ET_evaluate's. Updating a leaf below a shared node (see
+ * ET_intern) invalidates every cache. Not safe to call from several
+ * threads at once on overlapping trees.
+ *
+ * Parameters:
+ *   tree     The tree to compute
+ *
+ * Returns: The computed value
+ */
+double ET_evaluate_incremental(ExprTree tree);
+
+
+/*
+ * Change the value of a VALUE leaf, and invalidate the cached values
+ * of the nodes above it.
+ *
+ * Parameters:
+ *   leaf     A node created by ET_value or ET_arena_value
+ *   value    Its new value
+ *
+ * Returns: None
+ */
+void ET_set_value(ExprTree leaf, double value);
+
+
+/*
+ * Evaluate an ExprTree once per row over columns of variable values.
+ * Rows are processed in blocks, and each operator runs as a single
+ * (SIMD where the CPU allows) loop over the block.
+ *
+ * Parameters:
+ *   tree     The tree to compute
+ *   columns  columns[i][row] is the value of variable i for that row.
+ *            May be NULL, in which case every variable is NAN.
+ *   n_rows   Number of rows
+ *   out      Receives n_rows results
+ *
+ * Returns: None
+ */
+void ET_evaluate_batch(ExprTree tree, const double *const *columns, size_t n_rows, double *out);
+
 /*
  * Convert an ExprTree into a printable ASCII string stored in buf
- * Uses a recursive approach, converting the child nodes to strings first
- * and then formatting the parent node.
+ * Writes in a single left-to-right pass straight into buf, and stops
+ * walking the tree as soon as buf is full.
  *
  * Parameters:
  *   tree     The tree
@@ -127,4 +492,750 @@ double ET_evaluate(ExprTree tree);
 size_t ET_tree2string(ExprTree tree, char *buf, size_t buf_sz);
 
 
+/*
+ * Convert an ExprTree into text of the given ExprFormat stored in buf,
+ * truncated and terminated as by ET_tree2string, which is the same as
+ * ET_tree2string_format(tree, buf, buf_sz, ET_FORMAT_INFIX).
+ * ET_FORMAT_INFIX | ET_FORMAT_SHORTEST gives text that ET_parse reads
+ * back into a tree with exactly the same values.
+ *
+ * Parameters:
+ *   tree     The tree
+ *   buf      The buffer
+ *   buf_sz   Size of buffer, in bytes
+ *   format   The output format
+ *
+ * Returns: The number of characters written to buf, not counting the
+ * \0 terminator.
+ */
+size_t ET_tree2string_format(ExprTree tree, char *buf, size_t buf_sz, ExprFormat format);
+
+
+/*
+ * Format a double with the fewest significant digits that read back
+ * (with strtod or ET_parse) as exactly the same double, choosing the
+ * closest such digits if there are several. The layout is that of
+ * "%.17g" without trailing zeros, so 0.1 prints as "0.1", 1e-7 as
+ * "1e-07" and 2^60 as "1.152921504606847e+18"; the decimal point is
+ * always '.', whatever the locale. Takes a few 64-bit multiplications
+ * for all but a percent or two of values, which fall back to snprintf.
+ *
+ * Parameters:
+ *   value    The value; infinities print as "inf" and "-inf" and NaN
+ *            as "nan"
+ *   buf      Buffer of at least ET_DOUBLE_CHARS bytes
+ *
+ * Returns: The number of characters written to buf, not counting the
+ * \0 terminator.
+ */
+size_t ET_format_double(double value, char *buf);
+
+/*
+ * Write an ExprTree as text to a callback, with no limit on its length.
+ * The text is produced in a single pass into a fixed-size buffer that
+ * is handed to write_fn each time it fills, so memory use depends only
+ * on the depth of the tree. No \0 terminator is written.
+ *
+ * ET_FORMAT_INFIX is the text ET_tree2string would produce given a big
+ * enough buffer. ET_FORMAT_POSTFIX writes operands before operators,
+ * e.g. "2 1 + 1.5 2 * ^": binary operators print as in infix, negation
+ * as "neg", list nodes as their operator followed by their number of
+ * operands ("+3", "*4"), FMA as "fma", calls as the function's name,
+ * and a missing operand as 0. ET_FORMAT_JSON writes {"value":2.5},
+ * {"var":0} and {"op":"add","args":[...]}, with op one of add, sub,
+ * mul, div, pow, neg, sum, product, fma and powi, or "call" followed by
+ * "fn":"name", a missing operand as null, and non-finite values as the
+ * strings "NaN", "Infinity" and "-Infinity".
+ *
+ * Parameters:
+ *   tree      The tree; NULL writes nothing
+ *   write_fn  Called with ctx and each chunk of output in order; returns
+ *             0 to continue or anything else to stop writing
+ *   ctx       Passed through to write_fn
+ *   format    The output format, optionally with ET_FORMAT_SHORTEST
+ *
+ * Returns: 0 on success, -1 if write_fn stopped the output
+ */
+int ET_write(ExprTree tree, ExprWriteFunction write_fn, void *ctx, ExprFormat format);
+
+
+/*
+ * Write an ExprTree as with ET_write to a stdio stream or to a file
+ * descriptor
+ *
+ * Parameters:
+ *   tree     The tree
+ *   out      An open stream
+ *   fd       An open file descriptor
+ *   format   The output format
+ *
+ * Returns: 0 on success, -1 if a write failed (with errno set for
+ *   ET_write_fd)
+ */
+int ET_write_file(ExprTree tree, FILE *out, ExprFormat format);
+int ET_write_fd(ExprTree tree, int fd, ExprFormat format);
+
+
+/*
+ * Parse an expression, the inverse of ET_tree2string. Accepts the fully
+ * parenthesized form ET_tree2string prints as well as unparenthesized
+ * input, where ^ binds tightest (and to the right), then prefix -, then
+ * * and /, then + and -. As in ET_tree2string output, a '-' directly in
+ * front of a number is its sign, so "-3 ^ 2" is 9 while "-x0 ^ 2" is
+ * -(x0 ^ 2). Variables are written x0, x1, ...
+ *
+ * Parameters:
+ *   str      The text; it need not be \0 terminated and is not copied
+ *   len      Number of characters in str
+ *   arena    Arena to allocate nodes from, or NULL for the heap
+ *   end      If NULL, str must hold exactly one expression (plus white
+ *            space). Otherwise parsing stops at the end of the first
+ *            expression, such as at a newline, and *end receives the
+ *            offset where it stopped (or where the error was).
+ *
+ * Returns: The parsed tree, or NULL on a syntax error
+ *
+ * It is the responsibility of the caller to call ET_free on the tree
+ * when it is not arena allocated.
+ */
+ExprTree ET_parse(const char *str, size_t len, ExprArena arena, size_t *end);
+
+
+/*
+ * Simplify an ExprTree in place: fold every constant subtree into a
+ * single value and apply algebraic identities such as x * 1, x + 0,
+ * -(-x), x ^ 1 and x ^ 0. Discarded nodes are freed.
+ *
+ * Parameters:
+ *   tree     The tree to simplify
+ *   strict   If true, only apply rewrites that give exactly the same
+ *            result for every input, including NaN, infinities and
+ *            -0 (so x + 0 and x * 0 are left alone)
+ *   removed  If not NULL, receives the number of nodes removed
+ *
+ * Returns: The simplified tree. This may be a different node than
+ *   tree, which must not be used afterwards. Nodes shared with other
+ *   trees are copied before they change; see ET_share.
+ */
+ExprTree ET_simplify(ExprTree tree, bool strict, int *removed);
+
+
+/*
+ * Partially evaluate an ExprTree for some of its variables: replace
+ * each bound variable by its value and fold every subtree that then
+ * depends on values alone, as ET_evaluate computes it node by node. The
+ * residual tree keeps the other variables, and for any values of them
+ * evaluates bit for bit as the original does under the same bindings.
+ * Shared subtrees stay shared, and subtrees with no bound variable are
+ * shared with the original rather than copied.
+ *
+ * Parameters:
+ *   tree        The tree to specialize, which is left unchanged
+ *   bindings    The bound variables; a later binding of a variable
+ *               overrides an earlier one, and bindings of variables
+ *               the tree does not read are ignored
+ *   n_bindings  Number of bindings
+ *
+ * Returns: The residual tree, which may be tree itself with another
+ *   reference (see ET_share) when nothing changes
+ *
+ * It is the responsibility of the caller to call ET_free on the
+ * returned tree.
+ */
+ExprTree ET_specialize(ExprTree tree, const ExprBinding *bindings, size_t n_bindings);
+
+
+/*
+ * Rewrite an ExprTree in place into the node kinds that evaluate
+ * faster: every chain of three or more OP_ADD (OP_MUL) operands into a
+ * single OP_SUM (OP_PRODUCT), each remaining x * y + z into OP_FMA, and
+ * x ^ k into OP_POWI for integer constants |k| <= ET_POWI_MAX. Arena
+ * nodes are left as they are, and chains are not folded through nodes
+ * with several references; shared nodes that change are copied, as
+ * described under ET_share.
+ *
+ * The results change by rounding only. Against the tree before the
+ * rewrite, and barring overflow and underflow:
+ *
+ *   - a sum of n operands of the same sign, and any product of n
+ *     operands, is within n - 1 + ceil(log2 n) ULPs
+ *   - an FMA whose product and addend have the same sign is within
+ *     3 ULPs
+ *   - x ^ k is within |k| + 1 ULPs
+ *
+ * of each rewritten node's result, given the same operand values. Sums
+ * of mixed signs can cancel, so for them the same number of ULPs is of
+ * the sum of the operands' magnitudes rather than of the result.
+ *
+ * Parameters:
+ *   tree     The tree to rewrite
+ *   fused    If not NULL, receives the number of nodes rewritten into
+ *            or absorbed by the new ones
+ *
+ * Returns: The rewritten tree. This may be a different node than tree,
+ *   which must not be used afterwards.
+ */
+ExprTree ET_fuse(ExprTree tree, int *fused);
+
+
+/*
+ * Compute a structural hash of an ExprTree. Trees for which ET_equal
+ * is true have the same hash.
+ *
+ * Parameters:
+ *   tree     The tree
+ *
+ * Returns: The hash
+ */
+uint64_t ET_hash(ExprTree tree);
+
+
+/*
+ * Compare two ExprTrees structurally. Values are compared by their bit
+ * patterns, so 0 and -0 differ while identical NaNs are equal.
+ *
+ * Parameters:
+ *   a        The first tree
+ *   b        The second tree
+ *
+ * Returns: true if the trees have the same shape, operators and leaves
+ */
+bool ET_equal(ExprTree a, ExprTree b);
+
+
+/*
+ * Merge identical subtrees of an ExprTree, turning it into a DAG in
+ * which each distinct subtree exists once and is reference counted.
+ * The duplicates are freed. ET_evaluate computes each shared node of
+ * the result once per call, and ET_free releases a shared node when
+ * its last reference goes away. Arena nodes are left as they are.
+ *
+ * Parameters:
+ *   tree     The tree
+ *
+ * Returns: The interned tree. This may be a different node than tree,
+ *   which must not be used afterwards.
+ */
+ExprTree ET_intern(ExprTree tree);
+
+
+/*
+ * Return the number of distinct nodes in a tree, counting a node that
+ * is shared by several parents once. ET_count counts it once per
+ * parent.
+ *
+ * Parameters:
+ *   tree     The tree
+ *
+ * Returns: The number of distinct nodes
+ */
+int ET_count_distinct(ExprTree tree);
+
+
+/*
+ * Serialize an ExprTree into a compact, versioned binary record: a
+ * header followed by the nodes in pre-order, one opcode byte each plus
+ * the raw bits of every value, so values round-trip exactly. Records
+ * may be concatenated to form a library for ET_image_open.
+ *
+ * Parameters:
+ *   tree     The tree
+ *   buf      The buffer, or NULL to only measure the record
+ *   buf_sz   Size of buffer, in bytes
+ *
+ * Returns: The size of the record in bytes. If this is more than
+ *   buf_sz, nothing was written to buf.
+ */
+size_t ET_serialize(ExprTree tree, void *buf, size_t buf_sz);
+
+
+/*
+ * Serialize an ExprTree as with ET_serialize, writing the record to a
+ * file descriptor in fixed-size chunks
+ *
+ * Parameters:
+ *   tree     The tree
+ *   fd       An open file descriptor
+ *
+ * Returns: 0 on success, -1 if a write failed (with errno set)
+ */
+int ET_serialize_fd(ExprTree tree, int fd);
+
+
+/*
+ * Rebuild an ExprTree from a record written by ET_serialize
+ *
+ * Parameters:
+ *   buf      The record
+ *   len      Bytes available at buf
+ *   arena    Arena to allocate nodes from, or NULL for the heap
+ *   used     If not NULL, receives the length of the record, which is
+ *            where the next record of a library starts
+ *
+ * Returns: The tree, or NULL if the record is malformed or of an
+ *   unknown version
+ */
+ExprTree ET_load(const void *buf, size_t len, ExprArena arena, size_t *used);
+
+
+/*
+ * Evaluate a record written by ET_serialize in place, without building
+ * any nodes
+ *
+ * Parameters:
+ *   buf      The record
+ *   len      Bytes available at buf
+ *   vars     Variable values, as for ET_evaluate_vars
+ *
+ * Returns: The computed value, or NAN if the record is malformed
+ */
+double ET_evaluate_serialized(const void *buf, size_t len, const double *vars);
+
+
+/*
+ * Map a file of serialized records read-only into memory. Only the
+ * record headers are read, so opening a large library is cheap; trees
+ * are evaluated straight from the mapping with ET_image_evaluate.
+ *
+ * Parameters:
+ *   path     The file
+ *
+ * Returns: The image, or NULL if the file cannot be mapped or is not a
+ *   sequence of valid records
+ *
+ * It is the responsibility of the caller to call ET_image_close on the
+ * image.
+ */
+ExprImage ET_image_open(const char *path);
+
+
+/*
+ * Unmap an image. Trees loaded from it with ET_image_load stay valid.
+ *
+ * Parameters:
+ *   image    The image
+ *
+ * Returns: None
+ */
+void ET_image_close(ExprImage image);
+
+
+/*
+ * Return the number of trees in an image
+ */
+size_t ET_image_count(ExprImage image);
+
+
+/*
+ * Evaluate tree i of an image in place; see ET_evaluate_serialized
+ */
+double ET_image_evaluate(ExprImage image, size_t i, const double *vars);
+
+
+/*
+ * Build tree i of an image; see ET_load
+ */
+ExprTree ET_image_load(ExprImage image, size_t i, ExprArena arena);
+
+
+/*
+ * Create an arena that hands out tree nodes from large contiguous
+ * blocks. Nodes are carved out in allocation order, so a subtree built
+ * bottom-up sits in adjacent memory.
+ *
+ * Parameters:
+ *   block_nodes   Number of nodes per block, or 0 for the default
+ *
+ * Returns: The new arena
+ *
+ * It is the responsibility of the caller to call ET_arena_destroy on
+ * the arena.
+ */
+ExprArena ET_arena_create(size_t block_nodes);
+
+
+/*
+ * Release every node handed out by the arena in constant time. The
+ * blocks are kept and reused by later allocations.
+ *
+ * Parameters:
+ *   arena    The arena
+ *
+ * Returns: None
+ */
+void ET_arena_reset(ExprArena arena);
+
+
+/*
+ * Destroy an arena, freeing all of its blocks. Every tree built from
+ * the arena becomes invalid.
+ *
+ * Parameters:
+ *   arena    The arena
+ *
+ * Returns: None
+ */
+void ET_arena_destroy(ExprArena arena);
+
+
+/*
+ * Arena-allocated variants of ET_value, ET_var, ET_node, ET_node_list
+ * and ET_call. The children of an arena node must come from an arena
+ * as well.
+ *
+ * Nodes built this way are released by ET_arena_reset or
+ * ET_arena_destroy; ET_free on an arena node does nothing.
+ */
+ExprTree ET_arena_value(ExprArena arena, double value);
+ExprTree ET_arena_var(ExprArena arena, size_t index);
+ExprTree ET_arena_node(ExprArena arena, ExprNodeType op, ExprTree left, ExprTree right);
+ExprTree ET_arena_node_list(ExprArena arena, ExprNodeType op, ExprTree *args, size_t n_args);
+ExprTree ET_arena_call(ExprArena arena, int fn, ExprTree *args, size_t n_args);
+
+
+/*
+ * Return the calling thread's private arena, creating it on first use.
+ * Building trees from it never contends with other threads. The arena
+ * is destroyed when the thread exits.
+ *
+ * Returns: The arena for this thread
+ */
+ExprArena ET_arena_thread(void);
+
+
+/*
+ * Destroy the calling thread's arena before the thread exits. A later
+ * call to ET_arena_thread creates a fresh one.
+ *
+ * Returns: None
+ */
+void ET_arena_thread_release(void);
+
+
+/*
+ * Compile an ExprTree into a flat postfix program. The program is a
+ * single contiguous array of opcodes with the constants stored inline,
+ * so running it touches memory sequentially.
+ *
+ * Parameters:
+ *   tree     The tree to compile
+ *
+ * Returns: The compiled program. The tree is not referenced afterwards
+ *   and may be freed.
+ *
+ * It is the responsibility of the caller to call ET_program_free on
+ * the program.
+ */
+ExprProgram ET_compile(ExprTree tree);
+
+
+/*
+ * Run a compiled program on its preallocated value stack. Gives the
+ * same result as ET_evaluate on the tree it was compiled from.
+ *
+ * Parameters:
+ *   prog     The program
+ *
+ * Returns: The computed value
+ *
+ * The stack belongs to the program, so a program must not be run by
+ * two threads at once.
+ */
+double ET_run(ExprProgram prog);
+
+
+/*
+ * Run a compiled program with the given variable values; see
+ * ET_evaluate_vars.
+ */
+double ET_run_vars(ExprProgram prog, const double *vars);
+
+
+/*
+ * Run a compiled program once per row over columns of variable values;
+ * see ET_evaluate_batch. Unlike ET_run, this may be called by several
+ * threads at once on the same program.
+ */
+void ET_run_batch(ExprProgram prog, const double *const *columns, size_t n_rows, double *out);
+
+
+/*
+ * Compute the value of an ExprTree and its partial derivatives with
+ * respect to variables 0 to n_vars - 1, by reverse-mode automatic
+ * differentiation: one forward sweep records the operands of every
+ * operation on a tape, and one reverse sweep over the tape carries the
+ * derivative of the result back to the variables. The cost is a small
+ * constant times that of ET_evaluate_vars, however many variables.
+ *
+ * Each operator is differentiated exactly, at the values the forward
+ * sweep computed. d(x ^ y)/dy is x ^ y * log(x), so it is NaN for a
+ * negative x, and 0 where x ^ y is 0; d(x ^ 0)/dx is 0. OP_CALL nodes
+ * are differentiated by their function's derivative kernel, which the
+ * built-in functions all have: d abs(x)/dx is 0 at 0, and min and max
+ * pass the derivative to the operand they return, the first on a tie.
+ * Functions registered without one are differentiated by central
+ * differences, accurate to about 1e-10 relative where smooth.
+ *
+ * Parameters:
+ *   tree     The tree
+ *   vars     Values of the variables, or NULL for all NAN. Variables
+ *            numbered n_vars or more are NAN as well.
+ *   n_vars   Number of variables
+ *   grad     Receives the n_vars partial derivatives
+ *
+ * Returns: The value of the tree, the same as ET_evaluate_vars
+ */
+double ET_gradient(ExprTree tree, const double *vars, size_t n_vars, double *grad);
+
+
+/*
+ * ET_gradient on a compiled program. The tape is allocated with the
+ * program's first gradient and reused after that, so, as with ET_run,
+ * a program must not be run by two threads at once.
+ */
+double ET_run_gradient(ExprProgram prog, const double *vars, size_t n_vars, double *grad);
+
+
+/*
+ * ET_gradient once per row over columns of variable values, sweeping a
+ * block of rows at a time so that each operation is a loop over the
+ * block. May be called by several threads at once on the same program.
+ *
+ * Parameters:
+ *   prog     The program
+ *   columns  n_vars columns of n_rows values, one per variable
+ *   n_rows   Number of rows
+ *   n_vars   Number of variables
+ *   out      Receives the n_rows values, or NULL
+ *   grads    n_vars columns that receive the n_rows partial
+ *            derivatives with respect to each variable
+ *
+ * Returns: None
+ */
+void ET_run_gradient_batch(ExprProgram prog, const double *const *columns, size_t n_rows, size_t n_vars,
+                           double *out, double *const *grads);
+
+
+/*
+ * Destroy a compiled program
+ *
+ * Parameters:
+ *   prog     The program
+ *
+ * Returns: None
+ */
+void ET_program_free(ExprProgram prog);
+
+
+/*
+ * Make an immutable compact copy of an ExprTree for read-mostly use.
+ * Node types, 32-bit child indices and constants are kept in separate
+ * arrays with the nodes in preorder, about 9 bytes per node plus 8 per
+ * constant, and the ET_frozen_* functions work by scanning those
+ * arrays. Subtrees shared within the tree are copied each time they
+ * appear. The tree itself is not changed and may be freed.
+ *
+ * Parameters:
+ *   tree     The tree to freeze
+ *
+ * Returns: The frozen tree, or NULL if tree is NULL or has 2^32 - 1 or
+ * more nodes or a variable index that does not fit in 32 bits
+ *
+ * It is the responsibility of the caller to call ET_frozen_free on
+ * the result.
+ */
+ExprFrozen ET_freeze(ExprTree tree);
+
+
+/*
+ * Counterparts of ET_count, ET_depth, ET_evaluate_vars and
+ * ET_tree2string for a frozen tree, with the same results as on the
+ * tree it was made from. ET_frozen_count is constant time; the others
+ * scan the arrays once, and ET_frozen_depth and ET_frozen_evaluate use
+ * a scratch array of one entry per node. A frozen tree may be used by
+ * several threads at once.
+ *
+ * Parameters:
+ *   frozen   The frozen tree; may be NULL, which counts as an empty tree
+ *   vars     Values of the variables, or NULL for all NAN
+ *   buf      Buffer to hold the string
+ *   buf_sz   Size of buf
+ */
+int ET_frozen_count(ExprFrozen frozen);
+int ET_frozen_depth(ExprFrozen frozen);
+double ET_frozen_evaluate(ExprFrozen frozen, const double *vars);
+size_t ET_frozen_tree2string(ExprFrozen frozen, char *buf, size_t buf_sz);
+
+
+/*
+ * Destroy a frozen tree
+ *
+ * Parameters:
+ *   frozen   The frozen tree; may be NULL
+ *
+ * Returns: None
+ */
+void ET_frozen_free(ExprFrozen frozen);
+
+
+/*
+ * Compile an ExprTree to native x86-64 code. The tree is compiled as
+ * for ET_compile, and each bytecode then becomes a few SSE2
+ * instructions, with the value stack kept in xmm registers (spilling
+ * to the frame only for very bushy trees) and pow called only for
+ * OP_POWER. Where native code cannot be generated (other platforms,
+ * builds with ET_NO_JIT defined, or no executable memory), the program
+ * is interpreted instead.
+ *
+ * Parameters:
+ *   tree     The tree to compile. It is not referenced afterwards and
+ *            may be freed.
+ *
+ * Returns: The compiled function
+ *
+ * It is the responsibility of the caller to call ET_jit_free on the
+ * result.
+ */
+ExprJit ET_jit(ExprTree tree);
+
+
+/*
+ * Return the native code of a compiled function as a plain function
+ * pointer, which takes the variable values (or NULL, in which case
+ * every variable is NAN) and returns the same result as
+ * ET_evaluate_vars. It stays valid until ET_jit_free, and may be
+ * called by several threads at once.
+ *
+ * Returns: The function, or NULL if ET_jit fell back to the interpreter
+ */
+ExprJitFunction ET_jit_function(ExprJit jit);
+
+
+/*
+ * Run a compiled function with the given variable values, natively or
+ * through the interpreter; see ET_evaluate_vars.
+ */
+double ET_jit_run(ExprJit jit, const double *vars);
+
+
+/*
+ * Destroy a compiled function
+ *
+ * Parameters:
+ *   jit      The function
+ *
+ * Returns: None
+ */
+void ET_jit_free(ExprJit jit);
+
+
+
+/*
+ * Read the library's counters. The counters are process-wide and
+ * only kept when expr_tree.c is built with -DET_STATS, which costs an
+ * atomic add per allocation and per evaluated node; otherwise every
+ * counter reads as zero.
+ *
+ * Evaluations count ET_evaluate, ET_evaluate_vars, ET_evaluate_parallel,
+ * ET_evaluate_incremental, ET_evaluate_serialized, and each run of a
+ * compiled or JIT-compiled program. Ops count the nodes each of those
+ * evaluated, so a shared subtree evaluated once counts once, and an
+ * incremental evaluation counts only the nodes it recomputed.
+ *
+ * Parameters:
+ *   stats    Filled in with the counters
+ *
+ * Returns: None
+ */
+void ET_stats_get(ExprStats *stats);
+
+
+/*
+ * Zero the counters read by ET_stats_get, except live_nodes, which
+ * follows the nodes still allocated.
+ *
+ * Parameters: None
+ *
+ * Returns: None
+ */
+void ET_stats_reset(void);
+
+
+/*
+ * Evaluate tree reps times as ET_evaluate_vars would, timing each of
+ * its larger subtrees: the root and every subtree holding at least
+ * 1/1024th of the tree's nodes. Time spent in smaller subtrees counts
+ * towards the timed subtree enclosing them. A shared subtree is timed
+ * separately for each place it appears. ET_evaluate itself is never
+ * instrumented, so profiling costs nothing when unused.
+ *
+ * Parameters:
+ *   tree     The tree to profile
+ *   vars     The variable values, as for ET_evaluate_vars (may be NULL)
+ *   reps     Number of evaluations to time
+ *
+ * Returns: The profile, to be freed by ET_profile_free
+ */
+ExprProfile ET_profile(ExprTree tree, const double *vars, int reps);
+
+
+/*
+ * Return the number of timed subtrees in a profile.
+ *
+ * Parameters:
+ *   prof     The profile
+ *
+ * Returns: The number of entries; entry 0 is the whole tree
+ */
+size_t ET_profile_count(ExprProfile prof);
+
+
+/*
+ * Return one timed subtree of a profile. Entries are in preorder, so
+ * an entry's parent always precedes it.
+ *
+ * Parameters:
+ *   prof     The profile
+ *   i        Index of the entry, less than ET_profile_count(prof)
+ *
+ * Returns: The entry, valid until ET_profile_free
+ */
+const ExprProfileEntry *ET_profile_entry(ExprProfile prof, size_t i);
+
+
+/*
+ * Write a profile in the folded-stack format read by flamegraph.pl
+ * and speedscope: one line per subtree, of the labels of the subtrees
+ * enclosing it from the root down separated by ';', a space, then the
+ * nanoseconds spent in the subtree itself. A label is the subtree as
+ * printed by ET_tree2string, without spaces and cut short with '$'.
+ *
+ * Only the max_subtrees subtrees with the most inclusive time are
+ * written, plus any enclosing subtrees they need; time in the others
+ * counts towards the subtree enclosing them.
+ *
+ * Parameters:
+ *   prof          The profile
+ *   out           Where to write it
+ *   max_subtrees  The most subtrees to show
+ *
+ * Returns: The number of lines written
+ */
+size_t ET_profile_write(ExprProfile prof, FILE *out, size_t max_subtrees);
+
+
+/*
+ * Free a profile. The trees it was taken of are not affected.
+ *
+ * Parameters:
+ *   prof     The profile to free
+ *
+ * Returns: None
+ */
+void ET_profile_free(ExprProfile prof);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* _EXPR_TREE_H_ */
@@ -0,0 +1,380 @@
+/*
+ * expr_tree.hpp
+ *
+ * A header-only C++ front end to expr_tree: expressions whose shape is
+ * fixed at compile time, built as expression templates
+ *
+ * Author: Howdy Pierce <howdy@sleepymoose.net>
+ * Contributor: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+
+#ifndef _EXPR_TREE_HPP_
+#define _EXPR_TREE_HPP_
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "expr_tree.h"
+
+/*
+ * Each node of a static expression is an object whose type records
+ * the node's ExprNodeType and the types of its operands, so that
+ *
+ *   constexpr auto f = (et::var<0> * 2 + 1) / et::var<1>;
+ *
+ * is a small value with no heap behind it, which the compiler inlines
+ * completely when it is evaluated. Evaluation gives exactly the result
+ * ET_evaluate_vars gives the tree that et::to_tree builds from the
+ * same expression, operation for operation: a missing variable is NAN,
+ * powers call pow(), calls the same libm functions as the built-in
+ * ET_FN_* functions. (Build with -ffp-contract=off, or the compiler
+ * may fuse an inlined multiply and add that the tree rounds twice.)
+ *
+ * Operators, powers and ET_POWI's repeated multiplication are
+ * constexpr, so expressions of constants and of variables in a
+ * constexpr array fold at compile time; pow(), fma and the functions
+ * are evaluated at run time.
+ */
+namespace et
+{
+
+// A leaf holding a constant; doubles and integers in an expression
+// become these
+struct Value
+{
+  static constexpr ExprNodeType type = VALUE;
+  static constexpr int count = 1;
+  static constexpr int depth = 1;
+
+  double value;
+
+  constexpr double operator()(const double *) const { return value; }
+};
+
+// A leaf reading variable Index
+template <size_t Index>
+struct Var
+{
+  static constexpr ExprNodeType type = VARIABLE;
+  static constexpr size_t index = Index;
+  static constexpr int count = 1;
+  static constexpr int depth = 1;
+
+  constexpr double operator()(const double *vars) const
+  {
+    return vars == nullptr ? std::numeric_limits<double>::quiet_NaN() : vars[Index];
+  }
+};
+
+template <size_t Index>
+constexpr Var<Index> var{};
+
+/*
+ * x ^ y as OP_POWI computes it: by repeated squaring for integers of
+ * at most ET_POWI_MAX in magnitude, and with pow() otherwise
+ */
+constexpr double power_int(double x, double y)
+{
+  if (!((y < 0 ? -y : y) <= ET_POWI_MAX) || y != (int)y)
+    return std::pow(x, y);
+
+  double result = 1, base = x;
+  for (int k = y < 0 ? -(int)y : (int)y; k > 0; k >>= 1)
+  {
+    if (k & 1)
+      result *= base;
+    base *= base;
+  }
+  return y < 0 ? 1 / result : result;
+}
+
+// UNARY_NEGATE of Operand
+template <class Operand>
+struct Negate
+{
+  static constexpr ExprNodeType type = UNARY_NEGATE;
+  static constexpr int count = 1 + Operand::count;
+  static constexpr int depth = 1 + Operand::depth;
+
+  Operand operand;
+
+  constexpr double operator()(const double *vars) const { return -operand(vars); }
+};
+
+// A binary operator: OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_POWER or OP_POWI
+template <ExprNodeType Op, class Left, class Right>
+struct Binary
+{
+  static constexpr ExprNodeType type = Op;
+  static constexpr int count = 1 + Left::count + Right::count;
+  static constexpr int depth = 1 + (Left::depth > Right::depth ? Left::depth : Right::depth);
+
+  Left left;
+  Right right;
+
+  constexpr double operator()(const double *vars) const
+  {
+    double l = left(vars), r = right(vars);
+
+    if constexpr (Op == OP_ADD)
+      return l + r;
+    else if constexpr (Op == OP_SUB)
+      return l - r;
+    else if constexpr (Op == OP_MUL)
+      return l * r;
+    else if constexpr (Op == OP_DIV)
+      return l / r;
+    else if constexpr (Op == OP_POWER)
+      return std::pow(l, r);
+    else
+    {
+      static_assert(Op == OP_POWI, "not a binary ExprNodeType");
+      return power_int(l, r);
+    }
+  }
+};
+
+// OP_FMA: a * b + c, rounded once
+template <class A, class B, class C>
+struct Fma
+{
+  static constexpr ExprNodeType type = OP_FMA;
+  static constexpr int count = 1 + A::count + B::count + C::count;
+  static constexpr int depth = 1 + std::max({A::depth, B::depth, C::depth});
+
+  A a;
+  B b;
+  C c;
+
+  double operator()(const double *vars) const { return std::fma(a(vars), b(vars), c(vars)); }
+};
+
+// OP_CALL of the built-in function Fn, one of ET_FN_EXP to ET_FN_MAX
+template <int Fn, class... Args>
+struct Call
+{
+  static constexpr ExprNodeType type = OP_CALL;
+  static constexpr int fn = Fn;
+  static constexpr int count = 1 + (Args::count + ...);
+  static constexpr int depth = 1 + std::max({Args::depth...});
+
+  std::tuple<Args...> args;
+
+  double operator()(const double *vars) const
+  {
+    return std::apply([vars](const auto &...arg) { return apply(arg(vars)...); }, args);
+  }
+
+private:
+  static double apply(double x)
+  {
+    if constexpr (Fn == ET_FN_EXP)
+      return std::exp(x);
+    else if constexpr (Fn == ET_FN_LOG)
+      return std::log(x);
+    else if constexpr (Fn == ET_FN_SQRT)
+      return std::sqrt(x);
+    else if constexpr (Fn == ET_FN_SIN)
+      return std::sin(x);
+    else if constexpr (Fn == ET_FN_COS)
+      return std::cos(x);
+    else
+    {
+      static_assert(Fn == ET_FN_ABS, "not a built-in function of one operand");
+      return std::fabs(x);
+    }
+  }
+
+  static double apply(double x, double y)
+  {
+    if constexpr (Fn == ET_FN_MIN)
+      return std::fmin(x, y);
+    else
+    {
+      static_assert(Fn == ET_FN_MAX, "not a built-in function of two operands");
+      return std::fmax(x, y);
+    }
+  }
+};
+
+template <class T>
+struct is_expr : std::false_type
+{
+};
+template <>
+struct is_expr<Value> : std::true_type
+{
+};
+template <size_t Index>
+struct is_expr<Var<Index>> : std::true_type
+{
+};
+template <class Operand>
+struct is_expr<Negate<Operand>> : std::true_type
+{
+};
+template <ExprNodeType Op, class Left, class Right>
+struct is_expr<Binary<Op, Left, Right>> : std::true_type
+{
+};
+template <class A, class B, class C>
+struct is_expr<Fma<A, B, C>> : std::true_type
+{
+};
+template <int Fn, class... Args>
+struct is_expr<Call<Fn, Args...>> : std::true_type
+{
+};
+
+// An expression, or a number that lift turns into a Value
+template <class T>
+constexpr bool is_operand = is_expr<T>::value || std::is_arithmetic<T>::value;
+
+template <class T>
+constexpr auto lift(T x)
+{
+  if constexpr (is_expr<T>::value)
+    return x;
+  else
+    return Value{static_cast<double>(x)};
+}
+
+// Operators taking at least one expression, and any numbers as Values
+template <class T, class U>
+using enable_binary = std::enable_if_t<(is_expr<T>::value || is_expr<U>::value) && is_operand<T> && is_operand<U>>;
+
+template <class T, class = std::enable_if_t<is_expr<T>::value>>
+constexpr auto operator-(T x)
+{
+  return Negate<T>{x};
+}
+
+#define ET_HPP_OPERATOR(symbol, op)                                        \
+  template <class T, class U, class = enable_binary<T, U>>                 \
+  constexpr auto operator symbol(T x, U y)                                 \
+  {                                                                        \
+    return Binary<op, decltype(lift(x)), decltype(lift(y))>{lift(x), lift(y)}; \
+  }
+
+ET_HPP_OPERATOR(+, OP_ADD)
+ET_HPP_OPERATOR(-, OP_SUB)
+ET_HPP_OPERATOR(*, OP_MUL)
+ET_HPP_OPERATOR(/, OP_DIV)
+
+#undef ET_HPP_OPERATOR
+
+// x ^ y with pow(), as OP_POWER
+template <class T, class U, class = enable_binary<T, U>>
+constexpr auto pow(T x, U y)
+{
+  return Binary<OP_POWER, decltype(lift(x)), decltype(lift(y))>{lift(x), lift(y)};
+}
+
+// x ^ y by repeated multiplication where y is a small integer, as OP_POWI
+template <class T, class U, class = enable_binary<T, U>>
+constexpr auto powi(T x, U y)
+{
+  return Binary<OP_POWI, decltype(lift(x)), decltype(lift(y))>{lift(x), lift(y)};
+}
+
+template <class A, class B, class C,
+          class = std::enable_if_t<is_operand<A> && is_operand<B> && is_operand<C> &&
+                                   (is_expr<A>::value || is_expr<B>::value || is_expr<C>::value)>>
+constexpr auto fma(A a, B b, C c)
+{
+  return Fma<decltype(lift(a)), decltype(lift(b)), decltype(lift(c))>{lift(a), lift(b), lift(c)};
+}
+
+#define ET_HPP_UNARY_CALL(name, fn)                        \
+  template <class T, class = std::enable_if_t<is_expr<T>::value>> \
+  constexpr auto name(T x)                                 \
+  {                                                        \
+    return Call<fn, T>{std::tuple<T>(x)};                  \
+  }
+#define ET_HPP_BINARY_CALL(name, fn)                                                       \
+  template <class T, class U, class = enable_binary<T, U>>                                 \
+  constexpr auto name(T x, U y)                                                            \
+  {                                                                                        \
+    return Call<fn, decltype(lift(x)), decltype(lift(y))>{std::make_tuple(lift(x), lift(y))}; \
+  }
+
+ET_HPP_UNARY_CALL(exp, ET_FN_EXP)
+ET_HPP_UNARY_CALL(log, ET_FN_LOG)
+ET_HPP_UNARY_CALL(sqrt, ET_FN_SQRT)
+ET_HPP_UNARY_CALL(sin, ET_FN_SIN)
+ET_HPP_UNARY_CALL(cos, ET_FN_COS)
+ET_HPP_UNARY_CALL(abs, ET_FN_ABS)
+ET_HPP_BINARY_CALL(min, ET_FN_MIN)
+ET_HPP_BINARY_CALL(max, ET_FN_MAX)
+
+#undef ET_HPP_UNARY_CALL
+#undef ET_HPP_BINARY_CALL
+
+/*
+ * Evaluate a static expression
+ *
+ * Parameters:
+ *   e        The expression
+ *   vars     Values of its variables, or NULL for all NAN
+ *
+ * Returns: What ET_evaluate_vars returns for to_tree(e)
+ */
+template <class E, class = std::enable_if_t<is_expr<E>::value>>
+constexpr double evaluate(const E &e, const double *vars = nullptr)
+{
+  return e(vars);
+}
+
+/*
+ * Build the runtime ExprTree of a static expression, node for node, in
+ * arena or on the heap if it is NULL. The tree evaluates, prints,
+ * compiles and serializes like any other.
+ *
+ * Parameters:
+ *   e        The expression
+ *   arena    The arena to allocate from, or NULL
+ *
+ * Returns: The new tree. It is the responsibility of the caller to call
+ * ET_free on a heap tree.
+ */
+template <class E, class = std::enable_if_t<is_expr<E>::value>>
+ExprTree to_tree(const E &e, ExprArena arena = nullptr)
+{
+  if constexpr (E::type == VALUE)
+    return arena != nullptr ? ET_arena_value(arena, e.value) : ET_value(e.value);
+  else if constexpr (E::type == VARIABLE)
+    return arena != nullptr ? ET_arena_var(arena, E::index) : ET_var(E::index);
+  else if constexpr (E::type == UNARY_NEGATE)
+  {
+    ExprTree operand = to_tree(e.operand, arena);
+    return arena != nullptr ? ET_arena_node(arena, UNARY_NEGATE, operand, nullptr)
+                            : ET_node(UNARY_NEGATE, operand, nullptr);
+  }
+  else if constexpr (E::type == OP_FMA)
+  {
+    ExprTree args[] = {to_tree(e.a, arena), to_tree(e.b, arena), to_tree(e.c, arena)};
+    return arena != nullptr ? ET_arena_node_list(arena, OP_FMA, args, 3) : ET_node_list(OP_FMA, args, 3);
+  }
+  else if constexpr (E::type == OP_CALL)
+    return std::apply(
+        [arena](const auto &...arg) {
+          ExprTree args[] = {to_tree(arg, arena)...};
+          size_t n_args = sizeof(args) / sizeof(args[0]);
+          return arena != nullptr ? ET_arena_call(arena, E::fn, args, n_args) : ET_call(E::fn, args, n_args);
+        },
+        e.args);
+  else
+  {
+    ExprTree left = to_tree(e.left, arena), right = to_tree(e.right, arena);
+    return arena != nullptr ? ET_arena_node(arena, E::type, left, right) : ET_node(E::type, left, right);
+  }
+}
+
+} // namespace et
+
+#endif /* _EXPR_TREE_HPP_ */